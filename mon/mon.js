@@ -60,6 +60,11 @@ const etcd_tree = {
             // client and osd
             tcp_header_buffer_size: 65536,
             use_sync_send_recv: false,
+            min_zerocopy_send_size: 0, // send batches of at least this size with zero-copy sendmsg (Linux 6.1+), 0 = never
+            use_multishot_recv: false, // receive with multishot recv into a shared buffer ring (Linux 6.0+, liburing 2.4+)
+            multishot_recv_buffers: 256, // number of tcp_header_buffer_size buffers in the shared ring
+            use_shm: false, // use shared memory rings for connections through osd_unix_socket
+            shm_ring_size: 2097152, // bytes, per direction of each connection
             use_rdma: true,
             rdma_device: null, // for example, "rocep5s0f0"
             rdma_port_num: 1,
@@ -75,6 +80,14 @@ const etcd_tree = {
             bitmap_granularity: 4096,
             immediate_commit: false, // 'all' or 'small'
             client_dirty_limit: 33554432,
+            client_ec_writeback: false, // buffer partial EC stripe writes in the client and send full stripes
+            client_ec_writeback_delay: 50, // ms. max age of a partial stripe buffer
+            client_writeback: false, // acknowledge small writes to all pools from memory, flush them on sync, by age or by client_max_dirty_bytes/ops
+            client_readahead: 0, // bytes. max sequential readahead window per inode, 0 = disabled
+            client_snapshot_cache: 0, // bytes. cache data of readonly inodes (snapshot layers) in client memory, 0 = disabled
+            client_osd_connections: 1, // TCP connections per OSD (1-16), the first one is reserved for small reads
+            client_small_read_size: 65536, // reads up to this size use the first connection
+            client_batch_ops: 1, // max small (<= 128 KB) reads/writes sent to an OSD in one request, 0 or 1 = disabled
             peer_connect_interval: 5, // seconds. min: 1
             peer_connect_timeout: 5, // seconds. min: 1
             osd_idle_timeout: 5, // seconds. min: 1
@@ -85,7 +98,12 @@ const etcd_tree = {
             run_primary: true,
             bind_address: "0.0.0.0",
             bind_port: 0,
+            osd_unix_socket: null, // path, for example "/run/vitastor-osd<N>.sock", for clients and OSDs on the same host
             autosync_interval: 5,
+            write_sync_on_pending_sync: false, // make writes durable at once if a sync is already pending for the PG
+            stab_piggyback_delay: 0, // ms, send stabilize lists with next writes or syncs to the same peer; 0 = disable
+            replica_reads: false, // balance reads of clean objects in replicated pools between up-to-date replicas
+            chain_replication: false, // replicated pool writes are forwarded from replica to replica instead of fan-out from the primary
             client_queue_depth: 128, // unused
             recovery_queue_depth: 4,
             recovery_sync_batch: 16,
@@ -94,6 +112,7 @@ const etcd_tree = {
             no_rebalance: false,
             print_stats_interval: 3,
             slow_log_interval: 10,
+            ec_native: true, // false to use Jerasure for EC instead of the built-in SIMD code
             // blockstore - fixed in superblock
             block_size,
             disk_alignment,
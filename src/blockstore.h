@@ -15,6 +15,7 @@
 #include <functional>
 
 #include "object_id.h"
+#include "object_pool.h"
 #include "ringloop.h"
 #include "timerfd_manager.h"
 
@@ -139,7 +140,7 @@ struct blockstore_op_t
     // operation
     uint64_t opcode;
     // finish callback
-    std::function<void (blockstore_op_t*)> callback;
+    inline_callback_t<blockstore_op_t> callback;
     object_id oid;
     uint64_t version;
     uint32_t offset;
@@ -149,6 +150,9 @@ struct blockstore_op_t
     int retval;
 
     uint8_t private_data[BS_OP_PRIVATE_DATA_SIZE];
+
+    static void *operator new(size_t size) { return object_pool_t<blockstore_op_t>::alloc(size); }
+    static void operator delete(void *ptr, size_t size) { object_pool_t<blockstore_op_t>::release(ptr, size); }
 };
 
 typedef std::unordered_map<std::string, std::string> blockstore_config_t;
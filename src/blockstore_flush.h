@@ -46,7 +46,7 @@ class journal_flusher_co
     obj_ver_id cur;
     std::map<obj_ver_id, dirty_entry>::iterator dirty_it, dirty_start, dirty_end;
     std::map<object_id, uint64_t>::iterator repeat_it;
-    std::function<void(ring_data_t*)> simple_callback_r, simple_callback_w;
+    inline_callback_t<ring_data_t> simple_callback_r, simple_callback_w;
 
     bool skip_copy, has_delete, has_writes;
     blockstore_clean_db_t::iterator clean_it;
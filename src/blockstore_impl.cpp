@@ -342,12 +342,12 @@ void blockstore_impl_t::enqueue_op(blockstore_op_t *op)
     {
         // Basic verification not passed
         op->retval = -EINVAL;
-        std::function<void (blockstore_op_t*)>(op->callback)(op);
+        inline_callback_t<blockstore_op_t>(op->callback)(op);
         return;
     }
     if (op->opcode == BS_OP_SYNC_STAB_ALL)
     {
-        std::function<void(blockstore_op_t*)> *old_callback = new std::function<void(blockstore_op_t*)>(op->callback);
+        inline_callback_t<blockstore_op_t> *old_callback = new inline_callback_t<blockstore_op_t>(op->callback);
         op->opcode = BS_OP_SYNC;
         op->callback = [this, old_callback](blockstore_op_t *op)
         {
@@ -385,7 +385,7 @@ void blockstore_impl_t::enqueue_op(blockstore_op_t *op)
     }
     if ((op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE) && !enqueue_write(op))
     {
-        std::function<void (blockstore_op_t*)>(op->callback)(op);
+        inline_callback_t<blockstore_op_t>(op->callback)(op);
         return;
     }
     // Call constructor without allocating memory. We'll call destructor before returning op back
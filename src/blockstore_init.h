@@ -47,7 +47,7 @@ class blockstore_init_journal
     struct io_uring_sqe *sqe;
     struct ring_data_t *data;
     journal_entry_start *je_start;
-    std::function<void(ring_data_t*)> simple_callback;
+    inline_callback_t<ring_data_t> simple_callback;
     int handle_journal_part(void *buf, uint64_t done_pos, uint64_t len);
     void handle_event(ring_data_t *data);
     void erase_dirty_object(blockstore_dirty_db_t::iterator dirty_it);
@@ -153,7 +153,7 @@ journal_entry* prefill_single_journal_entry(journal_t & journal, uint16_t type,
     return je;
 }
 
-void prepare_journal_sector_write(journal_t & journal, int cur_sector, io_uring_sqe *sqe, std::function<void(ring_data_t*)> cb)
+void prepare_journal_sector_write(journal_t & journal, int cur_sector, io_uring_sqe *sqe, inline_callback_t<ring_data_t> cb)
 {
     journal.sector_info[cur_sector].dirty = false;
     journal.sector_info[cur_sector].written = true;
@@ -200,4 +200,4 @@ struct blockstore_journal_check_t
 
 journal_entry* prefill_single_journal_entry(journal_t & journal, uint16_t type, uint32_t size);
 
-void prepare_journal_sector_write(journal_t & journal, int sector, io_uring_sqe *sqe, std::function<void(ring_data_t*)> cb);
+void prepare_journal_sector_write(journal_t & journal, int sector, io_uring_sqe *sqe, inline_callback_t<ring_data_t> cb);
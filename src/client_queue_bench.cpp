@@ -0,0 +1,150 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Client operation queue benchmark: measures the client-side CPU cost of a write
+// with immediate_commit=none, i.e. with SYNC barriers in the queue, at various queue depths.
+// Uses the mock messenger, OSD replies are simulated in the order of requests.
+// Usage: client_queue_bench [writes_per_case]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cluster_client.h"
+
+static double now()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec/1000000000.0;
+}
+
+static void configure_pool(cluster_client_t *cli)
+{
+    json11::Json::object global_config = { { "immediate_commit", "none" } };
+    cli->st_cli.on_load_config_hook(global_config);
+    cli->st_cli.on_load_pgs_hook(true);
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/config/pools",
+        .value = json11::Json::object {
+            { "1", json11::Json::object {
+                { "name", "pool" },
+                { "scheme", "replicated" },
+                { "pg_size", 1 },
+                { "pg_minsize", 1 },
+                { "pg_count", 1 },
+                { "failure_domain", "osd" },
+            } }
+        },
+    });
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/config/pgs",
+        .value = json11::Json::object {
+            { "items", json11::Json::object {
+                { "1", json11::Json::object {
+                    { "1", json11::Json::object {
+                        { "osd_set", json11::Json::array { 1 } },
+                        { "primary", 1 },
+                    } }
+                } }
+            } }
+        },
+    });
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/pg/state/1/1",
+        .value = json11::Json::object {
+            { "peers", json11::Json::array { 1 } },
+            { "primary", 1 },
+            { "state", json11::Json::array { "active" } },
+        },
+    });
+    std::map<std::string, etcd_kv_t> changes;
+    cli->st_cli.on_change_hook(changes);
+    // Pretend that OSD 1 is connected
+    int peer_fd = 10;
+    cli->msgr.osd_peer_fds[1] = peer_fd;
+    cli->msgr.clients[peer_fd] = new osd_client_t();
+    cli->msgr.clients[peer_fd]->osd_num = 1;
+    cli->msgr.clients[peer_fd]->peer_state = PEER_CONNECTED;
+    cli->msgr.wanted_peers.erase(1);
+    cli->msgr.repeer_pgs(1);
+}
+
+// Runs <total> 4 KB writes with <qd> operations in flight and a SYNC after every <qd> writes
+static double run(uint64_t qd, uint64_t total)
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_pool(cli);
+    osd_client_t *cl = cli->msgr.clients.at(10);
+    void *buf = malloc_or_die(4096);
+    uint64_t submitted = 0, completed = 0, next_id = 1;
+    double start = now();
+    while (completed < total)
+    {
+        while (submitted - completed < qd && submitted < total)
+        {
+            cluster_op_t *op = new cluster_op_t;
+            if (submitted % qd == qd-1)
+            {
+                op->opcode = OSD_OP_SYNC;
+            }
+            else
+            {
+                op->opcode = OSD_OP_WRITE;
+                op->inode = 0x1000000000001;
+                op->offset = (submitted % 65536) * 4096;
+                op->len = 4096;
+                op->iov.push_back(buf, 4096);
+            }
+            op->callback = [&completed](cluster_op_t *op)
+            {
+                if (op->retval < 0)
+                {
+                    fprintf(stderr, "Operation failed: %d\n", op->retval);
+                    exit(1);
+                }
+                completed++;
+                delete op;
+            };
+            submitted++;
+            cli->execute(op);
+        }
+        // Reply to the oldest request sent to the OSD
+        auto op_it = cl->sent_ops.find(next_id);
+        while (op_it == cl->sent_ops.end())
+        {
+            if (next_id >= submitted*2)
+            {
+                fprintf(stderr, "No operations in flight, client is stuck\n");
+                exit(1);
+            }
+            op_it = cl->sent_ops.find(++next_id);
+        }
+        osd_op_t *op = op_it->second;
+        cl->sent_ops.erase(op_it);
+        op->reply.hdr.magic = SECONDARY_OSD_REPLY_MAGIC;
+        op->reply.hdr.id = op->req.hdr.id;
+        op->reply.hdr.opcode = op->req.hdr.opcode;
+        op->reply.hdr.retval = op->req.hdr.opcode == OSD_OP_SYNC ? 0 : op->req.rw.len;
+        inline_callback_t<osd_op_t>(op->callback)(op);
+    }
+    double t = now() - start;
+    free(buf);
+    delete cli;
+    delete tfd;
+    return t;
+}
+
+int main(int narg, char *args[])
+{
+    uint64_t total = narg > 1 ? strtoull(args[1], NULL, 10) : 200000;
+    const uint64_t qds[] = { 16, 64, 256, 1024 };
+    printf("%6s %12s\n", "qd", "ns/op");
+    for (auto qd: qds)
+    {
+        double t = run(qd, total);
+        printf("%6lu %12.1f\n", qd, t*1e9/total);
+    }
+    return 0;
+}
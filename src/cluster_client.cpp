@@ -6,6 +6,7 @@
 #include "cluster_client.h"
 
 #define SCRAP_BUFFER_SIZE 4*1024*1024
+#define ZERO_BUFFER_SIZE 4*1024*1024
 #define PART_SENT 1
 #define PART_DONE 2
 #define PART_ERROR 4
@@ -13,14 +14,16 @@
 #define CACHE_FLUSHING 2
 #define CACHE_REPEATING 3
 #define OP_FLUSH_BUFFER 2
+#define OP_NO_DELETE 4
 
-cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config)
+cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config, bool etcd_follower)
 {
     config = osd_messenger_t::read_config(config);
 
     this->ringloop = ringloop;
     this->tfd = tfd;
     this->config = config;
+    op_epochs.emplace_back();
 
     msgr.osd_num = 0;
     msgr.tfd = tfd;
@@ -59,6 +62,7 @@ cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd
     msgr.init();
 
     st_cli.tfd = tfd;
+    st_cli.follower = etcd_follower;
     st_cli.on_load_config_hook = [this](json11::Json::object & cfg) { on_load_config_hook(cfg); };
     st_cli.on_change_osd_state_hook = [this](uint64_t peer_osd) { on_change_osd_state_hook(peer_osd); };
     st_cli.on_change_hook = [this](std::map<std::string, etcd_kv_t> & changes) { on_change_hook(changes); };
@@ -69,6 +73,12 @@ cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd
 
     scrap_buffer_size = SCRAP_BUFFER_SIZE;
     scrap_buffer = malloc_or_die(scrap_buffer_size);
+    // Large calloc()'ed buffers are mmap()'ed and never touched, so they don't take real memory
+    zero_buffer = calloc(1, ZERO_BUFFER_SIZE);
+    if (!zero_buffer)
+    {
+        throw std::bad_alloc();
+    }
 
     if (ringloop)
     {
@@ -84,16 +94,36 @@ cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd
 
 cluster_client_t::~cluster_client_t()
 {
-    for (auto bp: dirty_buffers)
+    for (auto & bp: dirty_buffers)
     {
-        free(bp.second.buf);
+        free_buffer(bp.second);
     }
     dirty_buffers.clear();
+    for (auto & sp: stripe_buffers)
+    {
+        free(sp.second.buf);
+    }
+    stripe_buffers.clear();
+    for (auto & rp: readahead)
+    {
+        readahead_drop(rp.second, 0, UINT64_MAX);
+    }
+    readahead.clear();
+    while (ro_cache.size())
+    {
+        ro_cache_free(ro_cache.begin());
+    }
+    if (stripe_timer_id)
+    {
+        tfd->clear_timer(stripe_timer_id);
+        stripe_timer_id = 0;
+    }
     if (ringloop)
     {
         ringloop->unregister_consumer(&consumer);
     }
     free(scrap_buffer);
+    free(zero_buffer);
 }
 
 cluster_op_t::~cluster_op_t()
@@ -111,101 +141,76 @@ cluster_op_t::~cluster_op_t()
     }
 }
 
+// Dependencies between operations when immediate_commit is false:
+// - writes wait for all previous SYNCs
+// - SYNCs wait for all previous SYNCs and writes
+// - nothing except other flushes runs while any flush_buffer() write is in progress
+// Operations are divided into epochs by SYNCs, and each epoch counts its unfinished writes,
+// so both queueing and completing an operation take O(1)
 void cluster_client_t::calc_wait(cluster_op_t *op)
 {
     op->prev_wait = 0;
-    if (op->opcode == OSD_OP_WRITE)
+    uint64_t cur_epoch = op_epoch_base + op_epochs.size() - 1;
+    if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE)
     {
-        for (auto prev = op->prev; prev; prev = prev->prev)
+        op->epoch = cur_epoch;
+        auto & epoch = op_epochs.back();
+        epoch.writes++;
+        if (cur_epoch != op_epoch_base && !immediate_commit)
         {
-            if (prev->opcode == OSD_OP_SYNC ||
-                prev->opcode == OSD_OP_WRITE && !(op->flags & OP_FLUSH_BUFFER) && (prev->flags & OP_FLUSH_BUFFER))
-            {
-                op->prev_wait++;
-            }
+            // Wait for previous SYNCs
+            op->prev_wait++;
+            epoch.waiting.push_back(op);
         }
-        if (!op->prev_wait && pgs_loaded)
-            continue_rw(op);
     }
     else if (op->opcode == OSD_OP_SYNC)
     {
-        for (auto prev = op->prev; prev; prev = prev->prev)
+        op->epoch = cur_epoch;
+        auto & epoch = op_epochs.back();
+        epoch.sync = op;
+        if ((cur_epoch != op_epoch_base || epoch.writes > 0) && !immediate_commit)
         {
-            if (prev->opcode == OSD_OP_SYNC || prev->opcode == OSD_OP_WRITE)
-            {
-                op->prev_wait++;
-            }
+            // Wait for previous SYNCs and writes, released by continue_epoch()
+            op->prev_wait++;
         }
-        if (!op->prev_wait && pgs_loaded)
-            continue_sync(op);
+        op_epochs.emplace_back();
     }
-    else
+    if (!op->prev_wait && pgs_loaded && !flush_count)
     {
-        for (auto prev = op->prev; prev; prev = prev->prev)
-        {
-            if (prev->opcode == OSD_OP_WRITE && prev->flags & OP_FLUSH_BUFFER)
-            {
-                op->prev_wait++;
-            }
-            else if (prev->opcode == OSD_OP_WRITE || prev->opcode == OSD_OP_READ)
-            {
-                // Flushes are always in the beginning
-                break;
-            }
-        }
-        if (!op->prev_wait && pgs_loaded)
+        if (op->opcode == OSD_OP_SYNC)
+            continue_sync(op);
+        else
             continue_rw(op);
     }
 }
 
-void cluster_client_t::inc_wait(uint64_t opcode, uint64_t flags, cluster_op_t *next, int inc)
+// Start operations waiting for the first (oldest) epoch
+void cluster_client_t::continue_epoch()
 {
-    if (opcode == OSD_OP_WRITE)
+    if (op_epochs.front().waiting.size())
     {
-        while (next)
+        std::vector<cluster_op_t*> waiting;
+        waiting.swap(op_epochs.front().waiting);
+        for (auto op: waiting)
         {
-            auto n2 = next->next;
-            if (next->opcode == OSD_OP_SYNC ||
-                next->opcode == OSD_OP_WRITE && (flags & OP_FLUSH_BUFFER) && !(next->flags & OP_FLUSH_BUFFER) ||
-                next->opcode == OSD_OP_READ && (flags & OP_FLUSH_BUFFER))
-            {
-                next->prev_wait += inc;
-                if (!next->prev_wait)
-                {
-                    if (next->opcode == OSD_OP_SYNC)
-                        continue_sync(next);
-                    else
-                        continue_rw(next);
-                }
-            }
-            next = n2;
+            op->prev_wait--;
+            if (!op->prev_wait && pgs_loaded && !flush_count)
+                continue_rw(op);
         }
     }
-    else if (opcode == OSD_OP_SYNC)
+    auto & epoch = op_epochs.front();
+    if (epoch.sync && epoch.sync->prev_wait && !epoch.writes)
     {
-        while (next)
-        {
-            auto n2 = next->next;
-            if (next->opcode == OSD_OP_SYNC || next->opcode == OSD_OP_WRITE)
-            {
-                next->prev_wait += inc;
-                if (!next->prev_wait)
-                {
-                    if (next->opcode == OSD_OP_SYNC)
-                        continue_sync(next);
-                    else
-                        continue_rw(next);
-                }
-            }
-            next = n2;
-        }
+        cluster_op_t *sync_op = epoch.sync;
+        sync_op->prev_wait--;
+        if (pgs_loaded && !flush_count)
+            continue_sync(sync_op);
     }
 }
 
 void cluster_client_t::erase_op(cluster_op_t *op)
 {
     uint64_t opcode = op->opcode, flags = op->flags;
-    cluster_op_t *next = op->next;
     if (op->prev)
         op->prev->next = op->next;
     if (op->next)
@@ -215,9 +220,49 @@ void cluster_client_t::erase_op(cluster_op_t *op)
     if (op_queue_tail == op)
         op_queue_tail = op->prev;
     op->next = op->prev = NULL;
+    bool flushed = false;
+    if (flags & OP_FLUSH_BUFFER)
+    {
+        flushed = !--flush_count;
+    }
+    else if ((opcode == OSD_OP_WRITE || opcode == OSD_OP_DELETE || opcode == OSD_OP_SYNC) && op->epoch >= op_epoch_base)
+    {
+        // Epochs before op_epoch_base are already forgotten
+        auto & epoch = op_epochs[op->epoch - op_epoch_base];
+        if (opcode != OSD_OP_SYNC)
+            epoch.writes--;
+        else
+        {
+            epoch.sync = NULL;
+            epoch.synced = true;
+            while (op_epochs.size() > 1 && op_epochs.front().synced)
+            {
+                auto & next = op_epochs[1];
+                for (auto w: op_epochs.front().waiting)
+                    next.waiting.push_back(w);
+                op_epochs.pop_front();
+                op_epoch_base++;
+            }
+        }
+    }
+    if (client_readahead && (opcode == OSD_OP_WRITE || opcode == OSD_OP_DELETE))
+    {
+        // Prefetches issued while the write was queued may have read old data
+        readahead_drop_written(op);
+    }
     std::function<void(cluster_op_t*)>(op->callback)(op);
-    if (!immediate_commit)
-        inc_wait(opcode, flags, next, -1);
+    if (opcode != OSD_OP_READ)
+    {
+        continue_epoch();
+    }
+    if (flushed)
+    {
+        // Resume operations blocked by flushes
+        if (continuing_ops)
+            continuing_ops = 2;
+        else
+            continue_ops();
+    }
 }
 
 void cluster_client_t::continue_ops(bool up_retry)
@@ -240,7 +285,7 @@ restart:
         if (!op->up_wait || up_retry)
         {
             op->up_wait = false;
-            if (!op->prev_wait)
+            if (!op->prev_wait && (!flush_count || (op->flags & OP_FLUSH_BUFFER)))
             {
                 if (op->opcode == OSD_OP_SYNC)
                     continue_sync(op);
@@ -322,6 +367,42 @@ void cluster_client_t::on_load_config_hook(json11::Json::object & config)
     {
         up_wait_retry_interval = 50;
     }
+    // Client-side full-stripe write aggregation for EC pools, local configuration overrides etcd
+    json11::Json ec_writeback = this->config["client_ec_writeback"].is_null()
+        ? config["client_ec_writeback"] : this->config["client_ec_writeback"];
+    client_ec_writeback = ec_writeback == "true" || ec_writeback == "1" || ec_writeback == "yes" || ec_writeback == true;
+    // Client-side write-back cache for all pools
+    json11::Json writeback = this->config["client_writeback"].is_null()
+        ? config["client_writeback"] : this->config["client_writeback"];
+    client_writeback = writeback == "true" || writeback == "1" || writeback == "yes" || writeback == true;
+    // Max sequential readahead window, 0 disables readahead
+    client_readahead = (this->config["client_readahead"].is_null()
+        ? config["client_readahead"] : this->config["client_readahead"]).uint64_value();
+    // Max size of the readonly inode (snapshot layer) cache, 0 disables the cache
+    client_snapshot_cache = (this->config["client_snapshot_cache"].is_null()
+        ? config["client_snapshot_cache"] : this->config["client_snapshot_cache"]).uint64_value();
+    client_ec_writeback_delay = (this->config["client_ec_writeback_delay"].is_null()
+        ? config["client_ec_writeback_delay"] : this->config["client_ec_writeback_delay"]).uint64_value();
+    if (!client_ec_writeback_delay)
+    {
+        client_ec_writeback_delay = DEFAULT_CLIENT_EC_WRITEBACK_DELAY;
+    }
+    // Number of connections to each OSD
+    msgr.peer_connections = (this->config["client_osd_connections"].is_null()
+        ? config["client_osd_connections"] : this->config["client_osd_connections"]).uint64_value();
+    if (msgr.peer_connections < 1)
+        msgr.peer_connections = 1;
+    else if (msgr.peer_connections > MSGR_MAX_PEER_CONNECTIONS)
+        msgr.peer_connections = MSGR_MAX_PEER_CONNECTIONS;
+    // Small reads and writes sent to an OSD in one event loop iteration may be batched, 0 or 1 disables it
+    msgr.max_batch_ops = (this->config["client_batch_ops"].is_null()
+        ? config["client_batch_ops"] : this->config["client_batch_ops"]).uint64_value();
+    if (msgr.max_batch_ops > OSD_BATCH_MAX_OPS)
+        msgr.max_batch_ops = OSD_BATCH_MAX_OPS;
+    json11::Json small_read = this->config["client_small_read_size"].is_null()
+        ? config["client_small_read_size"] : this->config["client_small_read_size"];
+    if (!small_read.is_null())
+        msgr.small_read_size = small_read.uint64_value();
     msgr.parse_config(config);
     msgr.parse_config(this->config);
     st_cli.load_pgs();
@@ -366,6 +447,10 @@ void cluster_client_t::on_change_hook(std::map<std::string, etcd_kv_t> & changes
             pg_counts[pool_item.first] = pool_item.second.real_pg_count;
         }
     }
+    if (ro_cache.size())
+    {
+        ro_cache_purge();
+    }
     continue_ops();
 }
 
@@ -417,15 +502,52 @@ void cluster_client_t::on_ready(std::function<void(void)> fn)
  */
 void cluster_client_t::execute(cluster_op_t *op)
 {
-    if (op->opcode != OSD_OP_SYNC && op->opcode != OSD_OP_READ && op->opcode != OSD_OP_WRITE)
+    if (op->opcode != OSD_OP_SYNC && op->opcode != OSD_OP_READ && op->opcode != OSD_OP_WRITE &&
+        op->opcode != OSD_OP_DELETE)
     {
         op->retval = -EINVAL;
         std::function<void(cluster_op_t*)>(op->callback)(op);
         return;
     }
+    if (client_readahead && readahead_execute(op))
+    {
+        // Served from readahead buffers or waiting for a prefetch
+        return;
+    }
+    execute_wb(op);
+}
+
+// Execute an operation through the client-side write-back (stripe buffers)
+void cluster_client_t::execute_wb(cluster_op_t *op)
+{
+    if (client_ec_writeback || client_writeback || stripe_waiting.size())
+    {
+        if (stripe_waiting.size())
+        {
+            // Preserve order with operations waiting for stripe flushes
+            stripe_waiting.push_back(op);
+            return;
+        }
+        int res = stripe_wb_execute(op);
+        if (res == STRIPE_WB_DONE)
+        {
+            // Absorbed by a stripe buffer or completed
+            return;
+        }
+        else if (res == STRIPE_WB_WAIT)
+        {
+            stripe_waiting.push_back(op);
+            return;
+        }
+    }
+    execute_internal(op);
+}
+
+void cluster_client_t::execute_internal(cluster_op_t *op)
+{
     op->cur_inode = op->inode;
     op->retval = 0;
-    if (op->opcode == OSD_OP_WRITE && !immediate_commit)
+    if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) && !immediate_commit)
     {
         if (dirty_bytes >= client_max_dirty_bytes || dirty_ops >= client_max_dirty_ops)
         {
@@ -448,7 +570,9 @@ void cluster_client_t::execute(cluster_op_t *op)
             dirty_ops = 0;
             calc_wait(sync_op);
         }
-        dirty_bytes += op->len;
+        // Discards don't hold any data in the client
+        if (op->opcode == OSD_OP_WRITE)
+            dirty_bytes += op->len;
         dirty_ops++;
     }
     else if (op->opcode == OSD_OP_SYNC)
@@ -464,92 +588,208 @@ void cluster_client_t::execute(cluster_op_t *op)
     }
     else
         op_queue_tail = op_queue_head = op;
-    if (!immediate_commit)
-        calc_wait(op);
-    else if (pgs_loaded)
-    {
-        if (op->opcode == OSD_OP_SYNC)
-            continue_sync(op);
-        else
-            continue_rw(op);
+    calc_wait(op);
+}
+
+// Dirty buffers point into reference-counted allocations, so that parts of a buffer
+// can be split away and overwritten parts can be freed without copying
+struct cluster_buffer_alloc_t
+{
+    uint64_t refs;
+    uint64_t capacity;
+};
+
+static inline void *alloc_data(void *alloc)
+{
+    return (uint8_t*)alloc + sizeof(cluster_buffer_alloc_t);
+}
+
+static void *new_buffer_alloc(uint64_t capacity)
+{
+    cluster_buffer_alloc_t *alloc = (cluster_buffer_alloc_t*)malloc_or_die(sizeof(cluster_buffer_alloc_t) + capacity);
+    alloc->refs = 1;
+    alloc->capacity = capacity;
+    return alloc;
+}
+
+static inline void ref_buffer_alloc(void *alloc)
+{
+    ((cluster_buffer_alloc_t*)alloc)->refs++;
+}
+
+static inline void unref_buffer_alloc(void *alloc)
+{
+    if (!--((cluster_buffer_alloc_t*)alloc)->refs)
+        free(alloc);
+}
+
+void cluster_client_t::free_buffer(cluster_buffer_t & wr)
+{
+    if (wr.alloc)
+        unref_buffer_alloc(wr.alloc);
+    wr.alloc = wr.buf = NULL;
+}
+
+// Copy <len> bytes of <op> data starting from the position (<iov_idx>, <iov_pos>) and advance it
+static void copy_op_data(cluster_op_t *op, int & iov_idx, uint64_t & iov_pos, void *dst, uint64_t len)
+{
+    while (len > 0 && iov_idx < op->iov.count)
+    {
+        uint64_t cur = op->iov.buf[iov_idx].iov_len - iov_pos;
+        if (cur > len)
+            cur = len;
+        memcpy(dst, (uint8_t*)op->iov.buf[iov_idx].iov_base + iov_pos, cur);
+        dst = (uint8_t*)dst + cur;
+        len -= cur;
+        iov_pos += cur;
+        if (iov_pos >= op->iov.buf[iov_idx].iov_len)
+        {
+            iov_pos = 0;
+            iov_idx++;
+        }
     }
 }
 
+// Save operation for replay when one of PGs goes out of sync
+// (primary OSD drops our connection in this case)
+//
+// <dirty_buffers> is an extent map of non-overlapping buffers. Writes are copied into the
+// overlapped buffers in place. Buffers shared with a replay (flush_buffer) or with another part
+// of the same allocation aren't overwritten: overwritten parts of them are cut away without
+// copying. The rest of the write is saved into the spare capacity of the previous adjacent buffer
+// if it has some, or as a new buffer. New buffers following an adjacent one get spare capacity,
+// so sequential writes are merged into larger buffers. Discards are saved as buffers without
+// data (buf == NULL) and replayed as discards
 void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers)
 {
-    // Save operation for replay when one of PGs goes out of sync
-    // (primary OSD drops our connection in this case)
+    uint64_t op_end = op->offset + op->len;
     auto dirty_it = dirty_buffers.lower_bound((object_id){
         .inode = op->inode,
         .stripe = op->offset,
     });
-    while (dirty_it != dirty_buffers.begin())
+    if (dirty_it != dirty_buffers.begin())
     {
-        dirty_it--;
-        if (dirty_it->first.inode != op->inode ||
-            (dirty_it->first.stripe + dirty_it->second.len) <= op->offset)
-        {
-            dirty_it++;
-            break;
-        }
+        auto prev_it = std::prev(dirty_it);
+        if (prev_it->first.inode == op->inode && prev_it->first.stripe + prev_it->second.len > op->offset)
+            dirty_it = prev_it;
     }
-    uint64_t pos = op->offset, len = op->len, iov_idx = 0, iov_pos = 0;
-    while (len > 0)
+    uint64_t pos = op->offset, iov_pos = 0;
+    int iov_idx = 0;
+    while (pos < op_end)
     {
-        uint64_t new_len = 0;
-        if (dirty_it == dirty_buffers.end())
+        if (op->opcode == OSD_OP_WRITE && dirty_it != dirty_buffers.end() && dirty_it->first.inode == op->inode &&
+            dirty_it->first.stripe <= pos && dirty_it->second.alloc &&
+            ((cluster_buffer_alloc_t*)dirty_it->second.alloc)->refs == 1)
         {
-            new_len = len;
+            // Overwrite in place if the buffer isn't shared
+            uint64_t start = dirty_it->first.stripe;
+            uint64_t end = start + dirty_it->second.len;
+            uint64_t cur_end = end < op_end ? end : op_end;
+            copy_op_data(op, iov_idx, iov_pos, (uint8_t*)dirty_it->second.buf + (pos - start), cur_end-pos);
+            dirty_it->second.state = CACHE_DIRTY;
+            pos = cur_end;
+            dirty_it++;
+            continue;
         }
-        else if (dirty_it->first.inode != op->inode || dirty_it->first.stripe > pos)
+        // Cut away overwritten parts of shared buffers up to the next buffer which isn't shared
+        uint64_t gap_end = op_end;
+        while (dirty_it != dirty_buffers.end() && dirty_it->first.inode == op->inode &&
+            dirty_it->first.stripe < op_end)
         {
-            new_len = dirty_it->first.stripe - pos;
-            if (new_len > len)
+            if (op->opcode == OSD_OP_WRITE && dirty_it->second.alloc &&
+                ((cluster_buffer_alloc_t*)dirty_it->second.alloc)->refs == 1)
+            {
+                gap_end = dirty_it->first.stripe;
+                break;
+            }
+            uint64_t start = dirty_it->first.stripe;
+            uint64_t end = start + dirty_it->second.len;
+            if (end > op_end)
+            {
+                // Keep the tail
+                cluster_buffer_t tail = dirty_it->second;
+                if (tail.buf)
+                    tail.buf = (uint8_t*)tail.buf + (op_end - start);
+                tail.len = end - op_end;
+                if (start < pos)
+                {
+                    // ...and the head
+                    dirty_it->second.len = pos - start;
+                    if (tail.alloc)
+                        ref_buffer_alloc(tail.alloc);
+                    dirty_it++;
+                }
+                else
+                    dirty_it = dirty_buffers.erase(dirty_it);
+                dirty_it = dirty_buffers.emplace_hint(dirty_it, (object_id){ .inode = op->inode, .stripe = op_end }, tail);
+                break;
+            }
+            else if (start < pos)
+            {
+                // Keep the head
+                dirty_it->second.len = pos - start;
+                dirty_it++;
+            }
+            else
             {
-                new_len = len;
+                // Fully overwritten
+                if (dirty_it->second.alloc)
+                    unref_buffer_alloc(dirty_it->second.alloc);
+                dirty_it = dirty_buffers.erase(dirty_it);
             }
         }
-        if (new_len > 0)
+        if (op->opcode == OSD_OP_DELETE)
         {
-            dirty_it = dirty_buffers.emplace_hint(dirty_it, (object_id){
+            // Everything overlapped by the discard is cut away, remember it as a buffer without data
+            dirty_buffers.emplace_hint(dirty_it, (object_id){
                 .inode = op->inode,
-                .stripe = pos,
+                .stripe = op->offset,
             }, (cluster_buffer_t){
-                .buf = malloc_or_die(new_len),
-                .len = new_len,
+                .buf = NULL,
+                .len = op->len,
+                .state = CACHE_DIRTY,
+                .alloc = NULL,
             });
+            break;
         }
-        // FIXME: Split big buffers into smaller ones on overwrites. But this will require refcounting
-        dirty_it->second.state = CACHE_DIRTY;
-        uint64_t cur_len = (dirty_it->first.stripe + dirty_it->second.len - pos);
-        if (cur_len > len)
-        {
-            cur_len = len;
-        }
-        while (cur_len > 0 && iov_idx < op->iov.count)
+        // Save the data up to <gap_end>. Append it to the previous buffer if it's adjacent,
+        // not being flushed, not shared and has enough spare capacity
+        uint64_t new_len = gap_end - pos;
+        uint64_t capacity = new_len;
+        if (dirty_it != dirty_buffers.begin())
         {
-            unsigned iov_len = (op->iov.buf[iov_idx].iov_len - iov_pos);
-            if (iov_len <= cur_len)
+            auto prev_it = std::prev(dirty_it);
+            auto & prev = prev_it->second;
+            if (prev_it->first.inode == op->inode && prev_it->first.stripe + prev.len == pos &&
+                prev.state == CACHE_DIRTY && prev.alloc && ((cluster_buffer_alloc_t*)prev.alloc)->refs == 1 &&
+                prev.len + new_len <= MAX_DIRTY_BUFFER_MERGE)
             {
-                memcpy(dirty_it->second.buf + pos - dirty_it->first.stripe,
-                    op->iov.buf[iov_idx].iov_base + iov_pos, iov_len);
-                pos += iov_len;
-                len -= iov_len;
-                cur_len -= iov_len;
-                iov_pos = 0;
-                iov_idx++;
-            }
-            else
-            {
-                memcpy(dirty_it->second.buf + pos - dirty_it->first.stripe,
-                    op->iov.buf[iov_idx].iov_base + iov_pos, cur_len);
-                pos += cur_len;
-                len -= cur_len;
-                iov_pos += cur_len;
-                cur_len = 0;
+                uint64_t buf_pos = (uint8_t*)prev.buf - (uint8_t*)alloc_data(prev.alloc);
+                if (buf_pos + prev.len + new_len <= ((cluster_buffer_alloc_t*)prev.alloc)->capacity)
+                {
+                    copy_op_data(op, iov_idx, iov_pos, (uint8_t*)prev.buf + prev.len, new_len);
+                    prev.len += new_len;
+                    pos = gap_end;
+                    continue;
+                }
+                // The write looks sequential, reserve space for the next ones
+                capacity = prev.len*2 < MAX_DIRTY_BUFFER_MERGE ? prev.len*2 : MAX_DIRTY_BUFFER_MERGE;
+                if (capacity < new_len)
+                    capacity = new_len;
             }
         }
-        dirty_it++;
+        void *alloc = new_buffer_alloc(capacity);
+        copy_op_data(op, iov_idx, iov_pos, alloc_data(alloc), new_len);
+        dirty_buffers.emplace_hint(dirty_it, (object_id){
+            .inode = op->inode,
+            .stripe = pos,
+        }, (cluster_buffer_t){
+            .buf = alloc_data(alloc),
+            .len = new_len,
+            .state = CACHE_DIRTY,
+            .alloc = alloc,
+        });
+        pos = gap_end;
     }
 }
 
@@ -558,17 +798,32 @@ void cluster_client_t::flush_buffer(const object_id & oid, cluster_buffer_t *wr)
     wr->state = CACHE_REPEATING;
     cluster_op_t *op = new cluster_op_t;
     op->flags = OP_FLUSH_BUFFER;
-    op->opcode = OSD_OP_WRITE;
+    op->opcode = wr->buf ? OSD_OP_WRITE : OSD_OP_DELETE;
     op->cur_inode = op->inode = oid.inode;
     op->offset = oid.stripe;
     op->len = wr->len;
-    op->iov.push_back(wr->buf, wr->len);
-    op->callback = [wr](cluster_op_t* op)
-    {
-        if (wr->state == CACHE_REPEATING)
+    if (wr->buf)
+        op->iov.push_back(wr->buf, wr->len);
+    // The buffer may be split or overwritten while the operation is in progress,
+    // so keep a reference to its data and then find the remaining parts by the allocation.
+    // Parts of a discard can't be overwritten in place, so NULL matches them too
+    void *alloc = wr->alloc;
+    if (alloc)
+        ref_buffer_alloc(alloc);
+    op->callback = [this, alloc](cluster_op_t* op)
+    {
+        auto dirty_it = dirty_buffers.lower_bound((object_id){ .inode = op->inode, .stripe = op->offset });
+        while (dirty_it != dirty_buffers.end() && dirty_it->first.inode == op->inode &&
+            dirty_it->first.stripe < op->offset + op->len)
         {
-            wr->state = CACHE_DIRTY;
+            if (dirty_it->second.alloc == alloc && dirty_it->second.state == CACHE_REPEATING)
+            {
+                dirty_it->second.state = CACHE_DIRTY;
+            }
+            dirty_it++;
         }
+        if (alloc)
+            unref_buffer_alloc(alloc);
         delete op;
     };
     op->next = op_queue_head;
@@ -579,7 +834,7 @@ void cluster_client_t::flush_buffer(const object_id & oid, cluster_buffer_t *wr)
     }
     else
         op_queue_tail = op_queue_head = op;
-    inc_wait(op->opcode, op->flags, op->next, 1);
+    flush_count++;
     continue_rw(op);
 }
 
@@ -615,7 +870,7 @@ resume_0:
             return 0;
         }
     }
-    if (op->opcode == OSD_OP_WRITE)
+    if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE)
     {
         auto ino_it = st_cli.inode_config.find(op->inode);
         if (ino_it != st_cli.inode_config.end() && ino_it->second.readonly)
@@ -633,6 +888,11 @@ resume_1:
     // Slice the operation into parts
     slice_rw(op);
     op->needs_reslice = false;
+    if (op->opcode == OSD_OP_READ && ro_cache.size() && ro_cache_enabled(op->cur_inode))
+    {
+        // Take parts of readonly inodes from the cache
+        ro_cache_read(op);
+    }
     if (op->opcode == OSD_OP_WRITE && op->version && op->parts.size() > 1)
     {
         // Atomic writes to multiple stripes are unsupported
@@ -863,7 +1123,7 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
             if (end == begin)
                 op->done_count++;
         }
-        else
+        else if (op->opcode != OSD_OP_DELETE)
         {
             add_iov(end-begin, false, op, iov_idx, iov_pos, op->parts[i].iov, NULL, 0);
         }
@@ -873,6 +1133,7 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
         op->parts[i].pg_num = pg_num;
         op->parts[i].osd_num = 0;
         op->parts[i].flags = 0;
+        op->parts[i].cache_buf = NULL;
         i++;
     }
 }
@@ -896,6 +1157,16 @@ bool cluster_client_t::affects_osd(uint64_t inode, uint64_t offset, uint64_t len
     return false;
 }
 
+void cluster_client_t::push_zeroes(osd_op_buf_list_t & iov, uint64_t len)
+{
+    while (len > 0)
+    {
+        uint64_t cur = len < ZERO_BUFFER_SIZE ? len : ZERO_BUFFER_SIZE;
+        iov.push_back(zero_buffer, cur);
+        len -= cur;
+    }
+}
+
 bool cluster_client_t::try_send(cluster_op_t *op, int i)
 {
     auto part = &op->parts[i];
@@ -908,17 +1179,37 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
         auto peer_it = msgr.osd_peer_fds.find(primary_osd);
         if (peer_it != msgr.osd_peer_fds.end())
         {
-            int peer_fd = peer_it->second;
+            uint64_t pg_block_size = bs_block_size * (
+                pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
+            );
+            int peer_fd = msgr.select_peer_fd(primary_osd, op->opcode == OSD_OP_READ,
+                part->len, op->cur_inode + part->offset/pg_block_size);
             part->osd_num = primary_osd;
             part->flags |= PART_SENT;
             op->inflight_count++;
             uint64_t pg_bitmap_size = bs_bitmap_size * (
                 pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
             );
+            if (op->opcode == OSD_OP_READ && part->len > 0 && ro_cache_enabled(op->cur_inode))
+            {
+                // Read the whole stripe of the readonly inode and keep it in the cache
+                part->cache_buf = malloc_or_die(pg_block_size + pg_bitmap_size);
+            }
             uint64_t meta_rev = 0;
             auto ino_it = st_cli.inode_config.find(op->inode);
             if (ino_it != st_cli.inode_config.end())
                 meta_rev = ino_it->second.mod_revision;
+            uint64_t opcode = op->opcode;
+            if (opcode == OSD_OP_DELETE && ((op->flags & OP_NO_DELETE) ||
+                part->offset % pg_block_size || part->len < pg_block_size ||
+                ino_it != st_cli.inode_config.end() && ino_it->second.parent_id))
+            {
+                // Only whole objects are deleted. Other parts are overwritten with zeroes,
+                // and so are the objects of clones which would otherwise expose parent data
+                opcode = OSD_OP_WRITE;
+                part->iov.reset();
+                push_zeroes(part->iov, part->len);
+            }
             part->op = (osd_op_t){
                 .op_type = OSD_OP_OUT,
                 .peer_fd = peer_fd,
@@ -926,22 +1217,26 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
                     .header = {
                         .magic = SECONDARY_OSD_OP_MAGIC,
                         .id = op_id++,
-                        .opcode = op->opcode,
+                        .opcode = opcode,
                     },
                     .inode = op->cur_inode,
-                    .offset = part->offset,
-                    .len = part->len,
+                    .offset = part->cache_buf ? part->offset - part->offset % pg_block_size : part->offset,
+                    .len = part->cache_buf ? (uint32_t)pg_block_size : (opcode == OSD_OP_DELETE ? 0 : part->len),
                     .meta_revision = meta_rev,
                     .version = op->opcode == OSD_OP_WRITE ? op->version : 0,
                 } },
-                .bitmap = op->opcode == OSD_OP_WRITE ? NULL : op->part_bitmaps + pg_bitmap_size*i,
-                .bitmap_len = (unsigned)(op->opcode == OSD_OP_WRITE ? 0 : pg_bitmap_size),
+                .bitmap = opcode != OSD_OP_READ ? NULL : (part->cache_buf
+                    ? part->cache_buf + pg_block_size : op->part_bitmaps + pg_bitmap_size*i),
+                .bitmap_len = (unsigned)(opcode != OSD_OP_READ ? 0 : pg_bitmap_size),
                 .callback = [this, part](osd_op_t *op_part)
                 {
                     handle_op_part(part);
                 },
             };
-            part->op.iov = part->iov;
+            if (part->cache_buf)
+                part->op.iov.push_back(part->cache_buf, pg_block_size);
+            else
+                part->op.iov = part->iov;
             msgr.outbox_push(&part->op);
             return true;
         }
@@ -1030,7 +1325,7 @@ resume_1:
         {
             if (uw_it->second.state == CACHE_FLUSHING)
             {
-                free(uw_it->second.buf);
+                free_buffer(uw_it->second);
                 dirty_buffers.erase(uw_it++);
             }
             else
@@ -1080,7 +1375,17 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
     cluster_op_t *op = part->parent;
     op->inflight_count--;
     int expected = part->op.req.hdr.opcode == OSD_OP_SYNC ? 0 : part->op.req.rw.len;
-    if (part->op.reply.hdr.retval != expected)
+    if (part->op.req.hdr.opcode == OSD_OP_DELETE && part->op.reply.hdr.retval == -EBUSY)
+    {
+        // Objects can't be deleted from degraded PGs, retry the discard with zero writes
+        op->flags |= OP_NO_DELETE;
+        if (!op->retval)
+        {
+            op->retval = -EPIPE;
+        }
+        part->flags |= PART_ERROR;
+    }
+    else if (part->op.reply.hdr.retval != expected)
     {
         // Operation failed, retry
         if (part->op.reply.hdr.retval == -EPIPE)
@@ -1110,6 +1415,11 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
             msgr.stop_client(part->op.peer_fd);
         }
         part->flags |= PART_ERROR;
+        if (part->cache_buf)
+        {
+            free(part->cache_buf);
+            part->cache_buf = NULL;
+        }
     }
     else
     {
@@ -1119,7 +1429,10 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
         op->done_count++;
         if (op->opcode == OSD_OP_READ)
         {
-            copy_part_bitmap(op, part);
+            if (part->cache_buf)
+                ro_cache_fill(op, part);
+            else
+                copy_part_bitmap(op, part);
             op->version = op->parts.size() == 1 ? part->op.reply.rw.version : 0;
         }
     }
@@ -1135,7 +1448,13 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
 void cluster_client_t::copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *part)
 {
     // Copy (OR) bitmap
-    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->cur_inode));
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(op->cur_inode));
+    if (pool_it == st_cli.pool_config.end())
+    {
+        // The pool is deleted while the read was in flight
+        return;
+    }
+    auto & pool_cfg = pool_it->second;
     uint32_t pg_block_size = bs_block_size * (
         pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
     );
@@ -1161,3 +1480,122 @@ void cluster_client_t::copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *par
         part_len--;
     }
 }
+
+bool cluster_client_t::ro_cache_enabled(uint64_t inode)
+{
+    if (!client_snapshot_cache)
+    {
+        return false;
+    }
+    auto ino_it = st_cli.inode_config.find(inode);
+    return ino_it != st_cli.inode_config.end() && ino_it->second.readonly;
+}
+
+// Complete unsent parts of a readonly inode read which are found in the cache
+void cluster_client_t::ro_cache_read(cluster_op_t *op)
+{
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(op->cur_inode));
+    if (pool_it == st_cli.pool_config.end())
+    {
+        return;
+    }
+    auto & pool_cfg = pool_it->second;
+    uint64_t pg_block_size = bs_block_size * (
+        pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
+    );
+    for (auto & part: op->parts)
+    {
+        if (part.flags || !part.len)
+        {
+            continue;
+        }
+        auto ce_it = ro_cache.find((object_id){
+            .inode = op->cur_inode,
+            .stripe = part.offset - part.offset % pg_block_size,
+        });
+        if (ce_it == ro_cache.end())
+        {
+            continue;
+        }
+        ro_cache_lru.splice(ro_cache_lru.begin(), ro_cache_lru, ce_it->second.lru_it);
+        ro_cache_copy(op, &part, ce_it->second.buf, pg_block_size);
+        part.flags = PART_SENT | PART_DONE;
+        op->done_count++;
+    }
+}
+
+// Copy the part's range from a cached stripe into the operation, including the bitmap
+void cluster_client_t::ro_cache_copy(cluster_op_t *op, cluster_op_part_t *part, void *data, uint64_t pg_block_size)
+{
+    uint64_t pos = part->offset % pg_block_size;
+    for (int i = 0; i < part->iov.count; i++)
+    {
+        memcpy(part->iov.buf[i].iov_base, data + pos, part->iov.buf[i].iov_len);
+        pos += part->iov.buf[i].iov_len;
+    }
+    part->op.req.rw.offset = part->offset;
+    part->op.req.rw.len = part->len;
+    part->op.bitmap = data + pg_block_size;
+    copy_part_bitmap(op, part);
+}
+
+// Handle a completed full stripe read of a readonly inode
+void cluster_client_t::ro_cache_fill(cluster_op_t *op, cluster_op_part_t *part)
+{
+    // The pool may already be deleted, so take the stripe geometry from the request itself
+    uint64_t pg_block_size = part->op.req.rw.len;
+    uint64_t pg_bitmap_size = part->op.bitmap_len;
+    object_id oid = { .inode = op->cur_inode, .stripe = part->op.req.rw.offset };
+    void *buf = part->cache_buf;
+    part->cache_buf = NULL;
+    ro_cache_copy(op, part, buf, pg_block_size);
+    auto ino_it = st_cli.inode_config.find(oid.inode);
+    if (ro_cache.find(oid) != ro_cache.end() || ino_it == st_cli.inode_config.end() || !ino_it->second.readonly)
+    {
+        // Already cached by another read, or the inode isn't readonly anymore
+        free(buf);
+        return;
+    }
+    ro_cache_lru.push_front(oid);
+    ro_cache[oid] = (cluster_ro_cache_entry_t){
+        .buf = buf,
+        .size = pg_block_size + pg_bitmap_size,
+        .mod_revision = ino_it->second.mod_revision,
+        .lru_it = ro_cache_lru.begin(),
+    };
+    ro_cache_bytes += pg_block_size + pg_bitmap_size;
+    while (ro_cache_bytes > client_snapshot_cache && ro_cache_lru.size())
+    {
+        // Evict least recently used stripes
+        ro_cache_free(ro_cache.find(ro_cache_lru.back()));
+    }
+}
+
+void cluster_client_t::ro_cache_free(std::map<object_id, cluster_ro_cache_entry_t>::iterator ce_it)
+{
+    ro_cache_lru.erase(ce_it->second.lru_it);
+    ro_cache_bytes -= ce_it->second.size;
+    free(ce_it->second.buf);
+    ro_cache.erase(ce_it);
+}
+
+// Drop cached data of inodes which are deleted, made writable or otherwise modified in etcd
+void cluster_client_t::ro_cache_purge()
+{
+    auto ce_it = ro_cache.begin();
+    while (ce_it != ro_cache.end())
+    {
+        inode_t inode = ce_it->first.inode;
+        auto ino_it = st_cli.inode_config.find(inode);
+        if (ino_it != st_cli.inode_config.end() && ino_it->second.readonly &&
+            ino_it->second.mod_revision == ce_it->second.mod_revision)
+        {
+            ce_it = ro_cache.lower_bound((object_id){ .inode = inode+1, .stripe = 0 });
+            continue;
+        }
+        while (ce_it != ro_cache.end() && ce_it->first.inode == inode)
+        {
+            ro_cache_free(ce_it++);
+        }
+    }
+}
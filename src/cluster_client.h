@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include <deque>
+#include <list>
 #include "messenger.h"
 #include "etcd_state_client.h"
 
@@ -10,6 +12,13 @@
 #define MAX_BLOCK_SIZE 128*1024*1024
 #define DEFAULT_CLIENT_MAX_DIRTY_BYTES 32*1024*1024
 #define DEFAULT_CLIENT_MAX_DIRTY_OPS 1024
+#define DEFAULT_CLIENT_EC_WRITEBACK_DELAY 50
+#define MAX_DIRTY_BUFFER_MERGE 4*1024*1024
+
+// Results of stripe_wb_execute()
+#define STRIPE_WB_PASS 0
+#define STRIPE_WB_DONE 1
+#define STRIPE_WB_WAIT 2
 
 struct cluster_op_t;
 
@@ -22,12 +31,18 @@ struct cluster_op_part_t
     osd_num_t osd_num;
     osd_op_buf_list_t iov;
     unsigned flags;
+    // Full stripe buffer when the part fills the readonly inode cache
+    void *cache_buf;
     osd_op_t op;
 };
 
 struct cluster_op_t
 {
-    uint64_t opcode; // OSD_OP_READ, OSD_OP_WRITE, OSD_OP_SYNC
+    // OSD_OP_READ, OSD_OP_WRITE, OSD_OP_SYNC or OSD_OP_DELETE (discard: zero the range
+    // and free whole objects, so that it reads back as zeroes). Partial objects are written
+    // with zero data from a shared buffer instead of zeroing their bitmaps, because OSDs
+    // have no operation which clears a part of an object bitmap
+    uint64_t opcode;
     uint64_t inode;
     uint64_t offset;
     uint64_t len;
@@ -38,6 +53,9 @@ struct cluster_op_t
     osd_op_buf_list_t iov;
     std::function<void(cluster_op_t*)> callback;
     ~cluster_op_t();
+
+    static void *operator new(size_t size) { return object_pool_t<cluster_op_t>::alloc(size); }
+    static void operator delete(void *ptr, size_t size) { object_pool_t<cluster_op_t>::release(ptr, size); }
 protected:
     uint64_t flags = 0;
     int state = 0;
@@ -52,14 +70,82 @@ protected:
     unsigned bitmap_buf_size = 0;
     cluster_op_t *prev = NULL, *next = NULL;
     int prev_wait = 0;
+    uint64_t epoch = 0;
     friend class cluster_client_t;
 };
 
+// Operations between two SYNCs
+struct cluster_op_epoch_t
+{
+    // Unfinished writes of this epoch
+    uint64_t writes = 0;
+    // SYNC which ends this epoch
+    cluster_op_t *sync = NULL;
+    bool synced = false;
+    // Writes waiting for previous epochs to be synced
+    std::vector<cluster_op_t*> waiting;
+};
+
 struct cluster_buffer_t
 {
     void *buf;
     uint64_t len;
     int state;
+    // Reference-counted allocation which <buf> points into
+    void *alloc;
+};
+
+// Partial EC stripe held in the client until it becomes full (or gets too old)
+struct cluster_stripe_buffer_t
+{
+    // Data of the dirty range, grown on demand up to the stripe size
+    void *buf;
+    uint64_t buf_size;
+    // Dirty range, absolute offsets within the inode
+    uint64_t start, end;
+    // CLOCK_MONOTONIC time in microseconds when the buffer must be flushed
+    uint64_t deadline;
+    // Number of writes merged into the buffer
+    uint64_t ops;
+};
+
+// Stripe of a readonly inode (snapshot layer) cached by the client:
+// stripe data followed by the object bitmap. Readonly inodes never change, so entries
+// are only dropped when the cache is full or the inode metadata is modified
+struct cluster_ro_cache_entry_t
+{
+    void *buf;
+    uint64_t size;
+    uint64_t mod_revision;
+    std::list<object_id>::iterator lru_it;
+};
+
+// Data read ahead of a sequential reader
+struct cluster_readahead_buf_t
+{
+    uint64_t offset, len;
+    void *buf;
+    // Prefetch is completed
+    bool loaded = false;
+    // Prefetch or its completion handling is in progress, the buffer can't be freed yet
+    bool inflight = true;
+    // Buffer is removed from its stream and should be freed when the prefetch completes
+    bool dropped = false;
+    // Reads waiting for the prefetch
+    std::vector<cluster_op_t*> waiting;
+};
+
+// Sequential read stream of one inode
+struct cluster_readahead_t
+{
+    // End of the last sequential read, where the next one is expected
+    uint64_t next_offset = 0;
+    uint64_t seq_reads = 0;
+    // Current readahead window
+    uint64_t window = 0;
+    // End of data read ahead or being read ahead
+    uint64_t ahead_end = 0;
+    std::map<uint64_t, cluster_readahead_buf_t*> bufs;
 };
 
 // FIXME: Split into public and private interfaces
@@ -73,22 +159,47 @@ class cluster_client_t
     std::map<pool_id_t, uint64_t> pg_counts;
     // WARNING: initially true so execute() doesn't create fake sync
     bool immediate_commit = true;
-    // FIXME: Implement inmemory_commit mode. Note that it requires to return overlapping reads from memory.
     uint64_t client_max_dirty_bytes = 0;
     uint64_t client_max_dirty_ops = 0;
     int log_level;
     int up_wait_retry_interval = 500; // ms
+    bool client_ec_writeback = false;
+    bool client_writeback = false;
+    int client_ec_writeback_delay = DEFAULT_CLIENT_EC_WRITEBACK_DELAY; // ms
 
     int retry_timeout_id = 0;
     uint64_t op_id = 1;
     std::vector<cluster_op_t*> offline_ops;
     cluster_op_t *op_queue_head = NULL, *op_queue_tail = NULL;
+    std::deque<cluster_op_epoch_t> op_epochs;
+    uint64_t op_epoch_base = 0;
+    int flush_count = 0;
     std::map<object_id, cluster_buffer_t> dirty_buffers;
     std::set<osd_num_t> dirty_osds;
     uint64_t dirty_bytes = 0, dirty_ops = 0;
 
+    // EC full-stripe write-back
+    std::map<object_id, cluster_stripe_buffer_t> stripe_buffers;
+    std::map<object_id, int> stripe_flushing;
+    std::deque<cluster_op_t*> stripe_waiting;
+    uint64_t stripe_buffer_bytes = 0, stripe_buffer_ops = 0;
+    int stripe_timer_id = 0, stripe_error = 0;
+    bool stripe_continuing = false;
+
+    // Sequential readahead
+    uint64_t client_readahead = 0;
+    std::map<inode_t, cluster_readahead_t> readahead;
+    uint64_t readahead_bytes = 0;
+
+    // Readonly inode cache
+    uint64_t client_snapshot_cache = 0;
+    std::map<object_id, cluster_ro_cache_entry_t> ro_cache;
+    std::list<object_id> ro_cache_lru;
+    uint64_t ro_cache_bytes = 0;
+
     void *scrap_buffer = NULL;
     unsigned scrap_buffer_size = 0;
+    void *zero_buffer = NULL;
 
     bool pgs_loaded = false;
     ring_consumer_t consumer;
@@ -100,15 +211,38 @@ public:
     osd_messenger_t msgr;
     json11::Json config;
 
-    cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config);
+    // etcd_follower: don't talk to etcd, state is received through st_cli.mirror_*() from another client
+    cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config, bool etcd_follower = false);
     ~cluster_client_t();
     void execute(cluster_op_t *op);
     bool is_ready();
     void on_ready(std::function<void(void)> fn);
+    inline uint64_t get_bs_block_size() { return bs_block_size; }
+    // Append <len> zero bytes to <iov> from the shared zero buffer
+    void push_zeroes(osd_op_buf_list_t & iov, uint64_t len);
 
     static void copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers);
+    static void free_buffer(cluster_buffer_t & wr);
     void continue_ops(bool up_retry = false);
 protected:
+    void execute_wb(cluster_op_t *op);
+    void execute_internal(cluster_op_t *op);
+    bool readahead_execute(cluster_op_t *op);
+    void readahead_drop_written(cluster_op_t *op);
+    bool readahead_covers(cluster_readahead_t & ra, uint64_t start, uint64_t end);
+    bool readahead_read(cluster_readahead_t & ra, cluster_op_t *op);
+    void readahead_prefetch(uint64_t inode, cluster_readahead_t & ra, uint64_t read_end, uint64_t read_len);
+    void readahead_done(uint64_t inode, cluster_readahead_buf_t *rb, bool ok);
+    void readahead_drop(cluster_readahead_t & ra, uint64_t start, uint64_t end);
+    int stripe_wb_execute(cluster_op_t *op);
+    bool stripe_wb_read(cluster_op_t *op, uint64_t pg_block_size);
+    bool stripe_wb_flush_range(cluster_op_t *op, uint64_t pg_block_size);
+    void stripe_wb_flush(std::map<object_id, cluster_stripe_buffer_t>::iterator sb_it);
+    void stripe_wb_drop(std::map<object_id, cluster_stripe_buffer_t>::iterator sb_it);
+    void stripe_wb_set_timer(uint64_t delay_us);
+    void stripe_wb_flush_all();
+    void stripe_wb_continue();
+    void stripe_wb_on_timer();
     bool affects_osd(uint64_t inode, uint64_t offset, uint64_t len, osd_num_t osd);
     void flush_buffer(const object_id & oid, cluster_buffer_t *wr);
     void on_load_config_hook(json11::Json::object & config);
@@ -122,7 +256,13 @@ protected:
     void send_sync(cluster_op_t *op, cluster_op_part_t *part);
     void handle_op_part(cluster_op_part_t *part);
     void copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *part);
+    bool ro_cache_enabled(uint64_t inode);
+    void ro_cache_read(cluster_op_t *op);
+    void ro_cache_fill(cluster_op_t *op, cluster_op_part_t *part);
+    void ro_cache_copy(cluster_op_t *op, cluster_op_part_t *part, void *data, uint64_t pg_block_size);
+    void ro_cache_free(std::map<object_id, cluster_ro_cache_entry_t>::iterator ce_it);
+    void ro_cache_purge();
     void erase_op(cluster_op_t *op);
     void calc_wait(cluster_op_t *op);
-    void inc_wait(uint64_t opcode, uint64_t flags, cluster_op_t *next, int inc);
+    void continue_epoch();
 };
@@ -0,0 +1,263 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Client-side sequential readahead (client_readahead)
+//
+// Each inode has a read stream which remembers where the next sequential read is expected.
+// After READAHEAD_MIN_SEQUENTIAL sequential reads in a row the client starts to read data
+// ahead of the reader into readahead buffers. The window starts at 4 read sizes and doubles
+// with each prefetch up to client_readahead bytes. A new prefetch is issued when less than
+// a half of the window remains ahead of the reader.
+//
+// - reads fully covered by readahead buffers are served from memory, or wait for the prefetch
+//   if it's still in progress
+// - a read which is neither sequential nor covered by buffers is considered random and drops
+//   all buffers of the inode, prefetches in progress are forgotten and their results are thrown away
+// - writes and discards of this client drop overlapping buffers both when they're submitted and when they
+//   complete, so cached data is never older than the data written by the client itself. The second drop is
+//   needed because a write may wait for a SYNC, and a prefetch issued after it may reach the OSD first.
+//   Writes of other clients are not tracked
+// - buffers passed by the reader are freed
+// - prefetches go through the write-back cache like normal reads, so they see buffered writes
+
+#include <assert.h>
+#include "cluster_client.h"
+
+#define READAHEAD_MIN_SEQUENTIAL 2
+// Total readahead memory limit, in client_readahead windows
+#define READAHEAD_MAX_STREAMS 16
+
+// Returns true if the operation is served from readahead buffers or waits for a prefetch
+bool cluster_client_t::readahead_execute(cluster_op_t *op)
+{
+    if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE)
+    {
+        readahead_drop_written(op);
+        return false;
+    }
+    if (op->opcode != OSD_OP_READ || op->version || !op->len || !pgs_loaded)
+    {
+        return false;
+    }
+    uint64_t inode = op->inode, offset = op->offset, len = op->len;
+    auto & ra = readahead[inode];
+    bool covered = readahead_covers(ra, offset, offset+len);
+    if (covered || offset == ra.next_offset)
+    {
+        ra.seq_reads++;
+        if (ra.next_offset < offset+len)
+        {
+            ra.next_offset = offset+len;
+        }
+        // Free buffers already passed by the reader
+        while (ra.bufs.size() && ra.bufs.begin()->first + ra.bufs.begin()->second->len <= offset)
+        {
+            uint64_t passed = ra.bufs.begin()->first;
+            readahead_drop(ra, passed, passed+1);
+        }
+    }
+    else
+    {
+        // Random access - stop reading ahead
+        readahead_drop(ra, 0, UINT64_MAX);
+        ra.seq_reads = 1;
+        ra.window = 0;
+        ra.ahead_end = 0;
+        ra.next_offset = offset+len;
+    }
+    if (ra.seq_reads >= READAHEAD_MIN_SEQUENTIAL)
+    {
+        readahead_prefetch(inode, ra, offset+len, len);
+    }
+    // Serve the read last because its callback may submit new operations
+    return covered && readahead_read(ra, op);
+}
+
+// Drop buffers overlapping a write or a discard, called on submit and on completion
+void cluster_client_t::readahead_drop_written(cluster_op_t *op)
+{
+    auto ra_it = readahead.find(op->inode);
+    if (ra_it != readahead.end())
+    {
+        readahead_drop(ra_it->second, op->offset, op->offset+op->len);
+    }
+}
+
+// Check if [start, end) is fully covered by readahead buffers (loaded or not)
+bool cluster_client_t::readahead_covers(cluster_readahead_t & ra, uint64_t start, uint64_t end)
+{
+    auto it = ra.bufs.upper_bound(start);
+    if (it == ra.bufs.begin())
+    {
+        return false;
+    }
+    it--;
+    uint64_t pos = start;
+    while (pos < end)
+    {
+        if (it == ra.bufs.end() || it->first > pos || it->first + it->second->len <= pos)
+        {
+            return false;
+        }
+        pos = it->first + it->second->len;
+        it++;
+    }
+    return true;
+}
+
+// Serve <op> from readahead buffers or make it wait for the first buffer still being loaded.
+// Returns false if <op> isn't covered by the buffers anymore
+bool cluster_client_t::readahead_read(cluster_readahead_t & ra, cluster_op_t *op)
+{
+    if (!readahead_covers(ra, op->offset, op->offset+op->len))
+    {
+        return false;
+    }
+    auto first_it = std::prev(ra.bufs.upper_bound(op->offset));
+    for (auto it = first_it; it != ra.bufs.end() && it->first < op->offset+op->len; it++)
+    {
+        if (!it->second->loaded)
+        {
+            it->second->waiting.push_back(op);
+            return true;
+        }
+    }
+    // Copy data into the iovec which may cross buffer boundaries
+    auto it = first_it;
+    uint64_t pos = op->offset;
+    for (int i = 0; i < op->iov.count; i++)
+    {
+        uint64_t done = 0;
+        while (done < op->iov.buf[i].iov_len)
+        {
+            if (pos >= it->first + it->second->len)
+            {
+                it++;
+            }
+            uint64_t n = it->first + it->second->len - pos;
+            if (n > op->iov.buf[i].iov_len - done)
+            {
+                n = op->iov.buf[i].iov_len - done;
+            }
+            memcpy(op->iov.buf[i].iov_base + done, it->second->buf + (pos - it->first), n);
+            done += n;
+            pos += n;
+        }
+    }
+    assert(pos == op->offset+op->len);
+    op->retval = op->len;
+    std::function<void(cluster_op_t*)>(op->callback)(op);
+    return true;
+}
+
+// Read the next part of the stream if less than a half of the window remains ahead of <read_end>
+void cluster_client_t::readahead_prefetch(uint64_t inode, cluster_readahead_t & ra, uint64_t read_end, uint64_t read_len)
+{
+    if (ra.ahead_end < read_end)
+    {
+        ra.ahead_end = read_end;
+    }
+    if (ra.window && ra.ahead_end - read_end >= ra.window/2)
+    {
+        return;
+    }
+    ra.window = ra.window ? ra.window*2 : read_len*4;
+    if (ra.window > client_readahead)
+    {
+        ra.window = client_readahead;
+    }
+    ra.window -= ra.window % bs_bitmap_granularity;
+    uint64_t len = ra.window;
+    auto ino_it = st_cli.inode_config.find(inode);
+    if (ino_it != st_cli.inode_config.end() && ino_it->second.size &&
+        ra.ahead_end + len > ino_it->second.size)
+    {
+        // Don't read past the end of the image
+        len = ino_it->second.size > ra.ahead_end ? ino_it->second.size - ra.ahead_end : 0;
+        len -= len % bs_bitmap_granularity;
+    }
+    if (!len || ra.ahead_end % bs_bitmap_granularity ||
+        readahead_bytes + len > client_readahead*READAHEAD_MAX_STREAMS)
+    {
+        return;
+    }
+    cluster_readahead_buf_t *rb = new cluster_readahead_buf_t;
+    rb->offset = ra.ahead_end;
+    rb->len = len;
+    rb->buf = malloc_or_die(len);
+    ra.bufs[rb->offset] = rb;
+    ra.ahead_end += len;
+    readahead_bytes += len;
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->inode = inode;
+    op->offset = rb->offset;
+    op->len = len;
+    op->iov.push_back(rb->buf, len);
+    op->callback = [this, inode, rb](cluster_op_t *op)
+    {
+        bool ok = op->retval == op->len;
+        delete op;
+        readahead_done(inode, rb, ok);
+    };
+    execute_wb(op);
+}
+
+void cluster_client_t::readahead_done(uint64_t inode, cluster_readahead_buf_t *rb, bool ok)
+{
+    auto & ra = readahead[inode];
+    rb->loaded = true;
+    if (!ok && !rb->dropped)
+    {
+        readahead_drop(ra, rb->offset, rb->offset+rb->len);
+    }
+    std::vector<cluster_op_t*> waiting;
+    waiting.swap(rb->waiting);
+    for (auto op: waiting)
+    {
+        // Buffers may be dropped by operations submitted from callbacks,
+        // reads not covered by buffers anymore are just sent to OSDs
+        if (!readahead_read(ra, op))
+        {
+            execute_wb(op);
+        }
+    }
+    rb->inflight = false;
+    if (rb->dropped)
+    {
+        free(rb->buf);
+        delete rb;
+    }
+}
+
+// Drop readahead buffers overlapping [start, end)
+void cluster_client_t::readahead_drop(cluster_readahead_t & ra, uint64_t start, uint64_t end)
+{
+    auto it = ra.bufs.upper_bound(start);
+    if (it != ra.bufs.begin())
+    {
+        it--;
+    }
+    while (it != ra.bufs.end() && it->first < end)
+    {
+        cluster_readahead_buf_t *rb = it->second;
+        if (rb->offset + rb->len <= start)
+        {
+            it++;
+            continue;
+        }
+        readahead_bytes -= rb->len;
+        ra.bufs.erase(it++);
+        if (rb->inflight)
+        {
+            // Freed when the prefetch completes
+            rb->dropped = true;
+        }
+        else
+        {
+            assert(!rb->waiting.size());
+            free(rb->buf);
+            delete rb;
+        }
+    }
+}
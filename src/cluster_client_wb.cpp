@@ -0,0 +1,346 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Client-side write-back: full-stripe write aggregation for EC pools (client_ec_writeback)
+// and write-back cache for all pools (client_writeback)
+//
+// Any EC write smaller than a full stripe makes the primary OSD do a read-modify-write.
+// When immediate_commit is off the client is allowed to hold unsynced writes anyway,
+// so in this mode small aligned writes are acknowledged right away and accumulated
+// in per-stripe buffers (per-object for replicated pools). A buffer is sent as one write
+// when it covers the whole stripe (the primary then skips the RMW read phase), when
+// a non-adjacent write hits the same stripe, when it gets older than client_ec_writeback_delay,
+// when the client is asked to SYNC, or when the total buffered size or the number
+// of buffered writes exceeds client_max_dirty_bytes or client_max_dirty_ops.
+//
+// Ordering:
+// - a write overlapping a buffer flushes it first (or drops it if fully overwritten),
+//   the primary OSD then applies both writes to the object in order
+// - a read fully covered by a buffer is served from memory
+// - other reads overlapping a buffer or an in-flight stripe flush wait until all flushes complete
+// - a SYNC flushes all buffers and waits for them, then reports any flush error
+// - while some operations are waiting, all new operations are queued behind them
+
+#include <assert.h>
+#include <time.h>
+#include "cluster_client.h"
+
+static uint64_t stripe_wb_now_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+// Returns STRIPE_WB_PASS if the operation should be executed normally,
+// STRIPE_WB_DONE if it's absorbed into a stripe buffer or completed,
+// STRIPE_WB_WAIT if it should wait for stripe flushes to complete
+int cluster_client_t::stripe_wb_execute(cluster_op_t *op)
+{
+    if (op->opcode == OSD_OP_SYNC)
+    {
+        stripe_wb_flush_all();
+        if (stripe_flushing.size())
+        {
+            return STRIPE_WB_WAIT;
+        }
+        if (stripe_error)
+        {
+            // Report the error of a previously acknowledged write
+            op->retval = stripe_error;
+            stripe_error = 0;
+            std::function<void(cluster_op_t*)>(op->callback)(op);
+            return STRIPE_WB_DONE;
+        }
+        return STRIPE_WB_PASS;
+    }
+    if (!pgs_loaded || !stripe_buffers.size() && !stripe_flushing.size() &&
+        (immediate_commit || !client_ec_writeback && !client_writeback || op->opcode != OSD_OP_WRITE))
+    {
+        return STRIPE_WB_PASS;
+    }
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(op->inode));
+    if (pool_it == st_cli.pool_config.end())
+    {
+        return STRIPE_WB_PASS;
+    }
+    auto & pool_cfg = pool_it->second;
+    bool replicated = pool_cfg.scheme == POOL_SCHEME_REPLICATED;
+    if (replicated && !client_writeback && !stripe_buffers.size() && !stripe_flushing.size())
+    {
+        return STRIPE_WB_PASS;
+    }
+    uint64_t pg_block_size = bs_block_size * (replicated ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    uint64_t stripe = (op->offset / pg_block_size) * pg_block_size;
+    if (op->opcode == OSD_OP_WRITE && (client_writeback || client_ec_writeback && !replicated) && !immediate_commit &&
+        !op->version && op->len > 0 && op->len < pg_block_size &&
+        op->offset + op->len <= stripe + pg_block_size &&
+        !(op->offset % bs_bitmap_granularity) && !(op->len % bs_bitmap_granularity))
+    {
+        auto ino_it = st_cli.inode_config.find(op->inode);
+        if (ino_it == st_cli.inode_config.end() || !ino_it->second.readonly)
+        {
+            object_id oid = { .inode = op->inode, .stripe = stripe };
+            auto sb_it = stripe_buffers.find(oid);
+            if (sb_it != stripe_buffers.end() &&
+                (op->offset > sb_it->second.end || op->offset+op->len < sb_it->second.start))
+            {
+                // Not adjacent - send the previous part of the stripe as is
+                stripe_wb_flush(sb_it);
+                sb_it = stripe_buffers.end();
+            }
+            if (sb_it == stripe_buffers.end())
+            {
+                sb_it = stripe_buffers.emplace(oid, (cluster_stripe_buffer_t){
+                    .buf = malloc_or_die(op->len),
+                    .buf_size = op->len,
+                    .start = op->offset,
+                    .end = op->offset+op->len,
+                    .deadline = stripe_wb_now_us() + client_ec_writeback_delay*1000,
+                    .ops = 0,
+                }).first;
+                stripe_buffer_bytes += op->len;
+                if (!stripe_timer_id)
+                {
+                    stripe_wb_set_timer(client_ec_writeback_delay*1000);
+                }
+            }
+            else
+            {
+                auto & sb = sb_it->second;
+                uint64_t new_start = sb.start > op->offset ? op->offset : sb.start;
+                uint64_t new_end = sb.end < op->offset+op->len ? op->offset+op->len : sb.end;
+                if (new_start < sb.start || new_end-new_start > sb.buf_size)
+                {
+                    // Grow the buffer at least twice to not reallocate it on every small write
+                    uint64_t new_size = sb.buf_size*2;
+                    if (new_size < new_end-new_start)
+                        new_size = new_end-new_start;
+                    if (new_size > pg_block_size)
+                        new_size = pg_block_size;
+                    if (new_start < sb.start)
+                    {
+                        void *new_buf = malloc_or_die(new_size);
+                        memcpy(new_buf + (sb.start-new_start), sb.buf, sb.end-sb.start);
+                        free(sb.buf);
+                        sb.buf = new_buf;
+                    }
+                    else
+                        sb.buf = realloc_or_die(sb.buf, new_size);
+                    sb.buf_size = new_size;
+                }
+                stripe_buffer_bytes += (new_end-new_start) - (sb.end-sb.start);
+                sb.start = new_start;
+                sb.end = new_end;
+            }
+            sb_it->second.ops++;
+            stripe_buffer_ops++;
+            uint64_t pos = op->offset - sb_it->second.start;
+            for (int i = 0; i < op->iov.count; i++)
+            {
+                memcpy(sb_it->second.buf + pos, op->iov.buf[i].iov_base, op->iov.buf[i].iov_len);
+                pos += op->iov.buf[i].iov_len;
+            }
+            assert(pos == op->offset + op->len - sb_it->second.start);
+            if (sb_it->second.start == stripe && sb_it->second.end == stripe + pg_block_size)
+            {
+                // Full stripe - no need to wait anymore
+                stripe_wb_flush(sb_it);
+            }
+            else if (stripe_buffer_bytes >= client_max_dirty_bytes || stripe_buffer_ops >= client_max_dirty_ops)
+            {
+                stripe_wb_flush_all();
+            }
+            op->retval = op->len;
+            std::function<void(cluster_op_t*)>(op->callback)(op);
+            return STRIPE_WB_DONE;
+        }
+    }
+    if (op->opcode == OSD_OP_READ && stripe_wb_read(op, pg_block_size))
+    {
+        return STRIPE_WB_DONE;
+    }
+    if (stripe_wb_flush_range(op, pg_block_size) && op->opcode == OSD_OP_READ)
+    {
+        return STRIPE_WB_WAIT;
+    }
+    return STRIPE_WB_PASS;
+}
+
+// Serve a read from a stripe buffer if it's fully covered by it. Returns true if the read is completed
+bool cluster_client_t::stripe_wb_read(cluster_op_t *op, uint64_t pg_block_size)
+{
+    if (!stripe_buffers.size() || op->version)
+    {
+        return false;
+    }
+    uint64_t stripe = (op->offset / pg_block_size) * pg_block_size;
+    auto sb_it = stripe_buffers.find((object_id){ .inode = op->inode, .stripe = stripe });
+    if (sb_it == stripe_buffers.end() || sb_it->second.start > op->offset ||
+        sb_it->second.end < op->offset+op->len)
+    {
+        return false;
+    }
+    uint64_t pos = op->offset - sb_it->second.start;
+    for (int i = 0; i < op->iov.count; i++)
+    {
+        memcpy(op->iov.buf[i].iov_base, sb_it->second.buf + pos, op->iov.buf[i].iov_len);
+        pos += op->iov.buf[i].iov_len;
+    }
+    op->retval = op->len;
+    std::function<void(cluster_op_t*)>(op->callback)(op);
+    return true;
+}
+
+// Flush stripe buffers overlapping with <op>. Buffers fully overwritten by a write or a discard are dropped.
+// Returns true if <op> overlaps any buffer or any stripe being flushed
+bool cluster_client_t::stripe_wb_flush_range(cluster_op_t *op, uint64_t pg_block_size)
+{
+    bool overlaps = false;
+    uint64_t first_stripe = (op->offset / pg_block_size) * pg_block_size;
+    auto sb_it = stripe_buffers.lower_bound((object_id){ .inode = op->inode, .stripe = first_stripe });
+    while (sb_it != stripe_buffers.end() && sb_it->first.inode == op->inode &&
+        sb_it->first.stripe < op->offset+op->len)
+    {
+        auto cur_it = sb_it++;
+        if (cur_it->second.end <= op->offset || cur_it->second.start >= op->offset+op->len)
+        {
+            continue;
+        }
+        overlaps = true;
+        if ((op->opcode == OSD_OP_WRITE && !op->version || op->opcode == OSD_OP_DELETE) &&
+            cur_it->second.start >= op->offset && cur_it->second.end <= op->offset+op->len)
+        {
+            stripe_wb_drop(cur_it);
+        }
+        else
+        {
+            stripe_wb_flush(cur_it);
+        }
+    }
+    auto fl_it = stripe_flushing.lower_bound((object_id){ .inode = op->inode, .stripe = first_stripe });
+    if (fl_it != stripe_flushing.end() && fl_it->first.inode == op->inode &&
+        fl_it->first.stripe < op->offset+op->len)
+    {
+        overlaps = true;
+    }
+    return overlaps;
+}
+
+void cluster_client_t::stripe_wb_flush(std::map<object_id, cluster_stripe_buffer_t>::iterator sb_it)
+{
+    object_id oid = sb_it->first;
+    if (st_cli.pool_config.find(INODE_POOL(oid.inode)) == st_cli.pool_config.end())
+    {
+        // The pool is deleted - acknowledged writes are lost, report it to the next SYNC
+        fprintf(stderr, "Failed to flush EC stripe %lx:%lx: pool is deleted\n", oid.inode, oid.stripe);
+        if (!stripe_error)
+        {
+            stripe_error = -EIO;
+        }
+        stripe_wb_drop(sb_it);
+        return;
+    }
+    stripe_buffer_bytes -= sb_it->second.end - sb_it->second.start;
+    stripe_buffer_ops -= sb_it->second.ops;
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_WRITE;
+    op->inode = oid.inode;
+    op->offset = sb_it->second.start;
+    op->len = sb_it->second.end - sb_it->second.start;
+    // The buffer is freed along with the operation
+    op->buf = sb_it->second.buf;
+    op->iov.push_back(op->buf, op->len);
+    op->callback = [this, oid](cluster_op_t *op)
+    {
+        auto fl_it = stripe_flushing.find(oid);
+        if (!--fl_it->second)
+        {
+            stripe_flushing.erase(fl_it);
+        }
+        if (op->retval != op->len && !stripe_error)
+        {
+            fprintf(stderr, "Failed to flush EC stripe %lx:%lx: retval=%d\n", oid.inode, oid.stripe, op->retval);
+            stripe_error = op->retval < 0 ? op->retval : -EIO;
+        }
+        delete op;
+        stripe_wb_continue();
+    };
+    stripe_buffers.erase(sb_it);
+    stripe_flushing[oid]++;
+    execute_internal(op);
+}
+
+void cluster_client_t::stripe_wb_flush_all()
+{
+    while (stripe_buffers.size())
+    {
+        stripe_wb_flush(stripe_buffers.begin());
+    }
+}
+
+// Free a stripe buffer without sending it
+void cluster_client_t::stripe_wb_drop(std::map<object_id, cluster_stripe_buffer_t>::iterator sb_it)
+{
+    free(sb_it->second.buf);
+    stripe_buffer_bytes -= sb_it->second.end - sb_it->second.start;
+    stripe_buffer_ops -= sb_it->second.ops;
+    stripe_buffers.erase(sb_it);
+}
+
+void cluster_client_t::stripe_wb_set_timer(uint64_t delay_us)
+{
+    stripe_timer_id = tfd->set_timer_us(delay_us, false, [this](int)
+    {
+        stripe_timer_id = 0;
+        stripe_wb_on_timer();
+    });
+}
+
+// Flush buffers older than client_ec_writeback_delay and rearm the timer for the oldest remaining one
+void cluster_client_t::stripe_wb_on_timer()
+{
+    uint64_t now = stripe_wb_now_us();
+    uint64_t next_deadline = UINT64_MAX;
+    for (auto sb_it = stripe_buffers.begin(); sb_it != stripe_buffers.end(); )
+    {
+        auto cur_it = sb_it++;
+        if (cur_it->second.deadline <= now)
+        {
+            stripe_wb_flush(cur_it);
+        }
+        else if (next_deadline > cur_it->second.deadline)
+        {
+            next_deadline = cur_it->second.deadline;
+        }
+    }
+    if (next_deadline != UINT64_MAX && !stripe_timer_id)
+    {
+        stripe_wb_set_timer(next_deadline - now);
+    }
+}
+
+void cluster_client_t::stripe_wb_continue()
+{
+    if (stripe_continuing)
+    {
+        // Reentrant call from a synchronously completed flush
+        return;
+    }
+    stripe_continuing = true;
+    while (stripe_waiting.size())
+    {
+        cluster_op_t *op = stripe_waiting.front();
+        int res = stripe_wb_execute(op);
+        if (res == STRIPE_WB_WAIT)
+        {
+            break;
+        }
+        stripe_waiting.pop_front();
+        if (res == STRIPE_WB_PASS)
+        {
+            execute_internal(op);
+        }
+    }
+    stripe_continuing = false;
+}
@@ -0,0 +1,56 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Dirty buffer index benchmark: measures cluster_client_t::copy_write() cost per write
+// and the resulting number of buffers for random and sequential 4 KB writes,
+// as done by the client between SYNCs with immediate_commit=none.
+// Usage: copy_write_bench [writes_per_case]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cluster_client.h"
+
+static double now()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec/1000000000.0;
+}
+
+static void run(const char *name, uint64_t total, uint64_t range, bool sequential)
+{
+    std::map<object_id, cluster_buffer_t> dirty_buffers;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_WRITE;
+    op->inode = 1;
+    op->len = 4096;
+    op->iov.push_back(malloc_or_die(4096), 4096);
+    memset(op->iov.buf[0].iov_base, 0x55, 4096);
+    uint64_t blocks = range/4096;
+    double start = now();
+    for (uint64_t i = 0; i < total; i++)
+    {
+        op->offset = (sequential ? i % blocks : (uint64_t)lrand48() % blocks) * 4096;
+        cluster_client_t::copy_write(op, dirty_buffers);
+    }
+    double t = now() - start;
+    printf("%-12s %10lu %12.1f %10lu\n", name, range/1024/1024, t*1e9/total, dirty_buffers.size());
+    for (auto & p: dirty_buffers)
+    {
+        cluster_client_t::free_buffer(p.second);
+    }
+    free(op->iov.buf[0].iov_base);
+    delete op;
+}
+
+int main(int narg, char *args[])
+{
+    uint64_t total = narg > 1 ? strtoull(args[1], NULL, 10) : 1000000;
+    printf("%-12s %10s %12s %10s\n", "pattern", "range MB", "ns/write", "buffers");
+    run("random", total, 32*1024*1024, false);
+    run("random", total, 1024*1024*1024, false);
+    run("sequential", total, 32*1024*1024, true);
+    run("sequential", total, 1024*1024*1024, true);
+    return 0;
+}
@@ -171,6 +171,15 @@ void etcd_state_client_t::start_etcd_watcher()
                         changes[kv.key] = kv;
                     }
                 }
+                if (on_mirror_state_hook != NULL && changes.size())
+                {
+                    std::vector<etcd_kv_t> kvs;
+                    for (auto & kv: changes)
+                    {
+                        kvs.push_back(kv.second);
+                    }
+                    on_mirror_state_hook(kvs, false);
+                }
                 for (auto & kv: changes)
                 {
                     if (this->log_level > 3)
@@ -244,6 +253,10 @@ void etcd_state_client_t::start_etcd_watcher()
 
 void etcd_state_client_t::load_global_config()
 {
+    if (follower)
+    {
+        return;
+    }
     etcd_call("/kv/range", json11::Json::object {
         { "key", base64_encode(etcd_prefix+"/config/global") }
     }, ETCD_SLOW_TIMEOUT, [this](std::string err, json11::Json data)
@@ -266,17 +279,20 @@ void etcd_state_client_t::load_global_config()
                 global_config = kv.value.object_items();
             }
         }
-        bs_block_size = global_config["block_size"].uint64_value();
-        if (!bs_block_size)
+        if (on_mirror_config_hook != NULL)
         {
-            bs_block_size = DEFAULT_BLOCK_SIZE;
+            on_mirror_config_hook(global_config);
         }
-        on_load_config_hook(global_config);
+        mirror_config(global_config);
     });
 }
 
 void etcd_state_client_t::load_pgs()
 {
+    if (follower)
+    {
+        return;
+    }
     json11::Json::array txn = {
         json11::Json::object {
             { "request_range", json11::Json::object {
@@ -339,14 +355,22 @@ void etcd_state_client_t::load_pgs()
         {
             etcd_watch_revision = data["header"]["revision"].uint64_value();
         }
+        std::vector<etcd_kv_t> kvs;
         for (auto & res: data["responses"].array_items())
         {
             for (auto & kv_json: res["response_range"]["kvs"].array_items())
             {
-                auto kv = parse_etcd_kv(kv_json);
-                parse_state(kv);
+                kvs.push_back(parse_etcd_kv(kv_json));
             }
         }
+        if (on_mirror_state_hook != NULL)
+        {
+            on_mirror_state_hook(kvs, true);
+        }
+        for (auto & kv: kvs)
+        {
+            parse_state(kv);
+        }
         on_load_pgs_hook(true);
         start_etcd_watcher();
     });
@@ -358,8 +382,12 @@ void etcd_state_client_t::parse_config(const json11::Json & config)
 
 void etcd_state_client_t::load_global_config()
 {
+    if (follower)
+    {
+        return;
+    }
     json11::Json::object global_config;
-    on_load_config_hook(global_config);
+    mirror_config(global_config);
 }
 
 void etcd_state_client_t::load_pgs()
@@ -367,6 +395,39 @@ void etcd_state_client_t::load_pgs()
 }
 #endif
 
+// Apply global configuration loaded by the leader (or by this client itself)
+void etcd_state_client_t::mirror_config(json11::Json::object & global_config)
+{
+    bs_block_size = global_config["block_size"].uint64_value();
+    if (!bs_block_size)
+    {
+        bs_block_size = DEFAULT_BLOCK_SIZE;
+    }
+    on_load_config_hook(global_config);
+}
+
+// Apply keys loaded (initial = true) or changed in etcd and received from the leader
+void etcd_state_client_t::mirror_state(const std::vector<etcd_kv_t> & kvs, bool initial)
+{
+    for (auto & kv: kvs)
+    {
+        parse_state(kv);
+    }
+    if (initial)
+    {
+        on_load_pgs_hook(true);
+    }
+    else if (on_change_hook != NULL)
+    {
+        std::map<std::string, etcd_kv_t> changes;
+        for (auto & kv: kvs)
+        {
+            changes[kv.key] = kv;
+        }
+        on_change_hook(changes);
+    }
+}
+
 void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
 {
     const std::string & key = kv.key;
@@ -99,6 +99,12 @@ public:
     std::function<void(pool_id_t, pg_num_t)> on_change_pg_history_hook;
     std::function<void(osd_num_t)> on_change_osd_state_hook;
 
+    // State mirroring for clients running in several threads: the leader passes everything it loads
+    // from etcd to on_mirror_*_hook, followers don't talk to etcd and get the same data through mirror_*()
+    bool follower = false;
+    std::function<void(const json11::Json::object &)> on_mirror_config_hook;
+    std::function<void(const std::vector<etcd_kv_t> &, bool)> on_mirror_state_hook;
+
     etcd_kv_t parse_etcd_kv(const json11::Json & kv_json);
     void etcd_call(std::string api, json11::Json payload, int timeout, std::function<void(std::string, json11::Json)> callback);
     void etcd_txn(json11::Json txn, int timeout, std::function<void(std::string, json11::Json)> callback);
@@ -107,6 +113,8 @@ public:
     void load_pgs();
     void parse_state(const etcd_kv_t & kv);
     void parse_config(const json11::Json & config);
+    void mirror_config(json11::Json::object & global_config);
+    void mirror_state(const std::vector<etcd_kv_t> & kvs, bool initial);
     inode_watch_t* watch_inode(std::string name);
     void close_watch(inode_watch_t* watch);
     ~etcd_state_client_t();
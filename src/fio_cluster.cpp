@@ -17,12 +17,16 @@
 //
 // fio -thread -ioengine=./libfio_cluster.so -name=test -bs=4k -direct=1 -iodepth=32 -rw=randread \
 //     -etcd=127.0.0.1:2379 [-etcd_prefix=/vitastor] -image=testimg
+//
+// Add -client_threads=N to run I/O in N client threads, each with its own io_uring and OSD connections.
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include <atomic>
+#include <string>
 #include <vector>
 
 #include "vitastor_c.h"
@@ -31,14 +35,26 @@
 struct sec_data
 {
     vitastor_c *cli = NULL;
-    void *watch = NULL;
+    // Set from an I/O thread with client_threads
+    std::atomic<void*> watch { NULL };
     bool last_sync = false;
+    /* Operations queued since the last commit, submitted as one batch. */
+    std::vector<vitastor_c_op*> queued;
     /* The list of completed io_u structs. */
     std::vector<io_u*> completed;
+    /* Buffer for vitastor_c_poll_completions(), reused between getevents calls. */
+    std::vector<vitastor_c_op*> polled;
     uint64_t inflight = 0;
     bool trace = false;
 };
 
+/* Per-io_u operation, allocated once in io_u_init. */
+struct sec_io
+{
+    vitastor_c_op op;
+    struct iovec iov;
+};
+
 struct sec_options
 {
     int __pad;
@@ -55,6 +71,7 @@ struct sec_options
     int rdma_port_num = 0;
     int rdma_gid_index = 0;
     int rdma_mtu = 0;
+    int client_threads = 0;
 };
 
 static struct fio_option options[] = {
@@ -181,6 +198,16 @@ static struct fio_option options[] = {
         .category = FIO_OPT_C_ENGINE,
         .group  = FIO_OPT_G_FILENAME,
     },
+    {
+        .name   = "client_threads",
+        .lname  = "Client I/O threads",
+        .type   = FIO_OPT_INT,
+        .off1   = offsetof(struct sec_options, client_threads),
+        .help   = "Number of Vitastor client I/O threads, 0 to run I/O in the fio thread",
+        .def    = "0",
+        .category = FIO_OPT_C_ENGINE,
+        .group  = FIO_OPT_G_FILENAME,
+    },
     {
         .name = NULL,
     },
@@ -233,8 +260,38 @@ static int sec_setup(struct thread_data *td)
     {
         o->inode = 0;
     }
-    bsd->cli = vitastor_c_create_uring(o->config_path, o->etcd_host, o->etcd_prefix,
-        o->use_rdma, o->rdma_device, o->rdma_port_num, o->rdma_gid_index, o->rdma_mtu, o->cluster_log);
+    if (o->client_threads > 0)
+    {
+        std::vector<std::string> kv;
+        if (o->config_path)
+            kv.insert(kv.end(), { "config_path", o->config_path });
+        if (o->etcd_host)
+            kv.insert(kv.end(), { "etcd_address", o->etcd_host });
+        if (o->etcd_prefix)
+            kv.insert(kv.end(), { "etcd_prefix", o->etcd_prefix });
+        // -1 means unspecified
+        if (o->use_rdma >= 0)
+            kv.insert(kv.end(), { "use_rdma", o->use_rdma > 0 ? "1" : "0" });
+        if (o->rdma_device)
+            kv.insert(kv.end(), { "rdma_device", o->rdma_device });
+        if (o->rdma_port_num)
+            kv.insert(kv.end(), { "rdma_port_num", std::to_string(o->rdma_port_num) });
+        if (o->rdma_gid_index)
+            kv.insert(kv.end(), { "rdma_gid_index", std::to_string(o->rdma_gid_index) });
+        if (o->rdma_mtu)
+            kv.insert(kv.end(), { "rdma_mtu", std::to_string(o->rdma_mtu) });
+        if (o->cluster_log)
+            kv.insert(kv.end(), { "log_level", std::to_string(o->cluster_log) });
+        std::vector<const char*> options;
+        for (auto & s: kv)
+            options.push_back(s.c_str());
+        bsd->cli = vitastor_c_create_uring_threads_json(options.data(), options.size(), o->client_threads);
+    }
+    else
+    {
+        bsd->cli = vitastor_c_create_uring(o->config_path, o->etcd_host, o->etcd_prefix,
+            o->use_rdma, o->rdma_device, o->rdma_port_num, o->rdma_gid_index, o->rdma_mtu, o->cluster_log);
+    }
     if (o->image)
     {
         bsd->watch = NULL;
@@ -274,31 +331,25 @@ static int sec_init(struct thread_data *td)
     return 0;
 }
 
-static void io_callback(void *opaque, long retval)
+static void io_completed(sec_data *bsd, vitastor_c_op *op)
 {
-    struct io_u *io = (struct io_u*)opaque;
-    io->error = retval < 0 ? -retval : 0;
-    sec_data *bsd = (sec_data*)io->engine_data;
+    struct io_u *io = (struct io_u*)op->opaque;
+    io->error = op->retval < 0 ? -op->retval : 0;
     bsd->inflight--;
     bsd->completed.push_back(io);
     if (bsd->trace)
     {
         printf("--- %s 0x%lx retval=%ld\n", io->ddir == DDIR_READ ? "READ" :
-            (io->ddir == DDIR_WRITE ? "WRITE" : "SYNC"), (uint64_t)io, retval);
+            (io->ddir == DDIR_WRITE ? "WRITE" : (io->ddir == DDIR_TRIM ? "TRIM" : "SYNC")), (uint64_t)io, op->retval);
     }
 }
 
-static void read_callback(void *opaque, long retval, uint64_t version)
-{
-    io_callback(opaque, retval);
-}
-
-/* Begin read or write request. */
+/* Queue read or write request, it's submitted in sec_commit(). */
 static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
 {
     sec_options *opt = (sec_options*)td->eo;
     sec_data *bsd = (sec_data*)td->io_ops_data;
-    struct iovec iov;
+    sec_io *sio = (sec_io*)io->engine_data;
 
     fio_ro_check(td, io);
     if (io->ddir == DDIR_SYNC && bsd->last_sync)
@@ -306,16 +357,25 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
         return FIO_Q_COMPLETED;
     }
 
-    io->engine_data = bsd;
     io->error = 0;
-    bsd->inflight++;
 
     uint64_t inode = opt->image ? vitastor_c_inode_get_num(bsd->watch) : opt->inode;
+    sio->iov = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
+    sio->op = (vitastor_c_op){
+        .opcode = 0,
+        .inode = inode,
+        .offset = io->offset,
+        .len = io->xfer_buflen,
+        .version = 0,
+        .iov = &sio->iov,
+        .iovcnt = 1,
+        .retval = 0,
+        .opaque = io,
+    };
     switch (io->ddir)
     {
     case DDIR_READ:
-        iov = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
-        vitastor_c_read(bsd->cli, inode, io->offset, io->xfer_buflen, &iov, 1, read_callback, io);
+        sio->op.opcode = VITASTOR_C_OP_READ;
         bsd->last_sync = false;
         break;
     case DDIR_WRITE:
@@ -324,18 +384,28 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
             io->error = EROFS;
             return FIO_Q_COMPLETED;
         }
-        iov = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
-        vitastor_c_write(bsd->cli, inode, io->offset, io->xfer_buflen, 0, &iov, 1, io_callback, io);
+        sio->op.opcode = VITASTOR_C_OP_WRITE;
+        bsd->last_sync = false;
+        break;
+    case DDIR_TRIM:
+        if (opt->image && vitastor_c_inode_get_readonly(bsd->watch))
+        {
+            io->error = EROFS;
+            return FIO_Q_COMPLETED;
+        }
+        sio->op.opcode = VITASTOR_C_OP_DISCARD;
         bsd->last_sync = false;
         break;
     case DDIR_SYNC:
-        vitastor_c_sync(bsd->cli, io_callback, io);
+        sio->op.opcode = VITASTOR_C_OP_SYNC;
         bsd->last_sync = true;
         break;
     default:
         io->error = EINVAL;
         return FIO_Q_COMPLETED;
     }
+    bsd->queued.push_back(&sio->op);
+    bsd->inflight++;
 
     if (opt->trace)
     {
@@ -346,7 +416,7 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
         else
         {
             printf("+++ %s 0x%lx 0x%llx+%llx\n",
-                io->ddir == DDIR_READ ? "READ" : "WRITE",
+                io->ddir == DDIR_READ ? "READ" : (io->ddir == DDIR_WRITE ? "WRITE" : "TRIM"),
                 (uint64_t)io, io->offset, io->xfer_buflen);
         }
     }
@@ -356,12 +426,36 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
     return FIO_Q_QUEUED;
 }
 
+/* Submit all queued requests at once. */
+static int sec_commit(struct thread_data *td)
+{
+    sec_data *bsd = (sec_data*)td->io_ops_data;
+    if (bsd->queued.size())
+    {
+        vitastor_c_submit_batch(bsd->cli, bsd->queued.data(), bsd->queued.size());
+        bsd->queued.clear();
+    }
+    return 0;
+}
+
 static int sec_getevents(struct thread_data *td, unsigned int min, unsigned int max, const struct timespec *t)
 {
     sec_data *bsd = (sec_data*)td->io_ops_data;
+    if (bsd->polled.size() < max)
+        bsd->polled.resize(max);
+    vitastor_c_op **ops = bsd->polled.data();
+    sec_commit(td);
     while (true)
     {
         vitastor_c_uring_handle_events(bsd->cli);
+        if (bsd->completed.size() < max)
+        {
+            int n = vitastor_c_poll_completions(bsd->cli, ops, max - bsd->completed.size());
+            for (int i = 0; i < n; i++)
+            {
+                io_completed(bsd, ops[i]);
+            }
+        }
         if (bsd->completed.size() >= min)
             break;
         vitastor_c_uring_wait_events(bsd->cli);
@@ -382,12 +476,17 @@ static struct io_u *sec_event(struct thread_data *td, int event)
 
 static int sec_io_u_init(struct thread_data *td, struct io_u *io)
 {
-    io->engine_data = NULL;
+    io->engine_data = new sec_io;
     return 0;
 }
 
 static void sec_io_u_free(struct thread_data *td, struct io_u *io)
 {
+    if (io->engine_data)
+    {
+        delete (sec_io*)io->engine_data;
+        io->engine_data = NULL;
+    }
 }
 
 static int sec_open_file(struct thread_data *td, struct fio_file *f)
@@ -407,6 +506,7 @@ struct ioengine_ops ioengine = {
     .setup              = sec_setup,
     .init               = sec_init,
     .queue              = sec_queue,
+    .commit             = sec_commit,
     .getevents          = sec_getevents,
     .event              = sec_event,
     .cleanup            = sec_cleanup,
@@ -0,0 +1,310 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Flat replacements for std::map<int, T*> and std::map<uint64_t, T*> on hot lookup paths
+// (messenger clients by file descriptor and in-flight operations by request ID).
+// Both store non-NULL pointers only and keep the subset of the std::map interface used
+// by the messenger: find(), at(), operator[], erase(), size() and iteration over (key, value) pairs.
+// Iteration order is by key for fd_map_t and unspecified for id_map_t.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <stdexcept>
+
+#include "malloc_or_die.h"
+
+#define ID_MAP_MIN_CAPACITY 16
+
+// Array indexed by file descriptor. File descriptors are small and reused by the kernel,
+// so the array only grows up to the maximum number of simultaneously open files.
+// The array never shrinks, so neither insertion nor erasing invalidates other iterators.
+template<class T> class fd_map_t
+{
+    std::vector<T*> items;
+
+public:
+    class iterator
+    {
+        const fd_map_t *map = NULL;
+        int pos = 0;
+        std::pair<int, T*> cur;
+
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<int, T*> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator() {}
+        iterator(const fd_map_t *map, int pos): map(map), pos(pos) {}
+
+        inline bool operator == (const iterator & other) const { return pos == other.pos; }
+        inline bool operator != (const iterator & other) const { return pos != other.pos; }
+        inline std::pair<int, T*> & operator * () { cur = { pos, map->items[pos] }; return cur; }
+        inline std::pair<int, T*> *operator -> () { return &**this; }
+        inline iterator & operator ++ ()
+        {
+            pos++;
+            while (pos < map->items.size() && !map->items[pos])
+                pos++;
+            return *this;
+        }
+        inline iterator & operator -- ()
+        {
+            pos--;
+            while (pos > 0 && !map->items[pos])
+                pos--;
+            return *this;
+        }
+        inline iterator operator ++ (int) { iterator r = *this; ++*this; return r; }
+        inline iterator operator -- (int) { iterator r = *this; --*this; return r; }
+        inline int key() const { return pos; }
+    };
+
+    inline iterator begin() const
+    {
+        int pos = 0;
+        while (pos < items.size() && !items[pos])
+            pos++;
+        return iterator(this, pos);
+    }
+
+    inline iterator end() const
+    {
+        return iterator(this, items.size());
+    }
+
+    inline iterator find(int fd) const
+    {
+        return fd >= 0 && fd < items.size() && items[fd] ? iterator(this, fd) : end();
+    }
+
+    inline T *at(int fd) const
+    {
+        if (fd < 0 || fd >= items.size() || !items[fd])
+            throw std::out_of_range("fd_map_t::at");
+        return items[fd];
+    }
+
+    inline T*& operator [] (int fd)
+    {
+        if (fd >= items.size())
+            items.resize(fd+1, NULL);
+        return items[fd];
+    }
+
+    inline void erase(const iterator & it)
+    {
+        items[it.key()] = NULL;
+    }
+
+    inline void erase(int fd)
+    {
+        if (fd >= 0 && fd < items.size())
+            erase(iterator(this, fd));
+    }
+
+    // O(max fd), only used outside of the I/O path
+    inline size_t size() const
+    {
+        size_t n = 0;
+        for (auto item: items)
+            n += (item != NULL);
+        return n;
+    }
+};
+
+// Open-addressing hash table with linear probing keyed by 64-bit request IDs.
+// Request IDs are mostly sequential, but they are shared between all connections of
+// the sender, so they are hashed multiplicatively. Deletion shifts the following items
+// back instead of leaving tombstones, so lookups never degrade after many insertions and deletions.
+// Insertion may invalidate iterators, just like erasing.
+template<class T> class id_map_t
+{
+    struct slot_t
+    {
+        uint64_t id;
+        T *value;
+    };
+
+    slot_t *slots = NULL;
+    uint64_t mask = 0;
+    int shift = 64;
+    size_t count = 0;
+
+    inline uint64_t home(uint64_t id) const
+    {
+        return (id * 0x9E3779B97F4A7C15ull) >> shift;
+    }
+
+    void resize(uint64_t capacity)
+    {
+        slot_t *old_slots = slots;
+        uint64_t old_capacity = slots ? mask+1 : 0;
+        slots = (slot_t*)malloc_or_die(sizeof(slot_t) * capacity);
+        for (uint64_t i = 0; i < capacity; i++)
+            slots[i].value = NULL;
+        mask = capacity-1;
+        shift = 64;
+        while (capacity > 1)
+        {
+            capacity >>= 1;
+            shift--;
+        }
+        for (uint64_t i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i].value)
+            {
+                uint64_t pos = home(old_slots[i].id);
+                while (slots[pos].value)
+                    pos = (pos+1) & mask;
+                slots[pos] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    inline uint64_t lookup(uint64_t id) const
+    {
+        if (!slots)
+            return UINT64_MAX;
+        uint64_t pos = home(id);
+        while (slots[pos].value)
+        {
+            if (slots[pos].id == id)
+                return pos;
+            pos = (pos+1) & mask;
+        }
+        return UINT64_MAX;
+    }
+
+public:
+    class iterator
+    {
+        const id_map_t *map = NULL;
+        uint64_t pos = 0;
+        std::pair<uint64_t, T*> cur;
+
+        inline void skip()
+        {
+            while (pos <= map->mask && map->slots && !map->slots[pos].value)
+                pos++;
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<uint64_t, T*> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator() {}
+        iterator(const id_map_t *map, uint64_t pos, bool skip_empty = false): map(map), pos(pos)
+        {
+            if (skip_empty)
+                skip();
+        }
+
+        inline bool operator == (const iterator & other) const { return pos == other.pos; }
+        inline bool operator != (const iterator & other) const { return pos != other.pos; }
+        inline std::pair<uint64_t, T*> & operator * ()
+        {
+            cur = { map->slots[pos].id, map->slots[pos].value };
+            return cur;
+        }
+        inline std::pair<uint64_t, T*> *operator -> () { return &**this; }
+        inline iterator & operator ++ () { pos++; skip(); return *this; }
+        inline iterator operator ++ (int) { iterator r = *this; ++*this; return r; }
+        inline uint64_t slot() const { return pos; }
+    };
+
+    id_map_t() {}
+    id_map_t(const id_map_t & other) = delete;
+    id_map_t & operator = (const id_map_t & other) = delete;
+
+    ~id_map_t()
+    {
+        free(slots);
+    }
+
+    inline iterator begin() const
+    {
+        return iterator(this, 0, true);
+    }
+
+    inline iterator end() const
+    {
+        return iterator(this, slots ? mask+1 : 0);
+    }
+
+    inline iterator find(uint64_t id) const
+    {
+        uint64_t pos = lookup(id);
+        return pos == UINT64_MAX ? end() : iterator(this, pos);
+    }
+
+    inline size_t size() const
+    {
+        return count;
+    }
+
+    // Returns a reference to the value of <id>, inserting an empty item if it doesn't exist.
+    // The inserted item must be assigned a non-NULL value
+    T*& operator [] (uint64_t id)
+    {
+        uint64_t pos = lookup(id);
+        if (pos != UINT64_MAX)
+            return slots[pos].value;
+        if (!slots || (count+1)*2 > mask+1)
+            resize(slots ? (mask+1)*2 : ID_MAP_MIN_CAPACITY);
+        pos = home(id);
+        while (slots[pos].value)
+            pos = (pos+1) & mask;
+        count++;
+        slots[pos].id = id;
+        return slots[pos].value;
+    }
+
+    void erase(const iterator & it)
+    {
+        uint64_t pos = it.slot();
+        slots[pos].value = NULL;
+        count--;
+        // Shift back following items which can't be found anymore because of the hole
+        uint64_t next = (pos+1) & mask;
+        while (slots[next].value)
+        {
+            uint64_t h = home(slots[next].id);
+            if (((next - h) & mask) >= ((next - pos) & mask))
+            {
+                slots[pos] = slots[next];
+                slots[next].value = NULL;
+                pos = next;
+            }
+            next = (next+1) & mask;
+        }
+    }
+
+    inline void erase(uint64_t id)
+    {
+        uint64_t pos = lookup(id);
+        if (pos != UINT64_MAX)
+            erase(iterator(this, pos));
+    }
+
+    void clear()
+    {
+        if (slots)
+        {
+            for (uint64_t i = 0; i <= mask; i++)
+                slots[i].value = NULL;
+        }
+        count = 0;
+    }
+};
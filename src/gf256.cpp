@@ -0,0 +1,285 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <string.h>
+#include "gf256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF256_X86
+#endif
+
+#define GF256_POLY 0x11D
+
+struct gf256_log_t
+{
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    gf256_log_t()
+    {
+        int x = 1;
+        for (int i = 0; i < 255; i++)
+        {
+            exp[i] = exp[i+255] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100)
+                x ^= GF256_POLY;
+        }
+        exp[510] = exp[511] = exp[0];
+        log[0] = 0;
+    }
+};
+
+static const gf256_log_t & gf256_log()
+{
+    static gf256_log_t tables;
+    return tables;
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b)
+{
+    if (!a || !b)
+        return 0;
+    auto & t = gf256_log();
+    return t.exp[t.log[a] + t.log[b]];
+}
+
+uint8_t gf256_inv(uint8_t a)
+{
+    if (!a)
+        return 0;
+    auto & t = gf256_log();
+    return t.exp[255 - t.log[a]];
+}
+
+int gf256_invert_matrix(uint8_t *mat, uint8_t *inv, int rows)
+{
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < rows; j++)
+            inv[i*rows+j] = i == j ? 1 : 0;
+    // Gauss-Jordan elimination
+    for (int i = 0; i < rows; i++)
+    {
+        int r = i;
+        while (r < rows && !mat[r*rows+i])
+            r++;
+        if (r >= rows)
+            return -1;
+        if (r != i)
+        {
+            for (int j = 0; j < rows; j++)
+            {
+                uint8_t t = mat[r*rows+j];
+                mat[r*rows+j] = mat[i*rows+j];
+                mat[i*rows+j] = t;
+                t = inv[r*rows+j];
+                inv[r*rows+j] = inv[i*rows+j];
+                inv[i*rows+j] = t;
+            }
+        }
+        uint8_t f = gf256_inv(mat[i*rows+i]);
+        if (f != 1)
+        {
+            for (int j = 0; j < rows; j++)
+            {
+                mat[i*rows+j] = gf256_mul(mat[i*rows+j], f);
+                inv[i*rows+j] = gf256_mul(inv[i*rows+j], f);
+            }
+        }
+        for (int r = 0; r < rows; r++)
+        {
+            uint8_t e = mat[r*rows+i];
+            if (r != i && e)
+            {
+                for (int j = 0; j < rows; j++)
+                {
+                    mat[r*rows+j] ^= gf256_mul(e, mat[i*rows+j]);
+                    inv[r*rows+j] ^= gf256_mul(e, inv[i*rows+j]);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+void gf256_init_tables(const uint8_t *coefs, int n, uint8_t *tables)
+{
+    for (int i = 0; i < n; i++)
+    {
+        uint8_t *t = tables + i*GF256_TABLE_SIZE;
+        for (int x = 0; x < 16; x++)
+        {
+            t[x] = gf256_mul(coefs[i], x);
+            t[16+x] = gf256_mul(coefs[i], x << 4);
+        }
+    }
+}
+
+typedef void (*gf256_dotprod_fn)(const uint8_t *coefs, const uint8_t *tables, int n, const void **src, void *dest, uint32_t len);
+
+static inline void gf256_dotprod_tail(const uint8_t *coefs, const uint8_t *tables, int n,
+    const void **src, void *dest, uint32_t pos, uint32_t len)
+{
+    for (; pos < len; pos++)
+    {
+        uint8_t acc = 0;
+        for (int i = 0; i < n; i++)
+        {
+            uint8_t x = ((const uint8_t*)src[i])[pos];
+            const uint8_t *t = tables + i*GF256_TABLE_SIZE;
+            acc ^= coefs[i] == 1 ? x : (t[x & 0x0f] ^ t[16 + (x >> 4)]);
+        }
+        ((uint8_t*)dest)[pos] = acc;
+    }
+}
+
+static void gf256_dotprod_generic(const uint8_t *coefs, const uint8_t *tables, int n, const void **src, void *dest, uint32_t len)
+{
+    gf256_dotprod_tail(coefs, tables, n, src, dest, 0, len);
+}
+
+#ifdef GF256_X86
+__attribute__((target("ssse3")))
+static void gf256_dotprod_ssse3(const uint8_t *coefs, const uint8_t *tables, int n, const void **src, void *dest, uint32_t len)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    uint32_t pos = 0;
+    for (; pos+16 <= len; pos += 16)
+    {
+        __m128i acc = _mm_setzero_si128();
+        for (int i = 0; i < n; i++)
+        {
+            if (!coefs[i])
+                continue;
+            __m128i x = _mm_loadu_si128((const __m128i*)((const uint8_t*)src[i] + pos));
+            if (coefs[i] == 1)
+            {
+                acc = _mm_xor_si128(acc, x);
+                continue;
+            }
+            const uint8_t *t = tables + i*GF256_TABLE_SIZE;
+            __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)t), _mm_and_si128(x, mask));
+            __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(t+16)), _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+            acc = _mm_xor_si128(acc, _mm_xor_si128(lo, hi));
+        }
+        _mm_storeu_si128((__m128i*)((uint8_t*)dest + pos), acc);
+    }
+    gf256_dotprod_tail(coefs, tables, n, src, dest, pos, len);
+}
+
+__attribute__((target("avx2")))
+static void gf256_dotprod_avx2(const uint8_t *coefs, const uint8_t *tables, int n, const void **src, void *dest, uint32_t len)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    uint32_t pos = 0;
+    for (; pos+64 <= len; pos += 64)
+    {
+        __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+        for (int i = 0; i < n; i++)
+        {
+            if (!coefs[i])
+                continue;
+            const uint8_t *s = (const uint8_t*)src[i] + pos;
+            __m256i x0 = _mm256_loadu_si256((const __m256i*)s);
+            __m256i x1 = _mm256_loadu_si256((const __m256i*)(s+32));
+            if (coefs[i] == 1)
+            {
+                acc0 = _mm256_xor_si256(acc0, x0);
+                acc1 = _mm256_xor_si256(acc1, x1);
+                continue;
+            }
+            const uint8_t *t = tables + i*GF256_TABLE_SIZE;
+            __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)t));
+            __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(t+16)));
+            acc0 = _mm256_xor_si256(acc0, _mm256_xor_si256(
+                _mm256_shuffle_epi8(tlo, _mm256_and_si256(x0, mask)),
+                _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(x0, 4), mask))
+            ));
+            acc1 = _mm256_xor_si256(acc1, _mm256_xor_si256(
+                _mm256_shuffle_epi8(tlo, _mm256_and_si256(x1, mask)),
+                _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(x1, 4), mask))
+            ));
+        }
+        _mm256_storeu_si256((__m256i*)((uint8_t*)dest + pos), acc0);
+        _mm256_storeu_si256((__m256i*)((uint8_t*)dest + pos + 32), acc1);
+    }
+    gf256_dotprod_tail(coefs, tables, n, src, dest, pos, len);
+}
+#endif
+
+struct gf256_impl_t
+{
+    const char *name;
+    gf256_dotprod_fn fn;
+    bool (*supported)();
+};
+
+static bool gf256_always() { return true; }
+
+#ifdef GF256_X86
+static bool gf256_has_ssse3() { return __builtin_cpu_supports("ssse3"); }
+static bool gf256_has_avx2() { return __builtin_cpu_supports("avx2"); }
+#endif
+
+// Ordered from the best to the worst
+static const gf256_impl_t gf256_impls[] = {
+#ifdef GF256_X86
+    { "avx2", gf256_dotprod_avx2, gf256_has_avx2 },
+    { "ssse3", gf256_dotprod_ssse3, gf256_has_ssse3 },
+#endif
+    { "generic", gf256_dotprod_generic, gf256_always },
+};
+
+static const gf256_impl_t *gf256_selected = NULL;
+
+static inline const gf256_impl_t *gf256_get_impl()
+{
+    if (!gf256_selected)
+    {
+        for (auto & impl: gf256_impls)
+        {
+            if (impl.supported())
+            {
+                gf256_selected = &impl;
+                break;
+            }
+        }
+    }
+    return gf256_selected;
+}
+
+bool gf256_select(const char *name)
+{
+    for (auto & impl: gf256_impls)
+    {
+        if (!strcmp(impl.name, name))
+        {
+            if (!impl.supported())
+                return false;
+            gf256_selected = &impl;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *gf256_impl_name()
+{
+    return gf256_get_impl()->name;
+}
+
+void gf256_dotprod(const uint8_t *coefs, const uint8_t *tables, int n, const void **src, void *dest, uint32_t len)
+{
+    gf256_get_impl()->fn(coefs, tables, n, src, dest, len);
+}
+
+void gf256_encode(int k, int m, const uint8_t *coefs, const uint8_t *tables, const void **data, void **coding, uint32_t len)
+{
+    auto fn = gf256_get_impl()->fn;
+    for (int j = 0; j < m; j++)
+    {
+        fn(coefs + j*k, tables + j*k*GF256_TABLE_SIZE, k, data, coding[j], len);
+    }
+}
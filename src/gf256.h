@@ -0,0 +1,34 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+
+// Built-in GF(2^8) arithmetic for Reed-Solomon EC (polynomial 0x11D, same as Jerasure with w=8)
+// Region operations use split 4-bit multiplication tables (SSSE3/AVX2 PSHUFB) selected at runtime
+
+// Size of the split multiplication table for one coefficient
+#define GF256_TABLE_SIZE 32
+
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+
+uint8_t gf256_inv(uint8_t a);
+
+// Invert a rows*rows matrix. <mat> is destroyed. Returns -1 if the matrix is singular
+int gf256_invert_matrix(uint8_t *mat, uint8_t *inv, int rows);
+
+// Fill n split multiplication tables (GF256_TABLE_SIZE bytes each) for coefficients <coefs>
+void gf256_init_tables(const uint8_t *coefs, int n, uint8_t *tables);
+
+// dest = sum(coefs[i] * src[i]), i = 0..n-1
+void gf256_dotprod(const uint8_t *coefs, const uint8_t *tables, int n, const void **src, void *dest, uint32_t len);
+
+// coding[j] = sum(coefs[j*k + i] * data[i]), j = 0..m-1
+void gf256_encode(int k, int m, const uint8_t *coefs, const uint8_t *tables, const void **data, void **coding, uint32_t len);
+
+// Name of the selected region implementation
+const char *gf256_impl_name();
+
+// Force a specific region implementation ("generic", "ssse3", "avx2"), mainly for benchmarks
+bool gf256_select(const char *name);
@@ -0,0 +1,60 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+
+#define INLINE_CALLBACK_SIZE 48
+
+// Allocation-free replacement for std::function<void(T*)> for hot completion paths.
+// The callable is stored inline, so it must be trivially copyable and destructible
+// and not larger than INLINE_CALLBACK_SIZE - i.e. lambdas capturing pointers and numbers.
+// Copying is a memcpy, calling is a single indirect call.
+template<class T> class inline_callback_t
+{
+    void (*invoke)(void *storage, T *arg) = NULL;
+    alignas(8) uint8_t storage[INLINE_CALLBACK_SIZE];
+
+    template<class F> static void invoke_fn(void *storage, T *arg)
+    {
+        (*(F*)storage)(arg);
+    }
+
+public:
+    inline_callback_t() = default;
+    inline_callback_t(std::nullptr_t) {}
+    inline_callback_t(const inline_callback_t & other) = default;
+    inline_callback_t & operator = (const inline_callback_t & other) = default;
+
+    template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, inline_callback_t>::value>::type>
+    inline_callback_t(F f)
+    {
+        static_assert(sizeof(F) <= INLINE_CALLBACK_SIZE, "callback captures are too large");
+        static_assert(alignof(F) <= 8, "callback captures are over-aligned");
+        static_assert(std::is_trivially_copyable<F>::value && std::is_trivially_destructible<F>::value,
+            "callback captures must be trivially copyable and destructible");
+        new (storage) F(f);
+        invoke = invoke_fn<F>;
+    }
+
+    inline explicit operator bool() const
+    {
+        return invoke != NULL;
+    }
+
+    inline void operator () (T *arg)
+    {
+        invoke(storage, arg);
+    }
+
+    inline void swap(inline_callback_t & other)
+    {
+        inline_callback_t tmp = other;
+        other = *this;
+        *this = tmp;
+    }
+};
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <stdexcept>
 
@@ -49,6 +50,11 @@ void osd_messenger_t::init()
                 // Do not run keepalive on regular clients
                 continue;
             }
+            if (cl->shm_conn && !cl->shm_conn->recv_active)
+            {
+                // Don't ping during the switch to shared memory, the ping could go through the wrong channel
+                continue;
+            }
             if (cl->ping_time_remaining > 0)
             {
                 cl->ping_time_remaining--;
@@ -125,6 +131,15 @@ osd_messenger_t::~osd_messenger_t()
         delete rdma_context;
     }
 #endif
+#ifdef RINGLOOP_BUF_RING
+    if (recv_buf_ring)
+    {
+        ringloop->free_buf_ring(recv_buf_ring, recv_buf_count, MSGR_RECV_BUF_GROUP);
+        recv_buf_ring = NULL;
+        free(recv_bufs);
+        recv_bufs = NULL;
+    }
+#endif
 }
 
 void osd_messenger_t::parse_config(const json11::Json & config)
@@ -154,11 +169,33 @@ void osd_messenger_t::parse_config(const json11::Json & config)
     if (!this->rdma_max_msg || this->rdma_max_msg > 128*1024*1024)
         this->rdma_max_msg = 1024*1024;
 #endif
+    if (!config["use_shm"].is_null())
+    {
+        // Shared memory is only used for Unix socket connections, and it's off by default
+        this->use_shm = config["use_shm"].bool_value() || config["use_shm"].uint64_value() != 0;
+    }
+    this->shm_ring_size = config["shm_ring_size"].uint64_value();
+    if (!this->shm_ring_size || this->shm_ring_size > 1024*1024*1024)
+        this->shm_ring_size = DEFAULT_SHM_RING_SIZE;
+    if (this->shm_ring_size < 65536)
+        this->shm_ring_size = 65536;
+    // Ring size must be a power of 2
+    if (this->shm_ring_size & (this->shm_ring_size-1))
+        this->shm_ring_size = 1ul << (64 - __builtin_clzl(this->shm_ring_size));
     this->receive_buffer_size = (uint32_t)config["tcp_header_buffer_size"].uint64_value();
     if (!this->receive_buffer_size || this->receive_buffer_size > 1024*1024*1024)
         this->receive_buffer_size = 65536;
     this->use_sync_send_recv = config["use_sync_send_recv"].bool_value() ||
         config["use_sync_send_recv"].uint64_value();
+    this->min_zerocopy_send_size = config["min_zerocopy_send_size"].uint64_value();
+    this->use_multishot_recv = config["use_multishot_recv"].bool_value() ||
+        config["use_multishot_recv"].uint64_value();
+    this->multishot_recv_buffers = config["multishot_recv_buffers"].uint64_value();
+    if (!this->multishot_recv_buffers || this->multishot_recv_buffers > 32768)
+        this->multishot_recv_buffers = DEFAULT_MULTISHOT_RECV_BUFFERS;
+    // Buffer ring size must be a power of 2
+    if (this->multishot_recv_buffers & (this->multishot_recv_buffers-1))
+        this->multishot_recv_buffers = 1ul << (64 - __builtin_clzl(this->multishot_recv_buffers));
     this->peer_connect_interval = config["peer_connect_interval"].uint64_value();
     if (!this->peer_connect_interval)
         this->peer_connect_interval = 5;
@@ -174,18 +211,39 @@ void osd_messenger_t::parse_config(const json11::Json & config)
     this->log_level = config["log_level"].uint64_value();
 }
 
+// OSDs running on the same host are first tried through their Unix socket
+static json11::Json get_peer_address_list(json11::Json peer_state)
+{
+    if (peer_state["unix_socket"].string_value() == "" || peer_state["host"].string_value() == "")
+    {
+        return peer_state["addresses"];
+    }
+    char hostname[1024] = { 0 };
+    if (gethostname(hostname, sizeof(hostname)-1) < 0 || peer_state["host"].string_value() != hostname)
+    {
+        return peer_state["addresses"];
+    }
+    json11::Json::array address_list;
+    address_list.push_back("unix:"+peer_state["unix_socket"].string_value());
+    for (auto & addr: peer_state["addresses"].array_items())
+    {
+        address_list.push_back(addr);
+    }
+    return address_list;
+}
+
 void osd_messenger_t::connect_peer(uint64_t peer_osd, json11::Json peer_state)
 {
     if (wanted_peers.find(peer_osd) == wanted_peers.end())
     {
         wanted_peers[peer_osd] = (osd_wanted_peer_t){
-            .address_list = peer_state["addresses"],
+            .address_list = get_peer_address_list(peer_state),
             .port = (int)peer_state["port"].int64_value(),
         };
     }
     else
     {
-        wanted_peers[peer_osd].address_list = peer_state["addresses"];
+        wanted_peers[peer_osd].address_list = get_peer_address_list(peer_state);
         wanted_peers[peer_osd].port = (int)peer_state["port"].int64_value();
     }
     wanted_peers[peer_osd].address_changed = true;
@@ -216,30 +274,49 @@ void osd_messenger_t::try_connect_peer(uint64_t peer_osd)
     try_connect_peer_addr(peer_osd, wp.cur_addr.c_str(), wp.cur_port);
 }
 
-void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port)
+void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port, int main_fd)
 {
     assert(peer_osd != this->osd_num);
-    struct sockaddr_in addr;
+    struct sockaddr_in addr = { 0 };
+    struct sockaddr_un unix_addr = { 0 };
+    bool is_unix = !strncmp(peer_host, "unix:", 5);
     int r;
-    if ((r = inet_pton(AF_INET, peer_host, &addr.sin_addr)) != 1)
+    if (is_unix)
     {
-        on_connect_peer(peer_osd, -EINVAL);
-        return;
+        if (strlen(peer_host+5) >= sizeof(unix_addr.sun_path))
+        {
+            on_connect_result(peer_osd, main_fd, -EINVAL);
+            return;
+        }
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, peer_host+5);
+        addr.sin_family = AF_UNIX;
+    }
+    else
+    {
+        if ((r = inet_pton(AF_INET, peer_host, &addr.sin_addr)) != 1)
+        {
+            on_connect_result(peer_osd, main_fd, -EINVAL);
+            return;
+        }
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(peer_port ? peer_port : 11203);
     }
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(peer_port ? peer_port : 11203);
-    int peer_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int peer_fd = socket(is_unix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     if (peer_fd < 0)
     {
-        on_connect_peer(peer_osd, -errno);
+        on_connect_result(peer_osd, main_fd, -errno);
         return;
     }
     fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL, 0) | O_NONBLOCK);
-    r = connect(peer_fd, (sockaddr*)&addr, sizeof(addr));
+    if (is_unix)
+        r = connect(peer_fd, (sockaddr*)&unix_addr, sizeof(unix_addr));
+    else
+        r = connect(peer_fd, (sockaddr*)&addr, sizeof(addr));
     if (r < 0 && errno != EINPROGRESS)
     {
         close(peer_fd);
-        on_connect_peer(peer_osd, -errno);
+        on_connect_result(peer_osd, main_fd, -errno);
         return;
     }
     clients[peer_fd] = new osd_client_t();
@@ -249,7 +326,11 @@ void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer
     clients[peer_fd]->peer_state = PEER_CONNECTING;
     clients[peer_fd]->connect_timeout_id = -1;
     clients[peer_fd]->osd_num = peer_osd;
-    clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
+    clients[peer_fd]->main_fd = main_fd;
+    if (main_fd >= 0)
+        clients.at(main_fd)->lane_fds.push_back(peer_fd);
+    if (!init_recv_multishot())
+        clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
     tfd->set_fd_handler(peer_fd, true, [this](int peer_fd, int epoll_events)
     {
         // Either OUT (connected) or HUP
@@ -257,11 +338,11 @@ void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer
     });
     if (peer_connect_timeout > 0)
     {
-        clients[peer_fd]->connect_timeout_id = tfd->set_timer(1000*peer_connect_timeout, false, [this, peer_fd](int timer_id)
+        clients[peer_fd]->connect_timeout_id = tfd->set_timer(1000*peer_connect_timeout, false, [this, peer_fd, main_fd](int timer_id)
         {
             osd_num_t peer_osd = clients.at(peer_fd)->osd_num;
             stop_client(peer_fd, true);
-            on_connect_peer(peer_osd, -EPIPE);
+            on_connect_result(peer_osd, main_fd, -EPIPE);
             return;
         });
     }
@@ -276,6 +357,7 @@ void osd_messenger_t::handle_connect_epoll(int peer_fd)
         cl->connect_timeout_id = -1;
     }
     osd_num_t peer_osd = cl->osd_num;
+    int main_fd = cl->main_fd;
     int result = 0;
     socklen_t result_len = sizeof(result);
     if (getsockopt(peer_fd, SOL_SOCKET, SO_ERROR, &result, &result_len) < 0)
@@ -285,16 +367,28 @@ void osd_messenger_t::handle_connect_epoll(int peer_fd)
     if (result != 0)
     {
         stop_client(peer_fd, true);
-        on_connect_peer(peer_osd, -result);
+        on_connect_result(peer_osd, main_fd, -result);
         return;
     }
-    int one = 1;
-    setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (cl->peer_addr.sin_family != AF_UNIX)
+    {
+        int one = 1;
+        setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
     cl->peer_state = PEER_CONNECTED;
-    tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+    if (!cl->in_buf)
     {
-        handle_peer_epoll(peer_fd, epoll_events);
-    });
+        // Data is received by the multishot recv request, epoll isn't needed anymore
+        tfd->set_fd_handler(peer_fd, false, NULL);
+        recv_multishot(cl);
+    }
+    else
+    {
+        tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+        {
+            handle_peer_epoll(peer_fd, epoll_events);
+        });
+    }
     // Check OSD number
     check_peer_config(cl);
 }
@@ -377,24 +471,40 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
             },
         },
     };
+    json11::Json::object payload;
+    if (features)
+    {
+        payload["features"] = features;
+    }
+    if (use_shm && ringloop && cl->in_buf && cl->peer_addr.sin_family == AF_UNIX)
+    {
+        // Local peer: offer shared memory rings instead of the socket
+        cl->shm_conn = msgr_shm_connection_t::create(shm_ring_size);
+        if (cl->shm_conn)
+        {
+            payload["connect_shm"] = cl->shm_conn->name;
+            payload["shm_ring_size"] = cl->shm_conn->ring_size;
+        }
+    }
 #ifdef WITH_RDMA
-    if (rdma_context)
+    if (rdma_context && !cl->shm_conn)
     {
         cl->rdma_conn = msgr_rdma_connection_t::create(rdma_context, rdma_max_send, rdma_max_recv, rdma_max_sge, rdma_max_msg);
         if (cl->rdma_conn)
         {
-            json11::Json payload = json11::Json::object {
-                { "connect_rdma", cl->rdma_conn->addr.to_string() },
-                { "rdma_max_msg", cl->rdma_conn->max_msg },
-            };
-            std::string payload_str = payload.dump();
-            op->req.show_conf.json_len = payload_str.size();
-            op->buf = malloc_or_die(payload_str.size());
-            op->iov.push_back(op->buf, payload_str.size());
-            memcpy(op->buf, payload_str.c_str(), payload_str.size());
+            payload["connect_rdma"] = cl->rdma_conn->addr.to_string();
+            payload["rdma_max_msg"] = cl->rdma_conn->max_msg;
         }
     }
 #endif
+    if (payload.size())
+    {
+        std::string payload_str = json11::Json(payload).dump();
+        op->req.show_conf.json_len = payload_str.size();
+        op->buf = malloc_or_die(payload_str.size());
+        op->iov.push_back(op->buf, payload_str.size());
+        memcpy(op->buf, payload_str.c_str(), payload_str.size());
+    }
     op->callback = [this, cl](osd_op_t *op)
     {
         std::string json_err;
@@ -431,11 +541,39 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
         if (err)
         {
             osd_num_t peer_osd = cl->osd_num;
+            int main_fd = cl->main_fd;
             stop_client(op->peer_fd);
-            on_connect_peer(peer_osd, -1);
+            on_connect_result(peer_osd, main_fd, -1);
             delete op;
             return;
         }
+        cl->peer_features = config["features"].uint64_value();
+        if (cl->shm_conn)
+        {
+            // The peer has already mapped the region or doesn't use it at all
+            cl->shm_conn->unlink();
+            if (!config["shm_connected"].bool_value())
+            {
+                delete cl->shm_conn;
+                cl->shm_conn = NULL;
+            }
+            else
+            {
+                if (log_level > 0)
+                {
+                    fprintf(stderr, "Connected to OSD %lu using shared memory\n", cl->osd_num);
+                }
+                cl->shm_conn->send_active = true;
+                cl->shm_conn->recv_active = true;
+                // Check the ring for the first time
+                cl->read_ready++;
+                if (cl->read_ready == 1)
+                {
+                    read_ready_clients.push_back(cl->peer_fd);
+                    ringloop->wakeup();
+                }
+            }
+        }
 #ifdef WITH_RDMA
         if (config["rdma_address"].is_string())
         {
@@ -451,8 +589,9 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
                 cl->rdma_conn = NULL;
                 // FIXME: Keep TCP connection in this case
                 osd_num_t peer_osd = cl->osd_num;
+                int main_fd = cl->main_fd;
                 stop_client(cl->peer_fd);
-                on_connect_peer(peer_osd, -1);
+                on_connect_result(peer_osd, main_fd, -1);
                 delete op;
                 return;
             }
@@ -474,40 +613,117 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
             }
         }
 #endif
-        osd_peer_fds[cl->osd_num] = cl->peer_fd;
-        on_connect_peer(cl->osd_num, cl->peer_fd);
+        if (cl->main_fd >= 0)
+        {
+            on_connect_result(cl->osd_num, cl->main_fd, cl->peer_fd);
+        }
+        else if (peer_connections > 1 && cl->peer_state == PEER_CONNECTED)
+        {
+            connect_lanes(cl);
+        }
+        else
+        {
+            osd_peer_fds[cl->osd_num] = cl->peer_fd;
+            on_connect_peer(cl->osd_num, cl->peer_fd);
+        }
         delete op;
     };
     outbox_push(op);
 }
 
+// Open extra connections to the same OSD (client_osd_connections > 1). The peer is only reported
+// as connected when all of them are established or failed, so the mapping of objects
+// to connections doesn't change while the peer stays connected
+void osd_messenger_t::connect_lanes(osd_client_t *cl)
+{
+    auto & wp = wanted_peers.at(cl->osd_num);
+    std::string peer_host = wp.cur_addr;
+    int peer_port = wp.cur_port;
+    // One more for this function itself because connection errors may be reported synchronously
+    cl->lanes_connecting = 1;
+    for (int i = 1; i < peer_connections; i++)
+    {
+        cl->lanes_connecting++;
+        try_connect_peer_addr(cl->osd_num, peer_host.c_str(), peer_port, cl->peer_fd);
+    }
+    on_connect_result(cl->osd_num, cl->peer_fd, cl->peer_fd);
+}
+
+// Connection result for the main connection (main_fd < 0) or for an extra one.
+// peer_fd is the connected socket or a negative error code
+void osd_messenger_t::on_connect_result(osd_num_t peer_osd, int main_fd, int peer_fd)
+{
+    if (main_fd < 0)
+    {
+        on_connect_peer(peer_osd, peer_fd);
+        return;
+    }
+    auto main_it = clients.find(main_fd);
+    if (main_it == clients.end() || main_it->second->osd_num != peer_osd ||
+        main_it->second->peer_state == PEER_STOPPED || main_it->second->lanes_connecting <= 0)
+    {
+        // The main connection is already closed
+        if (peer_fd >= 0 && peer_fd != main_fd)
+            stop_client(peer_fd);
+        return;
+    }
+    osd_client_t *main_cl = main_it->second;
+    if (peer_fd < 0)
+    {
+        fprintf(stderr, "Failed to open an extra connection to OSD %lu, using %lu connections\n",
+            peer_osd, main_cl->lane_fds.size()+1);
+    }
+    main_cl->lanes_connecting--;
+    if (!main_cl->lanes_connecting)
+    {
+        osd_peer_fds[peer_osd] = main_fd;
+        on_connect_peer(peer_osd, main_fd);
+    }
+}
+
 void osd_messenger_t::accept_connections(int listen_fd)
 {
-    // Accept new connections
-    sockaddr_in addr;
+    // Accept new connections (TCP or local Unix socket ones)
+    sockaddr_in addr = { 0 };
     socklen_t peer_addr_size = sizeof(addr);
     int peer_fd;
     while ((peer_fd = accept(listen_fd, (sockaddr*)&addr, &peer_addr_size)) >= 0)
     {
         assert(peer_fd != 0);
-        char peer_str[256];
-        fprintf(stderr, "[OSD %lu] new client %d: connection from %s port %d\n", this->osd_num, peer_fd,
-            inet_ntop(AF_INET, &addr.sin_addr, peer_str, 256), ntohs(addr.sin_port));
         fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL, 0) | O_NONBLOCK);
-        int one = 1;
-        setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (addr.sin_family == AF_UNIX)
+        {
+            fprintf(stderr, "[OSD %lu] new client %d: local connection\n", this->osd_num, peer_fd);
+            addr = { .sin_family = AF_UNIX };
+        }
+        else
+        {
+            char peer_str[256];
+            fprintf(stderr, "[OSD %lu] new client %d: connection from %s port %d\n", this->osd_num, peer_fd,
+                inet_ntop(AF_INET, &addr.sin_addr, peer_str, 256), ntohs(addr.sin_port));
+            int one = 1;
+            setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
         clients[peer_fd] = new osd_client_t();
         clients[peer_fd]->peer_addr = addr;
         clients[peer_fd]->peer_port = ntohs(addr.sin_port);
         clients[peer_fd]->peer_fd = peer_fd;
         clients[peer_fd]->peer_state = PEER_CONNECTED;
-        clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
-        // Add FD to epoll
-        tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+        if (init_recv_multishot())
         {
-            handle_peer_epoll(peer_fd, epoll_events);
-        });
+            recv_multishot(clients[peer_fd]);
+        }
+        else
+        {
+            clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
+            // Add FD to epoll
+            tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+            {
+                handle_peer_epoll(peer_fd, epoll_events);
+            });
+        }
         // Try to accept next connection
+        addr = { 0 };
         peer_addr_size = sizeof(addr);
     }
     if (peer_fd == -1 && errno != EAGAIN)
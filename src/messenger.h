@@ -13,10 +13,12 @@
 #include <vector>
 
 #include "malloc_or_die.h"
+#include "flat_map.h"
 #include "json11/json11.hpp"
 #include "msgr_op.h"
 #include "timerfd_manager.h"
 #include <ringloop.h>
+#include "msgr_shm.h"
 
 #ifdef WITH_RDMA
 #include "msgr_rdma.h"
@@ -25,6 +27,8 @@
 #define CL_READ_HDR 1
 #define CL_READ_DATA 2
 #define CL_READ_REPLY_DATA 3
+#define CL_READ_BATCH 4
+#define CL_READ_REPLY_BATCH 5
 #define CL_WRITE_READY 1
 
 #define PEER_CONNECTING 1
@@ -39,6 +43,13 @@
 #define MSGR_SENDP_HDR 1
 #define MSGR_SENDP_FREE 2
 
+#define MSGR_MAX_PEER_CONNECTIONS 16
+#define DEFAULT_SMALL_READ_SIZE 65536
+#define MSGR_RECV_BUF_GROUP 1
+#define DEFAULT_MULTISHOT_RECV_BUFFERS 256
+
+struct ring_data_t;
+
 struct msgr_sendp_t
 {
     osd_op_t *op;
@@ -57,12 +68,30 @@ struct osd_client_t
     int ping_time_remaining = 0;
     int idle_time_remaining = 0;
     osd_num_t osd_num = 0;
+    // OSD_FEATURE_* supported by the peer: by the OSD we connected to, or by the connected
+    // OSD itself if it reported them in OSD_OP_SHOW_CONFIG
+    uint64_t peer_features = 0;
+    // Moving average of secondary read latency in microseconds and number of
+    // secondary reads in flight, used to balance reads
+    uint64_t read_lat_us = 0;
+    int reads_inflight = 0;
+
+    // Extra connections to the same OSD (main connection only) or the main connection fd (extra ones)
+    std::vector<int> lane_fds;
+    int lanes_connecting = 0;
+    int main_fd = -1;
 
     void *in_buf = NULL;
+    // Completion data of the multishot recv request, used instead of in_buf with use_multishot_recv
+    ring_data_t *recv_data = NULL;
+    // The multishot recv request ran out of buffers and waits for one to be returned
+    bool recv_nobuf = false;
 
 #ifdef WITH_RDMA
     msgr_rdma_connection_t *rdma_conn = NULL;
 #endif
+    // Shared memory rings used instead of the socket for local connections
+    msgr_shm_connection_t *shm_conn = NULL;
 
     // Read state
     int read_ready = 0;
@@ -71,16 +100,22 @@ struct osd_client_t
     msghdr read_msg = { 0 };
     int read_remaining = 0;
     int read_state = 0;
+    // The last operation had a payload larger than the receive buffer,
+    // so the next header is read separately to receive the next payload directly
+    bool read_hdr_only = false;
     osd_op_buf_list_t recv_list;
 
     // Incoming operations
     std::vector<osd_op_t*> received_ops;
 
     // Outbound operations
-    std::map<uint64_t, osd_op_t*> sent_ops;
+    id_map_t<osd_op_t> sent_ops;
+    // Small outbound reads and writes waiting to be sent as one OSD_OP_BATCH
+    std::vector<osd_op_t*> batch;
 
-    // PGs dirtied by this client's primary-writes
+    // PGs dirtied by this client's primary-writes and primary_write_seq of the last such write
     std::set<pool_pg_num_t> dirty_pgs;
+    uint64_t dirty_write_seq = 0;
 
     // Write state
     msghdr write_msg = { 0 };
@@ -127,6 +162,19 @@ protected:
     int osd_ping_timeout = 0;
     int log_level = 0;
     bool use_sync_send_recv = false;
+    uint64_t min_zerocopy_send_size = 0;
+    bool use_multishot_recv = false;
+    uint64_t multishot_recv_buffers = 0;
+#ifdef RINGLOOP_BUF_RING
+    io_uring_buf_ring *recv_buf_ring = NULL;
+    void *recv_bufs = NULL;
+    uint32_t recv_buf_size = 0, recv_buf_count = 0;
+    // Clients waiting for a buffer and buffers returned when nobody was waiting
+    std::deque<osd_client_t*> recv_nobuf_clients;
+    uint32_t recv_buf_credit = 0;
+#endif
+    bool use_shm = false;
+    uint64_t shm_ring_size = 0;
 
 #ifdef WITH_RDMA
     bool use_rdma = true;
@@ -139,6 +187,7 @@ protected:
 
     std::vector<int> read_ready_clients;
     std::vector<int> write_ready_clients;
+    std::vector<int> batch_clients;
     std::vector<std::function<void()>> set_immediate;
 
 public:
@@ -147,9 +196,18 @@ public:
     // osd_num_t is only for logging and asserts
     osd_num_t osd_num;
     uint64_t next_subop_id = 1;
-    std::map<int, osd_client_t*> clients;
+    fd_map_t<osd_client_t> clients;
     std::map<osd_num_t, osd_wanted_peer_t> wanted_peers;
     std::map<uint64_t, int> osd_peer_fds;
+    // OSD_FEATURE_* reported to the OSDs we connect to, set by the OSD
+    uint64_t features = 0;
+    // Number of connections opened to each OSD peer, set by the client (client_osd_connections)
+    int peer_connections = 1;
+    // Maximum number of small reads and writes sent to an OSD in one request, set by the client (client_batch_ops)
+    int max_batch_ops = 1;
+    // Reads up to this size use the main connection when there are several (client_small_read_size)
+    uint64_t small_read_size = DEFAULT_SMALL_READ_SIZE;
+    uint64_t next_lane = 0;
     // op statistics
     osd_op_stats_t stats;
 
@@ -158,6 +216,21 @@ public:
     void connect_peer(uint64_t osd_num, json11::Json peer_state);
     void stop_client(int peer_fd, bool force = false);
     void outbox_push(osd_op_t *cur_op);
+    void measure_exec(osd_op_t *cur_op);
+
+    // Select the connection to a connected OSD for an operation on <object_hash>.
+    // Operations on the same object always go through the same connection to keep their order
+    // With several connections, the main one only carries small reads and syncs so they don't wait
+    // behind large transfers. Writes are spread over the other connections by object to keep their
+    // order, large reads are sent round-robin
+    inline int select_peer_fd(osd_num_t peer_osd, bool read, uint64_t len, uint64_t object_hash)
+    {
+        int peer_fd = osd_peer_fds.at(peer_osd);
+        auto & lanes = clients.at(peer_fd)->lane_fds;
+        if (!lanes.size() || read && len <= small_read_size)
+            return peer_fd;
+        return lanes[(read ? next_lane++ : object_hash) % lanes.size()];
+    }
     std::function<void(osd_op_t*)> exec_op;
     std::function<void(osd_num_t)> repeer_pgs;
     void read_requests();
@@ -167,6 +240,8 @@ public:
 
     static json11::Json read_config(const json11::Json & config);
 
+    bool connect_shm(int peer_fd, std::string name, uint64_t ring_size);
+
 #ifdef WITH_RDMA
     bool is_rdma_enabled();
     bool connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg);
@@ -174,7 +249,9 @@ public:
 
 protected:
     void try_connect_peer(uint64_t osd_num);
-    void try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port);
+    void try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port, int main_fd = -1);
+    void connect_lanes(osd_client_t *cl);
+    void on_connect_result(osd_num_t peer_osd, int main_fd, int peer_fd);
     void handle_peer_epoll(int peer_fd, int epoll_events);
     void handle_connect_epoll(int peer_fd);
     void on_connect_peer(osd_num_t peer_osd, int peer_fd);
@@ -182,17 +259,36 @@ protected:
     void cancel_osd_ops(osd_client_t *cl);
     void cancel_op(osd_op_t *op);
 
+    void outbox_push_now(osd_client_t *cl, osd_op_t *cur_op);
     bool try_send(osd_client_t *cl);
-    void measure_exec(osd_op_t *cur_op);
-    void handle_send(int result, osd_client_t *cl);
+    bool batch_op(osd_client_t *cl, osd_op_t *cur_op);
+    void flush_batch(osd_client_t *cl);
+    void flush_batches();
+    void handle_batch_reply(osd_op_t *op);
+    void handle_send(int result, osd_client_t *cl, std::vector<osd_op_t*> *delay_free = NULL);
+#ifdef IORING_CQE_F_NOTIF
+    void handle_send_zc(ring_data_t *data, osd_client_t *cl, std::vector<osd_op_t*> *delay_free);
+#endif
 
     bool handle_read(int result, osd_client_t *cl);
+    bool init_recv_multishot();
+    void recv_multishot(osd_client_t *cl);
+#ifdef RINGLOOP_BUF_RING
+    void handle_recv_multishot(ring_data_t *data, osd_client_t *cl);
+#endif
     bool handle_read_buffer(osd_client_t *cl, void *curbuf, int remain);
     bool handle_finished_read(osd_client_t *cl);
-    void handle_op_hdr(osd_client_t *cl);
+    bool handle_op_hdr(osd_client_t *cl);
+    bool handle_batch_items(osd_client_t *cl);
     bool handle_reply_hdr(osd_client_t *cl);
+    bool handle_batch_reply_items(osd_client_t *cl);
     void handle_reply_ready(osd_op_t *op);
 
+    bool try_send_shm(osd_client_t *cl);
+    void wakeup_shm_peer(osd_client_t *cl);
+    void read_shm(osd_client_t *cl);
+    void handle_shm_recv(osd_client_t *cl);
+
 #ifdef WITH_RDMA
     bool try_send_rdma(osd_client_t *cl);
     bool try_recv_rdma(osd_client_t *cl);
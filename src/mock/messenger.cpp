@@ -21,7 +21,17 @@ osd_messenger_t::~osd_messenger_t()
 
 void osd_messenger_t::outbox_push(osd_op_t *cur_op)
 {
-    clients[cur_op->peer_fd]->sent_ops[cur_op->req.hdr.id] = cur_op;
+    osd_client_t *cl = clients.at(cur_op->peer_fd);
+    if (cur_op->op_type == OSD_OP_OUT && (max_batch_ops > 1 || cl->batch.size()) && batch_op(cl, cur_op))
+    {
+        return;
+    }
+    outbox_push_now(cl, cur_op);
+}
+
+void osd_messenger_t::outbox_push_now(osd_client_t *cl, osd_op_t *cur_op)
+{
+    cl->sent_ops[cur_op->req.hdr.id] = cur_op;
 }
 
 void osd_messenger_t::parse_config(const json11::Json & config)
@@ -41,6 +51,10 @@ void osd_messenger_t::read_requests()
 
 void osd_messenger_t::send_replies()
 {
+    if (batch_clients.size())
+    {
+        flush_batches();
+    }
 }
 
 json11::Json osd_messenger_t::read_config(const json11::Json & config)
@@ -22,4 +22,7 @@ public:
     void submit()
     {
     }
+    void wakeup()
+    {
+    }
 };
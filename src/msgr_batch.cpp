@@ -0,0 +1,121 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include "messenger.h"
+
+// Small reads and writes are collected during one event loop iteration and sent as one OSD_OP_BATCH.
+// Returns false if <cur_op> should be sent immediately; the collected batch is sent first in this case
+// to keep the order of operations on the connection
+bool osd_messenger_t::batch_op(osd_client_t *cl, osd_op_t *cur_op)
+{
+    if (max_batch_ops <= 1 || !ringloop || cl->peer_state != PEER_CONNECTED ||
+        !(cl->peer_features & OSD_FEATURE_BATCH) ||
+        cur_op->req.hdr.opcode != OSD_OP_READ && cur_op->req.hdr.opcode != OSD_OP_WRITE ||
+        cur_op->req.rw.len > OSD_BATCH_MAX_LEN)
+    {
+        if (cl->batch.size())
+        {
+            flush_batch(cl);
+        }
+        return false;
+    }
+    clock_gettime(CLOCK_REALTIME, &cur_op->tv_begin);
+    cl->batch.push_back(cur_op);
+    if (cl->batch.size() == 1)
+    {
+        batch_clients.push_back(cl->peer_fd);
+        ringloop->wakeup();
+    }
+    if (cl->batch.size() >= max_batch_ops || cl->batch.size() >= OSD_BATCH_MAX_OPS)
+    {
+        flush_batch(cl);
+    }
+    return true;
+}
+
+void osd_messenger_t::flush_batch(osd_client_t *cl)
+{
+    std::vector<osd_op_t*> ops;
+    ops.swap(cl->batch);
+    if (ops.size() == 1)
+    {
+        outbox_push_now(cl, ops[0]);
+        return;
+    }
+    osd_op_batch_data_t *batch = osd_op_batch_data_t::alloc(ops.size());
+    osd_op_t *op = new osd_op_t;
+    op->op_type = OSD_OP_OUT;
+    op->peer_fd = cl->peer_fd;
+    op->buf = batch;
+    op->iov.push_back(batch->items, ops.size()*sizeof(osd_op_batch_item_t));
+    uint64_t data_len = 0;
+    for (int i = 0; i < ops.size(); i++)
+    {
+        osd_op_t *sub = ops[i];
+        batch->ops[i] = sub;
+        batch->items[i] = (osd_op_batch_item_t){
+            .opcode = sub->req.hdr.opcode,
+            .inode = sub->req.rw.inode,
+            .offset = sub->req.rw.offset,
+            .len = sub->req.rw.len,
+            .flags = sub->req.rw.flags,
+            .meta_revision = sub->req.rw.meta_revision,
+            .version = sub->req.rw.version,
+        };
+        if (sub->req.hdr.opcode == OSD_OP_WRITE)
+        {
+            op->iov.append(sub->iov);
+            data_len += sub->req.rw.len;
+        }
+    }
+    // The batch uses the ID of its first operation, other IDs are just not used
+    op->req.batch = (osd_op_batch_t){
+        .header = {
+            .magic = SECONDARY_OSD_OP_MAGIC,
+            .id = ops[0]->req.hdr.id,
+            .opcode = OSD_OP_BATCH,
+        },
+        .count = ops.size(),
+        .data_len = data_len,
+    };
+    op->callback = [this](osd_op_t *op) { handle_batch_reply(op); };
+    outbox_push_now(cl, op);
+}
+
+void osd_messenger_t::flush_batches()
+{
+    for (int i = 0; i < batch_clients.size(); i++)
+    {
+        auto cl_it = clients.find(batch_clients[i]);
+        if (cl_it != clients.end() && cl_it->second->batch.size())
+        {
+            flush_batch(cl_it->second);
+        }
+    }
+    batch_clients.clear();
+}
+
+// Complete sub-operations of a batch as if they received separate replies
+void osd_messenger_t::handle_batch_reply(osd_op_t *op)
+{
+    osd_op_batch_data_t *batch = (osd_op_batch_data_t*)op->buf;
+    for (uint64_t i = 0; i < batch->count; i++)
+    {
+        osd_op_t *sub = batch->ops[i];
+        sub->reply.hdr.magic = SECONDARY_OSD_REPLY_MAGIC;
+        sub->reply.hdr.id = sub->req.hdr.id;
+        sub->reply.hdr.opcode = sub->req.hdr.opcode;
+        if (op->reply.hdr.retval < 0)
+        {
+            sub->reply.hdr.retval = op->reply.hdr.retval;
+        }
+        else
+        {
+            sub->reply.hdr.retval = batch->reply_items[i].retval;
+            sub->reply.rw.bitmap_len = batch->reply_items[i].bitmap_len;
+            sub->reply.rw.version = batch->reply_items[i].version;
+        }
+        inline_callback_t<osd_op_t>(sub->callback)(sub);
+    }
+    delete op;
+}
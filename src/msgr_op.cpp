@@ -13,6 +13,18 @@ osd_op_t::~osd_op_t()
     {
         free(rmw_buf);
     }
+    if (op_type == OSD_OP_IN && req.hdr.opcode == OSD_OP_BATCH && buf)
+    {
+        // Received batch owns its sub-operations
+        osd_op_batch_data_t *batch = (osd_op_batch_data_t*)buf;
+        for (uint64_t i = 0; i < batch->count; i++)
+        {
+            if (batch->ops[i])
+            {
+                delete batch->ops[i];
+            }
+        }
+    }
     if (buf)
     {
         // Note: reusing osd_op_t WILL currently lead to memory leaks
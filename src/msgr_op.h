@@ -10,6 +10,8 @@
 #include <stdlib.h>
 
 #include "osd_ops.h"
+#include "object_pool.h"
+#include "inline_callback.h"
 
 #define OSD_OP_IN 0
 #define OSD_OP_OUT 1
@@ -71,7 +73,6 @@ struct osd_op_buf_list_t
         {
             if (buf == inline_buf)
             {
-                int old = alloc;
                 alloc = (((count+other.count+15)/16)*16);
                 buf = (iovec*)malloc(sizeof(iovec) * alloc);
                 if (!buf)
@@ -79,7 +80,8 @@ struct osd_op_buf_list_t
                     fprintf(stderr, "Failed to allocate %lu bytes\n", sizeof(iovec) * alloc);
                     exit(1);
                 }
-                memcpy(buf, inline_buf, sizeof(iovec) * old);
+                // Only the used entries are copied, <count> never exceeds the inline buffer size here
+                memcpy(buf, inline_buf, sizeof(iovec) * count);
             }
             else
             {
@@ -150,6 +152,36 @@ struct osd_op_buf_list_t
 
 struct blockstore_op_t;
 
+struct osd_op_t;
+
+// State of OSD_OP_BATCH kept in osd_op_t::buf: sub-operations and request/reply items in one allocation.
+// On the client sub-operations belong to their callers, on the OSD they belong to the batch
+struct osd_op_batch_data_t
+{
+    uint64_t count;
+    // sub-operations not finished yet (OSD only)
+    uint64_t pending;
+    osd_op_batch_item_t *items;
+    osd_reply_batch_item_t *reply_items;
+    osd_op_t *ops[];
+
+    static inline osd_op_batch_data_t *alloc(uint64_t count)
+    {
+        uint64_t ops_size = sizeof(osd_op_batch_data_t) + count*sizeof(osd_op_t*);
+        osd_op_batch_data_t *b = (osd_op_batch_data_t*)calloc(1, ops_size +
+            count*(sizeof(osd_op_batch_item_t) + sizeof(osd_reply_batch_item_t)));
+        if (!b)
+        {
+            fprintf(stderr, "Failed to allocate batch of %lu operations\n", count);
+            exit(1);
+        }
+        b->count = count;
+        b->items = (osd_op_batch_item_t*)((uint8_t*)b + ops_size);
+        b->reply_items = (osd_reply_batch_item_t*)((uint8_t*)b->items + count*sizeof(osd_op_batch_item_t));
+        return b;
+    }
+};
+
 struct osd_primary_op_data_t;
 
 struct osd_op_t
@@ -167,9 +199,12 @@ struct osd_op_t
     unsigned bmp_data = 0;
     void *rmw_buf = NULL;
     osd_primary_op_data_t* op_data = NULL;
-    std::function<void(osd_op_t*)> callback;
+    inline_callback_t<osd_op_t> callback;
 
     osd_op_buf_list_t iov;
 
     ~osd_op_t();
+
+    static void *operator new(size_t size) { return object_pool_t<osd_op_t>::alloc(size); }
+    static void operator delete(void *ptr, size_t size) { object_pool_t<osd_op_t>::release(ptr, size); }
 };
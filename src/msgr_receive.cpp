@@ -13,10 +13,20 @@ void osd_messenger_t::read_requests()
         {
             continue;
         }
+        if (cl->shm_conn && cl->shm_conn->recv_active)
+        {
+            read_shm(cl);
+            continue;
+        }
         if (cl->read_remaining < receive_buffer_size)
         {
             cl->read_iov.iov_base = cl->in_buf;
             cl->read_iov.iov_len = receive_buffer_size;
+            if (cl->read_hdr_only && cl->read_state != CL_READ_DATA && cl->read_state != CL_READ_REPLY_DATA)
+            {
+                // Don't read the beginning of a possible large payload into the buffer, it would be copied
+                cl->read_iov.iov_len = cl->read_remaining > 0 ? cl->read_remaining : OSD_PACKET_SIZE;
+            }
             cl->read_msg.msg_iov = &cl->read_iov;
             cl->read_msg.msg_iovlen = 1;
         }
@@ -120,6 +130,168 @@ fin:
     return ret;
 }
 
+// Multishot receive mode (use_multishot_recv): each connection has one long-living
+// recv request which takes buffers from a shared provided buffer ring, so idle
+// connections don't hold any receive buffers. Received data is always copied.
+bool osd_messenger_t::init_recv_multishot()
+{
+#ifdef RINGLOOP_BUF_RING
+    if (!use_multishot_recv || !ringloop || use_sync_send_recv)
+    {
+        return false;
+    }
+    if (recv_buf_ring)
+    {
+        return true;
+    }
+    int err = 0;
+    recv_buf_ring = ringloop->setup_buf_ring(multishot_recv_buffers, MSGR_RECV_BUF_GROUP, &err);
+    if (!recv_buf_ring)
+    {
+        fprintf(stderr, "Failed to set up receive buffer ring: %s, multishot receive is disabled\n", strerror(-err));
+        use_multishot_recv = false;
+        return false;
+    }
+    recv_buf_count = multishot_recv_buffers;
+    recv_buf_size = receive_buffer_size;
+    recv_bufs = malloc_or_die((uint64_t)recv_buf_count*recv_buf_size);
+    for (uint32_t i = 0; i < recv_buf_count; i++)
+    {
+        io_uring_buf_ring_add(recv_buf_ring, recv_bufs + (uint64_t)i*recv_buf_size, recv_buf_size,
+            i, io_uring_buf_ring_mask(recv_buf_count), i);
+    }
+    io_uring_buf_ring_advance(recv_buf_ring, recv_buf_count);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void osd_messenger_t::recv_multishot(osd_client_t *cl)
+{
+#ifdef RINGLOOP_BUF_RING
+    if (!cl->recv_data)
+    {
+        cl->recv_data = new ring_data_t();
+    }
+    cl->refs++;
+    io_uring_sqe *sqe = ringloop->get_sqe(cl->recv_data);
+    if (!sqe)
+    {
+        ringloop->wait_sqe([this, cl]()
+        {
+            cl->refs--;
+            if (cl->peer_state != PEER_STOPPED)
+            {
+                recv_multishot(cl);
+            }
+            else
+            {
+                delete cl->recv_data;
+                cl->recv_data = NULL;
+                if (cl->refs <= 0)
+                    delete cl;
+            }
+        });
+        return;
+    }
+    cl->recv_data->callback = [this, cl](ring_data_t *data) { handle_recv_multishot(data, cl); };
+    my_uring_prep_recv_multishot(sqe, cl->peer_fd, MSGR_RECV_BUF_GROUP);
+    ringloop->wakeup();
+#endif
+}
+
+#ifdef RINGLOOP_BUF_RING
+void osd_messenger_t::handle_recv_multishot(ring_data_t *data, osd_client_t *cl)
+{
+    if (data->flags & IORING_CQE_F_BUFFER)
+    {
+        int bid = data->flags >> IORING_CQE_BUFFER_SHIFT;
+        void *buf = recv_bufs + (uint64_t)bid*recv_buf_size;
+        if (data->res > 0 && cl->peer_state != PEER_STOPPED)
+        {
+            handle_read_buffer(cl, buf, data->res);
+        }
+        // Give the buffer back to the ring
+        io_uring_buf_ring_add(recv_buf_ring, buf, recv_buf_size, bid, io_uring_buf_ring_mask(recv_buf_count), 0);
+        io_uring_buf_ring_advance(recv_buf_ring, 1);
+        // And let one of the clients which ran out of buffers receive again
+        if (recv_nobuf_clients.size())
+        {
+            osd_client_t *waiting = recv_nobuf_clients.front();
+            recv_nobuf_clients.pop_front();
+            waiting->recv_nobuf = false;
+            waiting->refs--;
+            recv_multishot(waiting);
+        }
+        else if (recv_buf_credit < recv_buf_count)
+        {
+            recv_buf_credit++;
+        }
+    }
+    else if (cl->peer_state != PEER_STOPPED && data->res == -EINVAL)
+    {
+        // Kernels before 6.0 support buffer rings, but not multishot recv
+        if (use_multishot_recv)
+        {
+            fprintf(stderr, "Multishot recv is not supported by the kernel, falling back to regular receive\n");
+            use_multishot_recv = false;
+        }
+    }
+    else if (cl->peer_state != PEER_STOPPED && data->res <= 0 && data->res != -ENOBUFS)
+    {
+        // this is a client socket, so don't panic on error. just disconnect it
+        if (data->res != 0)
+        {
+            fprintf(stderr, "Client %d socket read error: %d (%s). Disconnecting client\n", cl->peer_fd, -data->res, strerror(-data->res));
+        }
+        stop_client(cl->peer_fd);
+    }
+    if (!(data->flags & IORING_CQE_F_MORE))
+    {
+        // The request is finished: the client is stopped or buffers ran out (ENOBUFS)
+        cl->refs--;
+        if (cl->peer_state != PEER_STOPPED && use_multishot_recv && data->res == -ENOBUFS && !recv_buf_credit)
+        {
+            // Buffers are still taken by other requests, the new request would get ENOBUFS again.
+            // So re-arm it only when a buffer is returned, one request per buffer
+            cl->refs++;
+            cl->recv_nobuf = true;
+            recv_nobuf_clients.push_back(cl);
+        }
+        else if (cl->peer_state != PEER_STOPPED && use_multishot_recv)
+        {
+            if (data->res == -ENOBUFS)
+                recv_buf_credit--;
+            recv_multishot(cl);
+        }
+        else if (cl->peer_state != PEER_STOPPED)
+        {
+            // Multishot recv is unsupported, switch the client to regular epoll + recvmsg receive
+            delete cl->recv_data;
+            cl->recv_data = NULL;
+            cl->in_buf = malloc_or_die(receive_buffer_size);
+            tfd->set_fd_handler(cl->peer_fd, false, [this](int peer_fd, int epoll_events)
+            {
+                handle_peer_epoll(peer_fd, epoll_events);
+            });
+        }
+        else
+        {
+            delete cl->recv_data;
+            cl->recv_data = NULL;
+            if (cl->refs <= 0)
+                delete cl;
+        }
+    }
+    for (auto cb: set_immediate)
+    {
+        cb();
+    }
+    set_immediate.clear();
+}
+#endif
+
 bool osd_messenger_t::handle_read_buffer(osd_client_t *cl, void *curbuf, int remain)
 {
     // Compose operation(s) from the buffer
@@ -172,15 +344,26 @@ bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
     if (cl->read_state == CL_READ_HDR)
     {
         if (cl->read_op->req.hdr.magic == SECONDARY_OSD_REPLY_MAGIC)
-            return handle_reply_hdr(cl);
+        {
+            if (!handle_reply_hdr(cl))
+                return false;
+        }
         else if (cl->read_op->req.hdr.magic == SECONDARY_OSD_OP_MAGIC)
-            handle_op_hdr(cl);
+        {
+            if (!handle_op_hdr(cl))
+                return false;
+        }
         else
         {
             fprintf(stderr, "Received garbage: magic=%lx id=%lu opcode=%lx from %d\n", cl->read_op->req.hdr.magic, cl->read_op->req.hdr.id, cl->read_op->req.hdr.opcode, cl->peer_fd);
             stop_client(cl->peer_fd);
             return false;
         }
+        // Large payloads usually come in series (e.g. 128k+ writes or reads), so only read the next
+        // header alone after a large payload. Doing it always would cost an extra recvmsg() for every
+        // request without payload (reads, syncs) which are otherwise received in batches
+        cl->read_hdr_only = (cl->read_state == CL_READ_DATA || cl->read_state == CL_READ_REPLY_DATA) &&
+            cl->read_remaining >= receive_buffer_size;
     }
     else if (cl->read_state == CL_READ_DATA)
     {
@@ -197,6 +380,16 @@ bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
         cl->read_op = NULL;
         cl->read_state = 0;
     }
+    else if (cl->read_state == CL_READ_BATCH)
+    {
+        if (!handle_batch_items(cl))
+            return false;
+    }
+    else if (cl->read_state == CL_READ_REPLY_BATCH)
+    {
+        if (!handle_batch_reply_items(cl))
+            return false;
+    }
     else
     {
         assert(0);
@@ -204,9 +397,34 @@ bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
     return true;
 }
 
-void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
+bool osd_messenger_t::handle_op_hdr(osd_client_t *cl)
 {
     osd_op_t *cur_op = cl->read_op;
+    if (!(cl->peer_features & OSD_FEATURE_STAB_PIGGYBACK) || !(features & OSD_FEATURE_STAB_PIGGYBACK))
+    {
+        // stab_len is only valid if both sides support piggybacked stabilize lists,
+        // it may contain anything otherwise
+        if (cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE || cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE)
+            cur_op->req.sec_rw.stab_len = 0;
+        else if (cur_op->req.hdr.opcode == OSD_OP_SEC_SYNC)
+            cur_op->req.sec_sync.stab_len = 0;
+    }
+    if ((!(cl->peer_features & OSD_FEATURE_WRITE_FORWARD) || !(features & OSD_FEATURE_WRITE_FORWARD)) &&
+        (cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE || cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE))
+    {
+        // The same for forward_to, otherwise garbage in it would make us forward writes to random OSDs
+        memset(cur_op->req.sec_rw.forward_to, 0, sizeof(cur_op->req.sec_rw.forward_to));
+    }
+    uint64_t stab_len = (cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE || cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE
+        ? cur_op->req.sec_rw.stab_len : (cur_op->req.hdr.opcode == OSD_OP_SEC_SYNC ? cur_op->req.sec_sync.stab_len : 0));
+    if (stab_len % sizeof(obj_ver_id) || stab_len > UINT32_MAX)
+    {
+        // Piggybacked stabilize list must consist of whole obj_ver_ids, its size is limited like the data size
+        fprintf(stderr, "Received garbage: op id=%lu opcode=%lx with invalid stab_len=%lu from %d\n",
+            cur_op->req.hdr.id, cur_op->req.hdr.opcode, stab_len, cl->peer_fd);
+        stop_client(cl->peer_fd);
+        return false;
+    }
     if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ)
     {
         cl->read_remaining = 0;
@@ -222,12 +440,22 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
                 cur_op->bitmap = &cur_op->bmp_data;
             cl->recv_list.push_back(cur_op->bitmap, cur_op->req.sec_rw.attr_len);
         }
-        if (cur_op->req.sec_rw.len > 0)
+        // Piggybacked stabilize list is received into the same buffer, right after data
+        if (cur_op->req.sec_rw.len + cur_op->req.sec_rw.stab_len > 0)
+        {
+            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.sec_rw.len + cur_op->req.sec_rw.stab_len);
+            cl->recv_list.push_back(cur_op->buf, cur_op->req.sec_rw.len + cur_op->req.sec_rw.stab_len);
+        }
+        cl->read_remaining = cur_op->req.sec_rw.len + cur_op->req.sec_rw.attr_len + cur_op->req.sec_rw.stab_len;
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SEC_SYNC)
+    {
+        if (cur_op->req.sec_sync.stab_len > 0)
         {
-            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.sec_rw.len);
-            cl->recv_list.push_back(cur_op->buf, cur_op->req.sec_rw.len);
+            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.sec_sync.stab_len);
+            cl->recv_list.push_back(cur_op->buf, cur_op->req.sec_sync.stab_len);
         }
-        cl->read_remaining = cur_op->req.sec_rw.len + cur_op->req.sec_rw.attr_len;
+        cl->read_remaining = cur_op->req.sec_sync.stab_len;
     }
     else if (cur_op->req.hdr.opcode == OSD_OP_SEC_STABILIZE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_ROLLBACK)
@@ -271,6 +499,24 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
         }
         cl->read_remaining = cur_op->req.show_conf.json_len;
     }
+    else if (cur_op->req.hdr.opcode == OSD_OP_BATCH)
+    {
+        // Read sub-operation descriptions first, write data is then received directly into sub-operation buffers
+        if (!cur_op->req.batch.count || cur_op->req.batch.count > OSD_BATCH_MAX_OPS)
+        {
+            // The payload can't be parsed without items, so the stream can't be continued
+            fprintf(stderr, "Received garbage: batch id=%lu with invalid count %lu from %d\n",
+                cur_op->req.hdr.id, cur_op->req.batch.count, cl->peer_fd);
+            stop_client(cl->peer_fd);
+            return false;
+        }
+        osd_op_batch_data_t *batch = osd_op_batch_data_t::alloc(cur_op->req.batch.count);
+        cur_op->buf = batch;
+        cl->read_remaining = batch->count*sizeof(osd_op_batch_item_t);
+        cl->recv_list.push_back(batch->items, cl->read_remaining);
+        cl->read_state = CL_READ_BATCH;
+        return true;
+    }
     if (cl->read_remaining > 0)
     {
         // Read data
@@ -284,6 +530,74 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
         cl->read_op = NULL;
         cl->read_state = 0;
     }
+    return true;
+}
+
+bool osd_messenger_t::handle_batch_items(osd_client_t *cl)
+{
+    osd_op_t *cur_op = cl->read_op;
+    osd_op_batch_data_t *batch = (osd_op_batch_data_t*)cur_op->buf;
+    uint64_t data_len = 0;
+    for (uint64_t i = 0; i < batch->count; i++)
+    {
+        osd_op_batch_item_t & item = batch->items[i];
+        if (item.opcode == OSD_OP_WRITE)
+        {
+            if (item.len > OSD_BATCH_MAX_LEN)
+            {
+                data_len = UINT64_MAX;
+                break;
+            }
+            data_len += item.len;
+        }
+    }
+    if (data_len != cur_op->req.batch.data_len)
+    {
+        fprintf(stderr, "Received garbage: batch id=%lu with invalid data length from %d\n", cur_op->req.hdr.id, cl->peer_fd);
+        stop_client(cl->peer_fd);
+        return false;
+    }
+    for (uint64_t i = 0; i < batch->count; i++)
+    {
+        osd_op_batch_item_t & item = batch->items[i];
+        osd_op_t *sub = new osd_op_t;
+        sub->op_type = OSD_OP_IN;
+        sub->peer_fd = cl->peer_fd;
+        sub->req.rw = (osd_op_rw_t){
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = cur_op->req.hdr.id,
+                .opcode = item.opcode,
+            },
+            .inode = item.inode,
+            .offset = item.offset,
+            .len = item.len,
+            .flags = item.flags,
+            .meta_revision = item.meta_revision,
+            .version = item.version,
+        };
+        if (item.opcode == OSD_OP_WRITE && item.len > 0)
+        {
+            sub->buf = memalign_or_die(MEM_ALIGNMENT, item.len);
+            cl->recv_list.push_back(sub->buf, item.len);
+        }
+        batch->ops[i] = sub;
+    }
+    cl->read_remaining = data_len;
+    if (cl->read_remaining > 0)
+    {
+        // Read data
+        cl->read_state = CL_READ_DATA;
+    }
+    else
+    {
+        // Operation is ready
+        cl->received_ops.push_back(cur_op);
+        set_immediate.push_back([this, cur_op]() { exec_op(cur_op); });
+        cl->read_op = NULL;
+        cl->read_state = 0;
+    }
+    return true;
 }
 
 bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
@@ -299,6 +613,8 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
     osd_op_t *op = req_it->second;
     memcpy(op->reply.buf, cl->read_op->req.buf, OSD_PACKET_SIZE);
     cl->sent_ops.erase(req_it);
+    if (op->req.hdr.opcode == OSD_OP_SEC_READ)
+        cl->reads_inflight--;
     if (op->reply.hdr.opcode == OSD_OP_SEC_READ || op->reply.hdr.opcode == OSD_OP_READ)
     {
         // Read data. In this case we assume that the buffer is preallocated by the caller (!)
@@ -332,6 +648,23 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
         cl->read_op = op;
         cl->read_state = CL_READ_REPLY_DATA;
     }
+    else if (op->reply.hdr.opcode == OSD_OP_BATCH && op->reply.hdr.retval >= 0)
+    {
+        osd_op_batch_data_t *batch = (osd_op_batch_data_t*)op->buf;
+        if (op->reply.batch.count != batch->count)
+        {
+            fprintf(stderr, "Client %d batch reply of different size: expected %lu, got %lu\n",
+                cl->peer_fd, batch->count, op->reply.batch.count);
+            cl->sent_ops[op->req.hdr.id] = op;
+            stop_client(cl->peer_fd);
+            return false;
+        }
+        delete cl->read_op;
+        cl->read_op = op;
+        cl->read_state = CL_READ_REPLY_BATCH;
+        cl->read_remaining = batch->count*sizeof(osd_reply_batch_item_t);
+        cl->recv_list.push_back(batch->reply_items, cl->read_remaining);
+    }
     else if (op->reply.hdr.opcode == OSD_OP_SEC_LIST && op->reply.hdr.retval > 0)
     {
         assert(!op->iov.count);
@@ -375,6 +708,60 @@ reuse:
     return true;
 }
 
+bool osd_messenger_t::handle_batch_reply_items(osd_client_t *cl)
+{
+    osd_op_t *op = cl->read_op;
+    osd_op_batch_data_t *batch = (osd_op_batch_data_t*)op->buf;
+    for (uint64_t i = 0; i < batch->count; i++)
+    {
+        osd_op_t *sub = batch->ops[i];
+        osd_reply_batch_item_t & item = batch->reply_items[i];
+        if (sub->req.hdr.opcode == OSD_OP_READ && item.retval >= 0 &&
+            (item.retval != sub->req.rw.len || item.bitmap_len > sub->bitmap_len))
+        {
+            // Check reply length to not overflow the buffer
+            fprintf(stderr, "Client %d batched read reply of different length: expected %u+%u, got %ld+%u\n",
+                cl->peer_fd, sub->req.rw.len, sub->bitmap_len, item.retval, item.bitmap_len);
+            cl->sent_ops[op->req.hdr.id] = op;
+            stop_client(cl->peer_fd);
+            return false;
+        }
+    }
+    cl->read_remaining = 0;
+    for (uint64_t i = 0; i < batch->count; i++)
+    {
+        osd_op_t *sub = batch->ops[i];
+        osd_reply_batch_item_t & item = batch->reply_items[i];
+        if (sub->req.hdr.opcode != OSD_OP_READ || item.retval < 0)
+        {
+            continue;
+        }
+        if (item.bitmap_len > 0)
+        {
+            assert(sub->bitmap);
+            cl->recv_list.push_back(sub->bitmap, item.bitmap_len);
+        }
+        if (item.retval > 0)
+        {
+            assert(sub->iov.count > 0);
+            cl->recv_list.append(sub->iov);
+        }
+        cl->read_remaining += item.retval + item.bitmap_len;
+    }
+    if (cl->read_remaining > 0)
+    {
+        cl->read_state = CL_READ_REPLY_DATA;
+    }
+    else
+    {
+        // Reply is ready
+        handle_reply_ready(op);
+        cl->read_op = NULL;
+        cl->read_state = 0;
+    }
+    return true;
+}
+
 void osd_messenger_t::handle_reply_ready(osd_op_t *op)
 {
     // Measure subop latency
@@ -386,13 +773,23 @@ void osd_messenger_t::handle_reply_ready(osd_op_t *op)
         stats.subop_stat_count[op->req.hdr.opcode]++;
         stats.subop_stat_sum[op->req.hdr.opcode] = 0;
     }
-    stats.subop_stat_sum[op->req.hdr.opcode] += (
+    uint64_t latency = (
         (tv_end.tv_sec - op->tv_begin.tv_sec)*1000000 +
         (tv_end.tv_nsec - op->tv_begin.tv_nsec)/1000
     );
+    stats.subop_stat_sum[op->req.hdr.opcode] += latency;
+    if (op->req.hdr.opcode == OSD_OP_SEC_READ)
+    {
+        auto cl_it = clients.find(op->peer_fd);
+        if (cl_it != clients.end())
+        {
+            uint64_t & avg = cl_it->second->read_lat_us;
+            avg = avg ? (avg*7 + latency)/8 : latency;
+        }
+    }
     set_immediate.push_back([this, op]()
     {
         // Copy lambda to be unaffected by `delete op`
-        std::function<void(osd_op_t*)>(op->callback)(op);
+        inline_callback_t<osd_op_t>(op->callback)(op);
     });
 }
@@ -10,6 +10,15 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
 {
     assert(cur_op->peer_fd);
     osd_client_t *cl = clients.at(cur_op->peer_fd);
+    if (cur_op->op_type == OSD_OP_OUT && (max_batch_ops > 1 || cl->batch.size()) && batch_op(cl, cur_op))
+    {
+        return;
+    }
+    outbox_push_now(cl, cur_op);
+}
+
+void osd_messenger_t::outbox_push_now(osd_client_t *cl, osd_op_t *cur_op)
+{
     if (cur_op->op_type == OSD_OP_OUT)
     {
         clock_gettime(CLOCK_REALTIME, &cur_op->tv_begin);
@@ -45,6 +54,8 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
     {
         to_send_list.push_back((iovec){ .iov_base = cur_op->req.buf, .iov_len = OSD_PACKET_SIZE });
         cl->sent_ops[cur_op->req.hdr.id] = cur_op;
+        if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ)
+            cl->reads_inflight++;
     }
     to_outbox.push_back((msgr_sendp_t){ .op = cur_op, .flags = MSGR_SENDP_HDR });
     // Bitmap
@@ -73,13 +84,16 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
         ? (cur_op->req.hdr.opcode == OSD_OP_READ ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_READ ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_LIST ||
-        cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG)
+        cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG ||
+        cur_op->req.hdr.opcode == OSD_OP_BATCH)
         : (cur_op->req.hdr.opcode == OSD_OP_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE ||
+        cur_op->req.hdr.opcode == OSD_OP_SEC_SYNC ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_STABILIZE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_ROLLBACK ||
-        cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG)) && cur_op->iov.count > 0)
+        cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG ||
+        cur_op->req.hdr.opcode == OSD_OP_BATCH)) && cur_op->iov.count > 0)
     {
         for (int i = 0; i < cur_op->iov.count; i++)
         {
@@ -168,6 +182,10 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
     {
         return true;
     }
+    if (cl->shm_conn && cl->shm_conn->send_active)
+    {
+        return try_send_shm(cl);
+    }
     if (ringloop && !use_sync_send_recv)
     {
         io_uring_sqe* sqe = ringloop->get_sqe();
@@ -179,6 +197,25 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
         cl->write_msg.msg_iovlen = cl->send_list.size() < IOV_MAX ? cl->send_list.size() : IOV_MAX;
         cl->refs++;
         ring_data_t* data = ((ring_data_t*)sqe->user_data);
+#ifdef IORING_CQE_F_NOTIF
+        if (min_zerocopy_send_size > 0 && cl->peer_addr.sin_family != AF_UNIX)
+        {
+            uint64_t total = 0;
+            for (int i = 0; i < cl->write_msg.msg_iovlen && total < min_zerocopy_send_size; i++)
+            {
+                total += cl->send_list[i].iov_len;
+            }
+            if (total >= min_zerocopy_send_size)
+            {
+                // Replies sent by this request are only freed when the kernel releases their buffers
+                auto delay_free = new std::vector<osd_op_t*>();
+                cl->refs++;
+                data->callback = [this, cl, delay_free](ring_data_t *data) { handle_send_zc(data, cl, delay_free); };
+                my_uring_prep_sendmsg_zc(sqe, peer_fd, &cl->write_msg, 0);
+                return true;
+            }
+        }
+#endif
         data->callback = [this, cl](ring_data_t *data) { handle_send(data->res, cl); };
         my_uring_prep_sendmsg(sqe, peer_fd, &cl->write_msg, 0);
     }
@@ -199,6 +236,10 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
 
 void osd_messenger_t::send_replies()
 {
+    if (batch_clients.size())
+    {
+        flush_batches();
+    }
     for (int i = 0; i < write_ready_clients.size(); i++)
     {
         int peer_fd = write_ready_clients[i];
@@ -212,7 +253,39 @@ void osd_messenger_t::send_replies()
     write_ready_clients.clear();
 }
 
-void osd_messenger_t::handle_send(int result, osd_client_t *cl)
+#ifdef IORING_CQE_F_NOTIF
+void osd_messenger_t::handle_send_zc(ring_data_t *data, osd_client_t *cl, std::vector<osd_op_t*> *delay_free)
+{
+    if (!(data->flags & IORING_CQE_F_NOTIF))
+    {
+        if (data->res == -EINVAL || data->res == -EOPNOTSUPP)
+        {
+            // Zero-copy send is not supported by the kernel or by the socket
+            fprintf(stderr, "Zero-copy sendmsg is not supported (%s), disabling it\n", strerror(-data->res));
+            min_zerocopy_send_size = 0;
+            data->res = -EAGAIN;
+        }
+        handle_send(data->res, cl, delay_free);
+        if (data->flags & IORING_CQE_F_MORE)
+        {
+            // Wait for the notification
+            return;
+        }
+    }
+    for (auto op: *delay_free)
+    {
+        delete op;
+    }
+    delete delay_free;
+    cl->refs--;
+    if (cl->peer_state == PEER_STOPPED && cl->refs <= 0)
+    {
+        delete cl;
+    }
+}
+#endif
+
+void osd_messenger_t::handle_send(int result, osd_client_t *cl, std::vector<osd_op_t*> *delay_free)
 {
     cl->write_msg.msg_iovlen = 0;
     cl->refs--;
@@ -242,7 +315,10 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
                 if (cl->outbox[done].flags & MSGR_SENDP_FREE)
                 {
                     // Reply fully sent
-                    delete cl->outbox[done].op;
+                    if (delay_free)
+                        delay_free->push_back(cl->outbox[done].op);
+                    else
+                        delete cl->outbox[done].op;
                 }
                 result -= iov.iov_len;
                 done++;
@@ -267,6 +343,11 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
             cl->next_outbox.clear();
         }
         cl->write_state = cl->outbox.size() > 0 ? CL_WRITE_READY : 0;
+        if (cl->shm_conn && !cl->shm_conn->send_active && !cl->outbox.size() && cl->shm_conn->recv_active)
+        {
+            // The handshake reply is sent through the socket, everything else goes through the ring
+            cl->shm_conn->send_active = true;
+        }
 #ifdef WITH_RDMA
         if (cl->rdma_conn && !cl->outbox.size() && cl->peer_state == PEER_RDMA_CONNECTING)
         {
@@ -0,0 +1,273 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "messenger.h"
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+    "shared memory rings require lock-free atomics");
+static_assert(2*sizeof(msgr_shm_ring_t) <= MSGR_SHM_HDR_SIZE, "ring headers must fit into the region header");
+
+static std::atomic<uint64_t> shm_counter;
+
+msgr_shm_connection_t::~msgr_shm_connection_t()
+{
+    unlink();
+    if (mem)
+    {
+        munmap(mem, MSGR_SHM_HDR_SIZE + 2*ring_size);
+        mem = NULL;
+    }
+}
+
+void msgr_shm_connection_t::unlink()
+{
+    if (name != "")
+    {
+        shm_unlink(name.c_str());
+        name = "";
+    }
+}
+
+static void *map_shm(int fd, uint64_t size)
+{
+    void *mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+msgr_shm_connection_t *msgr_shm_connection_t::create(uint64_t ring_size)
+{
+    std::string name = "/vitastor-"+std::to_string(getpid())+"-"+std::to_string(++shm_counter);
+    int fd = shm_open(name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create shared memory %s: %s\n", name.c_str(), strerror(errno));
+        return NULL;
+    }
+    void *mem = NULL;
+    if (ftruncate(fd, MSGR_SHM_HDR_SIZE + 2*ring_size) < 0 ||
+        !(mem = map_shm(fd, MSGR_SHM_HDR_SIZE + 2*ring_size)))
+    {
+        fprintf(stderr, "Failed to map shared memory %s: %s\n", name.c_str(), strerror(errno));
+        shm_unlink(name.c_str());
+        return NULL;
+    }
+    auto sc = new msgr_shm_connection_t();
+    sc->name = name;
+    sc->mem = mem;
+    sc->ring_size = ring_size;
+    // The first ring goes from the connecting side to the accepting side
+    sc->send_ring = (msgr_shm_ring_t*)mem;
+    sc->recv_ring = (msgr_shm_ring_t*)mem + 1;
+    sc->send_buf = (uint8_t*)mem + MSGR_SHM_HDR_SIZE;
+    sc->recv_buf = (uint8_t*)mem + MSGR_SHM_HDR_SIZE + ring_size;
+    return sc;
+}
+
+msgr_shm_connection_t *msgr_shm_connection_t::open(const std::string & name, uint64_t ring_size)
+{
+    if (name.substr(0, 10) != "/vitastor-" || name.find('/', 1) != std::string::npos ||
+        !ring_size || (ring_size & (ring_size-1)) || ring_size > 1024*1024*1024)
+    {
+        return NULL;
+    }
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open shared memory %s: %s\n", name.c_str(), strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != MSGR_SHM_HDR_SIZE + 2*ring_size)
+    {
+        fprintf(stderr, "Shared memory %s has unexpected size, not using it\n", name.c_str());
+        close(fd);
+        return NULL;
+    }
+    void *mem = map_shm(fd, MSGR_SHM_HDR_SIZE + 2*ring_size);
+    if (!mem)
+    {
+        fprintf(stderr, "Failed to map shared memory %s: %s\n", name.c_str(), strerror(errno));
+        return NULL;
+    }
+    auto sc = new msgr_shm_connection_t();
+    sc->mem = mem;
+    sc->ring_size = ring_size;
+    sc->send_ring = (msgr_shm_ring_t*)mem + 1;
+    sc->recv_ring = (msgr_shm_ring_t*)mem;
+    sc->send_buf = (uint8_t*)mem + MSGR_SHM_HDR_SIZE + ring_size;
+    sc->recv_buf = (uint8_t*)mem + MSGR_SHM_HDR_SIZE;
+    return sc;
+}
+
+uint64_t msgr_shm_connection_t::send(const iovec *iov, int count, bool *wakeup)
+{
+    uint64_t head = send_ring->head.load(std::memory_order_relaxed);
+    uint64_t done = 0;
+    int i = 0;
+    uint64_t pos = 0;
+    while (i < count)
+    {
+        uint64_t tail = send_ring->tail.load(std::memory_order_acquire);
+        // Don't trust the peer: it can only make the ring look full
+        uint64_t used = head+done-tail <= ring_size ? head+done-tail : ring_size;
+        while (i < count && used < ring_size)
+        {
+            uint64_t len = iov[i].iov_len-pos < ring_size-used ? iov[i].iov_len-pos : ring_size-used;
+            uint64_t start = (head+done) & (ring_size-1);
+            uint64_t part = len < ring_size-start ? len : ring_size-start;
+            memcpy(send_buf + start, (uint8_t*)iov[i].iov_base + pos, part);
+            memcpy(send_buf, (uint8_t*)iov[i].iov_base + pos + part, len-part);
+            done += len;
+            used += len;
+            pos += len;
+            if (pos >= iov[i].iov_len)
+            {
+                pos = 0;
+                i++;
+            }
+        }
+        if (i >= count)
+        {
+            break;
+        }
+        // The ring is full. Ask the peer to wake us up and recheck in case it has just freed some space
+        send_ring->writer_waiting.store(1);
+        if (send_ring->tail.load() == tail)
+        {
+            break;
+        }
+        send_ring->writer_waiting.store(0);
+    }
+    *wakeup = false;
+    if (done > 0)
+    {
+        send_ring->head.store(head+done);
+        *wakeup = send_ring->reader_sleeping.exchange(0) != 0;
+    }
+    return done;
+}
+
+bool osd_messenger_t::connect_shm(int peer_fd, std::string name, uint64_t ring_size)
+{
+    auto cl = clients.at(peer_fd);
+    if (!use_shm || !ringloop || !cl->in_buf || cl->peer_addr.sin_family != AF_UNIX || cl->shm_conn)
+    {
+        return false;
+    }
+    cl->shm_conn = msgr_shm_connection_t::open(name, ring_size);
+    if (!cl->shm_conn)
+    {
+        return false;
+    }
+    // The peer only sends the handshake request through the socket, all further data comes through
+    // the ring. The reply is still sent through the socket, see handle_send()
+    cl->shm_conn->recv_active = true;
+    cl->shm_conn->recv_ring->reader_sleeping.store(1);
+    if (log_level > 0)
+    {
+        fprintf(stderr, "[OSD %lu] Client %d switched to shared memory\n", osd_num, peer_fd);
+    }
+    return true;
+}
+
+bool osd_messenger_t::try_send_shm(osd_client_t *cl)
+{
+    bool wakeup = false;
+    uint64_t done = cl->shm_conn->send(cl->send_list.data(), cl->send_list.size(), &wakeup);
+    if (wakeup)
+    {
+        wakeup_shm_peer(cl);
+    }
+    if (done > 0)
+    {
+        // Free sent replies and shift the send list just like after a socket write
+        cl->refs++;
+        handle_send(done, cl);
+    }
+    return true;
+}
+
+void osd_messenger_t::wakeup_shm_peer(osd_client_t *cl)
+{
+    // The data is already in the ring, so the wakeup may be dropped if the socket buffer is full
+    char c = 0;
+    send(cl->peer_fd, &c, 1, MSG_NOSIGNAL|MSG_DONTWAIT);
+}
+
+void osd_messenger_t::read_shm(osd_client_t *cl)
+{
+    // Drain wakeups from the socket (epoll is edge-triggered)
+    char buf[256];
+    int r;
+    while ((r = read(cl->peer_fd, buf, sizeof(buf))) > 0 || r < 0 && errno == EINTR)
+    {
+    }
+    cl->read_ready = 0;
+    if (r == 0 || errno != EAGAIN)
+    {
+        if (r < 0)
+        {
+            fprintf(stderr, "Client %d socket read error: %d (%s). Disconnecting client\n", cl->peer_fd, errno, strerror(errno));
+        }
+        stop_client(cl->peer_fd);
+        return;
+    }
+    handle_shm_recv(cl);
+}
+
+void osd_messenger_t::handle_shm_recv(osd_client_t *cl)
+{
+    msgr_shm_connection_t *sc = cl->shm_conn;
+    msgr_shm_ring_t *ring = sc->recv_ring;
+    cl->refs++;
+    while (true)
+    {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        if (head == tail)
+        {
+            // Go to sleep and recheck the ring in case the peer has just written something
+            ring->reader_sleeping.store(1);
+            if (ring->head.load() == tail)
+            {
+                break;
+            }
+            continue;
+        }
+        uint64_t start = tail & (sc->ring_size-1);
+        uint64_t len = head-tail < sc->ring_size-start ? head-tail : sc->ring_size-start;
+        if (!handle_read_buffer(cl, sc->recv_buf + start, len) || cl->peer_state == PEER_STOPPED)
+        {
+            // Client is stopped, <sc> is already freed
+            break;
+        }
+        ring->tail.store(tail+len);
+        if (ring->writer_waiting.load() && ring->writer_waiting.exchange(0))
+        {
+            wakeup_shm_peer(cl);
+        }
+    }
+    if (cl->peer_state != PEER_STOPPED)
+    {
+        // The peer may have freed space for our own pending data
+        try_send(cl);
+    }
+    for (auto cb: set_immediate)
+    {
+        cb();
+    }
+    set_immediate.clear();
+    cl->refs--;
+    if (cl->peer_state == PEER_STOPPED && cl->refs <= 0)
+    {
+        delete cl;
+    }
+}
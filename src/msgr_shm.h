@@ -0,0 +1,47 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+#include <sys/uio.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#define MSGR_SHM_HDR_SIZE 4096
+#define DEFAULT_SHM_RING_SIZE 2*1024*1024
+
+// One direction of a shared memory connection: a single-producer single-consumer byte ring
+struct msgr_shm_ring_t
+{
+    // Written only by the producer
+    std::atomic<uint64_t> head;
+    // Set by the producer when the ring is full and it waits for a wakeup
+    std::atomic<uint32_t> writer_waiting;
+    uint8_t pad1[52];
+    // Written only by the consumer
+    std::atomic<uint64_t> tail;
+    // Set by the consumer when the ring is empty and it waits for a wakeup
+    std::atomic<uint32_t> reader_sleeping;
+    uint8_t pad2[52];
+};
+
+// Connection to a peer on the same host through two rings in a shared memory region.
+// The region is created by the connecting side and mapped by the peer during the handshake.
+// The Unix socket stays open, but after the handshake it only carries 1-byte wakeups
+struct msgr_shm_connection_t
+{
+    // Name of the region, empty after it's unlinked or if it's created by the peer
+    std::string name;
+    void *mem = NULL;
+    uint64_t ring_size = 0;
+    msgr_shm_ring_t *send_ring = NULL, *recv_ring = NULL;
+    uint8_t *send_buf = NULL, *recv_buf = NULL;
+    bool send_active = false, recv_active = false;
+
+    ~msgr_shm_connection_t();
+    static msgr_shm_connection_t *create(uint64_t ring_size);
+    static msgr_shm_connection_t *open(const std::string & name, uint64_t ring_size);
+    void unlink();
+    // Copy as much of <iov> as fits into the send ring. Sets <wakeup> if the peer should be woken up
+    uint64_t send(const iovec *iov, int count, bool *wakeup);
+};
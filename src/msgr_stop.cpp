@@ -3,6 +3,8 @@
 
 #include <unistd.h>
 #include <assert.h>
+#include <sys/socket.h>
+#include <algorithm>
 
 #include "messenger.h"
 
@@ -15,6 +17,9 @@ void osd_messenger_t::cancel_osd_ops(osd_client_t *cl)
     {
         cancel_ops[i++] = p.second;
     }
+    // Operations waiting to be batched weren't sent at all
+    cancel_ops.insert(cancel_ops.end(), cl->batch.begin(), cl->batch.end());
+    cl->batch.clear();
     cl->sent_ops.clear();
     cl->outbox.clear();
     for (auto op: cancel_ops)
@@ -32,7 +37,7 @@ void osd_messenger_t::cancel_op(osd_op_t *op)
         op->reply.hdr.opcode = op->req.hdr.opcode;
         op->reply.hdr.retval = -EPIPE;
         // Copy lambda to be unaffected by `delete op`
-        std::function<void(osd_op_t*)>(op->callback)(op);
+        inline_callback_t<osd_op_t>(op->callback)(op);
     }
     else
     {
@@ -68,7 +73,7 @@ void osd_messenger_t::stop_client(int peer_fd, bool force)
     // First set state to STOPPED so another stop_client() call doesn't try to free it again
     cl->refs++;
     cl->peer_state = PEER_STOPPED;
-    if (cl->osd_num)
+    if (cl->osd_num && cl->main_fd < 0)
     {
         // ...and forget OSD peer
         osd_peer_fds.erase(cl->osd_num);
@@ -98,7 +103,30 @@ void osd_messenger_t::stop_client(int peer_fd, bool force)
         }
     }
 #endif
-    if (cl->osd_num)
+    if (cl->main_fd >= 0)
+    {
+        // An extra connection to the OSD peer: the peer is lost along with any of its connections
+        auto main_it = clients.find(cl->main_fd);
+        if (main_it != clients.end())
+        {
+            auto & lanes = main_it->second->lane_fds;
+            lanes.erase(std::remove(lanes.begin(), lanes.end(), peer_fd), lanes.end());
+            if (!main_it->second->lanes_connecting)
+            {
+                stop_client(cl->main_fd, true);
+            }
+        }
+    }
+    else if (cl->lane_fds.size())
+    {
+        std::vector<int> lanes;
+        lanes.swap(cl->lane_fds);
+        for (int lane_fd: lanes)
+        {
+            stop_client(lane_fd, true);
+        }
+    }
+    if (cl->osd_num && cl->main_fd < 0)
     {
         // Then repeer PGs because cancel_op() callbacks can try to perform
         // some actions and we need correct PG states to not do something silly
@@ -119,6 +147,22 @@ void osd_messenger_t::stop_client(int peer_fd, bool force)
         cancel_osd_ops(cl);
     }
 #ifndef __MOCK__
+#ifdef RINGLOOP_BUF_RING
+    if (cl->recv_nobuf)
+    {
+        // The client has no multishot recv request, it waits for a buffer
+        recv_nobuf_clients.erase(std::find(recv_nobuf_clients.begin(), recv_nobuf_clients.end(), cl));
+        cl->recv_nobuf = false;
+        cl->refs--;
+        delete cl->recv_data;
+        cl->recv_data = NULL;
+    }
+#endif
+    if (cl->recv_data)
+    {
+        // Terminate the multishot recv request, it holds a reference to the socket
+        shutdown(peer_fd, SHUT_RDWR);
+    }
     // And close the FD only when everything is done
     // ...because peer_fd number can get reused after close()
     close(peer_fd);
@@ -128,6 +172,17 @@ void osd_messenger_t::stop_client(int peer_fd, bool force)
         delete cl->rdma_conn;
     }
 #endif
+    if (cl->shm_conn)
+    {
+        delete cl->shm_conn;
+        cl->shm_conn = NULL;
+    }
+    if (cl->main_fd < 0 && cl->lanes_connecting > 0)
+    {
+        // The peer wasn't reported as connected yet, report the failure instead
+        cl->lanes_connecting = 0;
+        on_connect_peer(cl->osd_num, -EPIPE);
+    }
 #endif
     // Find the item again because it can be invalidated at this point
     it = clients.find(peer_fd);
@@ -0,0 +1,106 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Messenger lookup table benchmark: measures the cost of the per-reply lookups done in
+// handle_reply_hdr() (client by fd, then in-flight operation by ID, erase, send a new one)
+// for std::map and for the flat tables at various numbers of outstanding operations.
+// Usage: msgr_table_bench [replies_per_case]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <map>
+#include "flat_map.h"
+
+struct bench_client_t
+{
+    std::map<uint64_t, void*> map_ops;
+    id_map_t<void> flat_ops;
+};
+
+static double now()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec/1000000000.0;
+}
+
+// Operation IDs are shared by all connections, so each connection only sees every <conns>'th ID.
+// Replies arrive roughly, but not exactly, in the order of requests
+template<class C, class O> static double run(C & clients, int conns, int inflight, uint64_t replies,
+    O & (*ops_of)(bench_client_t*))
+{
+    uint64_t next_id = 1;
+    std::vector<std::vector<uint64_t>> pending(conns);
+    for (int i = 0; i < inflight*conns; i++)
+    {
+        int fd = 10 + i % conns;
+        uint64_t id = next_id++;
+        ops_of(clients[fd])[id] = (void*)id;
+        pending[i % conns].push_back(id);
+    }
+    uint64_t found = 0;
+    double start = now();
+    for (uint64_t r = 0; r < replies; r++)
+    {
+        int c = r % conns;
+        int fd = 10 + c;
+        auto & p = pending[c];
+        // Take one of the 4 oldest requests
+        int idx = (r >> 3) & 3;
+        uint64_t id = p[idx];
+        p[idx] = p.back();
+        p.pop_back();
+        auto cl_it = clients.find(fd);
+        auto & ops = ops_of(cl_it->second);
+        auto op_it = ops.find(id);
+        found += (uint64_t)op_it->second;
+        ops.erase(op_it);
+        uint64_t new_id = next_id++;
+        ops[new_id] = (void*)new_id;
+        p.push_back(new_id);
+    }
+    double t = now() - start;
+    if (!found)
+        printf("impossible\n");
+    return t;
+}
+
+static std::map<uint64_t, void*> & map_ops(bench_client_t *cl)
+{
+    return cl->map_ops;
+}
+
+static id_map_t<void> & flat_ops(bench_client_t *cl)
+{
+    return cl->flat_ops;
+}
+
+int main(int narg, char *args[])
+{
+    uint64_t replies = narg > 1 ? strtoull(args[1], NULL, 10) : 10000000;
+    const int conns[] = { 1, 16 };
+    const int inflight[] = { 16, 256, 1024, 4096 };
+    printf("%6s %9s %14s %14s\n", "conns", "inflight", "std::map ns", "flat ns");
+    for (int nc: conns)
+    {
+        for (int n: inflight)
+        {
+            std::map<int, bench_client_t*> map_clients;
+            fd_map_t<bench_client_t> flat_clients;
+            for (int i = 0; i < nc; i++)
+            {
+                map_clients[10+i] = new bench_client_t;
+                flat_clients[10+i] = new bench_client_t;
+            }
+            double t_map = run(map_clients, nc, n, replies, map_ops);
+            double t_flat = run(flat_clients, nc, n, replies, flat_ops);
+            printf("%6d %9d %14.1f %14.1f\n", nc, n, t_map*1e9/replies, t_flat*1e9/replies);
+            for (auto & kv: map_clients)
+                delete kv.second;
+            for (auto & kv: flat_clients)
+                delete kv.second;
+        }
+    }
+    return 0;
+}
@@ -14,6 +14,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/eventfd.h>
+
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include "epoll_manager.h"
 #include "cluster_client.h"
@@ -22,19 +27,69 @@
 #define MSG_ZEROCOPY 0
 #endif
 
+// Not defined in older kernel headers
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#endif
+#ifndef NBD_CMD_WRITE_ZEROES
+#define NBD_CMD_WRITE_ZEROES 6
+#endif
+#ifndef NBD_FLAG_CAN_MULTI_CONN
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+#endif
+#ifndef NBD_CMD_FLAG_NO_HOLE
+#define NBD_CMD_FLAG_NO_HOLE (1 << 17)
+#endif
+
+#define MAX_NBD_CONNECTIONS 64
+#define NBD_FLAGS (NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES)
+
 const char *exe_name = NULL;
 
-class nbd_proxy
+struct nbd_sync_all_t
 {
-protected:
-    std::string image_name;
+    cluster_op_t *op;
+    int pending;
+    int retval;
+};
+
+// Request split at route unit boundaries into parts executed by different connections
+struct nbd_split_t
+{
+    cluster_op_t *op;
+    int pending;
+    int retval;
+};
+
+// Requests of a multi-connection device are routed between connections in units of this size
+// rounded to whole pool stripes, so each byte is always read and written by the same client
+#define NBD_ROUTE_SIZE 4*1024*1024
+
+// One NBD connection. The kernel maps each connection of a device to a blk-mq hardware queue.
+// With several connections each one is served by its own thread with its own ring and cluster client
+class nbd_conn_t
+{
+public:
+    std::vector<nbd_conn_t*> *conns = NULL;
     uint64_t inode = 0;
-    uint64_t device_size = 0;
     inode_watch_t *watch = NULL;
 
     ring_loop_t *ringloop = NULL;
     epoll_manager_t *epmgr = NULL;
     cluster_client_t *cli = NULL;
+    std::thread thread;
+    bool stop = false;
+    // Route unit of requests between connections, 0 if there's only one connection
+    uint64_t route_size = 0;
+    // Number of connections still served by the kernel
+    std::atomic<int> *active = NULL;
+
+    // Functions posted from other threads, signalled through <event_fd>
+    int event_fd = -1;
+    std::mutex post_mutex;
+    std::vector<std::function<void()>> posted;
+
+protected:
     ring_consumer_t consumer;
 
     std::vector<iovec> send_list, next_send_list;
@@ -51,6 +106,515 @@ protected:
     msghdr read_msg = { 0 }, send_msg = { 0 };
     iovec read_iov = { 0 };
 
+public:
+    nbd_conn_t(std::vector<nbd_conn_t*> *conns, json11::Json & cfg, bool etcd_follower)
+    {
+        this->conns = conns;
+        ringloop = new ring_loop_t(512);
+        epmgr = new epoll_manager_t(ringloop);
+        cli = new cluster_client_t(ringloop, epmgr->tfd, cfg, etcd_follower);
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0)
+        {
+            perror("eventfd");
+            exit(1);
+        }
+        epmgr->tfd->set_fd_handler(event_fd, false, [this](int fd, int epoll_events)
+        {
+            handle_posted();
+        });
+    }
+
+    ~nbd_conn_t()
+    {
+        if (watch)
+        {
+            cli->st_cli.close_watch(watch);
+        }
+        epmgr->tfd->set_fd_handler(event_fd, false, NULL);
+        close(event_fd);
+        delete cli;
+        delete epmgr;
+        delete ringloop;
+        free(recv_buf);
+    }
+
+    // Run <fn> in the thread of this connection
+    void post(std::function<void()> fn)
+    {
+        bool wake;
+        {
+            std::unique_lock<std::mutex> lock(post_mutex);
+            wake = !posted.size();
+            posted.push_back(fn);
+        }
+        if (wake)
+        {
+            uint64_t n = 1;
+            if (write(event_fd, &n, sizeof(n)) < 0)
+            {
+                perror("write eventfd");
+            }
+        }
+    }
+
+    void handle_posted()
+    {
+        // Read the eventfd before taking the queue to not miss wakeups
+        uint64_t n;
+        if (read(event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        {
+            perror("read eventfd");
+        }
+        std::vector<std::function<void()>> fns;
+        {
+            std::unique_lock<std::mutex> lock(post_mutex);
+            fns.swap(posted);
+        }
+        for (auto & fn: fns)
+        {
+            fn();
+        }
+    }
+
+    void start(int sock)
+    {
+        nbd_fd = sock;
+        // Initialize read state
+        read_state = CL_READ_HDR;
+        recv_buf = malloc_or_die(receive_buffer_size);
+        cur_buf = &cur_req;
+        cur_left = sizeof(nbd_request);
+        consumer.loop = [this]()
+        {
+            submit_read();
+            submit_send();
+            ringloop->submit();
+        };
+        ringloop->register_consumer(&consumer);
+        // Add FD to epoll
+        epmgr->tfd->set_fd_handler(nbd_fd, false, [this](int peer_fd, int epoll_events)
+        {
+            if (epoll_events & EPOLLRDHUP)
+            {
+                close(peer_fd);
+                stop = true;
+            }
+            else
+            {
+                read_ready++;
+                submit_read();
+            }
+        });
+    }
+
+    // Serve requests until the kernel closes the socket, then sync
+    void run()
+    {
+        while (!stop)
+        {
+            ringloop->loop();
+            ringloop->wait();
+        }
+        if (active)
+        {
+            // Other connections may still route requests to this one, so wait until all of them stop
+            if (!--*active)
+            {
+                for (auto conn: *conns)
+                    if (conn != this)
+                        conn->post([]() {});
+            }
+            while (*active > 0)
+            {
+                ringloop->loop();
+                ringloop->wait();
+            }
+        }
+        stop = false;
+        cluster_op_t *close_sync = new cluster_op_t;
+        close_sync->opcode = OSD_OP_SYNC;
+        close_sync->callback = [this](cluster_op_t *op)
+        {
+            stop = true;
+            delete op;
+        };
+        cli->execute(close_sync);
+        while (!stop)
+        {
+            ringloop->loop();
+            ringloop->wait();
+        }
+        ringloop->unregister_consumer(&consumer);
+    }
+
+protected:
+    void execute(cluster_op_t *op)
+    {
+        if (op->opcode == OSD_OP_SYNC && conns->size() > 1)
+            sync_all(op);
+        else if (route_size)
+            route(op);
+        else
+            cli->execute(op);
+    }
+
+    // The kernel may send overlapping writes through different connections. If they were executed
+    // by different clients, these clients could replay them in a different order after an OSD
+    // reconnect. So requests are split at route unit boundaries and each part is executed
+    // by the client of the connection which owns it
+    void route(cluster_op_t *op)
+    {
+        uint64_t first = op->offset/route_size;
+        uint64_t last = op->len ? (op->offset+op->len-1)/route_size : first;
+        if (first == last)
+        {
+            execute_in(route_owner(op->offset), op);
+            return;
+        }
+        nbd_split_t *st = new nbd_split_t{ .op = op, .pending = (int)(last-first+1), .retval = (int)op->len };
+        uint64_t pos = op->offset;
+        int iov_idx = 0;
+        uint64_t iov_pos = 0;
+        for (uint64_t unit = first; unit <= last; unit++)
+        {
+            uint64_t end = (unit+1)*route_size < op->offset+op->len ? (unit+1)*route_size : op->offset+op->len;
+            cluster_op_t *sop = new cluster_op_t;
+            sop->opcode = op->opcode;
+            sop->inode = op->inode;
+            sop->offset = pos;
+            sop->len = end-pos;
+            uint64_t left = sop->len;
+            while (op->opcode != OSD_OP_DELETE && left > 0 && iov_idx < op->iov.count)
+            {
+                iovec & iov = op->iov.buf[iov_idx];
+                uint64_t n = iov.iov_len-iov_pos < left ? iov.iov_len-iov_pos : left;
+                sop->iov.push_back((uint8_t*)iov.iov_base + iov_pos, n);
+                left -= n;
+                iov_pos += n;
+                if (iov_pos >= iov.iov_len)
+                {
+                    iov_idx++;
+                    iov_pos = 0;
+                }
+            }
+            sop->callback = [st](cluster_op_t *sop)
+            {
+                if (sop->retval < 0)
+                    st->retval = sop->retval;
+                delete sop;
+                if (!--st->pending)
+                {
+                    st->op->retval = st->retval;
+                    std::function<void(cluster_op_t*)>(st->op->callback)(st->op);
+                    delete st;
+                }
+            };
+            execute_in(route_owner(pos), sop);
+            pos = end;
+        }
+    }
+
+    nbd_conn_t *route_owner(uint64_t offset)
+    {
+        return (*conns)[(offset/route_size) % conns->size()];
+    }
+
+    // Execute <op> by the client of <owner> and complete it in this thread
+    void execute_in(nbd_conn_t *owner, cluster_op_t *op)
+    {
+        if (owner == this)
+        {
+            cli->execute(op);
+            return;
+        }
+        std::function<void(cluster_op_t*)> callback = op->callback;
+        op->callback = [this, callback](cluster_op_t *op)
+        {
+            post([op, callback]() { callback(op); });
+        };
+        owner->post([owner, op]() { owner->cli->execute(op); });
+    }
+
+    // A flush on one connection must also cover writes completed on other connections
+    // (NBD_FLAG_CAN_MULTI_CONN), so it's sent through the clients of all connections
+    void sync_all(cluster_op_t *op)
+    {
+        nbd_sync_all_t *st = new nbd_sync_all_t{ .op = op, .pending = (int)conns->size(), .retval = 0 };
+        for (auto conn: *conns)
+        {
+            cluster_op_t *sync = new cluster_op_t;
+            sync->opcode = OSD_OP_SYNC;
+            sync->callback = [this, st](cluster_op_t *sync)
+            {
+                int retval = sync->retval;
+                delete sync;
+                post([st, retval]()
+                {
+                    if (retval < 0 && !st->retval)
+                        st->retval = retval;
+                    if (!--st->pending)
+                    {
+                        st->op->retval = st->retval;
+                        std::function<void(cluster_op_t*)>(st->op->callback)(st->op);
+                        delete st;
+                    }
+                });
+            };
+            conn->post([conn, sync]() { conn->cli->execute(sync); });
+        }
+    }
+
+    void submit_send()
+    {
+        if (!send_list.size() || send_msg.msg_iovlen > 0)
+        {
+            return;
+        }
+        io_uring_sqe* sqe = ringloop->get_sqe();
+        if (!sqe)
+        {
+            return;
+        }
+        ring_data_t* data = ((ring_data_t*)sqe->user_data);
+        data->callback = [this](ring_data_t *data) { handle_send(data->res); };
+        send_msg.msg_iov = send_list.data();
+        send_msg.msg_iovlen = send_list.size();
+        my_uring_prep_sendmsg(sqe, nbd_fd, &send_msg, MSG_ZEROCOPY);
+    }
+
+    void handle_send(int result)
+    {
+        send_msg.msg_iovlen = 0;
+        if (result < 0 && result != -EAGAIN)
+        {
+            fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
+            exit(1);
+        }
+        int to_eat = 0;
+        while (result > 0 && to_eat < send_list.size())
+        {
+            if (result >= send_list[to_eat].iov_len)
+            {
+                free(to_free[to_eat]);
+                result -= send_list[to_eat].iov_len;
+                to_eat++;
+            }
+            else
+            {
+                send_list[to_eat].iov_base += result;
+                send_list[to_eat].iov_len -= result;
+                break;
+            }
+        }
+        if (to_eat > 0)
+        {
+            send_list.erase(send_list.begin(), send_list.begin() + to_eat);
+            to_free.erase(to_free.begin(), to_free.begin() + to_eat);
+        }
+        for (int i = 0; i < next_send_list.size(); i++)
+        {
+            send_list.push_back(next_send_list[i]);
+        }
+        next_send_list.clear();
+        if (send_list.size() > 0)
+        {
+            ringloop->wakeup();
+        }
+    }
+
+    void submit_read()
+    {
+        if (!read_ready || read_msg.msg_iovlen > 0)
+        {
+            return;
+        }
+        io_uring_sqe* sqe = ringloop->get_sqe();
+        if (!sqe)
+        {
+            return;
+        }
+        ring_data_t* data = ((ring_data_t*)sqe->user_data);
+        data->callback = [this](ring_data_t *data) { handle_read(data->res); };
+        if (cur_left < receive_buffer_size)
+        {
+            read_iov.iov_base = recv_buf;
+            read_iov.iov_len = receive_buffer_size;
+        }
+        else
+        {
+            read_iov.iov_base = cur_buf;
+            read_iov.iov_len = cur_left;
+        }
+        read_msg.msg_iov = &read_iov;
+        read_msg.msg_iovlen = 1;
+        my_uring_prep_recvmsg(sqe, nbd_fd, &read_msg, 0);
+    }
+
+    void handle_read(int result)
+    {
+        read_msg.msg_iovlen = 0;
+        if (result < 0 && result != -EAGAIN)
+        {
+            fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
+            exit(1);
+        }
+        if (result == -EAGAIN || result < read_iov.iov_len)
+        {
+            read_ready--;
+        }
+        if (read_ready > 0)
+        {
+            ringloop->wakeup();
+        }
+        void *b = recv_buf;
+        while (result > 0)
+        {
+            if (read_iov.iov_base == recv_buf)
+            {
+                int inc = result >= cur_left ? cur_left : result;
+                memcpy(cur_buf, b, inc);
+                cur_left -= inc;
+                result -= inc;
+                cur_buf += inc;
+                b += inc;
+            }
+            else
+            {
+                assert(result <= cur_left);
+                cur_left -= result;
+                result = 0;
+            }
+            if (cur_left <= 0)
+            {
+                handle_finished_read();
+            }
+        }
+    }
+
+    void handle_finished_read()
+    {
+        if (read_state == CL_READ_HDR)
+        {
+            // Command flags are in the upper 16 bits
+            int req_type = be32toh(cur_req.type) & 0xffff;
+            int req_flags = be32toh(cur_req.type) & ~0xffff;
+            if (be32toh(cur_req.magic) != NBD_REQUEST_MAGIC ||
+                req_type != NBD_CMD_READ && req_type != NBD_CMD_WRITE && req_type != NBD_CMD_FLUSH &&
+                req_type != NBD_CMD_TRIM && req_type != NBD_CMD_WRITE_ZEROES)
+            {
+                printf("Unexpected request: magic=%x type=%x, terminating\n", cur_req.magic, req_type);
+                exit(1);
+            }
+            uint64_t handle = *((uint64_t*)cur_req.handle);
+#ifdef DEBUG
+            printf("request %lx +%x %lx\n", be64toh(cur_req.from), be32toh(cur_req.len), handle);
+#endif
+            void *buf = NULL;
+            cluster_op_t *op = new cluster_op_t;
+            if (req_type == NBD_CMD_READ || req_type == NBD_CMD_WRITE)
+            {
+                op->opcode = req_type == NBD_CMD_READ ? OSD_OP_READ : OSD_OP_WRITE;
+                op->inode = inode ? inode : watch->cfg.num;
+                op->offset = be64toh(cur_req.from);
+                op->len = be32toh(cur_req.len);
+                buf = malloc_or_die(sizeof(nbd_reply) + op->len);
+                op->iov.push_back(buf + sizeof(nbd_reply), op->len);
+            }
+            else if (req_type == NBD_CMD_WRITE_ZEROES && (req_flags & NBD_CMD_FLAG_NO_HOLE))
+            {
+                // Space must stay allocated, so write real zeroes from the client's zero buffer
+                op->opcode = OSD_OP_WRITE;
+                op->inode = inode ? inode : watch->cfg.num;
+                op->offset = be64toh(cur_req.from);
+                op->len = be32toh(cur_req.len);
+                buf = malloc_or_die(sizeof(nbd_reply));
+                cli->push_zeroes(op->iov, op->len);
+            }
+            else if (req_type == NBD_CMD_TRIM || req_type == NBD_CMD_WRITE_ZEROES)
+            {
+                // Discarded ranges read back as zeroes, so both are discards
+                op->opcode = OSD_OP_DELETE;
+                op->inode = inode ? inode : watch->cfg.num;
+                op->offset = be64toh(cur_req.from);
+                op->len = be32toh(cur_req.len);
+                buf = malloc_or_die(sizeof(nbd_reply));
+            }
+            else if (req_type == NBD_CMD_FLUSH)
+            {
+                op->opcode = OSD_OP_SYNC;
+                buf = malloc_or_die(sizeof(nbd_reply));
+            }
+            op->callback = [this, buf, handle](cluster_op_t *op)
+            {
+#ifdef DEBUG
+                printf("reply %lx e=%d\n", handle, op->retval);
+#endif
+                nbd_reply *reply = (nbd_reply*)buf;
+                reply->magic = htobe32(NBD_REPLY_MAGIC);
+                memcpy(reply->handle, &handle, 8);
+                reply->error = htobe32(op->retval < 0 ? -op->retval : 0);
+                auto & to_list = send_msg.msg_iovlen > 0 ? next_send_list : send_list;
+                if (op->retval < 0 || op->opcode != OSD_OP_READ)
+                    to_list.push_back({ .iov_base = buf, .iov_len = sizeof(nbd_reply) });
+                else
+                    to_list.push_back({ .iov_base = buf, .iov_len = sizeof(nbd_reply) + op->len });
+                to_free.push_back(buf);
+                delete op;
+                ringloop->wakeup();
+            };
+            if (req_type == NBD_CMD_WRITE)
+            {
+                cur_op = op;
+                cur_buf = buf + sizeof(nbd_reply);
+                cur_left = op->len;
+                read_state = CL_READ_DATA;
+            }
+            else
+            {
+                cur_op = NULL;
+                cur_buf = &cur_req;
+                cur_left = sizeof(nbd_request);
+                read_state = CL_READ_HDR;
+                if (op->opcode != OSD_OP_READ && op->opcode != OSD_OP_SYNC && watch && watch->cfg.readonly)
+                {
+                    op->retval = -EROFS;
+                    std::function<void(cluster_op_t*)>(op->callback)(op);
+                }
+                else
+                {
+                    execute(op);
+                }
+            }
+        }
+        else
+        {
+            if (cur_op->opcode == OSD_OP_WRITE && watch && watch->cfg.readonly)
+            {
+                cur_op->retval = -EROFS;
+                std::function<void(cluster_op_t*)>(cur_op->callback)(cur_op);
+            }
+            else
+            {
+                execute(cur_op);
+            }
+            cur_op = NULL;
+            cur_buf = &cur_req;
+            cur_left = sizeof(nbd_request);
+            read_state = CL_READ_HDR;
+        }
+    }
+};
+
+class nbd_proxy
+{
+protected:
+    std::string image_name;
+    uint64_t inode = 0;
+    uint64_t device_size = 0;
+    std::vector<nbd_conn_t*> conns;
+    std::atomic<int> active { 0 };
+
 public:
     static json11::Json::object parse_args(int narg, const char *args[])
     {
@@ -117,9 +681,15 @@ public:
             "Vitastor NBD proxy\n"
             "(c) Vitaliy Filippov, 2020-2021 (VNPL-1.1)\n\n"
             "USAGE:\n"
-            "  %s map [--etcd_address <etcd_address>] (--image <image> | --pool <pool> --inode <inode> --size <size in bytes>)\n"
+            "  %s map [--etcd_address <etcd_address>] [--nbd_connections <N>] (--image <image> | --pool <pool> --inode <inode> --size <size in bytes>)\n"
             "  %s unmap /dev/nbd0\n"
-            "  %s list [--json]\n",
+            "  %s list [--json]\n"
+            "\n"
+            "Sequential reads may be sped up with client-side readahead: --client_readahead <max window in bytes>\n"
+            "--nbd_connections <N> (or --nbd-connections) serves the device through N connections, which the kernel\n"
+            "maps to N hardware queues, each served by a separate thread with its own cluster client.\n"
+            "Requests are routed between clients by offset, so each byte of the device is always written\n"
+            "by the same client. Client-side readahead and write-back are disabled with more than one connection\n",
             exe_name, exe_name, exe_name
         );
         exit(0);
@@ -174,37 +744,121 @@ public:
                 exit(1);
             }
         }
-        // Create client
-        ringloop = new ring_loop_t(512);
-        epmgr = new epoll_manager_t(ringloop);
-        cli = new cluster_client_t(ringloop, epmgr->tfd, cfg);
-        if (!inode)
+        json11::Json conn_cfg = cfg["nbd_connections"].is_null() ? cfg["nbd-connections"] : cfg["nbd_connections"];
+        int conn_count = conn_cfg.is_null() ? 1 : conn_cfg.int64_value();
+        if (conn_count < 1 || conn_count > MAX_NBD_CONNECTIONS)
+        {
+            fprintf(stderr, "nbd_connections must be between 1 and %d\n", MAX_NBD_CONNECTIONS);
+            exit(1);
+        }
+        if (conn_count > 1)
         {
-            // Load image metadata
+            // Each connection has its own cluster client and the kernel may send overlapping reads
+            // and writes through different connections, so client-side readahead and write-back
+            // buffers of one connection could return stale data. Disable them, overriding etcd config
+            json11::Json::object cfg_obj = cfg.object_items();
+            for (const char *opt: { "client_readahead", "client_writeback", "client_ec_writeback" })
+            {
+                if (!cfg_obj[opt].is_null())
+                {
+                    fprintf(stderr, "%s is not supported with nbd_connections > 1, disabling it\n", opt);
+                }
+                cfg_obj[opt] = !strcmp(opt, "client_readahead") ? json11::Json(0) : json11::Json(false);
+            }
+            cfg = cfg_obj;
+        }
+        // Create clients. Only the first one talks to etcd, others receive the same state from it
+        for (int i = 0; i < conn_count; i++)
+        {
+            nbd_conn_t *conn = new nbd_conn_t(&conns, cfg, i > 0);
+            conn->inode = inode;
+            conns.push_back(conn);
+        }
+        auto & leader = conns[0]->cli->st_cli;
+        leader.on_mirror_config_hook = [this](const json11::Json::object & global_config)
+        {
+            for (int i = 1; i < conns.size(); i++)
+            {
+                nbd_conn_t *conn = conns[i];
+                conn->post([conn, global_config]()
+                {
+                    json11::Json::object cfg = global_config;
+                    conn->cli->st_cli.mirror_config(cfg);
+                });
+            }
+        };
+        leader.on_mirror_state_hook = [this](const std::vector<etcd_kv_t> & kvs, bool initial)
+        {
+            for (int i = 1; i < conns.size(); i++)
+            {
+                nbd_conn_t *conn = conns[i];
+                conn->post([conn, kvs, initial]() { conn->cli->st_cli.mirror_state(kvs, initial); });
+            }
+        };
+        if (!inode || conn_count > 1)
+        {
+            // Load image metadata and pool configuration
+            cluster_client_t *cli = conns[0]->cli;
             while (!cli->is_ready())
             {
-                ringloop->loop();
+                conns[0]->ringloop->loop();
                 if (cli->is_ready())
                     break;
-                ringloop->wait();
+                conns[0]->ringloop->wait();
+            }
+            for (auto conn: conns)
+            {
+                // Threads aren't started yet, so the state is passed to other clients right here
+                if (conn != conns[0])
+                    conn->handle_posted();
+                if (!inode)
+                    conn->watch = conn->cli->st_cli.watch_inode(image_name);
+            }
+            if (!inode)
+                device_size = conns[0]->watch->cfg.size;
+        }
+        if (conn_count > 1)
+        {
+            // The route unit never changes, otherwise in-flight requests could be reordered
+            uint64_t pool_id = INODE_POOL(inode ? inode : conns[0]->watch->cfg.num);
+            auto pool_it = conns[0]->cli->st_cli.pool_config.find(pool_id);
+            if (pool_it == conns[0]->cli->st_cli.pool_config.end() || !pool_it->second.exists)
+            {
+                fprintf(stderr, "Pool %lu does not exist\n", pool_id);
+                exit(1);
+            }
+            auto & pool_cfg = pool_it->second;
+            uint64_t stripe = conns[0]->cli->get_bs_block_size() * (
+                pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
+            );
+            uint64_t route_size = stripe < NBD_ROUTE_SIZE ? stripe * (NBD_ROUTE_SIZE/stripe) : stripe;
+            active = conn_count;
+            for (auto conn: conns)
+            {
+                conn->route_size = route_size;
+                conn->active = &active;
             }
-            watch = cli->st_cli.watch_inode(image_name);
-            device_size = watch->cfg.size;
         }
         // Initialize NBD
-        int sockfd[2];
-        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd) < 0)
+        std::vector<int> sockfd;
+        for (int i = 0; i < conn_count; i++)
         {
-            perror("socketpair");
-            exit(1);
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+            {
+                perror("socketpair");
+                exit(1);
+            }
+            fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL, 0) | O_NONBLOCK);
+            sockfd.push_back(pair[0]);
+            sockfd.push_back(pair[1]);
         }
-        fcntl(sockfd[0], F_SETFL, fcntl(sockfd[0], F_GETFL, 0) | O_NONBLOCK);
-        nbd_fd = sockfd[0];
+        uint64_t flags = NBD_FLAGS | (conn_count > 1 ? NBD_FLAG_CAN_MULTI_CONN : 0);
         load_module();
         bool bg = cfg["foreground"].is_null();
         if (!cfg["dev_num"].is_null())
         {
-            if (run_nbd(sockfd, cfg["dev_num"].int64_value(), device_size, NBD_FLAG_SEND_FLUSH, 30, bg) < 0)
+            if (run_nbd(sockfd, cfg["dev_num"].int64_value(), device_size, flags, 30, bg) < 0)
             {
                 perror("run_nbd");
                 exit(1);
@@ -216,7 +870,7 @@ public:
             int i = 0;
             while (true)
             {
-                int r = run_nbd(sockfd, i, device_size, NBD_FLAG_SEND_FLUSH, 30, bg);
+                int r = run_nbd(sockfd, i, device_size, flags, 30, bg);
                 if (r == 0)
                 {
                     printf("/dev/nbd%d\n", i);
@@ -241,57 +895,33 @@ public:
         }
         if (bg)
         {
-            daemonize();
+            daemonize();
+        }
+        for (int i = 0; i < conn_count; i++)
+        {
+            conns[i]->start(sockfd[i*2]);
         }
-        // Initialize read state
-        read_state = CL_READ_HDR;
-        recv_buf = malloc_or_die(receive_buffer_size);
-        cur_buf = &cur_req;
-        cur_left = sizeof(nbd_request);
-        consumer.loop = [this]()
+        if (conn_count == 1)
         {
-            submit_read();
-            submit_send();
-            ringloop->submit();
-        };
-        ringloop->register_consumer(&consumer);
-        // Add FD to epoll
-        bool stop = false;
-        epmgr->tfd->set_fd_handler(sockfd[0], false, [this, &stop](int peer_fd, int epoll_events)
+            conns[0]->run();
+        }
+        else
         {
-            if (epoll_events & EPOLLRDHUP)
+            // Threads are started after daemonize() because fork() only keeps the calling thread
+            for (auto conn: conns)
             {
-                close(peer_fd);
-                stop = true;
+                conn->thread = std::thread([conn]() { conn->run(); });
             }
-            else
+            for (auto conn: conns)
             {
-                read_ready++;
-                submit_read();
+                conn->thread.join();
             }
-        });
-        while (!stop)
-        {
-            ringloop->loop();
-            ringloop->wait();
         }
-        stop = false;
-        cluster_op_t *close_sync = new cluster_op_t;
-        close_sync->opcode = OSD_OP_SYNC;
-        close_sync->callback = [this, &stop](cluster_op_t *op)
-        {
-            stop = true;
-            delete op;
-        };
-        cli->execute(close_sync);
-        while (!stop)
+        for (auto conn: conns)
         {
-            ringloop->loop();
-            ringloop->wait();
+            delete conn;
         }
-        delete cli;
-        delete epmgr;
-        delete ringloop;
+        conns.clear();
     }
 
     void load_module()
@@ -438,10 +1068,11 @@ public:
     }
 
 protected:
-    int run_nbd(int sockfd[2], int dev_num, uint64_t size, uint64_t flags, unsigned timeout, bool bg)
+    // sockfd contains pairs of sockets: (ours, kernel's) for each connection
+    int run_nbd(std::vector<int> & sockfd, int dev_num, uint64_t size, uint64_t flags, unsigned timeout, bool bg)
     {
         // Check handle size
-        assert(sizeof(cur_req.handle) == 8);
+        assert(sizeof(nbd_request::handle) == 8);
         char path[64] = { 0 };
         sprintf(path, "/dev/nbd%d", dev_num);
         int r, nbd = open(path, O_RDWR), qd_fd;
@@ -454,6 +1085,15 @@ protected:
         {
             goto end_close;
         }
+        for (int i = 3; i < sockfd.size(); i += 2)
+        {
+            // Each NBD_SET_SOCK adds a connection
+            r = ioctl(nbd, NBD_SET_SOCK, sockfd[i]);
+            if (r < 0)
+            {
+                goto end_unmap;
+            }
+        }
         r = ioctl(nbd, NBD_SET_BLKSIZE, 4096);
         if (r < 0)
         {
@@ -485,7 +1125,10 @@ protected:
         if (!fork())
         {
             // Run in child
-            close(sockfd[0]);
+            for (int i = 0; i < sockfd.size(); i += 2)
+            {
+                close(sockfd[i]);
+            }
             if (bg)
             {
                 daemonize();
@@ -495,12 +1138,18 @@ protected:
             {
                 fprintf(stderr, "NBD device terminated with error: %s\n", strerror(errno));
             }
-            close(sockfd[1]);
+            for (int i = 1; i < sockfd.size(); i += 2)
+            {
+                close(sockfd[i]);
+            }
             ioctl(nbd, NBD_CLEAR_QUE);
             ioctl(nbd, NBD_CLEAR_SOCK);
             exit(0);
         }
-        close(sockfd[1]);
+        for (int i = 1; i < sockfd.size(); i += 2)
+        {
+            close(sockfd[i]);
+        }
         close(nbd);
         return 0;
     end_close:
@@ -516,215 +1165,6 @@ protected:
         return -3;
     }
 
-    void submit_send()
-    {
-        if (!send_list.size() || send_msg.msg_iovlen > 0)
-        {
-            return;
-        }
-        io_uring_sqe* sqe = ringloop->get_sqe();
-        if (!sqe)
-        {
-            return;
-        }
-        ring_data_t* data = ((ring_data_t*)sqe->user_data);
-        data->callback = [this](ring_data_t *data) { handle_send(data->res); };
-        send_msg.msg_iov = send_list.data();
-        send_msg.msg_iovlen = send_list.size();
-        my_uring_prep_sendmsg(sqe, nbd_fd, &send_msg, MSG_ZEROCOPY);
-    }
-
-    void handle_send(int result)
-    {
-        send_msg.msg_iovlen = 0;
-        if (result < 0 && result != -EAGAIN)
-        {
-            fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
-            exit(1);
-        }
-        int to_eat = 0;
-        while (result > 0 && to_eat < send_list.size())
-        {
-            if (result >= send_list[to_eat].iov_len)
-            {
-                free(to_free[to_eat]);
-                result -= send_list[to_eat].iov_len;
-                to_eat++;
-            }
-            else
-            {
-                send_list[to_eat].iov_base += result;
-                send_list[to_eat].iov_len -= result;
-                break;
-            }
-        }
-        if (to_eat > 0)
-        {
-            send_list.erase(send_list.begin(), send_list.begin() + to_eat);
-            to_free.erase(to_free.begin(), to_free.begin() + to_eat);
-        }
-        for (int i = 0; i < next_send_list.size(); i++)
-        {
-            send_list.push_back(next_send_list[i]);
-        }
-        next_send_list.clear();
-        if (send_list.size() > 0)
-        {
-            ringloop->wakeup();
-        }
-    }
-
-    void submit_read()
-    {
-        if (!read_ready || read_msg.msg_iovlen > 0)
-        {
-            return;
-        }
-        io_uring_sqe* sqe = ringloop->get_sqe();
-        if (!sqe)
-        {
-            return;
-        }
-        ring_data_t* data = ((ring_data_t*)sqe->user_data);
-        data->callback = [this](ring_data_t *data) { handle_read(data->res); };
-        if (cur_left < receive_buffer_size)
-        {
-            read_iov.iov_base = recv_buf;
-            read_iov.iov_len = receive_buffer_size;
-        }
-        else
-        {
-            read_iov.iov_base = cur_buf;
-            read_iov.iov_len = cur_left;
-        }
-        read_msg.msg_iov = &read_iov;
-        read_msg.msg_iovlen = 1;
-        my_uring_prep_recvmsg(sqe, nbd_fd, &read_msg, 0);
-    }
-
-    void handle_read(int result)
-    {
-        read_msg.msg_iovlen = 0;
-        if (result < 0 && result != -EAGAIN)
-        {
-            fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
-            exit(1);
-        }
-        if (result == -EAGAIN || result < read_iov.iov_len)
-        {
-            read_ready--;
-        }
-        if (read_ready > 0)
-        {
-            ringloop->wakeup();
-        }
-        void *b = recv_buf;
-        while (result > 0)
-        {
-            if (read_iov.iov_base == recv_buf)
-            {
-                int inc = result >= cur_left ? cur_left : result;
-                memcpy(cur_buf, b, inc);
-                cur_left -= inc;
-                result -= inc;
-                cur_buf += inc;
-                b += inc;
-            }
-            else
-            {
-                assert(result <= cur_left);
-                cur_left -= result;
-                result = 0;
-            }
-            if (cur_left <= 0)
-            {
-                handle_finished_read();
-            }
-        }
-    }
-
-    void handle_finished_read()
-    {
-        if (read_state == CL_READ_HDR)
-        {
-            int req_type = be32toh(cur_req.type);
-            if (be32toh(cur_req.magic) != NBD_REQUEST_MAGIC ||
-                req_type != NBD_CMD_READ && req_type != NBD_CMD_WRITE && req_type != NBD_CMD_FLUSH)
-            {
-                printf("Unexpected request: magic=%x type=%x, terminating\n", cur_req.magic, req_type);
-                exit(1);
-            }
-            uint64_t handle = *((uint64_t*)cur_req.handle);
-#ifdef DEBUG
-            printf("request %lx +%x %lx\n", be64toh(cur_req.from), be32toh(cur_req.len), handle);
-#endif
-            void *buf = NULL;
-            cluster_op_t *op = new cluster_op_t;
-            if (req_type == NBD_CMD_READ || req_type == NBD_CMD_WRITE)
-            {
-                op->opcode = req_type == NBD_CMD_READ ? OSD_OP_READ : OSD_OP_WRITE;
-                op->inode = inode ? inode : watch->cfg.num;
-                op->offset = be64toh(cur_req.from);
-                op->len = be32toh(cur_req.len);
-                buf = malloc_or_die(sizeof(nbd_reply) + op->len);
-                op->iov.push_back(buf + sizeof(nbd_reply), op->len);
-            }
-            else if (req_type == NBD_CMD_FLUSH)
-            {
-                op->opcode = OSD_OP_SYNC;
-                buf = malloc_or_die(sizeof(nbd_reply));
-            }
-            op->callback = [this, buf, handle](cluster_op_t *op)
-            {
-#ifdef DEBUG
-                printf("reply %lx e=%d\n", handle, op->retval);
-#endif
-                nbd_reply *reply = (nbd_reply*)buf;
-                reply->magic = htobe32(NBD_REPLY_MAGIC);
-                memcpy(reply->handle, &handle, 8);
-                reply->error = htobe32(op->retval < 0 ? -op->retval : 0);
-                auto & to_list = send_msg.msg_iovlen > 0 ? next_send_list : send_list;
-                if (op->retval < 0 || op->opcode != OSD_OP_READ)
-                    to_list.push_back({ .iov_base = buf, .iov_len = sizeof(nbd_reply) });
-                else
-                    to_list.push_back({ .iov_base = buf, .iov_len = sizeof(nbd_reply) + op->len });
-                to_free.push_back(buf);
-                delete op;
-                ringloop->wakeup();
-            };
-            if (req_type == NBD_CMD_WRITE)
-            {
-                cur_op = op;
-                cur_buf = buf + sizeof(nbd_reply);
-                cur_left = op->len;
-                read_state = CL_READ_DATA;
-            }
-            else
-            {
-                cur_op = NULL;
-                cur_buf = &cur_req;
-                cur_left = sizeof(nbd_request);
-                read_state = CL_READ_HDR;
-                cli->execute(op);
-            }
-        }
-        else
-        {
-            if (cur_op->opcode == OSD_OP_WRITE && watch->cfg.readonly)
-            {
-                cur_op->retval = -EROFS;
-                std::function<void(cluster_op_t*)>(cur_op->callback)(cur_op);
-            }
-            else
-            {
-                cli->execute(cur_op);
-            }
-            cur_op = NULL;
-            cur_buf = &cur_req;
-            cur_left = sizeof(nbd_request);
-            read_state = CL_READ_HDR;
-        }
-    }
 };
 
 int main(int narg, const char *args[])
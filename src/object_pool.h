@@ -0,0 +1,143 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Per-thread freelists for hot operation objects (osd_op_t, cluster_op_t, blockstore_op_t)
+// and their variable-size companion buffers (primary operation data).
+// Freed memory is kept for reuse, up to OBJECT_POOL_MAX_FREE items per object type or size class.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "malloc_or_die.h"
+
+#define OBJECT_POOL_MAX_FREE 1024
+#define OBJECT_POOL_CLASS_SIZE 256
+#define OBJECT_POOL_CLASS_COUNT 16
+// Keeps 16-byte alignment of the returned buffer
+#define OBJECT_POOL_HEADER_SIZE 16
+
+struct object_pool_item_t
+{
+    object_pool_item_t *next;
+};
+
+struct object_pool_list_t
+{
+    object_pool_item_t *head = NULL;
+    int count = 0;
+
+    ~object_pool_list_t()
+    {
+        while (head)
+        {
+            object_pool_item_t *next = head->next;
+            free(head);
+            head = next;
+        }
+    }
+
+    inline void *pop()
+    {
+        object_pool_item_t *item = head;
+        head = item->next;
+        count--;
+        return item;
+    }
+
+    inline bool push(void *ptr)
+    {
+        if (count >= OBJECT_POOL_MAX_FREE)
+        {
+            return false;
+        }
+        object_pool_item_t *item = (object_pool_item_t*)ptr;
+        item->next = head;
+        head = item;
+        count++;
+        return true;
+    }
+};
+
+// Allocation counters of the current thread
+struct object_pool_stats_t
+{
+    uint64_t reused = 0, allocated = 0;
+};
+
+inline object_pool_stats_t & object_pool_stats()
+{
+    static thread_local object_pool_stats_t stats;
+    return stats;
+}
+
+// Used through class-specific operator new and delete:
+// static void *operator new(size_t size) { return object_pool_t<T>::alloc(size); }
+// static void operator delete(void *ptr, size_t size) { object_pool_t<T>::release(ptr, size); }
+template<class T> struct object_pool_t
+{
+    static inline object_pool_list_t & list()
+    {
+        static thread_local object_pool_list_t list;
+        return list;
+    }
+
+    static inline void *alloc(size_t size)
+    {
+        object_pool_list_t & l = list();
+        if (size == sizeof(T) && l.head)
+        {
+            object_pool_stats().reused++;
+            return l.pop();
+        }
+        object_pool_stats().allocated++;
+        return malloc_or_die(size < sizeof(object_pool_item_t) ? sizeof(object_pool_item_t) : size);
+    }
+
+    static inline void release(void *ptr, size_t size)
+    {
+        if (size != sizeof(T) || !list().push(ptr))
+        {
+            free(ptr);
+        }
+    }
+};
+
+// Zero-filled buffer, reused from per-thread size classes of OBJECT_POOL_CLASS_SIZE bytes
+// if it's small enough. Must be freed with pool_free()
+inline object_pool_list_t *pool_size_classes()
+{
+    static thread_local object_pool_list_t classes[OBJECT_POOL_CLASS_COUNT];
+    return classes;
+}
+
+inline void *pool_calloc(size_t size)
+{
+    uint64_t size_class = (size + OBJECT_POOL_HEADER_SIZE + OBJECT_POOL_CLASS_SIZE - 1) / OBJECT_POOL_CLASS_SIZE;
+    void *buf;
+    if (size_class <= OBJECT_POOL_CLASS_COUNT && pool_size_classes()[size_class-1].head)
+    {
+        object_pool_stats().reused++;
+        buf = pool_size_classes()[size_class-1].pop();
+    }
+    else
+    {
+        object_pool_stats().allocated++;
+        buf = malloc_or_die(size_class <= OBJECT_POOL_CLASS_COUNT
+            ? size_class*OBJECT_POOL_CLASS_SIZE : size + OBJECT_POOL_HEADER_SIZE);
+    }
+    *(uint64_t*)buf = size_class;
+    memset(buf + OBJECT_POOL_HEADER_SIZE, 0, size);
+    return buf + OBJECT_POOL_HEADER_SIZE;
+}
+
+inline void pool_free(void *ptr)
+{
+    void *buf = ptr - OBJECT_POOL_HEADER_SIZE;
+    uint64_t size_class = *(uint64_t*)buf;
+    if (size_class > OBJECT_POOL_CLASS_COUNT || !pool_size_classes()[size_class-1].push(buf))
+    {
+        free(buf);
+    }
+}
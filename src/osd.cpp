@@ -3,11 +3,13 @@
 
 #include <sys/socket.h>
 #include <sys/poll.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "osd.h"
+#include "osd_rmw.h"
 #include "http_client.h"
 
 static blockstore_config_t json_to_bs(const json11::Json::object & config)
@@ -68,9 +70,19 @@ osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
 osd_t::~osd_t()
 {
     ringloop->unregister_consumer(&consumer);
+    if (deferred_stab_timer_id)
+    {
+        tfd->clear_timer(deferred_stab_timer_id);
+        deferred_stab_timer_id = 0;
+    }
     delete epmgr;
     delete bs;
     close(listen_fd);
+    if (unix_listen_fd >= 0)
+    {
+        close(unix_listen_fd);
+        unlink(unix_socket_path.c_str());
+    }
     free(zero_buffer);
 }
 
@@ -98,6 +110,10 @@ void osd_t::parse_config(const json11::Json & config)
     bind_port = config["bind_port"].uint64_value();
     if (bind_port <= 0 || bind_port > 65535)
         bind_port = 0;
+    // Unix socket for clients and OSDs on the same host, disabled by default
+    unix_socket_path = config["osd_unix_socket"].string_value();
+    if (unix_socket_path == "false" || unix_socket_path == "0" || unix_socket_path == "no")
+        unix_socket_path = "";
     // OSD configuration
     log_level = config["log_level"].uint64_value();
     etcd_report_interval = config["etcd_report_interval"].uint64_value();
@@ -114,6 +130,14 @@ void osd_t::parse_config(const json11::Json & config)
         immediate_commit = IMMEDIATE_SMALL;
     else
         immediate_commit = IMMEDIATE_NONE;
+    write_sync_on_pending_sync = config["write_sync_on_pending_sync"] == "true" ||
+        config["write_sync_on_pending_sync"] == "1" || config["write_sync_on_pending_sync"] == "yes";
+    disabled_features = config["disabled_features"].uint64_value();
+    msgr.features = OSD_FEATURES & ~disabled_features;
+    chain_replication = config["chain_replication"] == "true" || config["chain_replication"] == "1" || config["chain_replication"] == "yes";
+    replica_reads = config["replica_reads"] == "true" || config["replica_reads"] == "1" || config["replica_reads"] == "yes";
+    // Stabilize lists are piggybacked on later writes or syncs only if this is set, 0 disables it
+    stab_piggyback_delay = config["stab_piggyback_delay"].uint64_value();
     if (!config["autosync_interval"].is_null())
     {
         // Allow to set it to 0
@@ -139,6 +163,8 @@ void osd_t::parse_config(const json11::Json & config)
     slow_log_interval = config["slow_log_interval"].uint64_value();
     if (!slow_log_interval)
         slow_log_interval = 10;
+    // Jerasure is only used as a fallback for the built-in EC implementation
+    use_ec_native(config["ec_native"] != "false" && config["ec_native"] != "0" && config["ec_native"] != "no");
 }
 
 void osd_t::bind_socket()
@@ -193,6 +219,90 @@ void osd_t::bind_socket()
     {
         msgr.accept_connections(listen_fd);
     });
+
+    bind_unix_socket();
+}
+
+// Remove the socket left by a previous run, but only if it's really a socket and nobody listens on it
+static bool remove_stale_unix_socket(const sockaddr_un & addr)
+{
+    struct stat st;
+    if (lstat(addr.sun_path, &st) < 0)
+    {
+        if (errno == ENOENT)
+            return true;
+        fprintf(stderr, "Failed to stat unix socket %s: %s\n", addr.sun_path, strerror(errno));
+        return false;
+    }
+    if (!S_ISSOCK(st.st_mode))
+    {
+        fprintf(stderr, "%s exists and is not a socket, not listening on it\n", addr.sun_path);
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    }
+    int r = connect(fd, (sockaddr*)&addr, sizeof(addr));
+    int err = errno;
+    close(fd);
+    if (r == 0)
+    {
+        fprintf(stderr, "Unix socket %s is used by another process, not listening on it\n", addr.sun_path);
+        return false;
+    }
+    if (err != ECONNREFUSED)
+    {
+        fprintf(stderr, "Failed to check unix socket %s: %s\n", addr.sun_path, strerror(err));
+        return false;
+    }
+    unlink(addr.sun_path);
+    return true;
+}
+
+// Local clients connect to the Unix socket instead of TCP loopback when the OSD reports
+// the same hostname, see osd_messenger_t::connect_peer(). Failure to bind it isn't fatal
+void osd_t::bind_unix_socket()
+{
+    if (unix_socket_path == "" || unix_listen_fd >= 0)
+    {
+        return;
+    }
+    sockaddr_un addr = { 0 };
+    if (unix_socket_path.size() >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Unix socket path %s is too long, not listening on it\n", unix_socket_path.c_str());
+        unix_socket_path = "";
+        return;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, unix_socket_path.c_str());
+    unix_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unix_listen_fd < 0)
+    {
+        throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    }
+    if (!remove_stale_unix_socket(addr))
+    {
+        close(unix_listen_fd);
+        unix_listen_fd = -1;
+        unix_socket_path = "";
+        return;
+    }
+    if (bind(unix_listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(unix_listen_fd, listen_backlog) < 0)
+    {
+        fprintf(stderr, "Failed to listen on unix socket %s: %s\n", unix_socket_path.c_str(), strerror(errno));
+        close(unix_listen_fd);
+        unix_listen_fd = -1;
+        unix_socket_path = "";
+        return;
+    }
+    fcntl(unix_listen_fd, F_SETFL, fcntl(unix_listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    epmgr->set_fd_handler(unix_listen_fd, false, [this](int fd, int events)
+    {
+        msgr.accept_connections(unix_listen_fd);
+    });
 }
 
 bool osd_t::shutdown()
@@ -255,7 +365,8 @@ void osd_t::exec_op(osd_op_t *cur_op)
         cur_op->req.hdr.opcode != OSD_OP_SEC_LIST &&
         cur_op->req.hdr.opcode != OSD_OP_READ &&
         cur_op->req.hdr.opcode != OSD_OP_SEC_READ_BMP &&
-        cur_op->req.hdr.opcode != OSD_OP_SHOW_CONFIG)
+        cur_op->req.hdr.opcode != OSD_OP_SHOW_CONFIG &&
+        cur_op->req.hdr.opcode != OSD_OP_BATCH)
     {
         // Readonly mode
         finish_op(cur_op, -EROFS);
@@ -285,6 +396,10 @@ void osd_t::exec_op(osd_op_t *cur_op)
     {
         continue_primary_del(cur_op);
     }
+    else if (cur_op->req.hdr.opcode == OSD_OP_BATCH)
+    {
+        exec_batch(cur_op);
+    }
     else
     {
         exec_secondary(cur_op);
@@ -349,6 +464,15 @@ void osd_t::print_stats()
             recovery_stat_bytes[1][i] = recovery_stat_bytes[0][i];
         }
     }
+    object_pool_stats_t & pool_stats = object_pool_stats();
+    if (log_level > 0 && pool_stats.allocated+pool_stats.reused != prev_pool_stats.allocated+prev_pool_stats.reused)
+    {
+        printf(
+            "[OSD %lu] operation objects: %lu reused, %lu allocated\n", osd_num,
+            pool_stats.reused-prev_pool_stats.reused, pool_stats.allocated-prev_pool_stats.allocated
+        );
+        prev_pool_stats = pool_stats;
+    }
     if (incomplete_objects > 0)
     {
         printf("[OSD %lu] %lu object(s) incomplete\n", osd_num, incomplete_objects);
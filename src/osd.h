@@ -102,12 +102,20 @@ class osd_t
     bool no_recovery = false;
     std::string bind_address;
     int bind_port, listen_backlog;
+    // Unix socket for clients and OSDs running on the same host, empty = disabled
+    std::string unix_socket_path;
     // FIXME: Implement client queue depth limit
     int client_queue_depth = 128;
     bool allow_test_ops = false;
     int print_stats_interval = 3;
     int slow_log_interval = 10;
     int immediate_commit = IMMEDIATE_NONE;
+    bool write_sync_on_pending_sync = false;
+    // OSD_FEATURE_* not reported to peers, to test compatibility with older OSDs
+    uint64_t disabled_features = 0;
+    int stab_piggyback_delay = 0;
+    bool replica_reads = false;
+    bool chain_replication = false;
     int autosync_interval = DEFAULT_AUTOSYNC_INTERVAL; // sync every 5 seconds
     int recovery_queue_depth = DEFAULT_RECOVERY_QUEUE;
     int recovery_sync_batch = DEFAULT_RECOVERY_BATCH;
@@ -132,6 +140,10 @@ class osd_t
     std::map<pool_pg_num_t, pg_t> pgs;
     std::set<pool_pg_num_t> dirty_pgs;
     std::set<osd_num_t> dirty_osds;
+    // Connections with non-empty dirty_pgs, entries of closed connections are removed lazily
+    std::set<int> dirty_client_fds;
+    // Number of completed primary writes, a SYNC covers all writes completed before it starts
+    uint64_t primary_write_seq = 0;
     int copies_to_delete_after_sync_count = 0;
     uint64_t misplaced_objects = 0, degraded_objects = 0, incomplete_objects = 0;
     int peering_state = 0;
@@ -142,6 +154,9 @@ class osd_t
     // Unstable writes
     std::map<osd_object_id_t, uint64_t> unstable_writes;
     std::deque<osd_op_t*> syncs_in_progress;
+    // Synced versions waiting to be stabilized along with the next write or sync to the same peer
+    std::map<osd_object_id_t, uint64_t> deferred_stab;
+    int deferred_stab_timer_id = 0;
 
     // client & peer I/O
 
@@ -149,6 +164,9 @@ class osd_t
     int inflight_ops = 0;
     blockstore_t *bs;
     void *zero_buffer = NULL;
+    // Local read queue and moving average latency, used to balance reads between replicas
+    int local_reads_inflight = 0;
+    uint64_t local_read_lat_us = 0;
     uint64_t zero_buffer_size = 0;
     uint32_t bs_block_size, bs_bitmap_granularity, clean_entry_bitmap_size;
     ring_loop_t *ringloop;
@@ -157,10 +175,12 @@ class osd_t
 
     int listening_port = 0;
     int listen_fd = 0;
+    int unix_listen_fd = -1;
     ring_consumer_t consumer;
 
     // op statistics
     osd_op_stats_t prev_stats;
+    object_pool_stats_t prev_pool_stats;
     std::map<uint64_t, inode_stats_t> inode_stats;
     const char* recovery_stat_names[2] = { "degraded", "misplaced" };
     uint64_t recovery_stat_count[2][2] = { 0 };
@@ -176,6 +196,7 @@ class osd_t
     json11::Json on_load_pgs_checks_hook();
     void on_load_pgs_hook(bool success);
     void bind_socket();
+    void bind_unix_socket();
     void acquire_lease();
     json11::Json get_osd_state();
     void create_osd_state();
@@ -223,6 +244,9 @@ class osd_t
     void exec_show_config(osd_op_t *cur_op);
     void exec_secondary(osd_op_t *cur_op);
     void secondary_op_callback(osd_op_t *cur_op);
+    void enqueue_write_sync(blockstore_op_t *bs_op);
+    void enqueue_piggyback_stab(blockstore_op_t *bs_op, void *stab_buf, uint64_t stab_len);
+    void forward_secondary_write(osd_op_t *cur_op);
 
     // primary ops
     void autosync();
@@ -232,7 +256,13 @@ class osd_t
     void cancel_primary_write(osd_op_t *cur_op);
     void continue_primary_sync(osd_op_t *cur_op);
     void continue_primary_del(osd_op_t *cur_op);
+    void exec_batch(osd_op_t *cur_op);
+    void finish_batch_item(osd_op_t *cur_op, uint64_t i, osd_op_t *sub);
     bool check_write_queue(osd_op_t *cur_op, pg_t & pg);
+    bool use_write_sync(pg_t & pg);
+    osd_num_t pick_read_replica(pg_t & pg);
+    bool use_chain_write(const uint64_t* osd_set, int pg_size);
+    void handle_chain_write_reply(osd_op_t *head, osd_op_t *cur_op, int chain_head, int chain_len);
     void remove_object_from_state(object_id & oid, pg_osd_set_state_t *object_state, pg_t &pg);
     void free_object_state(pg_t & pg, pg_osd_set_state_t **object_state);
     bool remember_unstable_write(osd_op_t *cur_op, pg_t & pg, pg_osd_set_t & loc_set, int base_state);
@@ -248,6 +278,9 @@ class osd_t
     void submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_delete, int chunks_to_delete_count);
     int submit_primary_sync_subops(osd_op_t *cur_op);
     void submit_primary_stab_subops(osd_op_t *cur_op);
+    void defer_primary_stab(osd_primary_op_data_t *op_data);
+    uint64_t attach_deferred_stab(osd_num_t peer_osd, osd_op_t *subop);
+    void flush_deferred_stab();
 
     uint64_t* get_object_osd_set(pg_t &pg, object_id &oid, uint64_t *def, pg_osd_set_state_t **object_state);
 
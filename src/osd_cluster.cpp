@@ -122,6 +122,8 @@ json11::Json osd_t::get_osd_state()
         st["addresses"] = getifaddr_list();
     st["host"] = std::string(hostname.data(), hostname.size());
     st["port"] = listening_port;
+    if (unix_socket_path != "")
+        st["unix_socket"] = unix_socket_path;
     st["primary_enabled"] = run_primary;
     st["blockstore_enabled"] = bs ? true : false;
     return st;
@@ -29,13 +29,28 @@
 #define OSD_OP_DELETE               14
 #define OSD_OP_PING                 15
 #define OSD_OP_SEC_READ_BMP         16
-#define OSD_OP_MAX                  16
+#define OSD_OP_BATCH                17
+#define OSD_OP_MAX                  17
 // Alignment & limit for read/write operations
 #ifndef MEM_ALIGNMENT
 #define MEM_ALIGNMENT               512
 #endif
 #define OSD_RW_MAX                  64*1024*1024
 #define OSD_PROTOCOL_VERSION        1
+// Limits for batched primary reads/writes (OSD_OP_BATCH)
+#define OSD_BATCH_MAX_OPS           256
+#define OSD_BATCH_MAX_LEN           128*1024
+// Optional protocol features, reported in OSD_OP_SHOW_CONFIG reply as "features"
+#define OSD_FEATURE_WRITE_SYNC      1
+#define OSD_FEATURE_STAB_PIGGYBACK  2
+#define OSD_FEATURE_WRITE_FORWARD   4
+#define OSD_FEATURE_BATCH           8
+#define OSD_FEATURES                (OSD_FEATURE_WRITE_SYNC | OSD_FEATURE_STAB_PIGGYBACK | OSD_FEATURE_WRITE_FORWARD | OSD_FEATURE_BATCH)
+// Secondary read/write flags
+// Write is durable on completion (blockstore is synced before replying)
+#define OSD_SEC_RW_SYNC             1
+// Maximum number of OSDs a secondary write may be forwarded through (chain replication)
+#define OSD_SEC_RW_MAX_FORWARD      6
 
 // common request and reply headers
 struct __attribute__((__packed__)) osd_op_header_t
@@ -75,9 +90,19 @@ struct __attribute__((__packed__)) osd_op_sec_rw_t
     uint32_t len;
     // bitmap/attribute length - bitmap comes after header, but before data
     uint32_t attr_len;
-    uint32_t pad0;
+    // flags (OSD_SEC_RW_*), only valid if the peer supports OSD_FEATURE_WRITE_SYNC
+    uint32_t flags;
+    // for writes: length in bytes of the obj_ver_id array to stabilize, which comes after data
+    // only valid if the peer supports OSD_FEATURE_STAB_PIGGYBACK
+    uint64_t stab_len;
+    // for writes: OSDs to pass the write to after this one, 0-terminated (chain replication)
+    // only valid if the peer supports OSD_FEATURE_WRITE_FORWARD
+    osd_num_t forward_to[OSD_SEC_RW_MAX_FORWARD];
 };
 
+// forward_to must still fit into the fixed-size request header
+static_assert(sizeof(osd_op_sec_rw_t) <= OSD_PACKET_SIZE, "osd_op_sec_rw_t is larger than OSD_PACKET_SIZE");
+
 struct __attribute__((__packed__)) osd_reply_sec_rw_t
 {
     osd_reply_header_t header;
@@ -85,7 +110,8 @@ struct __attribute__((__packed__)) osd_reply_sec_rw_t
     uint64_t version;
     // for reads: bitmap/attribute length (just to double-check)
     uint32_t attr_len;
-    uint32_t pad0;
+    // for forwarded writes: number of OSDs which have written the data, including this one
+    uint32_t write_count;
 };
 
 // delete object on the secondary OSD
@@ -108,6 +134,9 @@ struct __attribute__((__packed__)) osd_reply_sec_del_t
 struct __attribute__((__packed__)) osd_op_sec_sync_t
 {
     osd_op_header_t header;
+    // length in bytes of the obj_ver_id array to stabilize after syncing, which comes after header
+    // only valid if the peer supports OSD_FEATURE_STAB_PIGGYBACK
+    uint64_t stab_len;
 };
 
 struct __attribute__((__packed__)) osd_reply_sec_sync_t
@@ -217,6 +246,46 @@ struct __attribute__((__packed__)) osd_reply_sync_t
     osd_reply_header_t header;
 };
 
+// batch of small reads and writes to the primary OSD, executed independently of each other.
+// followed by <count> osd_op_batch_item_t and then by data of all writes in the same order
+struct __attribute__((__packed__)) osd_op_batch_t
+{
+    osd_op_header_t header;
+    // number of operations, at most OSD_BATCH_MAX_OPS
+    uint64_t count;
+    // total length of write data
+    uint64_t data_len;
+};
+
+struct __attribute__((__packed__)) osd_op_batch_item_t
+{
+    // OSD_OP_READ or OSD_OP_WRITE, other fields are the same as in osd_op_rw_t
+    uint64_t opcode;
+    uint64_t inode;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t flags;
+    uint64_t meta_revision;
+    uint64_t version;
+};
+
+// followed by <count> osd_reply_batch_item_t and then by bitmap and data of all successful reads.
+// header.retval < 0 means that the whole batch failed and items don't follow
+struct __attribute__((__packed__)) osd_reply_batch_t
+{
+    osd_reply_header_t header;
+    uint64_t count;
+};
+
+struct __attribute__((__packed__)) osd_reply_batch_item_t
+{
+    // the same as in osd_reply_rw_t
+    int64_t retval;
+    uint32_t bitmap_len;
+    uint32_t pad0;
+    uint64_t version;
+};
+
 // FIXME it would be interesting to try to unify blockstore_op and osd_op formats
 union osd_any_op_t
 {
@@ -230,6 +299,7 @@ union osd_any_op_t
     osd_op_show_config_t show_conf;
     osd_op_rw_t rw;
     osd_op_sync_t sync;
+    osd_op_batch_t batch;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
@@ -245,6 +315,7 @@ union osd_any_reply_t
     osd_reply_show_config_t show_conf;
     osd_reply_rw_t rw;
     osd_reply_sync_t sync;
+    osd_reply_batch_t batch;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
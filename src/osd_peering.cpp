@@ -142,6 +142,14 @@ void osd_t::reset_pg(pg_t & pg)
         else
             it++;
     }
+    for (auto it = deferred_stab.begin(); it != deferred_stab.end(); )
+    {
+        // And its versions waiting for piggybacked stabilization, peering will handle them
+        if (INODE_POOL(it->first.oid.inode) == pg.pool_id && map_to_pg(it->first.oid, pg_stripe_size) == pg.pg_num)
+            deferred_stab.erase(it++);
+        else
+            it++;
+    }
     dirty_pgs.erase({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
 }
 
@@ -325,7 +333,7 @@ void osd_t::submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *p
     else
     {
         // Peer
-        auto & cl = msgr.clients.at(msgr.osd_peer_fds[role_osd]);
+        auto cl = msgr.clients.at(msgr.osd_peer_fds[role_osd]);
         osd_op_t *op = new osd_op_t();
         op->op_type = OSD_OP_OUT;
         op->peer_fd = cl->peer_fd;
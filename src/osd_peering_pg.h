@@ -114,6 +114,7 @@ struct pg_t
     pg_flush_batch_t *flush_batch = NULL;
 
     int inflight = 0; // including write_queue
+    int inflight_syncs = 0; // primary SYNCs covering this PG
     std::multimap<object_id, osd_op_t*> write_queue;
 
     void calc_object_states(int log_level);
@@ -80,10 +80,10 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
             chain_size++;
         }
     }
-    osd_primary_op_data_t *op_data = (osd_primary_op_data_t*)calloc_or_die(
+    osd_primary_op_data_t *op_data = (osd_primary_op_data_t*)pool_calloc(
         // Allocate:
         // - op_data
-        1, sizeof(osd_primary_op_data_t) +
+        sizeof(osd_primary_op_data_t) +
         // - stripes
         // - resulting bitmap buffers
         stripe_count * (clean_entry_bitmap_size + sizeof(osd_rmw_stripe_t)) +
@@ -138,6 +138,69 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
     return true;
 }
 
+// Estimate read latency of each replica as (reads in flight + 1) * average read latency
+// and return the best one. Replicas not measured yet are tried first when they have no reads
+// in flight, so that their latency is learned; while a probe is in flight they're assumed
+// to have the mean latency of the measured ones. Local OSD wins ties
+osd_num_t osd_t::pick_read_replica(pg_t & pg)
+{
+    osd_num_t cand_osd[pg.cur_set.size()];
+    uint64_t cand_queue[pg.cur_set.size()], cand_lat[pg.cur_set.size()];
+    int cand_count = 0;
+    for (auto role_osd: pg.cur_set)
+    {
+        if (role_osd == this->osd_num)
+        {
+            // Local OSD goes first to win ties
+            cand_osd[cand_count] = role_osd;
+            cand_queue[cand_count] = local_reads_inflight;
+            cand_lat[cand_count] = local_read_lat_us;
+            cand_count++;
+            break;
+        }
+    }
+    for (auto role_osd: pg.cur_set)
+    {
+        if (role_osd == 0 || role_osd == this->osd_num)
+        {
+            continue;
+        }
+        auto peer_it = msgr.osd_peer_fds.find(role_osd);
+        if (peer_it == msgr.osd_peer_fds.end())
+        {
+            continue;
+        }
+        osd_client_t *cl = msgr.clients.at(peer_it->second);
+        cand_osd[cand_count] = role_osd;
+        cand_queue[cand_count] = cl->reads_inflight;
+        cand_lat[cand_count] = cl->read_lat_us;
+        cand_count++;
+    }
+    uint64_t lat_sum = 0, measured = 0;
+    for (int i = 0; i < cand_count; i++)
+    {
+        if (cand_lat[i])
+        {
+            lat_sum += cand_lat[i];
+            measured++;
+        }
+    }
+    uint64_t mean_lat = measured ? lat_sum/measured : 0;
+    osd_num_t best_osd = 0;
+    uint64_t best_cost = UINT64_MAX;
+    for (int i = 0; i < cand_count; i++)
+    {
+        uint64_t cost = cand_lat[i] ? (cand_queue[i]+1) * cand_lat[i]
+            : (cand_queue[i] ? (cand_queue[i]+1) * mean_lat : 0);
+        if (cost < best_cost)
+        {
+            best_osd = cand_osd[i];
+            best_cost = cost;
+        }
+    }
+    return best_osd;
+}
+
 uint64_t* osd_t::get_object_osd_set(pg_t &pg, object_id &oid, uint64_t *def, pg_osd_set_state_t **object_state)
 {
     if (!(pg.state & (PG_HAS_INCOMPLETE | PG_HAS_DEGRADED | PG_HAS_MISPLACED)))
@@ -194,7 +257,23 @@ void osd_t::continue_primary_read(osd_op_t *cur_op)
         // Determine version
         auto vo_it = pg.ver_override.find(op_data->oid);
         op_data->target_ver = vo_it != pg.ver_override.end() ? vo_it->second : UINT64_MAX;
-        if (pg.state == PG_ACTIVE || op_data->scheme == POOL_SCHEME_REPLICATED)
+        if (pg.state == PG_ACTIVE && op_data->scheme == POOL_SCHEME_REPLICATED && replica_reads &&
+            op_data->target_ver == UINT64_MAX && pg.write_queue.find(op_data->oid) == pg.write_queue.end())
+        {
+            // Clean object without writes in progress - any replica has the same data,
+            // so read it from the least loaded one
+            uint64_t read_set[pg.pg_size];
+            for (int role = 0; role < pg.pg_size; role++)
+            {
+                read_set[role] = 0;
+            }
+            read_set[0] = pick_read_replica(pg);
+            assert(read_set[0] != 0);
+            cur_op->buf = alloc_read_buffer(op_data->stripes, op_data->pg_data_size, 0);
+            submit_primary_subops(SUBMIT_READ, op_data->target_ver, read_set, cur_op);
+            op_data->st = 1;
+        }
+        else if (pg.state == PG_ACTIVE || op_data->scheme == POOL_SCHEME_REPLICATED)
         {
             // Fast happy-path
             cur_op->buf = alloc_read_buffer(op_data->stripes, op_data->pg_data_size, 0);
@@ -26,6 +26,8 @@ struct osd_primary_op_data_t
     uint64_t scheme = 0;
     int n_subops = 0, done = 0, errors = 0, epipe = 0;
     int degraded = 0, pg_size, pg_data_size;
+    // write subops are sent with OSD_SEC_RW_SYNC and are durable on completion
+    bool write_sync;
     osd_rmw_stripe_t *stripes;
     osd_op_t *subops = NULL;
     uint64_t *prev_set = NULL;
@@ -44,6 +46,8 @@ struct osd_primary_op_data_t
             obj_ver_id *unstable_writes;
             obj_ver_osd_t *copies_to_delete;
             int copies_to_delete_count;
+            // primary_write_seq at the start of the sync
+            uint64_t sync_write_seq;
         };
         struct
         {
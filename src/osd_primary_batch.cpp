@@ -0,0 +1,69 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "osd_primary.h"
+
+// batch: small reads and writes of one client sent in one request (OSD_OP_BATCH)
+//
+// sub-operations are executed as independent primary operations of the same client,
+// so they are checked, queued and tracked for SYNC exactly like separate requests.
+// the reply is sent when all of them are finished and contains their results in the same order,
+// followed by bitmaps and data of successful reads
+
+void osd_t::exec_batch(osd_op_t *cur_op)
+{
+    osd_op_batch_data_t *batch = (osd_op_batch_data_t*)cur_op->buf;
+    // Hold the batch until all sub-operations are started, some of them may finish immediately
+    batch->pending = batch->count+1;
+    for (uint64_t i = 0; i < batch->count; i++)
+    {
+        osd_op_t *sub = batch->ops[i];
+        sub->callback = [this, cur_op, i](osd_op_t *sub) { finish_batch_item(cur_op, i, sub); };
+        if (sub->req.hdr.opcode != OSD_OP_READ && sub->req.hdr.opcode != OSD_OP_WRITE ||
+            sub->req.rw.len > OSD_BATCH_MAX_LEN)
+        {
+            // Bad sub-operation
+            memset(sub->reply.buf, 0, OSD_PACKET_SIZE);
+            sub->reply.hdr.retval = -EINVAL;
+            finish_batch_item(cur_op, i, sub);
+        }
+        else
+        {
+            exec_op(sub);
+        }
+    }
+    finish_batch_item(cur_op, UINT64_MAX, NULL);
+}
+
+void osd_t::finish_batch_item(osd_op_t *cur_op, uint64_t i, osd_op_t *sub)
+{
+    osd_op_batch_data_t *batch = (osd_op_batch_data_t*)cur_op->buf;
+    if (sub)
+    {
+        batch->reply_items[i] = (osd_reply_batch_item_t){
+            .retval = sub->reply.hdr.retval,
+            .bitmap_len = sub->reply.hdr.retval >= 0 ? sub->reply.rw.bitmap_len : 0,
+            .version = sub->reply.rw.version,
+        };
+        if (sub->tv_begin.tv_sec)
+        {
+            // Account sub-operations like separate requests
+            msgr.measure_exec(sub);
+        }
+    }
+    if (--batch->pending > 0)
+    {
+        return;
+    }
+    cur_op->iov.push_back(batch->reply_items, batch->count*sizeof(osd_reply_batch_item_t));
+    for (uint64_t j = 0; j < batch->count; j++)
+    {
+        if (batch->ops[j]->req.hdr.opcode == OSD_OP_READ && batch->reply_items[j].retval >= 0)
+        {
+            // Bitmap and data
+            cur_op->iov.append(batch->ops[j]->iov);
+        }
+    }
+    cur_op->reply.batch.count = batch->count;
+    finish_op(cur_op, 0);
+}
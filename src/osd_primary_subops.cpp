@@ -76,13 +76,19 @@ void osd_t::finish_op(osd_op_t *cur_op, int retval)
             }
         }
         assert(!cur_op->op_data->subops);
-        free(cur_op->op_data);
+        pool_free(cur_op->op_data);
         cur_op->op_data = NULL;
     }
     if (!cur_op->peer_fd)
     {
         // Copy lambda to be unaffected by `delete op`
-        std::function<void(osd_op_t*)>(cur_op->callback)(cur_op);
+        inline_callback_t<osd_op_t>(cur_op->callback)(cur_op);
+    }
+    else if (cur_op->callback)
+    {
+        // Sub-operation of a client batch, replied as a part of it
+        cur_op->reply.hdr.retval = retval;
+        inline_callback_t<osd_op_t>(cur_op->callback)(cur_op);
     }
     else
     {
@@ -137,6 +143,8 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
     bool wr = submit_type == SUBMIT_WRITE;
     osd_primary_op_data_t *op_data = cur_op->op_data;
     bool rep = op_data->scheme == POOL_SCHEME_REPLICATED;
+    bool chain_write = wr && rep && use_chain_write(osd_set, op_data->pg_size);
+    int chain_head = -1, chain_len = 0;
     int i = subop_idx;
     for (int role = 0; role < op_data->pg_size; role++)
     {
@@ -179,7 +187,12 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                     subop->bs_op->offset, subop->bs_op->len
                 );
 #endif
-                bs->enqueue_op(subop->bs_op);
+                if (!wr)
+                    local_reads_inflight++;
+                if (wr && op_data->write_sync)
+                    enqueue_write_sync(subop->bs_op);
+                else
+                    bs->enqueue_op(subop->bs_op);
             }
             else
             {
@@ -201,6 +214,7 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                     .offset = wr ? stripes[stripe_num].write_start : stripes[stripe_num].read_start,
                     .len = wr ? stripes[stripe_num].write_end - stripes[stripe_num].write_start : stripes[stripe_num].read_end - stripes[stripe_num].read_start,
                     .attr_len = wr ? clean_entry_bitmap_size : 0,
+                    .flags = (uint32_t)(wr && op_data->write_sync ? OSD_SEC_RW_SYNC : 0),
                 };
 #ifdef OSD_DEBUG
                 printf(
@@ -227,14 +241,114 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                 {
                     handle_primary_subop(subop, cur_op);
                 };
-                msgr.outbox_push(subop);
+                if (chain_write && chain_head >= 0)
+                {
+                    // Replica is written by the previous OSD of the chain, the subop
+                    // is only sent if the chain doesn't reach this replica
+                    op_data->subops[chain_head].req.sec_rw.forward_to[chain_len++] = role_osd_num;
+                }
+                else if (chain_write)
+                {
+                    chain_head = i;
+                }
+                else
+                {
+                    if (wr)
+                        subop->req.sec_rw.stab_len = attach_deferred_stab(role_osd_num, subop);
+                    msgr.outbox_push(subop);
+                }
             }
             i++;
         }
     }
+    if (chain_head >= 0)
+    {
+        osd_op_t *head = op_data->subops + chain_head;
+        head->req.sec_rw.stab_len = attach_deferred_stab(msgr.clients.at(head->peer_fd)->osd_num, head);
+        head->callback = [cur_op, chain_head, chain_len, this](osd_op_t *head)
+        {
+            handle_chain_write_reply(head, cur_op, chain_head, chain_len);
+        };
+        msgr.outbox_push(head);
+    }
     return i-subop_idx;
 }
 
+// Chain replication is used for replicated pool writes when there are at least 2 remote replicas
+// and all of them are connected and support forwarding
+bool osd_t::use_chain_write(const uint64_t* osd_set, int pg_size)
+{
+    if (!chain_replication)
+    {
+        return false;
+    }
+    int remote = 0;
+    for (int role = 0; role < pg_size; role++)
+    {
+        if (osd_set[role] != 0 && osd_set[role] != this->osd_num)
+        {
+            auto peer_it = msgr.osd_peer_fds.find(osd_set[role]);
+            if (peer_it == msgr.osd_peer_fds.end() ||
+                !(msgr.clients.at(peer_it->second)->peer_features & OSD_FEATURE_WRITE_FORWARD))
+            {
+                return false;
+            }
+            remote++;
+        }
+    }
+    return remote >= 2 && remote <= OSD_SEC_RW_MAX_FORWARD+1;
+}
+
+// Reply from the first OSD of a replication chain. Replicas reached by the chain are marked
+// as written, the rest (not connected to their predecessor) are written by sending their subops
+void osd_t::handle_chain_write_reply(osd_op_t *head, osd_op_t *cur_op, int chain_head, int chain_len)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    int written = 0;
+    if (head->reply.hdr.retval == head->req.sec_rw.len)
+    {
+        written = head->reply.sec_rw.write_count > 0 ? head->reply.sec_rw.write_count : 1;
+    }
+    osd_op_t *chain[OSD_SEC_RW_MAX_FORWARD];
+    for (int i = chain_head+1, n = 0; n < chain_len; i++)
+    {
+        // Local subop may be mixed with chain subops
+        if (op_data->subops[i].op_type == OSD_OP_OUT)
+        {
+            chain[n++] = op_data->subops+i;
+        }
+    }
+    // Send unreached subops first so the operation isn't completed
+    // (and subops aren't freed) by marking the rest as done
+    for (int n = (written > 0 ? written-1 : chain_len); n < chain_len; n++)
+    {
+        // The peer may have disconnected (and its fd may be reused) while the chain was in progress
+        auto peer_it = msgr.osd_peer_fds.find(head->req.sec_rw.forward_to[n]);
+        if (peer_it == msgr.osd_peer_fds.end())
+        {
+            // PGs of the disconnected peer are repeered, the operation is retried by the client
+            chain[n]->peer_fd = -1;
+            chain[n]->reply.hdr.retval = -EPIPE;
+            handle_primary_subop(chain[n], cur_op);
+            continue;
+        }
+        chain[n]->peer_fd = peer_it->second;
+        chain[n]->req.sec_rw.stab_len = attach_deferred_stab(head->req.sec_rw.forward_to[n], chain[n]);
+        msgr.outbox_push(chain[n]);
+    }
+    for (int n = 0; n < chain_len && (written == 0 || n < written-1); n++)
+    {
+        chain[n]->reply = head->reply;
+        if (written == 0)
+        {
+            // Chain failed, the connection to its head is dropped by handle_primary_subop()
+            chain[n]->peer_fd = -1;
+        }
+        handle_primary_subop(chain[n], cur_op);
+    }
+    handle_primary_subop(head, cur_op);
+}
+
 static uint64_t bs_op_to_osd_op[] = {
     0,
     OSD_OP_SEC_READ,            // BS_OP_READ = 1
@@ -263,6 +377,10 @@ void osd_t::handle_primary_bs_subop(osd_op_t *subop)
         );
     }
     add_bs_subop_stats(subop);
+    if (bs_op->opcode == BS_OP_READ)
+    {
+        local_reads_inflight--;
+    }
     subop->req.hdr.opcode = bs_op_to_osd_op[bs_op->opcode];
     subop->reply.hdr.retval = bs_op->retval;
     if (bs_op->opcode == BS_OP_READ || bs_op->opcode == BS_OP_WRITE || bs_op->opcode == BS_OP_WRITE_STABLE)
@@ -289,10 +407,15 @@ void osd_t::add_bs_subop_stats(osd_op_t *subop)
         msgr.stats.op_stat_sum[opcode] = 0;
         msgr.stats.op_stat_bytes[opcode] = 0;
     }
-    msgr.stats.op_stat_sum[opcode] += (
+    uint64_t latency = (
         (tv_end.tv_sec - subop->tv_begin.tv_sec)*1000000 +
         (tv_end.tv_nsec - subop->tv_begin.tv_nsec)/1000
     );
+    msgr.stats.op_stat_sum[opcode] += latency;
+    if (opcode == OSD_OP_SEC_READ)
+    {
+        local_read_lat_us = local_read_lat_us ? (local_read_lat_us*7 + latency)/8 : latency;
+    }
     if (opcode == OSD_OP_SEC_READ || opcode == OSD_OP_SEC_WRITE)
     {
         msgr.stats.op_stat_bytes[opcode] += subop->bs_op->len;
@@ -520,6 +643,7 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
                     .opcode = OSD_OP_SEC_SYNC,
                 },
             } };
+            subops[i].req.sec_sync.stab_len = attach_deferred_stab(sync_osd, &subops[i]);
             subops[i].callback = [cur_op, this](osd_op_t *subop)
             {
                 handle_primary_subop(subop, cur_op);
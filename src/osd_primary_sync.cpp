@@ -8,7 +8,7 @@ void osd_t::continue_primary_sync(osd_op_t *cur_op)
 {
     if (!cur_op->op_data)
     {
-        cur_op->op_data = (osd_primary_op_data_t*)calloc_or_die(1, sizeof(osd_primary_op_data_t));
+        cur_op->op_data = (osd_primary_op_data_t*)pool_calloc(sizeof(osd_primary_op_data_t));
     }
     osd_primary_op_data_t *op_data = cur_op->op_data;
     if (op_data->st == 1)      goto resume_1;
@@ -34,6 +34,7 @@ resume_1:
         syncs_in_progress.push_back(cur_op);
     }
 resume_2:
+    op_data->sync_write_seq = primary_write_seq;
     if (dirty_osds.size() == 0)
     {
         // Nothing to sync
@@ -111,7 +112,9 @@ resume_2:
         int dpg = 0;
         for (auto dirty_pg_num: dirty_pgs)
         {
-            pgs.at(dirty_pg_num).inflight++;
+            auto & pg = pgs.at(dirty_pg_num);
+            pg.inflight++;
+            pg.inflight_syncs++;
             op_data->dirty_pgs[dpg++] = dirty_pg_num;
         }
         dirty_pgs.clear();
@@ -138,7 +141,14 @@ resume_4:
             goto resume_6;
         }
     }
-    if (op_data->unstable_writes)
+    if (op_data->unstable_writes && stab_piggyback_delay > 0 && !op_data->copies_to_delete)
+    {
+        // Don't send separate STABILIZE requests to peers which support piggybacking,
+        // stabilize lists will be sent along with the next writes or syncs instead.
+        // Keep the original order of operations if some copies are deleted after sync
+        defer_primary_stab(op_data);
+    }
+    if (op_data->unstable_writes && op_data->unstable_write_osds->size() > 0)
     {
         // Stabilize version sets, if any
         submit_primary_stab_subops(cur_op);
@@ -218,6 +228,7 @@ resume_8:
     {
         auto & pg = pgs.at(op_data->dirty_pgs[i]);
         pg.inflight--;
+        pg.inflight_syncs--;
         if ((pg.state & PG_STOPPING) && pg.inflight == 0 && !pg.flush_batch)
         {
             finish_stop_pg(pg);
@@ -245,11 +256,19 @@ resume_8:
     else
     {
 finish:
-        if (cur_op->peer_fd)
+        // Forget dirty PGs of all connections whose writes are covered by this sync. A client
+        // with several connections (client_osd_connections) only sends SYNC through one of them
+        for (auto fd_it = dirty_client_fds.begin(); fd_it != dirty_client_fds.end(); )
         {
-            auto it = msgr.clients.find(cur_op->peer_fd);
-            if (it != msgr.clients.end())
-                it->second->dirty_pgs.clear();
+            auto cl_it = msgr.clients.find(*fd_it);
+            if (cl_it == msgr.clients.end() || cl_it->second->dirty_write_seq <= op_data->sync_write_seq)
+            {
+                if (cl_it != msgr.clients.end())
+                    cl_it->second->dirty_pgs.clear();
+                dirty_client_fds.erase(fd_it++);
+            }
+            else
+                fd_it++;
         }
         finish_op(cur_op, 0);
     }
@@ -263,3 +282,112 @@ finish:
         goto resume_2;
     }
 }
+
+// Move versions of peers supporting OSD_FEATURE_STAB_PIGGYBACK from op_data to deferred_stab
+void osd_t::defer_primary_stab(osd_primary_op_data_t *op_data)
+{
+    auto & stab_osds = *(op_data->unstable_write_osds);
+    int kept = 0;
+    for (int i = 0; i < stab_osds.size(); i++)
+    {
+        auto & stab_osd = stab_osds[i];
+        auto peer_it = msgr.osd_peer_fds.find(stab_osd.osd_num);
+        if (stab_osd.osd_num == this->osd_num || peer_it == msgr.osd_peer_fds.end() ||
+            !(msgr.clients.at(peer_it->second)->peer_features & OSD_FEATURE_STAB_PIGGYBACK))
+        {
+            stab_osds[kept++] = stab_osd;
+            continue;
+        }
+        for (int j = 0; j < stab_osd.len; j++)
+        {
+            auto & w = op_data->unstable_writes[stab_osd.start + j];
+            uint64_t & dest = deferred_stab[(osd_object_id_t){
+                .osd_num = stab_osd.osd_num,
+                .oid = w.oid,
+            }];
+            dest = dest < w.version ? w.version : dest;
+        }
+    }
+    stab_osds.resize(kept);
+    if (deferred_stab.size() > 0 && !deferred_stab_timer_id)
+    {
+        deferred_stab_timer_id = tfd->set_timer(stab_piggyback_delay, false, [this](int timer_id)
+        {
+            deferred_stab_timer_id = 0;
+            flush_deferred_stab();
+        });
+    }
+}
+
+// Attach versions waiting for stabilization on <peer_osd> to a write or sync sent to it.
+// Returns the length of the attached obj_ver_id list in bytes
+uint64_t osd_t::attach_deferred_stab(osd_num_t peer_osd, osd_op_t *subop)
+{
+    auto begin = deferred_stab.lower_bound((osd_object_id_t){ .osd_num = peer_osd });
+    if (begin == deferred_stab.end() || begin->first.osd_num != peer_osd ||
+        !(msgr.clients.at(subop->peer_fd)->peer_features & OSD_FEATURE_STAB_PIGGYBACK))
+    {
+        return 0;
+    }
+    auto end = begin;
+    int count = 0;
+    while (end != deferred_stab.end() && end->first.osd_num == peer_osd)
+    {
+        end++;
+        count++;
+    }
+    // The list is freed along with the subop
+    obj_ver_id *stab_list = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * count);
+    int i = 0;
+    for (auto it = begin; it != end; it++, i++)
+    {
+        stab_list[i] = (obj_ver_id){
+            .oid = it->first.oid,
+            .version = it->second,
+        };
+    }
+    deferred_stab.erase(begin, end);
+    subop->buf = stab_list;
+    subop->iov.push_back(stab_list, sizeof(obj_ver_id) * count);
+    return sizeof(obj_ver_id) * count;
+}
+
+// Send remaining deferred stabilize lists to idle peers as separate STABILIZE requests
+void osd_t::flush_deferred_stab()
+{
+    while (deferred_stab.size() > 0)
+    {
+        osd_num_t peer_osd = deferred_stab.begin()->first.osd_num;
+        auto peer_it = msgr.osd_peer_fds.find(peer_osd);
+        if (peer_it == msgr.osd_peer_fds.end())
+        {
+            // Peer is disconnected, its PGs are repeered and unstable versions are handled during peering
+            deferred_stab.erase(deferred_stab.begin(), deferred_stab.lower_bound((osd_object_id_t){ .osd_num = peer_osd+1 }));
+            continue;
+        }
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = peer_it->second;
+        op->req = (osd_any_op_t){ .sec_stab = {
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = msgr.next_subop_id++,
+                .opcode = OSD_OP_SEC_STABILIZE,
+            },
+        } };
+        op->req.sec_stab.len = attach_deferred_stab(peer_osd, op);
+        op->callback = [this, peer_osd](osd_op_t *op)
+        {
+            if (op->reply.hdr.retval != 0)
+            {
+                // Error or disconnect - the peer should be repeered
+                fprintf(stderr, "Deferred stabilize on OSD %lu failed: retval=%ld\n", peer_osd, op->reply.hdr.retval);
+                auto peer_it = msgr.osd_peer_fds.find(peer_osd);
+                if (peer_it != msgr.osd_peer_fds.end())
+                    msgr.stop_client(peer_it->second);
+            }
+            delete op;
+        };
+        msgr.outbox_push(op);
+    }
+}
@@ -31,6 +31,34 @@ bool osd_t::check_write_queue(osd_op_t *cur_op, pg_t & pg)
     return true;
 }
 
+// Writes may be made durable at once if a SYNC is already pending for the PG.
+// Such writes don't need a separate SYNC round trip to the secondary OSDs later
+bool osd_t::use_write_sync(pg_t & pg)
+{
+    if (immediate_commit == IMMEDIATE_ALL || !write_sync_on_pending_sync)
+    {
+        return false;
+    }
+    if (!pg.inflight_syncs && (!syncs_in_progress.size() ||
+        dirty_pgs.find({ .pool_id = pg.pool_id, .pg_num = pg.pg_num }) == dirty_pgs.end()))
+    {
+        return false;
+    }
+    for (auto osd_num: pg.cur_set)
+    {
+        if (osd_num && osd_num != this->osd_num)
+        {
+            auto peer_it = msgr.osd_peer_fds.find(osd_num);
+            if (peer_it == msgr.osd_peer_fds.end() ||
+                !(msgr.clients.at(peer_it->second)->peer_features & OSD_FEATURE_WRITE_SYNC))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 void osd_t::continue_primary_write(osd_op_t *cur_op)
 {
     if (!cur_op->op_data && !prepare_primary_rw(cur_op))
@@ -164,6 +192,7 @@ resume_10:
             return;
         }
     }
+    op_data->write_sync = use_write_sync(pg);
     submit_primary_subops(SUBMIT_WRITE, op_data->target_ver, pg.cur_set.data(), cur_op);
 resume_4:
     op_data->st = 4;
@@ -290,8 +319,9 @@ bool osd_t::remember_unstable_write(osd_op_t *cur_op, pg_t & pg, pg_osd_set_t &
     {
         goto resume_7;
     }
-    if (immediate_commit == IMMEDIATE_ALL)
+    if (immediate_commit == IMMEDIATE_ALL || op_data->write_sync)
     {
+        // Write is already durable
 immediate:
         if (op_data->scheme != POOL_SCHEME_REPLICATED)
         {
@@ -376,10 +406,13 @@ lazy:
         }
         // Remember PG as dirty to drop the connection when PG goes offline
         // (this is required because of the "lazy sync")
+        primary_write_seq++;
         auto cl_it = msgr.clients.find(cur_op->peer_fd);
         if (cl_it != msgr.clients.end())
         {
             cl_it->second->dirty_pgs.insert({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
+            cl_it->second->dirty_write_seq = primary_write_seq;
+            dirty_client_fds.insert(cur_op->peer_fd);
         }
         dirty_pgs.insert({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
     }
@@ -9,6 +9,7 @@
 #include <map>
 #include "allocator.h"
 #include "xor.h"
+#include "gf256.h"
 #include "osd_rmw.h"
 #include "malloc_or_die.h"
 
@@ -84,75 +85,64 @@ void split_stripes(uint64_t pg_minsize, uint32_t bs_block_size, uint32_t start,
 
 void reconstruct_stripes_xor(osd_rmw_stripe_t *stripes, int pg_size, uint32_t bitmap_size)
 {
+    const void *data_ptrs[pg_size];
+    const void *bmp_ptrs[pg_size];
     for (int role = 0; role < pg_size; role++)
     {
         if (stripes[role].read_end != 0 && stripes[role].missing)
         {
-            // Reconstruct missing stripe (XOR k+1)
-            int prev = -2;
+            // Reconstruct missing stripe (XOR k+1) from all other stripes in one pass
+            int n = 0;
             for (int other = 0; other < pg_size; other++)
             {
                 if (other != role)
                 {
-                    if (prev == -2)
-                    {
-                        prev = other;
-                    }
-                    else if (prev >= 0)
-                    {
-                        assert(stripes[role].read_start >= stripes[prev].read_start &&
-                            stripes[role].read_start >= stripes[other].read_start);
-                        memxor(
-                            stripes[prev].read_buf + (stripes[role].read_start - stripes[prev].read_start),
-                            stripes[other].read_buf + (stripes[role].read_start - stripes[other].read_start),
-                            stripes[role].read_buf, stripes[role].read_end - stripes[role].read_start
-                        );
-                        memxor(stripes[prev].bmp_buf, stripes[other].bmp_buf, stripes[role].bmp_buf, bitmap_size);
-                        prev = -1;
-                    }
-                    else
-                    {
-                        assert(stripes[role].read_start >= stripes[other].read_start);
-                        memxor(
-                            stripes[role].read_buf,
-                            stripes[other].read_buf + (stripes[role].read_start - stripes[other].read_start),
-                            stripes[role].read_buf, stripes[role].read_end - stripes[role].read_start
-                        );
-                        memxor(stripes[role].bmp_buf, stripes[other].bmp_buf, stripes[role].bmp_buf, bitmap_size);
-                    }
+                    assert(stripes[role].read_start >= stripes[other].read_start);
+                    data_ptrs[n] = stripes[other].read_buf + (stripes[role].read_start - stripes[other].read_start);
+                    bmp_ptrs[n] = stripes[other].bmp_buf;
+                    n++;
                 }
             }
+            memxor_multi(data_ptrs, n, stripes[role].read_buf, stripes[role].read_end - stripes[role].read_start);
+            memxor_multi(bmp_ptrs, n, stripes[role].bmp_buf, bitmap_size);
         }
     }
 }
 
-struct reed_sol_erased_t
-{
-    int *data;
-    int size;
-};
+// Maximum number of cached decoding matrices per (pg_size, pg_minsize)
+#define OSD_JERASURE_DECODING_CACHE 64
 
-inline bool operator < (const reed_sol_erased_t &a, const reed_sol_erased_t &b)
+struct reed_sol_decoding_t
 {
-    for (int i = 0; i < a.size && i < b.size; i++)
-    {
-        if (a.data[i] < b.data[i])
-            return -1;
-        else if (a.data[i] > b.data[i])
-            return 1;
-    }
-    return 0;
-}
+    uint64_t last_used;
+    // dm_ids[pg_minsize] + decoding_matrix[pg_minsize*pg_minsize] in Jerasure format,
+    // followed by the same matrix in bytes and its split multiplication tables
+    int *dm_ids;
+    uint8_t *native;
+    uint8_t *native_tables;
+};
 
 struct reed_sol_matrix_t
 {
     int refs = 0;
     int *data;
-    std::map<reed_sol_erased_t, int*> decodings;
+    uint8_t *native;
+    uint8_t *native_tables;
+    uint64_t lru_counter = 0;
+    // Keyed by the bitmask of erased chunks, evicted in LRU order
+    std::map<uint64_t, reed_sol_decoding_t> decodings;
 };
 
 std::map<uint64_t, reed_sol_matrix_t> matrices;
 
+// Use built-in SIMD GF(2^8) code instead of Jerasure for encoding and decoding
+static bool ec_native = true;
+
+void use_ec_native(bool native)
+{
+    ec_native = native;
+}
+
 void use_jerasure(int pg_size, int pg_minsize, bool use)
 {
     uint64_t key = (uint64_t)pg_size | ((uint64_t)pg_minsize) << 32;
@@ -163,10 +153,19 @@ void use_jerasure(int pg_size, int pg_minsize, bool use)
         {
             return;
         }
+        // The coding matrix is always taken from Jerasure to keep the built-in implementation
+        // bit-compatible with the data already written
+        int total = pg_minsize*(pg_size-pg_minsize);
         int *matrix = reed_sol_vandermonde_coding_matrix(pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W);
+        uint8_t *native = (uint8_t*)malloc_or_die(total*(1+GF256_TABLE_SIZE));
+        for (int i = 0; i < total; i++)
+            native[i] = matrix[i];
+        gf256_init_tables(native, total, native+total);
         matrices[key] = (reed_sol_matrix_t){
             .refs = 0,
             .data = matrix,
+            .native = native,
+            .native_tables = native+total,
         };
         rs_it = matrices.find(key);
     }
@@ -174,11 +173,10 @@ void use_jerasure(int pg_size, int pg_minsize, bool use)
     if (rs_it->second.refs <= 0)
     {
         free(rs_it->second.data);
-        for (auto dec_it = rs_it->second.decodings.begin(); dec_it != rs_it->second.decodings.end();)
+        free(rs_it->second.native);
+        for (auto & dec: rs_it->second.decodings)
         {
-            int *data = dec_it->second;
-            rs_it->second.decodings.erase(dec_it++);
-            free(data);
+            free(dec.second.dm_ids);
         }
         matrices.erase(rs_it);
     }
@@ -199,48 +197,123 @@ reed_sol_matrix_t* get_jerasure_matrix(int pg_size, int pg_minsize)
 // we don't need it. also it makes an extra allocation of int *erased on every call and doesn't cache
 // the decoding matrix.
 // all these flaws are fixed in this function:
-int* get_jerasure_decoding_matrix(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize)
+reed_sol_decoding_t* get_jerasure_decoding_matrix(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize)
 {
     int edd = 0;
-    int erased[pg_size] = { 0 };
+    uint64_t erased = 0;
+    assert(pg_size <= 64);
     for (int i = 0; i < pg_size; i++)
         if (stripes[i].read_end == 0 || stripes[i].missing)
-            erased[i] = 1;
+            erased |= (1ul << i);
     for (int i = 0; i < pg_minsize; i++)
         if (stripes[i].read_end != 0 && stripes[i].missing)
             edd++;
     if (edd == 0)
         return NULL;
     reed_sol_matrix_t *matrix = get_jerasure_matrix(pg_size, pg_minsize);
-    auto dec_it = matrix->decodings.find((reed_sol_erased_t){ .data = erased, .size = pg_size });
-    if (dec_it == matrix->decodings.end())
-    {
-        int *dm_ids = (int*)malloc_or_die(sizeof(int)*(pg_minsize + pg_minsize*pg_minsize + pg_size));
-        int *decoding_matrix = dm_ids + pg_minsize;
-        if (!dm_ids)
-            throw std::bad_alloc();
-        // we always use row_k_ones=1 and w=8 (OSD_JERASURE_W)
-        if (jerasure_make_decoding_matrix(pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W, matrix->data, erased, decoding_matrix, dm_ids) < 0)
+    auto dec_it = matrix->decodings.find(erased);
+    if (dec_it != matrix->decodings.end())
+    {
+        dec_it->second.last_used = ++matrix->lru_counter;
+        return &dec_it->second;
+    }
+    if (matrix->decodings.size() >= OSD_JERASURE_DECODING_CACHE)
+    {
+        auto lru_it = matrix->decodings.begin();
+        for (auto it = matrix->decodings.begin(); it != matrix->decodings.end(); it++)
+        {
+            if (it->second.last_used < lru_it->second.last_used)
+                lru_it = it;
+        }
+        free(lru_it->second.dm_ids);
+        matrix->decodings.erase(lru_it);
+    }
+    int k = pg_minsize;
+    int *dm_ids = (int*)malloc_or_die(sizeof(int)*(k + k*k) + k*k*(1+GF256_TABLE_SIZE));
+    int *decoding_matrix = dm_ids + k;
+    uint8_t *native = (uint8_t*)(decoding_matrix + k*k);
+    // Same as jerasure_make_decoding_matrix(), but without extra allocations
+    uint8_t tmp_matrix[k*k];
+    for (int i = 0, j = 0; j < k; i++)
+    {
+        if (!(erased & (1ul << i)))
+            dm_ids[j++] = i;
+    }
+    for (int i = 0; i < k; i++)
+    {
+        if (dm_ids[i] < k)
         {
-            free(dm_ids);
-            throw std::runtime_error("jerasure_make_decoding_matrix() failed");
+            memset(tmp_matrix + i*k, 0, k);
+            tmp_matrix[i*k + dm_ids[i]] = 1;
         }
-        int *erased_copy = dm_ids + pg_minsize + pg_minsize*pg_minsize;
-        memcpy(erased_copy, erased, pg_size*sizeof(int));
-        matrix->decodings.emplace((reed_sol_erased_t){ .data = erased_copy, .size = pg_size }, dm_ids);
-        return dm_ids;
+        else
+            memcpy(tmp_matrix + i*k, matrix->native + (dm_ids[i]-k)*k, k);
+    }
+    if (gf256_invert_matrix(tmp_matrix, native, k) < 0)
+    {
+        free(dm_ids);
+        throw std::runtime_error("failed to invert the decoding matrix");
+    }
+    for (int i = 0; i < k*k; i++)
+        decoding_matrix[i] = native[i];
+    gf256_init_tables(native, k*k, native + k*k);
+    auto & dec = matrix->decodings[erased];
+    dec = (reed_sol_decoding_t){
+        .last_used = ++matrix->lru_counter,
+        .dm_ids = dm_ids,
+        .native = native,
+        .native_tables = native + k*k,
+    };
+    return &dec;
+}
+
+static void reed_sol_decode_chunk(reed_sol_decoding_t *dec, int pg_minsize, int role, char **data_ptrs, uint32_t len)
+{
+    if (ec_native)
+    {
+        const void *src_ptrs[pg_minsize];
+        for (int i = 0; i < pg_minsize; i++)
+            src_ptrs[i] = data_ptrs[dec->dm_ids[i]];
+        gf256_dotprod(
+            dec->native + role*pg_minsize, dec->native_tables + role*pg_minsize*GF256_TABLE_SIZE,
+            pg_minsize, src_ptrs, data_ptrs[role], len
+        );
+    }
+    else
+    {
+        int *decoding_matrix = dec->dm_ids + pg_minsize;
+        jerasure_matrix_dotprod(
+            pg_minsize, OSD_JERASURE_W, decoding_matrix+(role*pg_minsize), dec->dm_ids, role,
+            data_ptrs, data_ptrs+pg_minsize, len
+        );
+    }
+}
+
+static void reed_sol_encode(reed_sol_matrix_t *matrix, int pg_size, int pg_minsize, void **data_ptrs, uint32_t len)
+{
+    if (ec_native)
+    {
+        gf256_encode(
+            pg_minsize, pg_size-pg_minsize, matrix->native, matrix->native_tables,
+            (const void**)data_ptrs, data_ptrs+pg_minsize, len
+        );
+    }
+    else
+    {
+        jerasure_matrix_encode(
+            pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W, matrix->data,
+            (char**)data_ptrs, (char**)data_ptrs+pg_minsize, len
+        );
     }
-    return dec_it->second;
 }
 
 void reconstruct_stripes_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize, uint32_t bitmap_size)
 {
-    int *dm_ids = get_jerasure_decoding_matrix(stripes, pg_size, pg_minsize);
-    if (!dm_ids)
+    reed_sol_decoding_t *dec = get_jerasure_decoding_matrix(stripes, pg_size, pg_minsize);
+    if (!dec)
     {
         return;
     }
-    int *decoding_matrix = dm_ids + pg_minsize;
     char *data_ptrs[pg_size] = { 0 };
     for (int role = 0; role < pg_minsize; role++)
     {
@@ -258,10 +331,7 @@ void reconstruct_stripes_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg
                     }
                 }
                 data_ptrs[role] = (char*)stripes[role].read_buf;
-                jerasure_matrix_dotprod(
-                    pg_minsize, OSD_JERASURE_W, decoding_matrix+(role*pg_minsize), dm_ids, role,
-                    data_ptrs, data_ptrs+pg_minsize, stripes[role].read_end - stripes[role].read_start
-                );
+                reed_sol_decode_chunk(dec, pg_minsize, role, data_ptrs, stripes[role].read_end - stripes[role].read_start);
             }
             for (int other = 0; other < pg_size; other++)
             {
@@ -271,10 +341,7 @@ void reconstruct_stripes_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg
                 }
             }
             data_ptrs[role] = (char*)stripes[role].bmp_buf;
-            jerasure_matrix_dotprod(
-                pg_minsize, OSD_JERASURE_W, decoding_matrix+(role*pg_minsize), dm_ids, role,
-                data_ptrs, data_ptrs+pg_minsize, bitmap_size
-            );
+            reed_sol_decode_chunk(dec, pg_minsize, role, data_ptrs, bitmap_size);
         }
     }
 }
@@ -507,38 +574,6 @@ static void get_old_new_buffers(osd_rmw_stripe_t & stripe, uint32_t wr_start, ui
     }
 }
 
-static void xor_multiple_buffers(buf_len_t *xor1, int n1, buf_len_t *xor2, int n2, void *dest, uint32_t len)
-{
-    assert(n1 > 0 && n2 > 0);
-    int i1 = 0, i2 = 0;
-    uint32_t start1 = 0, start2 = 0, end1 = xor1[0].len, end2 = xor2[0].len;
-    uint32_t pos = 0;
-    while (pos < len)
-    {
-        // We know for sure that ranges overlap
-        uint32_t end = std::min(end1, end2);
-        memxor(xor1[i1].buf + pos-start1, xor2[i2].buf + pos-start2, dest+pos, end-pos);
-        pos = end;
-        if (pos >= end1)
-        {
-            i1++;
-            if (i1 >= n1)
-            {
-                assert(pos >= end2);
-                return;
-            }
-            start1 = end1;
-            end1 += xor1[i1].len;
-        }
-        if (pos >= end2)
-        {
-            i2++;
-            start2 = end2;
-            end2 += xor2[i2].len;
-        }
-    }
-}
-
 static void calc_rmw_parity_copy_mod(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize,
     uint64_t *read_osd_set, uint64_t *write_osd_set, uint32_t chunk_size, uint32_t bitmap_granularity,
     uint32_t &start, uint32_t &end)
@@ -647,32 +682,44 @@ void calc_rmw_parity_xor(osd_rmw_stripe_t *stripes, int pg_size, uint64_t *read_
     calc_rmw_parity_copy_mod(stripes, pg_size, pg_minsize, read_osd_set, write_osd_set, chunk_size, bitmap_granularity, start, end);
     if (write_osd_set[pg_minsize] != 0 && end != 0)
     {
-        // Calculate new parity (XOR k+1)
-        int parity = pg_minsize, prev = -2;
-        for (int other = 0; other < pg_minsize; other++)
+        // Calculate new parity (XOR k+1) in one pass over all data chunks.
+        // Each data chunk may consist of up to 3 old/new buffers
+        int parity = pg_minsize;
+        buf_len_t bufs[pg_minsize][3];
+        int nbuf[pg_minsize] = { 0 }, curbuf[pg_minsize] = { 0 };
+        uint32_t positions[pg_minsize];
+        const void *data_ptrs[pg_minsize];
+        for (int i = 0; i < pg_minsize; i++)
+        {
+            get_old_new_buffers(stripes[i], start, end, bufs[i], nbuf[i]);
+            positions[i] = start;
+            data_ptrs[i] = stripes[i].bmp_buf;
+        }
+        memxor_multi(data_ptrs, pg_minsize, stripes[parity].bmp_buf, bitmap_size);
+        uint32_t pos = start;
+        while (pos < end)
         {
-            if (prev == -2)
+            uint32_t next_end = end;
+            for (int i = 0; i < pg_minsize; i++)
             {
-                prev = other;
+                assert(curbuf[i] < nbuf[i]);
+                data_ptrs[i] = bufs[i][curbuf[i]].buf + pos-positions[i];
+                uint32_t this_end = bufs[i][curbuf[i]].len + positions[i];
+                if (next_end > this_end)
+                    next_end = this_end;
             }
-            else
+            assert(next_end > pos);
+            for (int i = 0; i < pg_minsize; i++)
             {
-                int n1 = 0, n2 = 0;
-                buf_len_t xor1[3], xor2[3];
-                if (prev == -1)
-                {
-                    xor1[n1++] = { .buf = stripes[parity].write_buf, .len = end-start };
-                    memxor(stripes[parity].bmp_buf, stripes[other].bmp_buf, stripes[parity].bmp_buf, bitmap_size);
-                }
-                else
+                uint32_t this_end = bufs[i][curbuf[i]].len + positions[i];
+                if (next_end >= this_end)
                 {
-                    memxor(stripes[prev].bmp_buf, stripes[other].bmp_buf, stripes[parity].bmp_buf, bitmap_size);
-                    get_old_new_buffers(stripes[prev], start, end, xor1, n1);
-                    prev = -1;
+                    positions[i] += bufs[i][curbuf[i]].len;
+                    curbuf[i]++;
                 }
-                get_old_new_buffers(stripes[other], start, end, xor2, n2);
-                xor_multiple_buffers(xor1, n1, xor2, n2, stripes[parity].write_buf, end-start);
             }
+            memxor_multi(data_ptrs, pg_minsize, stripes[parity].write_buf + pos-start, next_end-pos);
+            pos = next_end;
         }
     }
     calc_rmw_parity_copy_parity(stripes, pg_size, pg_minsize, read_osd_set, write_osd_set, chunk_size, start, end);
@@ -734,20 +781,14 @@ void calc_rmw_parity_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_min
                         curbuf[i]++;
                     }
                 }
-                jerasure_matrix_encode(
-                    pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W, matrix->data,
-                    (char**)data_ptrs, (char**)data_ptrs+pg_minsize, next_end-pos
-                );
+                reed_sol_encode(matrix, pg_size, pg_minsize, data_ptrs, next_end-pos);
                 pos = next_end;
             }
             for (int i = 0; i < pg_size; i++)
             {
                 data_ptrs[i] = stripes[i].bmp_buf;
             }
-            jerasure_matrix_encode(
-                pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W, matrix->data,
-                (char**)data_ptrs, (char**)data_ptrs+pg_minsize, bitmap_size
-            );
+            reed_sol_encode(matrix, pg_size, pg_minsize, data_ptrs, bitmap_size);
         }
     }
     calc_rmw_parity_copy_parity(stripes, pg_size, pg_minsize, read_osd_set, write_osd_set, chunk_size, start, end);
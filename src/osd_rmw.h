@@ -46,6 +46,9 @@ void calc_rmw_parity_xor(osd_rmw_stripe_t *stripes, int pg_size, uint64_t *read_
 
 void use_jerasure(int pg_size, int pg_minsize, bool use);
 
+// Switch between the built-in SIMD GF(2^8) implementation (default) and Jerasure
+void use_ec_native(bool native);
+
 void reconstruct_stripes_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize, uint32_t bitmap_size);
 
 void calc_rmw_parity_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize,
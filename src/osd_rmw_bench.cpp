@@ -0,0 +1,149 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// EC throughput benchmark: measures single-core full-stripe encode and degraded-read decode speed
+// of XOR and Reed-Solomon (built-in GF(2^8) implementations and Jerasure) for several pool shapes.
+// Usage: osd_rmw_bench [min_seconds_per_case]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "osd_rmw.h"
+#include "gf256.h"
+#include "xor.h"
+#include "malloc_or_die.h"
+
+#define CHUNK_SIZE (128*1024)
+#define BITMAP_SIZE (CHUNK_SIZE/4096/8)
+
+struct bench_case_t
+{
+    int pg_size, pg_minsize;
+    bool xor_scheme;
+};
+
+static double now()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec/1000000000.0;
+}
+
+static void prepare_write(const bench_case_t & bc, void *write_buf, osd_rmw_stripe_t *stripes,
+    uint8_t *bitmaps, osd_num_t *osd_set, void **rmw_buf)
+{
+    memset(stripes, 0, sizeof(osd_rmw_stripe_t)*bc.pg_size);
+    split_stripes(bc.pg_minsize, CHUNK_SIZE, 0, CHUNK_SIZE*bc.pg_minsize, stripes);
+    *rmw_buf = calc_rmw(write_buf, stripes, osd_set, bc.pg_size, bc.pg_minsize, bc.pg_size, osd_set, CHUNK_SIZE, BITMAP_SIZE);
+    for (int i = 0; i < bc.pg_size; i++)
+        stripes[i].bmp_buf = bitmaps + i*BITMAP_SIZE;
+}
+
+static double bench_encode(const bench_case_t & bc, void *write_buf, double min_time)
+{
+    osd_num_t osd_set[bc.pg_size];
+    osd_rmw_stripe_t stripes[bc.pg_size];
+    uint8_t bitmaps[bc.pg_size*BITMAP_SIZE];
+    for (int i = 0; i < bc.pg_size; i++)
+        osd_set[i] = i+1;
+    void *rmw_buf;
+    prepare_write(bc, write_buf, stripes, bitmaps, osd_set, &rmw_buf);
+    uint64_t bytes = 0;
+    double start = now(), end;
+    do
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            if (bc.xor_scheme)
+                calc_rmw_parity_xor(stripes, bc.pg_size, osd_set, osd_set, CHUNK_SIZE, BITMAP_SIZE);
+            else
+                calc_rmw_parity_jerasure(stripes, bc.pg_size, bc.pg_minsize, osd_set, osd_set, CHUNK_SIZE, BITMAP_SIZE);
+            bytes += CHUNK_SIZE*bc.pg_minsize;
+        }
+        end = now();
+    } while (end-start < min_time);
+    free(rmw_buf);
+    return bytes/(end-start)/1000000000.0;
+}
+
+static double bench_decode(const bench_case_t & bc, double min_time)
+{
+    osd_num_t osd_set[bc.pg_size];
+    osd_rmw_stripe_t stripes[bc.pg_size];
+    uint8_t bitmaps[bc.pg_size*BITMAP_SIZE];
+    // Lose as many data chunks as possible
+    for (int i = 0; i < bc.pg_size; i++)
+        osd_set[i] = i < bc.pg_size-bc.pg_minsize ? 0 : i+1;
+    memset(stripes, 0, sizeof(stripes));
+    split_stripes(bc.pg_minsize, CHUNK_SIZE, 0, CHUNK_SIZE*bc.pg_minsize, stripes);
+    for (int i = 0; i < bc.pg_size; i++)
+    {
+        stripes[i].read_start = stripes[i].req_start;
+        stripes[i].read_end = stripes[i].req_end;
+    }
+    extend_missing_stripes(stripes, osd_set, bc.pg_minsize, bc.pg_size);
+    void *read_buf = alloc_read_buffer(stripes, bc.pg_size, 0);
+    memset(read_buf, 0x5a, CHUNK_SIZE*bc.pg_size);
+    for (int i = 0; i < bc.pg_size; i++)
+        stripes[i].bmp_buf = bitmaps + i*BITMAP_SIZE;
+    uint64_t bytes = 0;
+    double start = now(), end;
+    do
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            if (bc.xor_scheme)
+                reconstruct_stripes_xor(stripes, bc.pg_size, BITMAP_SIZE);
+            else
+                reconstruct_stripes_jerasure(stripes, bc.pg_size, bc.pg_minsize, BITMAP_SIZE);
+            bytes += CHUNK_SIZE*bc.pg_minsize;
+        }
+        end = now();
+    } while (end-start < min_time);
+    free(read_buf);
+    return bytes/(end-start)/1000000000.0;
+}
+
+int main(int narg, char *args[])
+{
+    double min_time = narg > 1 ? atof(args[1]) : 0.5;
+    const bench_case_t cases[] = {
+        { 3, 2, true },
+        { 5, 4, true },
+        { 3, 2, false },
+        { 6, 4, false },
+        { 11, 8, false },
+    };
+    const char *impls[] = { "jerasure", "generic", "ssse3", "avx2" };
+    void *write_buf = memalign_or_die(MEM_ALIGNMENT, CHUNK_SIZE*8);
+    for (int i = 0; i < CHUNK_SIZE*8/4; i++)
+        ((uint32_t*)write_buf)[i] = i*0x9e3779b9;
+    printf("%-10s %-8s %12s %12s\n", "scheme", "impl", "encode GB/s", "decode GB/s");
+    for (auto & bc: cases)
+    {
+        char scheme[32];
+        snprintf(scheme, sizeof(scheme), "%s %d+%d", bc.xor_scheme ? "xor" : "rs", bc.pg_minsize, bc.pg_size-bc.pg_minsize);
+        if (bc.xor_scheme)
+        {
+            printf("%-10s %-8s %12.2f %12.2f\n", scheme, memxor_impl_name(),
+                bench_encode(bc, write_buf, min_time), bench_decode(bc, min_time));
+            continue;
+        }
+        use_jerasure(bc.pg_size, bc.pg_minsize, true);
+        for (auto impl: impls)
+        {
+            if (!strcmp(impl, "jerasure"))
+                use_ec_native(false);
+            else if (gf256_select(impl))
+                use_ec_native(true);
+            else
+                continue;
+            printf("%-10s %-8s %12.2f %12.2f\n", scheme, impl,
+                bench_encode(bc, write_buf, min_time), bench_decode(bc, min_time));
+        }
+        use_jerasure(bc.pg_size, bc.pg_minsize, false);
+    }
+    free(write_buf);
+    return 0;
+}
@@ -20,6 +20,7 @@ void test11();
 void test12();
 void test13();
 void test14();
+void test15();
 
 int main(int narg, char *args[])
 {
@@ -47,6 +48,8 @@ int main(int narg, char *args[])
     test13();
     // Test 14
     test14();
+    // Test 15
+    test15();
     // End
     printf("all ok\n");
     return 0;
@@ -802,3 +805,76 @@ void test14()
     free(write_buf);
     use_jerasure(3, 2, false);
 }
+
+/***
+
+15. built-in GF(2^8) vs Jerasure 4+2 test
+   calc_rmw(offset=0, len=512K, osd_set=[1,2,3,4,0,0], write_set=[1,2,3,4,5,6])
+   then calc_rmw_parity_jerasure() with native and Jerasure implementations: parity must be the same
+   then reconstruct chunks 0 and 2 from [1,3,4,5] with both implementations
+
+***/
+
+void test15()
+{
+    const int bmp = 4;
+    use_jerasure(6, 4, true);
+    osd_num_t osd_set[6] = { 1, 2, 3, 4, 0, 0 };
+    osd_num_t write_osd_set[6] = { 1, 2, 3, 4, 5, 6 };
+    osd_rmw_stripe_t stripes[6] = { 0 };
+    unsigned bitmaps[6] = { 0 };
+    void *parity[2];
+    // Test 15.0 - encode with both implementations
+    uint8_t *write_buf = (uint8_t*)malloc_or_die(4*128*1024);
+    for (int i = 0; i < 4*128*1024; i++)
+        write_buf[i] = (i*7 + (i >> 11)*13) & 0xff;
+    for (int native = 0; native < 2; native++)
+    {
+        use_ec_native(native);
+        memset(stripes, 0, sizeof(stripes));
+        split_stripes(4, 128*1024, 0, 4*128*1024, stripes);
+        void *rmw_buf = calc_rmw(write_buf, stripes, osd_set, 6, 4, 6, write_osd_set, 128*1024, bmp);
+        for (int i = 0; i < 6; i++)
+            stripes[i].bmp_buf = bitmaps+i;
+        assert(rmw_buf);
+        assert(stripes[4].write_buf && stripes[5].write_buf);
+        calc_rmw_parity_jerasure(stripes, 6, 4, osd_set, write_osd_set, 128*1024, bmp);
+        parity[native] = rmw_buf;
+        if (native)
+        {
+            assert(memcmp(parity[0], parity[1], 2*128*1024) == 0);
+        }
+    }
+    // Test 15.1 - decode with both implementations
+    osd_num_t read_osd_set[6] = { 0, 2, 0, 4, 5, 6 };
+    for (int native = 0; native < 2; native++)
+    {
+        use_ec_native(native);
+        memset(stripes, 0, sizeof(stripes));
+        split_stripes(4, 128*1024, 0, 4*128*1024, stripes);
+        for (int role = 0; role < 6; role++)
+        {
+            stripes[role].read_start = stripes[role].req_start;
+            stripes[role].read_end = stripes[role].req_end;
+        }
+        assert(extend_missing_stripes(stripes, read_osd_set, 4, 6) == 0);
+        assert(stripes[0].missing && stripes[2].missing);
+        void *read_buf = alloc_read_buffer(stripes, 6, 0);
+        for (int i = 0; i < 6; i++)
+            stripes[i].bmp_buf = bitmaps+i;
+        memcpy(stripes[1].read_buf, write_buf+128*1024, 128*1024);
+        memcpy(stripes[3].read_buf, write_buf+3*128*1024, 128*1024);
+        memcpy(stripes[4].read_buf, parity[1], 128*1024);
+        memcpy(stripes[5].read_buf, parity[1]+128*1024, 128*1024);
+        reconstruct_stripes_jerasure(stripes, 6, 4, bmp);
+        assert(memcmp(stripes[0].read_buf, write_buf, 128*1024) == 0);
+        assert(memcmp(stripes[2].read_buf, write_buf+2*128*1024, 128*1024) == 0);
+        free(read_buf);
+    }
+    // Done
+    use_ec_native(true);
+    free(parity[0]);
+    free(parity[1]);
+    free(write_buf);
+    use_jerasure(6, 4, false);
+}
@@ -138,10 +138,181 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
 #ifdef OSD_STUB
     secondary_op_callback(cur_op);
 #else
-    bs->enqueue_op(cur_op->bs_op);
+    // forward_to is reset to zeroes by the messenger if OSD_FEATURE_WRITE_FORWARD isn't negotiated
+    if ((cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE || cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE) &&
+        cur_op->req.sec_rw.forward_to[0] != 0)
+        forward_secondary_write(cur_op);
+    // stab_len is already reset to 0 by the messenger if OSD_FEATURE_STAB_PIGGYBACK isn't negotiated
+    if ((cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE || cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE) &&
+        cur_op->req.sec_rw.stab_len > 0)
+        enqueue_piggyback_stab(cur_op->bs_op, cur_op->buf + cur_op->req.sec_rw.len, cur_op->req.sec_rw.stab_len);
+    else if (cur_op->req.hdr.opcode == OSD_OP_SEC_SYNC && cur_op->req.sec_sync.stab_len > 0)
+        enqueue_piggyback_stab(cur_op->bs_op, cur_op->buf, cur_op->req.sec_sync.stab_len);
+    if ((cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE || cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE) &&
+        (cur_op->req.sec_rw.flags & OSD_SEC_RW_SYNC))
+        enqueue_write_sync(cur_op->bs_op);
+    else
+        bs->enqueue_op(cur_op->bs_op);
 #endif
 }
 
+// Write + SYNC in one request: the write is durable when the callback is called.
+// The SYNC is submitted only after the write, so it also commits the write itself.
+// The SYNC operation is allocated in advance and keeps the write callback while the write
+// is in progress, then the callback is moved back to the write operation, so no other
+// allocation is needed. Blockstore calls a copy of the callback, so it may be replaced
+void osd_t::enqueue_write_sync(blockstore_op_t *bs_op)
+{
+    blockstore_op_t *sync_op = new blockstore_op_t();
+    sync_op->opcode = BS_OP_SYNC;
+    sync_op->callback = bs_op->callback;
+    bs_op->callback = [this, sync_op](blockstore_op_t *bs_op)
+    {
+        bs_op->callback = sync_op->callback;
+        if (bs_op->retval != bs_op->len)
+        {
+            delete sync_op;
+            inline_callback_t<blockstore_op_t>(bs_op->callback)(bs_op);
+            return;
+        }
+        sync_op->callback = [bs_op](blockstore_op_t *sync_op)
+        {
+            if (sync_op->retval < 0)
+            {
+                bs_op->retval = sync_op->retval;
+            }
+            delete sync_op;
+            inline_callback_t<blockstore_op_t>(bs_op->callback)(bs_op);
+        };
+        bs->enqueue_op(sync_op);
+    };
+    bs->enqueue_op(bs_op);
+}
+
+struct secondary_forward_t
+{
+    int pending;
+    osd_op_t *cur_op, *fwd_op;
+    blockstore_op_t *bs_op;
+    inline_callback_t<blockstore_op_t> op_cb;
+};
+
+static void finish_secondary_forward(secondary_forward_t *fw)
+{
+    if (--fw->pending > 0)
+    {
+        return;
+    }
+    osd_op_t *fwd_op = fw->fwd_op;
+    blockstore_op_t *bs_op = fw->bs_op;
+    if (fwd_op->reply.hdr.retval != fwd_op->req.sec_rw.len)
+    {
+        fprintf(stderr, "Failed to forward write of %lx:%lx v%lu: retval=%ld\n", fwd_op->req.sec_rw.oid.inode,
+            fwd_op->req.sec_rw.oid.stripe, fwd_op->req.sec_rw.version, fwd_op->reply.hdr.retval);
+        if (bs_op->retval == bs_op->len)
+            bs_op->retval = fwd_op->reply.hdr.retval < 0 ? fwd_op->reply.hdr.retval : -EIO;
+    }
+    else
+    {
+        // Older OSDs don't report write_count
+        fw->cur_op->reply.sec_rw.write_count = 1 + (fwd_op->reply.sec_rw.write_count > 0 ? fwd_op->reply.sec_rw.write_count : 1);
+    }
+    auto cb = fw->op_cb;
+    delete fwd_op;
+    delete fw;
+    cb(bs_op);
+}
+
+// Chain replication: pass the write to the next OSD of the chain in parallel with the local write.
+// The reply is sent when both are done and reports how many OSDs of the chain have written the data.
+// If the next OSD isn't connected, the write isn't forwarded and the primary sends it there itself
+void osd_t::forward_secondary_write(osd_op_t *cur_op)
+{
+    cur_op->reply.sec_rw.write_count = 1;
+    auto peer_it = msgr.osd_peer_fds.find(cur_op->req.sec_rw.forward_to[0]);
+    if (peer_it == msgr.osd_peer_fds.end() ||
+        !(msgr.clients.at(peer_it->second)->peer_features & OSD_FEATURE_WRITE_FORWARD))
+    {
+        return;
+    }
+    osd_op_t *fwd_op = new osd_op_t();
+    fwd_op->op_type = OSD_OP_OUT;
+    fwd_op->peer_fd = peer_it->second;
+    fwd_op->req = cur_op->req;
+    fwd_op->req.sec_rw.header.id = msgr.next_subop_id++;
+    fwd_op->req.sec_rw.stab_len = 0;
+    for (int i = 0; i < OSD_SEC_RW_MAX_FORWARD; i++)
+    {
+        fwd_op->req.sec_rw.forward_to[i] = i < OSD_SEC_RW_MAX_FORWARD-1 ? cur_op->req.sec_rw.forward_to[i+1] : 0;
+    }
+    fwd_op->bitmap = cur_op->bitmap;
+    fwd_op->bitmap_len = cur_op->req.sec_rw.attr_len;
+    if (cur_op->req.sec_rw.len > 0)
+    {
+        fwd_op->iov.push_back(cur_op->buf, cur_op->req.sec_rw.len);
+    }
+    secondary_forward_t *fw = new secondary_forward_t({
+        .pending = 2,
+        .cur_op = cur_op,
+        .fwd_op = fwd_op,
+        .bs_op = cur_op->bs_op,
+        .op_cb = cur_op->bs_op->callback,
+    });
+    cur_op->bs_op->callback = [fw](blockstore_op_t *bs_op) { finish_secondary_forward(fw); };
+    fwd_op->callback = [fw](osd_op_t *fwd_op) { finish_secondary_forward(fw); };
+    msgr.outbox_push(fwd_op);
+}
+
+struct secondary_stab_t
+{
+    int pending;
+    blockstore_op_t *bs_op, *stab_op;
+    inline_callback_t<blockstore_op_t> op_cb;
+};
+
+static void finish_piggyback_stab(secondary_stab_t *st)
+{
+    if (--st->pending > 0)
+    {
+        return;
+    }
+    blockstore_op_t *bs_op = st->bs_op, *stab_op = st->stab_op;
+    if (stab_op->retval < 0)
+    {
+        fprintf(stderr, "Failed to stabilize %u piggybacked object versions: retval=%d\n", stab_op->len, stab_op->retval);
+        if (bs_op->retval >= 0)
+        {
+            // The operation itself succeeded, so it must not be reported as failed to the client.
+            // EPIPE makes the primary drop the connection, repeer the PG and retry the operation
+            bs_op->retval = -EPIPE;
+        }
+    }
+    auto cb = st->op_cb;
+    delete stab_op;
+    delete st;
+    cb(bs_op);
+}
+
+// Stabilize the obj_ver_id list piggybacked on a write or sync. Listed versions are already
+// synced, so the stabilization runs in parallel with the operation itself. The callback is
+// called when both are done, and a stabilization error is reported as EPIPE
+void osd_t::enqueue_piggyback_stab(blockstore_op_t *bs_op, void *stab_buf, uint64_t stab_len)
+{
+    blockstore_op_t *stab_op = new blockstore_op_t();
+    stab_op->opcode = BS_OP_STABLE;
+    stab_op->len = stab_len / sizeof(obj_ver_id);
+    stab_op->buf = stab_buf;
+    secondary_stab_t *st = new secondary_stab_t({
+        .pending = 2,
+        .bs_op = bs_op,
+        .stab_op = stab_op,
+        .op_cb = bs_op->callback,
+    });
+    bs_op->callback = [st](blockstore_op_t *bs_op) { finish_piggyback_stab(st); };
+    stab_op->callback = [st](blockstore_op_t *stab_op) { finish_piggyback_stab(st); };
+    bs->enqueue_op(stab_op);
+}
+
 void osd_t::exec_show_config(osd_op_t *cur_op)
 {
     std::string json_err;
@@ -160,7 +331,16 @@ void osd_t::exec_show_config(osd_op_t *cur_op)
         { "immediate_commit", (immediate_commit == IMMEDIATE_ALL ? "all" :
             (immediate_commit == IMMEDIATE_SMALL ? "small" : "none")) },
         { "lease_timeout", etcd_report_interval+(MAX_ETCD_ATTEMPTS*(2*ETCD_QUICK_TIMEOUT)+999)/1000 },
+        { "features", msgr.features },
     };
+    // Remember features of the connected OSD, e.g. whether it may piggyback stabilize lists
+    msgr.clients.at(cur_op->peer_fd)->peer_features = req_json["features"].uint64_value();
+    if (req_json["connect_shm"].is_string() &&
+        msgr.connect_shm(cur_op->peer_fd, req_json["connect_shm"].string_value(), req_json["shm_ring_size"].uint64_value()))
+    {
+        // Local peer has offered shared memory rings and we've mapped them
+        wire_config["shm_connected"] = true;
+    }
 #ifdef WITH_RDMA
     if (msgr.is_rdma_enabled())
     {
@@ -259,6 +259,9 @@ static int vitastor_file_open(BlockDriverState *bs, QDict *options, int flags, E
         return -1;
     }
     bs->total_sectors = client->size / BDRV_SECTOR_SIZE;
+#if QEMU_VERSION_MAJOR >= 3
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
+#endif
     //client->aio_context = bdrv_get_aio_context(bs);
     qdict_del(options, "use_rdma");
     qdict_del(options, "rdma_mtu");
@@ -375,6 +378,10 @@ static int vitastor_refresh_limits(BlockDriverState *bs)
     bs->request_alignment = 4096;
 #endif
     bs->bl.opt_mem_alignment = 4096;
+#if QEMU_VERSION_MAJOR >= 3
+    bs->bl.pdiscard_alignment = 4096;
+    bs->bl.pwrite_zeroes_alignment = 4096;
+#endif
 #if QEMU_VERSION_MAJOR < 3
     return 0;
 #endif
@@ -466,6 +473,45 @@ static int coroutine_fn vitastor_co_writev(BlockDriverState *bs, int64_t sector_
 }
 #endif
 
+#if QEMU_VERSION_MAJOR >= 3
+#if QEMU_VERSION_MAJOR > 6 || QEMU_VERSION_MAJOR == 6 && QEMU_VERSION_MINOR >= 2
+static int coroutine_fn vitastor_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+#else
+static int coroutine_fn vitastor_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
+#endif
+{
+    VitastorClient *client = bs->opaque;
+    VitastorRPC task;
+    vitastor_co_init_task(bs, &task);
+
+    uint64_t inode = client->watch ? vitastor_c_inode_get_num(client->watch) : client->inode;
+    qemu_mutex_lock(&client->mutex);
+    vitastor_c_discard(client->proxy, inode, offset, bytes, vitastor_co_generic_bh_cb, &task);
+    qemu_mutex_unlock(&client->mutex);
+
+    while (!task.complete)
+    {
+        qemu_coroutine_yield();
+    }
+
+    return task.ret < 0 ? task.ret : 0;
+}
+
+#if QEMU_VERSION_MAJOR > 6 || QEMU_VERSION_MAJOR == 6 && QEMU_VERSION_MINOR >= 2
+static int coroutine_fn vitastor_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes, BdrvRequestFlags flags)
+#else
+static int coroutine_fn vitastor_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes, BdrvRequestFlags flags)
+#endif
+{
+    if (!(flags & BDRV_REQ_MAY_UNMAP))
+    {
+        // Discard deallocates the range, QEMU writes zero buffers instead
+        return -ENOTSUP;
+    }
+    return vitastor_co_pdiscard(bs, offset, bytes);
+}
+#endif
+
 static int coroutine_fn vitastor_co_flush(BlockDriverState *bs)
 {
     VitastorClient *client = bs->opaque;
@@ -558,6 +604,9 @@ static BlockDriver bdrv_vitastor = {
 
     .bdrv_co_preadv                 = vitastor_co_preadv,
     .bdrv_co_pwritev                = vitastor_co_pwritev,
+
+    .bdrv_co_pdiscard               = vitastor_co_pdiscard,
+    .bdrv_co_pwrite_zeroes          = vitastor_co_pwrite_zeroes,
 #else
     .bdrv_co_readv                  = vitastor_co_readv,
     .bdrv_co_writev                 = vitastor_co_writev,
@@ -14,7 +14,7 @@ ring_loop_t::ring_loop_t(int qd)
     {
         throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-ret));
     }
-    free_ring_data_ptr = *ring.cq.kring_entries;
+    free_ring_data_ptr = ring_data_count = *ring.cq.kring_entries;
     ring_datas = (struct ring_data_t*)calloc(free_ring_data_ptr, sizeof(ring_data_t));
     free_ring_data = (int*)malloc(sizeof(int) * free_ring_data_ptr);
     if (!ring_datas || !free_ring_data)
@@ -64,7 +64,17 @@ void ring_loop_t::loop()
     while (!io_uring_peek_cqe(&ring, &cqe))
     {
         struct ring_data_t *d = (struct ring_data_t*)cqe->user_data;
-        if (d->callback)
+        if (d->callback && ((cqe->flags & IORING_CQE_F_MORE) || d < ring_datas || d >= ring_datas+ring_data_count))
+        {
+            // More completions will follow for this SQE or ring_data item is owned by the caller, so keep it
+            struct ring_data_t dl;
+            dl.iov = d->iov;
+            dl.res = cqe->res;
+            dl.flags = cqe->flags;
+            dl.callback = d->callback;
+            dl.callback(&dl);
+        }
+        else if (d->callback)
         {
             // First free ring_data item, then call the callback
             // so it has at least 1 free slot for the next event
@@ -72,6 +82,7 @@ void ring_loop_t::loop()
             struct ring_data_t dl;
             dl.iov = d->iov;
             dl.res = cqe->res;
+            dl.flags = cqe->flags;
             dl.callback.swap(d->callback);
             free_ring_data[free_ring_data_ptr++] = d - ring_datas;
             dl.callback(&dl);
@@ -108,7 +119,9 @@ void ring_loop_t::restore(unsigned sqe_tail)
     assert(ring.sq.sqe_tail >= sqe_tail);
     for (unsigned i = sqe_tail; i < ring.sq.sqe_tail; i++)
     {
-        free_ring_data[free_ring_data_ptr++] = ((ring_data_t*)ring.sq.sqes[i & *ring.sq.kring_mask].user_data) - ring_datas;
+        ring_data_t *d = (ring_data_t*)ring.sq.sqes[i & *ring.sq.kring_mask].user_data;
+        if (d >= ring_datas && d < ring_datas+ring_data_count)
+            free_ring_data[free_ring_data_ptr++] = d - ring_datas;
     }
     ring.sq.sqe_tail = sqe_tail;
 }
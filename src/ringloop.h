@@ -15,6 +15,18 @@
 #include <functional>
 #include <vector>
 
+#include "inline_callback.h"
+
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+
+// Provided buffer rings (liburing 2.4+) and multishot recv (Linux 6.0+)
+#if defined(IORING_RECV_MULTISHOT) && defined(IO_URING_VERSION_MAJOR) && \
+    (IO_URING_VERSION_MAJOR > 2 || IO_URING_VERSION_MINOR >= 4)
+#define RINGLOOP_BUF_RING
+#endif
+
 static inline void my_uring_prep_rw(int op, struct io_uring_sqe *sqe, int fd, const void *addr, unsigned len, off_t offset)
 {
     sqe->opcode = op;
@@ -62,6 +74,27 @@ static inline void my_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const
     sqe->msg_flags = flags;
 }
 
+#ifdef IORING_CQE_F_NOTIF
+// Zero-copy sendmsg (Linux 6.1+). The first completion reports the result and has IORING_CQE_F_MORE set
+// if a second one follows. The second one has IORING_CQE_F_NOTIF and means that buffers may be reused
+static inline void my_uring_prep_sendmsg_zc(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned flags)
+{
+    my_uring_prep_rw(IORING_OP_SENDMSG_ZC, sqe, fd, msg, 1, 0);
+    sqe->msg_flags = flags;
+}
+#endif
+
+#ifdef RINGLOOP_BUF_RING
+// Multishot recv into buffers selected from the provided buffer ring <buf_group>
+static inline void my_uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, int buf_group)
+{
+    my_uring_prep_rw(IORING_OP_RECV, sqe, fd, NULL, 0, 0);
+    sqe->ioprio |= IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buf_group;
+}
+#endif
+
 static inline void my_uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, short poll_mask)
 {
     my_uring_prep_rw(IORING_OP_POLL_ADD, sqe, fd, NULL, 0, 0);
@@ -112,7 +145,8 @@ struct ring_data_t
 {
     struct iovec iov; // for single-entry read/write operations
     int res;
-    std::function<void(ring_data_t*)> callback;
+    unsigned flags; // CQE flags
+    inline_callback_t<ring_data_t> callback;
 };
 
 struct ring_consumer_t
@@ -125,6 +159,7 @@ class ring_loop_t
     std::vector<std::pair<int,std::function<void()>>> get_sqe_queue;
     std::vector<ring_consumer_t*> consumers;
     struct ring_data_t *ring_datas;
+    unsigned ring_data_count;
     int *free_ring_data;
     int wait_sqe_id;
     unsigned free_ring_data_ptr;
@@ -148,6 +183,28 @@ public:
         }
         return sqe;
     }
+    // Get an SQE completed through caller-owned <data> instead of a ring_data_t slot.
+    // Used for long-living multishot requests so they don't exhaust the slots
+    inline struct io_uring_sqe* get_sqe(ring_data_t *data)
+    {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (sqe)
+        {
+            *sqe = { 0 };
+            io_uring_sqe_set_data(sqe, data);
+        }
+        return sqe;
+    }
+#ifdef RINGLOOP_BUF_RING
+    inline io_uring_buf_ring* setup_buf_ring(unsigned entries, int buf_group, int *err)
+    {
+        return io_uring_setup_buf_ring(&ring, entries, buf_group, 0, err);
+    }
+    inline void free_buf_ring(io_uring_buf_ring *br, unsigned entries, int buf_group)
+    {
+        io_uring_free_buf_ring(&ring, br, entries, buf_group);
+    }
+#endif
     inline int wait_sqe(std::function<void()> cb)
     {
         get_sqe_queue.push_back({ wait_sqe_id, cb });
@@ -4,6 +4,9 @@
 /**
  * Stub "OSD" implemented on top of osd_messenger to test & compare
  * network performance with sync read/write and io_uring
+ *
+ * Numeric messenger options may be passed as --option value,
+ * for example --min_zerocopy_send_size 65536
  */
 
 #include <sys/types.h>
@@ -23,6 +26,7 @@
 #include "ringloop.h"
 #include "epoll_manager.h"
 #include "messenger.h"
+#include "json11/json11.hpp"
 
 int bind_stub(const char *bind_address, int bind_port);
 
@@ -39,6 +43,13 @@ int main(int narg, char *args[])
     msgr->ringloop = ringloop;
     msgr->repeer_pgs = [](osd_num_t) {};
     msgr->exec_op = [msgr](osd_op_t *op) { stub_exec_op(msgr, op); };
+    json11::Json::object config;
+    for (int i = 1; i < narg-1; i += 2)
+    {
+        if (args[i][0] == '-' && args[i][1] == '-')
+            config[args[i]+2] = (uint64_t)strtoull(args[i+1], NULL, 10);
+    }
+    msgr->parse_config(config);
     // Accept new connections
     int listen_fd = bind_stub("0.0.0.0", 11203);
     epmgr->set_fd_handler(listen_fd, false, [listen_fd, msgr](int fd, int events)
@@ -6,52 +6,63 @@
 #include <assert.h>
 #include "cluster_client.h"
 
-void configure_single_pg_pool(cluster_client_t *cli)
+std::vector<etcd_kv_t> single_pg_pool_state(bool ec = false, osd_num_t primary = 1)
 {
-    cli->st_cli.on_load_pgs_hook(true);
-    cli->st_cli.parse_state((etcd_kv_t){
-        .key = "/config/pools",
-        .value = json11::Json::object {
-            { "1", json11::Json::object {
-                { "name", "hddpool" },
-                { "scheme", "replicated" },
-                { "pg_size", 2 },
-                { "pg_minsize", 1 },
-                { "pg_count", 1 },
-                { "failure_domain", "osd" },
-            } }
-        },
-    });
-    cli->st_cli.parse_state((etcd_kv_t){
-        .key = "/config/pgs",
-        .value = json11::Json::object {
-            { "items", json11::Json::object {
+    return std::vector<etcd_kv_t>{
+        (etcd_kv_t){
+            .key = "/config/pools",
+            .value = json11::Json::object {
                 { "1", json11::Json::object {
+                    { "name", "hddpool" },
+                    { "scheme", ec ? "xor" : "replicated" },
+                    { "pg_size", ec ? 3 : 2 },
+                    { "pg_minsize", ec ? 2 : 1 },
+                    { "parity_chunks", ec ? 1 : 0 },
+                    { "pg_count", 1 },
+                    { "failure_domain", "osd" },
+                } }
+            },
+        },
+        (etcd_kv_t){
+            .key = "/config/pgs",
+            .value = json11::Json::object {
+                { "items", json11::Json::object {
                     { "1", json11::Json::object {
-                        { "osd_set", json11::Json::array { 1, 2 } },
-                        { "primary", 1 },
+                        { "1", json11::Json::object {
+                            { "osd_set", ec ? json11::Json::array { 1, 2, 3 } : json11::Json::array { 1, 2 } },
+                            { "primary", primary },
+                        } }
                     } }
                 } }
-            } }
+            },
         },
-    });
-    cli->st_cli.parse_state((etcd_kv_t){
-        .key = "/pg/state/1/1",
-        .value = json11::Json::object {
-            { "peers", json11::Json::array { 1, 2 } },
-            { "primary", 1 },
-            { "state", json11::Json::array { "active" } },
+        (etcd_kv_t){
+            .key = "/pg/state/1/1",
+            .value = json11::Json::object {
+                { "peers", ec ? json11::Json::array { 1, 2, 3 } : json11::Json::array { 1, 2 } },
+                { "primary", primary },
+                { "state", json11::Json::array { "active" } },
+            },
         },
-    });
+    };
+}
+
+void configure_single_pg_pool(cluster_client_t *cli, bool ec = false)
+{
+    cli->st_cli.on_load_pgs_hook(true);
+    for (auto & kv: single_pg_pool_state(ec))
+    {
+        cli->st_cli.parse_state(kv);
+    }
     std::map<std::string, etcd_kv_t> changes;
     cli->st_cli.on_change_hook(changes);
 }
 
-int *test_write(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c, std::function<void()> cb = NULL)
+int *test_write(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c, std::function<void()> cb = NULL, bool allow_immediate = false)
 {
     printf("Post write %lx+%lx\n", offset, len);
     int *r = new int;
-    *r = -1;
+    *r = allow_immediate ? -2 : -1;
     cluster_op_t *op = new cluster_op_t();
     op->opcode = OSD_OP_WRITE;
     op->inode = 0x1000000000001;
@@ -75,6 +86,54 @@ int *test_write(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c,
     return r;
 }
 
+int *test_read(cluster_client_t *cli, uint64_t offset, uint64_t len, bool allow_immediate = false)
+{
+    printf("Post read %lx+%lx\n", offset, len);
+    int *r = new int;
+    *r = allow_immediate ? -2 : -1;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_READ;
+    op->inode = 0x1000000000001;
+    op->offset = offset;
+    op->len = len;
+    op->iov.push_back(malloc_or_die(len), len);
+    op->callback = [r](cluster_op_t *op)
+    {
+        if (*r == -1)
+            printf("Error: Not allowed to complete yet\n");
+        assert(*r != -1);
+        *r = op->retval == op->len ? 1 : 0;
+        free(op->iov.buf[0].iov_base);
+        printf("Done read %lx+%lx r=%d\n", op->offset, op->len, op->retval);
+        delete op;
+    };
+    cli->execute(op);
+    return r;
+}
+
+int *test_discard(cluster_client_t *cli, uint64_t offset, uint64_t len)
+{
+    printf("Post discard %lx+%lx\n", offset, len);
+    int *r = new int;
+    *r = -1;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_DELETE;
+    op->inode = 0x1000000000001;
+    op->offset = offset;
+    op->len = len;
+    op->callback = [r](cluster_op_t *op)
+    {
+        if (*r == -1)
+            printf("Error: Not allowed to complete yet\n");
+        assert(*r != -1);
+        *r = op->retval == op->len ? 1 : 0;
+        printf("Done discard %lx+%lx r=%d\n", op->offset, op->len, op->retval);
+        delete op;
+    };
+    cli->execute(op);
+    return r;
+}
+
 int *test_sync(cluster_client_t *cli)
 {
     printf("Post sync\n");
@@ -114,6 +173,7 @@ void pretend_connected(cluster_client_t *cli, osd_num_t osd_num)
     int peer_fd = cli->msgr.clients.size() ? std::prev(cli->msgr.clients.end())->first+1 : 10;
     cli->msgr.osd_peer_fds[osd_num] = peer_fd;
     cli->msgr.clients[peer_fd] = new osd_client_t();
+    cli->msgr.clients[peer_fd]->peer_fd = peer_fd;
     cli->msgr.clients[peer_fd]->osd_num = osd_num;
     cli->msgr.clients[peer_fd]->peer_state = PEER_CONNECTED;
     cli->msgr.wanted_peers.erase(osd_num);
@@ -167,7 +227,8 @@ void pretend_op_completed(cluster_client_t *cli, osd_op_t *op, int64_t retval)
 {
     assert(op);
     printf("Pretend completed %s %lx+%x\n", op->req.hdr.opcode == OSD_OP_SYNC
-        ? "sync" : (op->req.hdr.opcode == OSD_OP_WRITE ? "write" : "read"), op->req.rw.offset, op->req.rw.len);
+        ? "sync" : (op->req.hdr.opcode == OSD_OP_WRITE ? "write" : (op->req.hdr.opcode == OSD_OP_DELETE
+        ? "delete" : "read")), op->req.rw.offset, op->req.rw.len);
     uint64_t op_id = op->req.hdr.id;
     int peer_fd = op->peer_fd;
     cli->msgr.clients[peer_fd]->sent_ops.erase(op_id);
@@ -176,7 +237,7 @@ void pretend_op_completed(cluster_client_t *cli, osd_op_t *op, int64_t retval)
     op->reply.hdr.opcode = op->req.hdr.opcode;
     op->reply.hdr.retval = retval < 0 ? retval : (op->req.hdr.opcode == OSD_OP_SYNC ? 0 : op->req.rw.len);
     // Copy lambda to be unaffected by `delete op`
-    std::function<void(osd_op_t*)>(op->callback)(op);
+    inline_callback_t<osd_op_t>(op->callback)(op);
 }
 
 void test1()
@@ -333,6 +394,39 @@ void test1()
     can_complete(r2);
     pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x1000, 0x1000), 0);
     check_completed(r2);
+    r2 = test_sync(cli);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r2);
+
+    // Check that a write waiting for a replay then overwrites the replayed buffer in place
+    r1 = test_write(cli, 0, 0x4000, 0x62);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x4000), 0);
+    check_completed(r1);
+    pretend_disconnected(cli, 1);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+    check_op_count(cli, 1, 1);
+    r2 = test_write(cli, 0x1000, 0x1000, 0x63);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x4000), 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x1000, 0x1000), 0);
+    check_completed(r2);
+    pretend_disconnected(cli, 1);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+    check_op_count(cli, 1, 1);
+    {
+        osd_op_t *op = find_op(cli, 1, OSD_OP_WRITE, 0, 0x4000);
+        assert(op && op->iov.count == 1);
+        uint8_t *buf = (uint8_t*)op->iov.buf[0].iov_base;
+        assert(buf[0xFFF] == 0x62 && buf[0x1000] == 0x63 && buf[0x1FFF] == 0x63 && buf[0x2000] == 0x62);
+        pretend_op_completed(cli, op, 0);
+    }
+    check_op_count(cli, 1, 0);
 
     // Free client
     delete cli;
@@ -389,19 +483,620 @@ void test2()
     for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
     assert(i == uit->second.len);
     uit++;
+    // 8k-12k = 0x88 overwrites the buffer in place
+    void *orig_buf = std::next(unsynced_writes.begin(), 2)->second.buf;
+    op->len = op->iov.buf[0].iov_len = 4096;
+    op->offset = 8192;
+    memset(op->iov.buf[0].iov_base, 0x88, op->iov.buf[0].iov_len);
+    cluster_client_t::copy_write(op, unsynced_writes);
+    assert(unsynced_writes.size() == 4);
+    uit = std::next(unsynced_writes.begin(), 2);
+    assert(uit->first.stripe == 8192 && uit->second.buf == orig_buf);
+    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x88; i++) {}
+    assert(i == uit->second.len);
+    // 4M-4M+12k = 0xB0, 0xB1, 0xB2 sequentially: the third write is merged into the second buffer
+    for (int j = 0; j < 3; j++)
+    {
+        op->offset = 4096*1024 + j*4096;
+        memset(op->iov.buf[0].iov_base, 0xB0+j, op->iov.buf[0].iov_len);
+        cluster_client_t::copy_write(op, unsynced_writes);
+    }
+    assert(unsynced_writes.size() == 6);
+    uit = std::next(unsynced_writes.begin(), 4);
+    assert(uit->first.stripe == 4096*1024 && uit->second.len == 4096);
+    uit++;
+    assert(uit->first.stripe == 4096*1024+4096 && uit->second.len == 8192);
+    for (i = 0; i < 4096 && ((uint8_t*)uit->second.buf)[i] == 0xB1; i++) {}
+    for (; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0xB2; i++) {}
+    assert(i == uit->second.len);
+    // 2M-2M+16k = 0x99, then discard 2M+4k-2M+8k which splits it into two parts of one allocation
+    op->len = op->iov.buf[0].iov_len = 16384;
+    op->offset = 2048*1024;
+    memset(op->iov.buf[0].iov_base, 0x99, op->iov.buf[0].iov_len);
+    cluster_client_t::copy_write(op, unsynced_writes);
+    orig_buf = std::next(unsynced_writes.begin(), 4)->second.buf;
+    op->opcode = OSD_OP_DELETE;
+    op->offset = 2048*1024+4096;
+    op->len = 4096;
+    cluster_client_t::copy_write(op, unsynced_writes);
+    assert(unsynced_writes.size() == 9);
+    // 2M+6k-2M+12k = 0xAA cuts the shared tail without copying
+    op->opcode = OSD_OP_WRITE;
+    op->len = op->iov.buf[0].iov_len = 6144;
+    op->offset = 2048*1024+6144;
+    memset(op->iov.buf[0].iov_base, 0xAA, op->iov.buf[0].iov_len);
+    cluster_client_t::copy_write(op, unsynced_writes);
+    assert(unsynced_writes.size() == 10);
+    uit = std::next(unsynced_writes.begin(), 4);
+    assert(uit->first.stripe == 2048*1024 && uit->second.len == 4096 && uit->second.buf == orig_buf);
+    uit++;
+    assert(uit->first.stripe == 2048*1024+4096 && uit->second.len == 2048 && !uit->second.buf);
+    uit++;
+    assert(uit->first.stripe == 2048*1024+6144 && uit->second.len == 6144);
+    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0xAA; i++) {}
+    assert(i == uit->second.len);
+    uit++;
+    assert(uit->first.stripe == 2048*1024+12288 && uit->second.len == 4096);
+    assert(uit->second.buf == orig_buf + 12288);
+    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x99; i++) {}
+    assert(i == uit->second.len);
     // free memory
     free(op->iov.buf[0].iov_base);
     delete op;
-    for (auto p: unsynced_writes)
+    for (auto & p: unsynced_writes)
     {
-        free(p.second.buf);
+        cluster_client_t::free_buffer(p.second);
     }
     printf("[ok] copy_write test\n");
 }
 
+void test3()
+{
+    json11::Json config = json11::Json::object { { "client_ec_writeback", true } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli, true);
+    pretend_connected(cli, 1);
+    // Stripe is 2*128K. Two adjacent partial writes are acknowledged at once
+    // and then sent as a single full-stripe write
+    int *r1 = test_write(cli, 0, 0x10000, 0x55, NULL, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 0);
+    r1 = test_write(cli, 0x10000, 0x30000, 0x56, NULL, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 1);
+    osd_op_t *op = find_op(cli, 1, OSD_OP_WRITE, 0, 0x40000);
+    assert(op && op->iov.count == 1);
+    for (int i = 0; i < 0x40000; i++)
+        assert(((uint8_t*)op->iov.buf[0].iov_base)[i] == (i < 0x10000 ? 0x55 : 0x56));
+    // Overlapping read waits for the flush
+    int *r2 = test_read(cli, 0, 0x1000);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, op, 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 0x1000), 0);
+    check_completed(r2);
+    // Partial stripe is flushed by SYNC and SYNC waits for it
+    r1 = test_write(cli, 0x40000, 0x1000, 0x57, NULL, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 0);
+    r2 = test_sync(cli);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x40000, 0x1000), 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r2);
+    // Non-adjacent write to the same stripe flushes the previous part
+    r1 = test_write(cli, 0x80000, 0x1000, 0x58, NULL, true);
+    check_completed(r1);
+    r1 = test_write(cli, 0x90000, 0x1000, 0x59, NULL, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x80000, 0x1000), 0);
+    // Fully overwritten buffer is dropped
+    r1 = test_write(cli, 0x80000, 0x40000, 0x5A);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x80000, 0x40000), 0);
+    check_completed(r1);
+    check_op_count(cli, 1, 0);
+    // Buffers of a deleted pool are dropped and the next SYNC reports the loss
+    r1 = test_write(cli, 0xC0000, 0x1000, 0x5B, NULL, true);
+    check_completed(r1);
+    cli->st_cli.pool_config.erase(1);
+    r2 = new int;
+    *r2 = -1;
+    cluster_op_t *sync_op = new cluster_op_t();
+    sync_op->opcode = OSD_OP_SYNC;
+    sync_op->callback = [r2](cluster_op_t *op)
+    {
+        *r2 = op->retval == -EIO ? 1 : 0;
+        delete op;
+    };
+    cli->execute(sync_op);
+    check_completed(r2);
+    check_op_count(cli, 1, 0);
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] EC stripe write-back test\n");
+}
+
+void test4()
+{
+    json11::Json config = json11::Json::object { { "client_writeback", true } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    // Adjacent small writes are acknowledged at once and merged
+    int *r1 = test_write(cli, 0, 0x1000, 0x55, NULL, true);
+    check_completed(r1);
+    r1 = test_write(cli, 0x1000, 0x1000, 0x56, NULL, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 0);
+    // Covered read is served from memory
+    int *r2 = new int;
+    *r2 = -1;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_READ;
+    op->inode = 0x1000000000001;
+    op->offset = 0x800;
+    op->len = 0x1000;
+    op->iov.push_back(malloc_or_die(op->len), op->len);
+    op->callback = [r2](cluster_op_t *op)
+    {
+        *r2 = op->retval == op->len ? 1 : 0;
+        for (int i = 0; i < op->len; i++)
+            assert(((uint8_t*)op->iov.buf[0].iov_base)[i] == (i < 0x800 ? 0x55 : 0x56));
+        free(op->iov.buf[0].iov_base);
+        delete op;
+    };
+    cli->execute(op);
+    check_completed(r2);
+    check_op_count(cli, 1, 0);
+    // Partially covered read waits for the flush
+    r2 = test_read(cli, 0x1000, 0x2000);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x2000), 0);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x1000, 0x2000), 0);
+    check_completed(r2);
+    // Reads from a buffer starting in the middle of a stripe use offsets from the buffer start
+    r1 = test_write(cli, 0x41000, 0x1000, 0x58, NULL, true);
+    check_completed(r1);
+    r1 = test_write(cli, 0x42000, 0x1000, 0x59, NULL, true);
+    check_completed(r1);
+    r2 = new int;
+    *r2 = -1;
+    op = new cluster_op_t();
+    op->opcode = OSD_OP_READ;
+    op->inode = 0x1000000000001;
+    op->offset = 0x41800;
+    op->len = 0x1000;
+    op->iov.push_back(malloc_or_die(op->len), op->len);
+    op->callback = [r2](cluster_op_t *op)
+    {
+        *r2 = op->retval == op->len ? 1 : 0;
+        for (int i = 0; i < op->len; i++)
+            assert(((uint8_t*)op->iov.buf[0].iov_base)[i] == (i < 0x800 ? 0x58 : 0x59));
+        free(op->iov.buf[0].iov_base);
+        delete op;
+    };
+    cli->execute(op);
+    check_completed(r2);
+    check_op_count(cli, 1, 0);
+    // SYNC flushes buffers and waits for them
+    r1 = test_write(cli, 0x20000, 0x1000, 0x57, NULL, true);
+    check_completed(r1);
+    r2 = test_sync(cli);
+    check_op_count(cli, 1, 2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x20000, 0x1000), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x41000, 0x2000), 0);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r2);
+    check_op_count(cli, 1, 0);
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] write-back cache test\n");
+}
+
+void test5()
+{
+    json11::Json config = json11::Json::object { { "client_readahead", 0x10000 } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    // Two sequential reads start readahead with the window of 4 read sizes
+    int *r1 = test_read(cli, 0, 0x1000);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 0x1000), 0);
+    check_completed(r1);
+    r1 = test_read(cli, 0x1000, 0x1000);
+    check_op_count(cli, 1, 2);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x1000, 0x1000), 0);
+    check_completed(r1);
+    osd_op_t *op = find_op(cli, 1, OSD_OP_READ, 0x2000, 0x4000);
+    assert(op);
+    memset(op->iov.buf[0].iov_base, 0x55, 0x4000);
+    pretend_op_completed(cli, op, 0);
+    // Following reads are served from memory until less than a half of the window remains
+    int *r2 = new int;
+    *r2 = -1;
+    cluster_op_t *rop = new cluster_op_t();
+    rop->opcode = OSD_OP_READ;
+    rop->inode = 0x1000000000001;
+    rop->offset = 0x2000;
+    rop->len = 0x2000;
+    rop->iov.push_back(malloc_or_die(rop->len), rop->len);
+    rop->callback = [r2](cluster_op_t *op)
+    {
+        *r2 = op->retval == op->len ? 1 : 0;
+        for (int i = 0; i < op->len; i++)
+            assert(((uint8_t*)op->iov.buf[0].iov_base)[i] == 0x55);
+        free(op->iov.buf[0].iov_base);
+        delete op;
+    };
+    cli->execute(rop);
+    check_completed(r2);
+    check_op_count(cli, 1, 0);
+    // Now only 0x2000 is left ahead, so the next read triggers a prefetch of the doubled window
+    r1 = test_read(cli, 0x4000, 0x1000, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 1);
+    op = find_op(cli, 1, OSD_OP_READ, 0x6000, 0x8000);
+    assert(op);
+    // A read crossing into the buffer being loaded waits for it
+    r1 = test_read(cli, 0x5000, 0x2000);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, op, 0);
+    check_completed(r1);
+    // Client's own write drops the overlapping buffer, so the next read goes to the OSD
+    r1 = test_write(cli, 0x7000, 0x1000, 0x56);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x7000, 0x1000), 0);
+    check_completed(r1);
+    r1 = test_read(cli, 0x7000, 0x1000);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x7000, 0x1000), 0);
+    check_completed(r1);
+    // Random read stops readahead
+    r1 = test_read(cli, 0x100000, 0x1000);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x100000, 0x1000), 0);
+    check_completed(r1);
+    r1 = test_read(cli, 0x8000, 0x1000);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x8000, 0x1000), 0);
+    check_completed(r1);
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] readahead test\n");
+}
+
+void test6()
+{
+    json11::Json config = json11::Json::object { { "client_readahead", 0x10000 } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    // Unsynced write and a SYNC, the next write has to wait for the SYNC
+    int *r1 = test_write(cli, 0x100000, 0x1000, 0x55);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x100000, 0x1000), 0);
+    check_completed(r1);
+    int *r2 = test_sync(cli);
+    check_op_count(cli, 1, 1);
+    int *r3 = test_write(cli, 0x7000, 0x1000, 0x56);
+    check_op_count(cli, 1, 1);
+    // Sequential reads start a prefetch over the queued write, it reaches the OSD first and gets old data
+    r1 = test_read(cli, 0, 0x2000);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 0x2000), 0);
+    check_completed(r1);
+    r1 = test_read(cli, 0x2000, 0x2000);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x2000, 0x2000), 0);
+    check_completed(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x4000, 0x8000), 0);
+    // The write is sent after the SYNC, its completion drops the prefetched buffer
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r2);
+    can_complete(r3);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x7000, 0x1000), 0);
+    check_completed(r3);
+    // So the next read goes to the OSD instead of returning old data from memory
+    r1 = test_read(cli, 0x4000, 0x4000);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x4000, 0x4000), 0);
+    check_completed(r1);
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] readahead write ordering test\n");
+}
+
+void test7()
+{
+    json11::Json config = json11::Json::object { { "client_snapshot_cache", 0x100000 } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/config/inode/1/1",
+        .value = json11::Json::object {
+            { "name", "snap" },
+            { "size", 0x1000000 },
+            { "readonly", true },
+        },
+    });
+    pretend_connected(cli, 1);
+    // Read of a readonly inode fetches the whole stripe into the cache
+    int *r1 = test_read(cli, 0x1000, 0x1000);
+    check_op_count(cli, 1, 1);
+    osd_op_t *op = find_op(cli, 1, OSD_OP_READ, 0, 0x20000);
+    assert(op);
+    memset(op->iov.buf[0].iov_base, 0x55, 0x20000);
+    memset(op->bitmap, 0xff, op->bitmap_len);
+    can_complete(r1);
+    pretend_op_completed(cli, op, 0);
+    check_completed(r1);
+    // Next reads of the same stripe are served from memory
+    int *r2 = new int;
+    *r2 = -1;
+    cluster_op_t *rop = new cluster_op_t();
+    rop->opcode = OSD_OP_READ;
+    rop->inode = 0x1000000000001;
+    rop->offset = 0x8000;
+    rop->len = 0x4000;
+    rop->iov.push_back(malloc_or_die(rop->len), rop->len);
+    rop->callback = [r2](cluster_op_t *op)
+    {
+        *r2 = op->retval == op->len ? 1 : 0;
+        for (int i = 0; i < op->len; i++)
+            assert(((uint8_t*)op->iov.buf[0].iov_base)[i] == 0x55);
+        free(op->iov.buf[0].iov_base);
+        delete op;
+    };
+    cli->execute(rop);
+    check_completed(r2);
+    check_op_count(cli, 1, 0);
+    // Another stripe isn't cached yet
+    r1 = test_read(cli, 0x20000, 0x1000);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x20000, 0x20000), 0);
+    check_completed(r1);
+    // Cache is dropped when the inode becomes writable
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/config/inode/1/1",
+        .value = json11::Json::object {
+            { "name", "snap" },
+            { "size", 0x1000000 },
+        },
+    });
+    std::map<std::string, etcd_kv_t> changes;
+    cli->st_cli.on_change_hook(changes);
+    r1 = test_read(cli, 0x1000, 0x1000);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x1000, 0x1000), 0);
+    check_completed(r1);
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] readonly inode cache test\n");
+}
+
+void pretend_batch_completed(cluster_client_t *cli, osd_op_t *op, std::vector<int64_t> retvals)
+{
+    assert(op && op->req.hdr.opcode == OSD_OP_BATCH);
+    osd_op_batch_data_t *batch = (osd_op_batch_data_t*)op->buf;
+    assert(batch->count == retvals.size());
+    printf("Pretend completed batch of %lu\n", batch->count);
+    cli->msgr.clients[op->peer_fd]->sent_ops.erase(op->req.hdr.id);
+    op->reply.hdr.magic = SECONDARY_OSD_REPLY_MAGIC;
+    op->reply.hdr.id = op->req.hdr.id;
+    op->reply.hdr.opcode = OSD_OP_BATCH;
+    op->reply.hdr.retval = 0;
+    for (int i = 0; i < retvals.size(); i++)
+    {
+        batch->reply_items[i].retval = retvals[i] < 0 ? retvals[i] : batch->items[i].len;
+    }
+    inline_callback_t<osd_op_t>(op->callback)(op);
+}
+
+void test8()
+{
+    json11::Json config = json11::Json::object { { "client_batch_ops", 8 } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    ring_loop_t *ringloop = new ring_loop_t();
+    cluster_client_t *cli = new cluster_client_t(ringloop, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    auto & sent_ops = cli->msgr.clients[cli->msgr.osd_peer_fds.at(1)]->sent_ops;
+    // OSDs not reporting OSD_FEATURE_BATCH get separate requests
+    int *r1 = test_write(cli, 0, 0x1000, 0x51);
+    int *r2 = test_write(cli, 0x1000, 0x1000, 0x52);
+    check_op_count(cli, 1, 2);
+    can_complete(r1);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x1000, 0x1000), 0);
+    check_completed(r1);
+    check_completed(r2);
+    // Small reads and writes are collected until the end of the event loop iteration
+    cli->msgr.clients[cli->msgr.osd_peer_fds.at(1)]->peer_features = OSD_FEATURE_BATCH;
+    r1 = test_write(cli, 0x2000, 0x1000, 0x53);
+    r2 = test_write(cli, 0x3000, 0x2000, 0x54);
+    int *r3 = test_read(cli, 0x10000, 0x1000);
+    check_op_count(cli, 1, 0);
+    cli->msgr.send_replies();
+    check_op_count(cli, 1, 1);
+    osd_op_t *op = sent_ops.begin()->second;
+    assert(op->req.hdr.opcode == OSD_OP_BATCH && op->req.batch.count == 3 && op->req.batch.data_len == 0x3000);
+    osd_op_batch_data_t *batch = (osd_op_batch_data_t*)op->buf;
+    assert(batch->items[0].opcode == OSD_OP_WRITE && batch->items[0].offset == 0x2000 && batch->items[0].len == 0x1000);
+    assert(batch->items[1].opcode == OSD_OP_WRITE && batch->items[1].offset == 0x3000 && batch->items[1].len == 0x2000);
+    assert(batch->items[2].opcode == OSD_OP_READ && batch->items[2].offset == 0x10000 && batch->items[2].len == 0x1000);
+    // Items are followed by data of both writes
+    assert(op->iov.count == 3 && op->iov.buf[0].iov_len == 3*sizeof(osd_op_batch_item_t));
+    assert(op->iov.buf[1].iov_len == 0x1000 && ((uint8_t*)op->iov.buf[1].iov_base)[0] == 0x53);
+    assert(op->iov.buf[2].iov_len == 0x2000 && ((uint8_t*)op->iov.buf[2].iov_base)[0x1fff] == 0x54);
+    // The reply is split into separate replies of each operation
+    can_complete(r1);
+    can_complete(r2);
+    can_complete(r3);
+    pretend_batch_completed(cli, op, { 0, 0, 0 });
+    check_completed(r1);
+    check_completed(r2);
+    check_completed(r3);
+    check_op_count(cli, 1, 0);
+    // The batch is sent as soon as it has client_batch_ops operations
+    int *rs[9];
+    for (int i = 0; i < 9; i++)
+        rs[i] = test_write(cli, 0x20000 + i*0x1000, 0x1000, 0x60+i);
+    check_op_count(cli, 1, 1);
+    op = sent_ops.begin()->second;
+    assert(op->req.hdr.opcode == OSD_OP_BATCH && op->req.batch.count == 8 && op->req.batch.data_len == 0x8000);
+    for (int i = 0; i < 8; i++)
+        can_complete(rs[i]);
+    pretend_batch_completed(cli, op, { 0, 0, 0, 0, 0, 0, 0, 0 });
+    for (int i = 0; i < 8; i++)
+        check_completed(rs[i]);
+    // A batch of one operation is sent as is
+    check_op_count(cli, 1, 0);
+    cli->msgr.send_replies();
+    check_op_count(cli, 1, 1);
+    can_complete(rs[8]);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x28000, 0x1000), 0);
+    check_completed(rs[8]);
+    // Each operation gets its own result
+    r1 = test_write(cli, 0x50000, 0x1000, 0x57);
+    r2 = test_write(cli, 0x60000, 0x1000, 0x58);
+    cli->msgr.send_replies();
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    can_complete(r2);
+    pretend_batch_completed(cli, sent_ops.begin()->second, { 0, -EIO });
+    check_completed(r1);
+    assert(*r2 == 0);
+    delete r2;
+    check_op_count(cli, 1, 0);
+    // Free client
+    delete cli;
+    delete ringloop;
+    delete tfd;
+    printf("[ok] batch test\n");
+}
+
+void test9()
+{
+    json11::Json config = json11::Json::object { { "immediate_commit", "none" } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    // Partial object is overwritten with zeroes, the whole object is deleted
+    int *r1 = test_discard(cli, 0x10000, 0x30000);
+    check_op_count(cli, 1, 2);
+    osd_op_t *op = find_op(cli, 1, OSD_OP_WRITE, 0x10000, 0x10000);
+    assert(op && op->iov.count == 1);
+    for (int i = 0; i < 0x10000; i++)
+        assert(((uint8_t*)op->iov.buf[0].iov_base)[i] == 0);
+    pretend_op_completed(cli, op, 0);
+    // Degraded PGs refuse to delete objects, the whole discard is then retried with zero writes
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_DELETE, 0x20000, 0), -EBUSY);
+    check_op_count(cli, 1, 2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x10000, 0x10000), 0);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x20000, 0x20000), 0);
+    check_completed(r1);
+    // Unsynced discards are replayed as discards after reconnect
+    r1 = test_discard(cli, 0x40000, 0x20000);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_DELETE, 0x40000, 0), 0);
+    check_completed(r1);
+    pretend_disconnected(cli, 1);
+    check_disconnected(cli, 1);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+    check_op_count(cli, 1, 3);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x10000, 0x10000), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_DELETE, 0x20000, 0), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_DELETE, 0x40000, 0), 0);
+    check_op_count(cli, 1, 0);
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] discard test\n");
+}
+
+// State mirroring to clients which don't talk to etcd themselves (multi-threaded vitastor_c)
+void test10()
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config, true);
+    // Followers don't load the configuration, operations wait for the mirrored one
+    assert(!cli->is_ready());
+    int *r1 = test_write(cli, 0, 0x1000, 0x55);
+    json11::Json::object global_config = json11::Json::object { { "block_size", 64*1024 } };
+    cli->st_cli.mirror_config(global_config);
+    assert(cli->get_bs_block_size() == 64*1024);
+    assert(!cli->is_ready());
+    cli->st_cli.mirror_state(single_pg_pool_state(), true);
+    assert(cli->is_ready());
+    assert(cli->st_cli.pool_config.at(1).real_pg_count == 1);
+    assert(cli->st_cli.pool_config.at(1).pg_config.at(1).cur_primary == 1);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), 0);
+    check_completed(r1);
+    // Changes are applied like etcd events: the primary moves to OSD 2
+    cli->st_cli.mirror_state(single_pg_pool_state(false, 2), false);
+    assert(cli->st_cli.pool_config.at(1).pg_config.at(1).cur_primary == 2);
+    pretend_connected(cli, 2);
+    r1 = test_read(cli, 0, 0x1000);
+    check_op_count(cli, 1, 0);
+    check_op_count(cli, 2, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 2, OSD_OP_READ, 0, 0x1000), 0);
+    check_completed(r1);
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] state mirroring test\n");
+}
+
 int main(int narg, char *args[])
 {
     test1();
     test2();
+    test3();
+    test4();
+    test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    test10();
     return 0;
 }
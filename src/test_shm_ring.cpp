@@ -0,0 +1,151 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Tests for the shared memory ring used by local client and OSD connections
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "msgr_shm.h"
+
+#define RING_SIZE 4096
+
+// Consume up to <len> bytes from the receive ring of <sc> like osd_messenger_t::handle_shm_recv() does
+uint64_t ring_read(msgr_shm_connection_t *sc, uint8_t *dst, uint64_t len)
+{
+    msgr_shm_ring_t *ring = sc->recv_ring;
+    uint64_t done = 0;
+    while (done < len)
+    {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        if (head == tail)
+        {
+            ring->reader_sleeping.store(1);
+            break;
+        }
+        uint64_t start = tail & (sc->ring_size-1);
+        uint64_t cur = head-tail < sc->ring_size-start ? head-tail : sc->ring_size-start;
+        if (cur > len-done)
+            cur = len-done;
+        memcpy(dst + done, sc->recv_buf + start, cur);
+        ring->tail.store(tail+cur);
+        done += cur;
+    }
+    return done;
+}
+
+void fill(uint8_t *buf, uint64_t len, uint64_t seed)
+{
+    for (uint64_t i = 0; i < len; i++)
+        buf[i] = (uint8_t)((seed+i)*7 + (seed+i)/251);
+}
+
+void check(uint8_t *buf, uint64_t len, uint64_t seed)
+{
+    for (uint64_t i = 0; i < len; i++)
+    {
+        if (buf[i] != (uint8_t)((seed+i)*7 + (seed+i)/251))
+        {
+            printf("data mismatch at %lu\n", seed+i);
+            exit(1);
+        }
+    }
+}
+
+// Writes crossing the end of the ring are split and continue at its beginning
+void test_wraparound(msgr_shm_connection_t *client, msgr_shm_connection_t *server)
+{
+    uint8_t src[3000], dst[3000];
+    uint64_t seed = 0;
+    bool wakeup = false;
+    for (int i = 0; i < 5; i++)
+    {
+        // 3 iovecs of 1000 bytes, the second write crosses the ring boundary inside an iovec
+        fill(src, sizeof(src), seed);
+        iovec iov[3] = { { src, 1000 }, { src+1000, 1000 }, { src+2000, 1000 } };
+        assert(client->send(iov, 3, &wakeup) == 3000);
+        assert(client->send_ring->head.load() == seed+3000);
+        assert(ring_read(server, dst, sizeof(dst)) == 3000);
+        check(dst, sizeof(dst), seed);
+        seed += 3000;
+    }
+    // The reader is now sleeping, the next write must wake it up exactly once
+    assert(ring_read(server, dst, 1) == 0);
+    assert(server->recv_ring->reader_sleeping.load());
+    fill(src, 10, seed);
+    iovec iov = { src, 10 };
+    assert(client->send(&iov, 1, &wakeup) == 10 && wakeup);
+    assert(client->send(&iov, 1, &wakeup) == 10 && !wakeup);
+    assert(ring_read(server, dst, 20) == 20);
+    check(dst, 10, seed);
+    check(dst+10, 10, seed);
+    printf("[ok] shm ring wraparound\n");
+}
+
+// A consumer which falls behind makes the ring full: the producer writes only
+// what fits, asks for a wakeup and continues with the rest when space is freed
+void test_slow_consumer(msgr_shm_connection_t *client, msgr_shm_connection_t *server)
+{
+    const uint64_t total = 3*RING_SIZE + 100;
+    uint8_t *src = (uint8_t*)malloc(total), *dst = (uint8_t*)malloc(total);
+    fill(src, total, 0);
+    uint64_t sent = 0, received = 0;
+    bool wakeup = false;
+    iovec iov = { src, total };
+    sent += client->send(&iov, 1, &wakeup);
+    assert(sent == RING_SIZE);
+    assert(client->send_ring->writer_waiting.load());
+    // Nothing more fits until the consumer reads something
+    iov = { src+sent, total-sent };
+    assert(client->send(&iov, 1, &wakeup) == 0);
+    while (received < total)
+    {
+        // Consume less than was written each time
+        uint64_t r = ring_read(server, dst+received, 1500);
+        assert(r > 0);
+        received += r;
+        if (sent < total)
+        {
+            iov = { src+sent, total-sent };
+            sent += client->send(&iov, 1, &wakeup);
+            assert(sent - received <= RING_SIZE);
+        }
+    }
+    assert(sent == total);
+    check(dst, total, 0);
+    free(src);
+    free(dst);
+    printf("[ok] shm ring slow consumer\n");
+}
+
+// The producer doesn't trust the ring header written by the peer
+void test_bad_tail(msgr_shm_connection_t *client, msgr_shm_connection_t *server)
+{
+    uint8_t src[100];
+    bool wakeup = false;
+    uint64_t head = client->send_ring->head.load();
+    server->recv_ring->tail.store(head + 12345);
+    iovec iov = { src, sizeof(src) };
+    assert(client->send(&iov, 1, &wakeup) == 0);
+    server->recv_ring->tail.store(head);
+    printf("[ok] shm ring invalid tail\n");
+}
+
+int main(int narg, char *args[])
+{
+    msgr_shm_connection_t *client = msgr_shm_connection_t::create(RING_SIZE);
+    assert(client);
+    msgr_shm_connection_t *server = msgr_shm_connection_t::open(client->name, RING_SIZE);
+    assert(server);
+    client->unlink();
+    // Only power of 2 sizes are accepted
+    assert(!msgr_shm_connection_t::open("/vitastor-nonexistent", 3000));
+    test_wraparound(client, server);
+    test_slow_consumer(client, server);
+    test_bad_tail(client, server);
+    delete server;
+    delete client;
+    return 0;
+}
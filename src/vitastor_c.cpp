@@ -5,6 +5,15 @@
 // Also acts as a C-C++ proxy for the QEMU driver (QEMU headers don't compile with g++)
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <set>
+#include <deque>
 
 #include "ringloop.h"
 #include "epoll_manager.h"
@@ -18,6 +27,38 @@ struct vitastor_qemu_fd_t
     std::function<void(int, int)> callback;
 };
 
+// Operations are routed to I/O threads by inode and offset in units of this size rounded to whole
+// pool stripes, so operations on the same data are always executed by the same thread in submission order
+#define VITASTOR_C_THREAD_ROUTE_SIZE 4*1024*1024
+
+// I/O thread of a multi-threaded client. Other threads only talk to it through post()
+struct vitastor_c_thread_t
+{
+    vitastor_c *owner = NULL;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    cluster_client_t *cli = NULL;
+    std::thread thread;
+    int event_fd = -1;
+    std::mutex mu;
+    std::vector<std::function<void()>> queue;
+    bool stopped = false;
+    std::atomic<bool> ready { false };
+};
+
+struct vitastor_c;
+
+// Inode watch handle. In multi-threaded mode the inode metadata is updated by the first
+// thread, so other threads read a copy of it which is refreshed under the lock
+struct vitastor_c_watch_t
+{
+    vitastor_c *client = NULL;
+    inode_watch_t *watch = NULL;
+    std::mutex mu;
+    uint64_t size = 0, num = 0;
+    bool readonly = false;
+};
+
 struct vitastor_c
 {
     std::map<int, vitastor_qemu_fd_t> handlers;
@@ -28,8 +69,372 @@ struct vitastor_c
 
     QEMUSetFDHandler *aio_set_fd_handler = NULL;
     void *aio_ctx = NULL;
+
+    // Completed operations of the batch API
+    std::vector<vitastor_c_op*> completed;
+
+    // Multi-threaded mode: I/O threads, the first of them talks to etcd and mirrors the state to others.
+    // ringloop and cli are NULL in this mode
+    std::vector<vitastor_c_thread_t*> threads;
+    std::mutex completed_mu;
+    std::condition_variable completed_cv;
+    uint64_t completed_events = 0, seen_events = 0;
+    // Route unit of each pool, set by the first thread when it learns the pool configuration.
+    // Operations are held until the route unit of their pool is known, in submission order.
+    // Like in single-threaded mode, operations of unknown pools don't delay other pools
+    std::mutex route_mu;
+    std::map<pool_id_t, uint64_t> route_sizes;
+    std::map<pool_id_t, std::deque<cluster_op_t*>> held_ops;
+    // Open inode watches, only changed by the first thread (or the only thread in single-threaded mode)
+    std::set<vitastor_c_watch_t*> watches;
 };
 
+// Multi-threaded mode: operations and sync fan-out
+
+struct vitastor_c_sync_t
+{
+    cluster_op_t *op;
+    std::atomic<int> pending;
+    std::atomic<int> retval;
+};
+
+// Operation split at route unit boundaries into parts executed by different threads
+struct vitastor_c_split_t
+{
+    cluster_op_t *op;
+    std::atomic<int> pending;
+    std::atomic<int> retval;
+    uint64_t version;
+};
+
+static void vitastor_c_thread_post(vitastor_c_thread_t *t, std::function<void()> fn)
+{
+    bool wake;
+    {
+        std::unique_lock<std::mutex> lock(t->mu);
+        wake = !t->queue.size();
+        t->queue.push_back(fn);
+    }
+    if (wake)
+    {
+        uint64_t n = 1;
+        if (write(t->event_fd, &n, sizeof(n)) < 0)
+        {
+            perror("write eventfd");
+        }
+    }
+}
+
+static void vitastor_c_thread_handle_queue(vitastor_c_thread_t *t)
+{
+    // Read the eventfd before taking the queue to not miss wakeups
+    uint64_t n;
+    if (read(t->event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+    {
+        perror("read eventfd");
+    }
+    std::vector<std::function<void()>> queue;
+    {
+        std::unique_lock<std::mutex> lock(t->mu);
+        queue.swap(t->queue);
+    }
+    for (auto & fn: queue)
+    {
+        fn();
+    }
+}
+
+static void vitastor_c_thread_run(vitastor_c_thread_t *t)
+{
+    while (!t->stopped)
+    {
+        t->ringloop->loop();
+        if (t->stopped)
+            break;
+        t->ringloop->wait();
+    }
+}
+
+// Wake up threads waiting in vitastor_c_uring_wait_events()
+static void vitastor_c_notify(vitastor_c *client)
+{
+    if (client->threads.size())
+    {
+        std::unique_lock<std::mutex> lock(client->completed_mu);
+        client->completed_events++;
+        client->completed_cv.notify_all();
+    }
+}
+
+// Returns 0 if the route unit of the pool isn't known yet. Must be called with route_mu locked
+static uint64_t vitastor_c_route_size(vitastor_c *client, uint64_t inode)
+{
+    auto it = client->route_sizes.find(INODE_POOL(inode));
+    return it != client->route_sizes.end() ? it->second : 0;
+}
+
+static int vitastor_c_route(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t route_size)
+{
+    uint64_t h = (inode ^ (inode >> 32)) + offset/route_size;
+    return h % client->threads.size();
+}
+
+// Route an operation to I/O threads. An operation crossing route unit boundaries is split into parts,
+// so that every byte of an inode is only read and written by one thread, including its write-back
+// and readahead buffers. Writes with a version check (CAS) can't be split and are rejected
+static void vitastor_c_route_op(vitastor_c *client, cluster_op_t *op, uint64_t route_size,
+    std::vector<std::vector<cluster_op_t*>> & by_thread)
+{
+    uint64_t first = op->offset/route_size;
+    uint64_t last = op->len ? (op->offset+op->len-1)/route_size : first;
+    if (first == last)
+    {
+        by_thread[vitastor_c_route(client, op->inode, op->offset, route_size)].push_back(op);
+        return;
+    }
+    if (op->opcode == OSD_OP_WRITE && op->version)
+    {
+        // Complete it from the I/O thread like other operations, the caller may hold route_mu
+        vitastor_c_thread_t *t = client->threads[vitastor_c_route(client, op->inode, op->offset, route_size)];
+        vitastor_c_thread_post(t, [op]()
+        {
+            op->retval = -EINVAL;
+            std::function<void(cluster_op_t*)>(op->callback)(op);
+        });
+        return;
+    }
+    vitastor_c_split_t *st = new vitastor_c_split_t;
+    st->op = op;
+    st->pending = last-first+1;
+    st->retval = op->len;
+    st->version = 0;
+    uint64_t pos = op->offset;
+    int iov_idx = 0;
+    uint64_t iov_pos = 0;
+    for (uint64_t unit = first; unit <= last; unit++)
+    {
+        uint64_t end = (unit+1)*route_size < op->offset+op->len ? (unit+1)*route_size : op->offset+op->len;
+        cluster_op_t *sop = new cluster_op_t;
+        sop->opcode = op->opcode;
+        sop->inode = op->inode;
+        sop->offset = pos;
+        sop->len = end-pos;
+        uint64_t left = sop->len;
+        while (op->opcode != OSD_OP_DELETE && left > 0 && iov_idx < op->iov.count)
+        {
+            iovec & iov = op->iov.buf[iov_idx];
+            uint64_t n = iov.iov_len-iov_pos < left ? iov.iov_len-iov_pos : left;
+            sop->iov.push_back((uint8_t*)iov.iov_base + iov_pos, n);
+            left -= n;
+            iov_pos += n;
+            if (iov_pos >= iov.iov_len)
+            {
+                iov_idx++;
+                iov_pos = 0;
+            }
+        }
+        bool first_part = unit == first;
+        sop->callback = [st, first_part](cluster_op_t *sop)
+        {
+            if (sop->retval < 0)
+            {
+                st->retval = sop->retval;
+            }
+            if (first_part && sop->opcode == OSD_OP_READ)
+            {
+                st->version = sop->version;
+            }
+            delete sop;
+            if (--st->pending == 0)
+            {
+                cluster_op_t *op = st->op;
+                op->retval = st->retval;
+                op->version = st->version;
+                delete st;
+                std::function<void(cluster_op_t*)>(op->callback)(op);
+            }
+        };
+        by_thread[vitastor_c_route(client, op->inode, pos, route_size)].push_back(sop);
+        pos = end;
+    }
+}
+
+// SYNC covers writes of all threads, so it's sent to every thread and completed when all of them finish
+static void vitastor_c_sync_all(vitastor_c *client, cluster_op_t *op)
+{
+    vitastor_c_sync_t *st = new vitastor_c_sync_t;
+    st->op = op;
+    st->pending = client->threads.size();
+    st->retval = 0;
+    for (auto t: client->threads)
+    {
+        cluster_op_t *sop = new cluster_op_t;
+        sop->opcode = OSD_OP_SYNC;
+        sop->callback = [st](cluster_op_t *sop)
+        {
+            if (sop->retval < 0)
+            {
+                st->retval = sop->retval;
+            }
+            delete sop;
+            if (--st->pending == 0)
+            {
+                cluster_op_t *op = st->op;
+                op->retval = st->retval;
+                delete st;
+                std::function<void(cluster_op_t*)>(op->callback)(op);
+            }
+        };
+        vitastor_c_thread_post(t, [t, sop]() { t->cli->execute(sop); });
+    }
+}
+
+// Post operations grouped by thread, one message per thread
+static void vitastor_c_execute_grouped(vitastor_c *client, std::vector<std::vector<cluster_op_t*>> & by_thread)
+{
+    for (int i = 0; i < by_thread.size(); i++)
+    {
+        if (by_thread[i].size())
+        {
+            vitastor_c_thread_t *t = client->threads[i];
+            vitastor_c_thread_post(t, [t, ops = by_thread[i]]()
+            {
+                for (auto op: ops)
+                {
+                    t->cli->execute(op);
+                }
+            });
+            by_thread[i].clear();
+        }
+    }
+}
+
+// Route an operation or hold it until the route unit of its pool is known. Must be called with route_mu locked
+static void vitastor_c_route_or_hold(vitastor_c *client, cluster_op_t *op, std::vector<std::vector<cluster_op_t*>> & by_thread)
+{
+    if (op->opcode == OSD_OP_SYNC)
+    {
+        // Previous writes must be queued before SYNC. Held writes aren't completed yet,
+        // so SYNC doesn't have to cover them
+        vitastor_c_execute_grouped(client, by_thread);
+        vitastor_c_sync_all(client, op);
+        return;
+    }
+    pool_id_t pool_id = INODE_POOL(op->inode);
+    if (!pool_id)
+    {
+        // Complete it from the I/O thread like other operations, the caller holds route_mu
+        vitastor_c_thread_post(client->threads[0], [op]()
+        {
+            op->retval = -EINVAL;
+            std::function<void(cluster_op_t*)>(op->callback)(op);
+        });
+        return;
+    }
+    uint64_t route_size = vitastor_c_route_size(client, op->inode);
+    if (!route_size)
+    {
+        client->held_ops[pool_id].push_back(op);
+        return;
+    }
+    vitastor_c_route_op(client, op, route_size, by_thread);
+}
+
+// Release held operations of pools which are now known. Must be called with route_mu locked
+static void vitastor_c_release_held(vitastor_c *client)
+{
+    std::vector<std::vector<cluster_op_t*>> by_thread(client->threads.size());
+    for (auto it = client->held_ops.begin(); it != client->held_ops.end(); )
+    {
+        auto rs_it = client->route_sizes.find(it->first);
+        if (rs_it == client->route_sizes.end())
+        {
+            it++;
+            continue;
+        }
+        for (auto op: it->second)
+        {
+            vitastor_c_route_op(client, op, rs_it->second, by_thread);
+        }
+        it = client->held_ops.erase(it);
+    }
+    vitastor_c_execute_grouped(client, by_thread);
+}
+
+static void vitastor_c_execute(vitastor_c *client, cluster_op_t *op)
+{
+    if (!client->threads.size())
+    {
+        client->cli->execute(op);
+        return;
+    }
+    std::vector<std::vector<cluster_op_t*>> by_thread(client->threads.size());
+    std::unique_lock<std::mutex> lock(client->route_mu);
+    vitastor_c_route_or_hold(client, op, by_thread);
+    vitastor_c_execute_grouped(client, by_thread);
+}
+
+static void vitastor_c_batch_op_completed(vitastor_c *client, vitastor_c_op *cop)
+{
+    if (client->threads.size())
+    {
+        std::unique_lock<std::mutex> lock(client->completed_mu);
+        client->completed.push_back(cop);
+        client->completed_events++;
+        client->completed_cv.notify_all();
+    }
+    else
+    {
+        client->completed.push_back(cop);
+    }
+}
+
+static void vitastor_c_watch_update(vitastor_c_watch_t *w)
+{
+    std::unique_lock<std::mutex> lock(w->mu);
+    w->size = w->watch->cfg.size;
+    w->num = w->watch->cfg.num;
+    w->readonly = w->watch->cfg.readonly;
+}
+
+static void vitastor_c_close_watch_now(cluster_client_t *cli, vitastor_c_watch_t *w)
+{
+    w->client->watches.erase(w);
+    cli->st_cli.close_watch(w->watch);
+    delete w;
+}
+
+// Runs in the first thread after it applies a state update from etcd
+static void vitastor_c_update_state(vitastor_c *client)
+{
+    cluster_client_t *cli = client->threads[0]->cli;
+    {
+        std::unique_lock<std::mutex> lock(client->route_mu);
+        for (auto & pp: cli->st_cli.pool_config)
+        {
+            auto & pool_cfg = pp.second;
+            if (!pool_cfg.exists || client->route_sizes.find(pp.first) != client->route_sizes.end())
+            {
+                // The route unit of a pool never changes, otherwise in-flight operations could be reordered
+                continue;
+            }
+            uint64_t stripe = cli->get_bs_block_size() * (
+                pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
+            );
+            if (stripe)
+            {
+                client->route_sizes[pp.first] = stripe < VITASTOR_C_THREAD_ROUTE_SIZE
+                    ? stripe * (VITASTOR_C_THREAD_ROUTE_SIZE/stripe) : stripe;
+            }
+        }
+        vitastor_c_release_held(client);
+    }
+    for (auto w: client->watches)
+    {
+        vitastor_c_watch_update(w);
+    }
+}
+
 extern "C" {
 
 static json11::Json vitastor_c_common_config(const char *config_path, const char *etcd_host, const char *etcd_prefix,
@@ -128,8 +533,101 @@ vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len)
     return self;
 }
 
+vitastor_c *vitastor_c_create_uring_threads_json(const char **options, int options_len, int threads)
+{
+    json11::Json::object cfg;
+    for (int i = 0; i < options_len-1; i += 2)
+    {
+        cfg[options[i]] = std::string(options[i+1]);
+    }
+    json11::Json cfg_json(cfg);
+    vitastor_c *self = new vitastor_c;
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; i++)
+    {
+        vitastor_c_thread_t *t = new vitastor_c_thread_t;
+        t->owner = self;
+        t->ringloop = new ring_loop_t(512);
+        t->epmgr = new epoll_manager_t(t->ringloop);
+        t->cli = new cluster_client_t(t->ringloop, t->epmgr->tfd, cfg_json, i > 0);
+        t->event_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (t->event_fd < 0)
+        {
+            perror("eventfd");
+            exit(1);
+        }
+        t->epmgr->tfd->set_fd_handler(t->event_fd, false, [t](int fd, int events)
+        {
+            vitastor_c_thread_handle_queue(t);
+        });
+        t->cli->on_ready([t, first = (i == 0)]()
+        {
+            if (first)
+            {
+                vitastor_c_update_state(t->owner);
+            }
+            t->ready = true;
+            vitastor_c_notify(t->owner);
+        });
+        self->threads.push_back(t);
+    }
+    // Only the first thread watches etcd, other threads receive the same state from it
+    auto & leader = self->threads[0]->cli->st_cli;
+    leader.on_mirror_config_hook = [self](const json11::Json::object & global_config)
+    {
+        for (int i = 1; i < self->threads.size(); i++)
+        {
+            vitastor_c_thread_t *t = self->threads[i];
+            vitastor_c_thread_post(t, [t, global_config]()
+            {
+                json11::Json::object cfg = global_config;
+                t->cli->st_cli.mirror_config(cfg);
+            });
+        }
+    };
+    leader.on_mirror_state_hook = [self](const std::vector<etcd_kv_t> & kvs, bool initial)
+    {
+        for (int i = 1; i < self->threads.size(); i++)
+        {
+            vitastor_c_thread_t *t = self->threads[i];
+            vitastor_c_thread_post(t, [t, kvs, initial]() { t->cli->st_cli.mirror_state(kvs, initial); });
+        }
+        // The hook is called before the first thread parses <kvs> itself, so update after it
+        vitastor_c_thread_post(self->threads[0], [self]() { vitastor_c_update_state(self); });
+    };
+    for (auto t: self->threads)
+    {
+        t->thread = std::thread(vitastor_c_thread_run, t);
+    }
+    return self;
+}
+
 void vitastor_c_destroy(vitastor_c *client)
 {
+    for (auto t: client->threads)
+    {
+        vitastor_c_thread_post(t, [t]() { t->stopped = true; });
+    }
+    for (auto t: client->threads)
+    {
+        t->thread.join();
+        t->epmgr->tfd->set_fd_handler(t->event_fd, false, NULL);
+        close(t->event_fd);
+        delete t->cli;
+        delete t->epmgr;
+        delete t->ringloop;
+        delete t;
+    }
+    for (auto w: client->watches)
+    {
+        delete w;
+    }
+    if (client->threads.size())
+    {
+        delete client;
+        return;
+    }
     delete client->cli;
     if (client->epmgr)
         delete client->epmgr;
@@ -142,11 +640,28 @@ void vitastor_c_destroy(vitastor_c *client)
 
 int vitastor_c_is_ready(vitastor_c *client)
 {
+    if (client->threads.size())
+    {
+        for (auto t: client->threads)
+        {
+            if (!t->ready)
+                return false;
+        }
+        return true;
+    }
     return client->cli->is_ready();
 }
 
 void vitastor_c_uring_wait_ready(vitastor_c *client)
 {
+    if (client->threads.size())
+    {
+        while (!vitastor_c_is_ready(client))
+        {
+            vitastor_c_uring_wait_events(client);
+        }
+        return;
+    }
     while (!client->cli->is_ready())
     {
         client->ringloop->loop();
@@ -158,11 +673,27 @@ void vitastor_c_uring_wait_ready(vitastor_c *client)
 
 void vitastor_c_uring_handle_events(vitastor_c *client)
 {
+    if (client->threads.size())
+    {
+        // Events are handled by I/O threads
+        return;
+    }
     client->ringloop->loop();
 }
 
 void vitastor_c_uring_wait_events(vitastor_c *client)
 {
+    if (client->threads.size())
+    {
+        // Wait for any completion since the previous call
+        std::unique_lock<std::mutex> lock(client->completed_mu);
+        while (client->completed_events == client->seen_events)
+        {
+            client->completed_cv.wait(lock);
+        }
+        client->seen_events = client->completed_events;
+        return;
+    }
     client->ringloop->wait();
 }
 
@@ -178,12 +709,13 @@ void vitastor_c_read(vitastor_c *client, uint64_t inode, uint64_t offset, uint64
     {
         op->iov.push_back(iov[i].iov_base, iov[i].iov_len);
     }
-    op->callback = [cb, opaque](cluster_op_t *op)
+    op->callback = [client, cb, opaque](cluster_op_t *op)
     {
         cb(opaque, op->retval, op->version);
         delete op;
+        vitastor_c_notify(client);
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
 }
 
 void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len, uint64_t check_version,
@@ -199,56 +731,194 @@ void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint6
     {
         op->iov.push_back(iov[i].iov_base, iov[i].iov_len);
     }
-    op->callback = [cb, opaque](cluster_op_t *op)
+    op->callback = [client, cb, opaque](cluster_op_t *op)
+    {
+        cb(opaque, op->retval);
+        delete op;
+        vitastor_c_notify(client);
+    };
+    vitastor_c_execute(client, op);
+}
+
+void vitastor_c_discard(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque)
+{
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_DELETE;
+    op->inode = inode;
+    op->offset = offset;
+    op->len = len;
+    op->callback = [client, cb, opaque](cluster_op_t *op)
     {
         cb(opaque, op->retval);
         delete op;
+        vitastor_c_notify(client);
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
 }
 
 void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque)
 {
     cluster_op_t *op = new cluster_op_t;
     op->opcode = OSD_OP_SYNC;
-    op->callback = [cb, opaque](cluster_op_t *op)
+    op->callback = [client, cb, opaque](cluster_op_t *op)
     {
         cb(opaque, op->retval);
         delete op;
+        vitastor_c_notify(client);
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
+}
+
+void vitastor_c_submit_batch(vitastor_c *client, vitastor_c_op **ops, int count)
+{
+    std::vector<std::vector<cluster_op_t*>> by_thread(client->threads.size());
+    std::unique_lock<std::mutex> lock(client->route_mu, std::defer_lock);
+    if (client->threads.size())
+    {
+        lock.lock();
+    }
+    for (int i = 0; i < count; i++)
+    {
+        vitastor_c_op *cop = ops[i];
+        if (cop->opcode != VITASTOR_C_OP_READ && cop->opcode != VITASTOR_C_OP_WRITE &&
+            cop->opcode != VITASTOR_C_OP_SYNC && cop->opcode != VITASTOR_C_OP_DISCARD)
+        {
+            cop->retval = -EINVAL;
+            vitastor_c_batch_op_completed(client, cop);
+            continue;
+        }
+        cluster_op_t *op = new cluster_op_t;
+        if (cop->opcode == VITASTOR_C_OP_SYNC)
+        {
+            op->opcode = OSD_OP_SYNC;
+        }
+        else
+        {
+            op->opcode = cop->opcode == VITASTOR_C_OP_READ ? OSD_OP_READ
+                : (cop->opcode == VITASTOR_C_OP_DISCARD ? OSD_OP_DELETE : OSD_OP_WRITE);
+            op->inode = cop->inode;
+            op->offset = cop->offset;
+            op->len = cop->len;
+            op->version = cop->opcode == VITASTOR_C_OP_WRITE ? cop->version : 0;
+            for (int j = 0; op->opcode != OSD_OP_DELETE && j < cop->iovcnt; j++)
+            {
+                op->iov.push_back(cop->iov[j].iov_base, cop->iov[j].iov_len);
+            }
+        }
+        op->callback = [client, cop](cluster_op_t *op)
+        {
+            cop->retval = op->retval;
+            if (op->opcode == OSD_OP_READ)
+            {
+                cop->version = op->version;
+            }
+            delete op;
+            vitastor_c_batch_op_completed(client, cop);
+        };
+        if (!client->threads.size())
+        {
+            client->cli->execute(op);
+        }
+        else
+        {
+            vitastor_c_route_or_hold(client, op, by_thread);
+        }
+    }
+    vitastor_c_execute_grouped(client, by_thread);
+}
+
+int vitastor_c_poll_completions(vitastor_c *client, vitastor_c_op **ops, int max)
+{
+    std::unique_lock<std::mutex> lock(client->completed_mu, std::defer_lock);
+    if (client->threads.size())
+    {
+        lock.lock();
+    }
+    int n = client->completed.size() < max ? client->completed.size() : max;
+    if (n > 0)
+    {
+        memcpy(ops, client->completed.data(), n*sizeof(vitastor_c_op*));
+        client->completed.erase(client->completed.begin(), client->completed.begin()+n);
+    }
+    return n;
 }
 
 void vitastor_c_watch_inode(vitastor_c *client, char *image, VitastorIOHandler cb, void *opaque)
 {
+    if (client->threads.size())
+    {
+        // Inode watches live in the first thread
+        vitastor_c_thread_t *t = client->threads[0];
+        std::string name(image);
+        vitastor_c_thread_post(t, [=]()
+        {
+            t->cli->on_ready([=]()
+            {
+                vitastor_c_watch_t *w = new vitastor_c_watch_t;
+                w->client = client;
+                w->watch = t->cli->st_cli.watch_inode(name);
+                vitastor_c_watch_update(w);
+                client->watches.insert(w);
+                cb(opaque, (long)w);
+                vitastor_c_notify(client);
+            });
+        });
+        return;
+    }
     client->cli->on_ready([=]()
     {
-        auto watch = client->cli->st_cli.watch_inode(std::string(image));
-        cb(opaque, (long)watch);
+        vitastor_c_watch_t *w = new vitastor_c_watch_t;
+        w->client = client;
+        w->watch = client->cli->st_cli.watch_inode(std::string(image));
+        client->watches.insert(w);
+        cb(opaque, (long)w);
     });
 }
 
 void vitastor_c_close_watch(vitastor_c *client, void *handle)
 {
-    client->cli->st_cli.close_watch((inode_watch_t*)handle);
+    vitastor_c_watch_t *w = (vitastor_c_watch_t*)handle;
+    if (client->threads.size())
+    {
+        vitastor_c_thread_t *t = client->threads[0];
+        vitastor_c_thread_post(t, [t, w]() { vitastor_c_close_watch_now(t->cli, w); });
+        return;
+    }
+    vitastor_c_close_watch_now(client->cli, w);
 }
 
 uint64_t vitastor_c_inode_get_size(void *handle)
 {
-    inode_watch_t *watch = (inode_watch_t*)handle;
-    return watch->cfg.size;
+    vitastor_c_watch_t *w = (vitastor_c_watch_t*)handle;
+    if (!w->client->threads.size())
+    {
+        return w->watch->cfg.size;
+    }
+    std::unique_lock<std::mutex> lock(w->mu);
+    return w->size;
 }
 
 uint64_t vitastor_c_inode_get_num(void *handle)
 {
-    inode_watch_t *watch = (inode_watch_t*)handle;
-    return watch->cfg.num;
+    vitastor_c_watch_t *w = (vitastor_c_watch_t*)handle;
+    if (!w->client->threads.size())
+    {
+        return w->watch->cfg.num;
+    }
+    std::unique_lock<std::mutex> lock(w->mu);
+    return w->num;
 }
 
 int vitastor_c_inode_get_readonly(void *handle)
 {
-    inode_watch_t *watch = (inode_watch_t*)handle;
-    return watch->cfg.readonly;
+    vitastor_c_watch_t *w = (vitastor_c_watch_t*)handle;
+    if (!w->client->threads.size())
+    {
+        return w->watch->cfg.readonly;
+    }
+    std::unique_lock<std::mutex> lock(w->mu);
+    return w->readonly;
 }
 
 }
@@ -22,6 +22,28 @@ typedef struct vitastor_c vitastor_c;
 typedef void VitastorReadHandler(void *opaque, long retval, uint64_t version);
 typedef void VitastorIOHandler(void *opaque, long retval);
 
+// Operation for the batch submission API
+#define VITASTOR_C_OP_READ 1
+#define VITASTOR_C_OP_WRITE 2
+#define VITASTOR_C_OP_SYNC 3
+#define VITASTOR_C_OP_DISCARD 4
+typedef struct vitastor_c_op
+{
+    // VITASTOR_C_OP_*
+    int opcode;
+    uint64_t inode;
+    uint64_t offset;
+    uint64_t len;
+    // write: version for "compare-and-set" or 0, read: set to the object version on completion
+    uint64_t version;
+    struct iovec *iov;
+    int iovcnt;
+    // set on completion
+    long retval;
+    // caller data
+    void *opaque;
+} vitastor_c_op;
+
 // QEMU
 typedef void IOHandler(void *opaque);
 typedef void QEMUSetFDHandler(void *ctx, int fd, int is_external, IOHandler *fd_read, IOHandler *fd_write, void *poll_fn, void *opaque);
@@ -32,6 +54,16 @@ vitastor_c *vitastor_c_create_qemu(QEMUSetFDHandler *aio_set_fd_handler, void *a
 vitastor_c *vitastor_c_create_uring(const char *config_path, const char *etcd_host, const char *etcd_prefix,
     int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level);
 vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len);
+// Multi-threaded client: <threads> I/O threads, each with its own io_uring and OSD connections.
+// Only the first thread watches etcd, others receive the same state from it. Operations may be
+// submitted from any thread and are routed to I/O threads by inode and offset in units of whole pool
+// stripes (operations crossing units are split), SYNCs go to all of them. Operations are queued until
+// the configuration of their pool is loaded. Writes with check_version crossing a unit and operations
+// without a pool number in the inode fail with -EINVAL.
+// Inode getters return a copy of the metadata refreshed by the first thread
+// Callbacks are called in I/O threads; vitastor_c_uring_handle_events() does nothing in this mode
+// and vitastor_c_uring_wait_events() waits for any operation completion
+vitastor_c *vitastor_c_create_uring_threads_json(const char **options, int options_len, int threads);
 void vitastor_c_destroy(vitastor_c *client);
 int vitastor_c_is_ready(vitastor_c *client);
 void vitastor_c_uring_wait_ready(vitastor_c *client);
@@ -41,7 +73,17 @@ void vitastor_c_read(vitastor_c *client, uint64_t inode, uint64_t offset, uint64
     struct iovec *iov, int iovcnt, VitastorReadHandler cb, void *opaque);
 void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len, uint64_t check_version,
     struct iovec *iov, int iovcnt, VitastorIOHandler cb, void *opaque);
+// Zero the range and free whole objects in it. Discarded ranges read back as zeroes,
+// so it's also used for "write zeroes". Offset and length must be aligned to bitmap_granularity
+void vitastor_c_discard(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque);
 void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque);
+// Submit <count> operations at once. They don't have callbacks, completed operations are
+// returned by vitastor_c_poll_completions(). Operations and iovecs must stay valid until completion
+void vitastor_c_submit_batch(vitastor_c *client, vitastor_c_op **ops, int count);
+// Take up to <max> completed operations in the order of completion. Doesn't block and doesn't
+// handle events by itself, so it's called after vitastor_c_uring_handle_events() or QEMU event handlers
+int vitastor_c_poll_completions(vitastor_c *client, vitastor_c_op **ops, int max);
 void vitastor_c_watch_inode(vitastor_c *client, char *image, VitastorIOHandler cb, void *opaque);
 void vitastor_c_close_watch(vitastor_c *client, void *handle);
 uint64_t vitastor_c_inode_get_size(void *handle);
@@ -0,0 +1,207 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <string.h>
+#include "xor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XOR_X86
+#endif
+
+typedef void (*memxor_multi_fn)(const void **src, int n, void *res, unsigned int len);
+
+// Process tail with 64-bit words, then bytes
+static inline void memxor_multi_tail(const void **src, int n, void *res, unsigned int pos, unsigned int len)
+{
+    for (; pos+8 <= len; pos += 8)
+    {
+        uint64_t w;
+        memcpy(&w, (const uint8_t*)src[0] + pos, 8);
+        for (int i = 1; i < n; i++)
+        {
+            uint64_t o;
+            memcpy(&o, (const uint8_t*)src[i] + pos, 8);
+            w ^= o;
+        }
+        memcpy((uint8_t*)res + pos, &w, 8);
+    }
+    for (; pos < len; pos++)
+    {
+        uint8_t b = ((const uint8_t*)src[0])[pos];
+        for (int i = 1; i < n; i++)
+            b ^= ((const uint8_t*)src[i])[pos];
+        ((uint8_t*)res)[pos] = b;
+    }
+}
+
+static void memxor_multi_generic(const void **src, int n, void *res, unsigned int len)
+{
+    unsigned int pos = 0;
+    for (; pos+32 <= len; pos += 32)
+    {
+        uint64_t w[4];
+        memcpy(w, (const uint8_t*)src[0] + pos, 32);
+        for (int i = 1; i < n; i++)
+        {
+            uint64_t o[4];
+            memcpy(o, (const uint8_t*)src[i] + pos, 32);
+            w[0] ^= o[0];
+            w[1] ^= o[1];
+            w[2] ^= o[2];
+            w[3] ^= o[3];
+        }
+        memcpy((uint8_t*)res + pos, w, 32);
+    }
+    memxor_multi_tail(src, n, res, pos, len);
+}
+
+#ifdef XOR_X86
+__attribute__((target("avx2")))
+static void memxor_multi_avx2(const void **src, int n, void *res, unsigned int len)
+{
+    unsigned int pos = 0;
+    for (; pos+128 <= len; pos += 128)
+    {
+        const uint8_t *s = (const uint8_t*)src[0] + pos;
+        __m256i a = _mm256_loadu_si256((const __m256i*)s);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s+32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(s+64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(s+96));
+        for (int i = 1; i < n; i++)
+        {
+            s = (const uint8_t*)src[i] + pos;
+            a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)s));
+            b = _mm256_xor_si256(b, _mm256_loadu_si256((const __m256i*)(s+32)));
+            c = _mm256_xor_si256(c, _mm256_loadu_si256((const __m256i*)(s+64)));
+            d = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*)(s+96)));
+        }
+        uint8_t *r = (uint8_t*)res + pos;
+        _mm256_storeu_si256((__m256i*)r, a);
+        _mm256_storeu_si256((__m256i*)(r+32), b);
+        _mm256_storeu_si256((__m256i*)(r+64), c);
+        _mm256_storeu_si256((__m256i*)(r+96), d);
+    }
+    for (; pos+32 <= len; pos += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)((const uint8_t*)src[0] + pos));
+        for (int i = 1; i < n; i++)
+            a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)((const uint8_t*)src[i] + pos)));
+        _mm256_storeu_si256((__m256i*)((uint8_t*)res + pos), a);
+    }
+    memxor_multi_tail(src, n, res, pos, len);
+}
+
+__attribute__((target("avx512f")))
+static void memxor_multi_avx512(const void **src, int n, void *res, unsigned int len)
+{
+    unsigned int pos = 0;
+    for (; pos+256 <= len; pos += 256)
+    {
+        const uint8_t *s = (const uint8_t*)src[0] + pos;
+        __m512i a = _mm512_loadu_si512((const void*)s);
+        __m512i b = _mm512_loadu_si512((const void*)(s+64));
+        __m512i c = _mm512_loadu_si512((const void*)(s+128));
+        __m512i d = _mm512_loadu_si512((const void*)(s+192));
+        for (int i = 1; i < n; i++)
+        {
+            s = (const uint8_t*)src[i] + pos;
+            a = _mm512_xor_si512(a, _mm512_loadu_si512((const void*)s));
+            b = _mm512_xor_si512(b, _mm512_loadu_si512((const void*)(s+64)));
+            c = _mm512_xor_si512(c, _mm512_loadu_si512((const void*)(s+128)));
+            d = _mm512_xor_si512(d, _mm512_loadu_si512((const void*)(s+192)));
+        }
+        uint8_t *r = (uint8_t*)res + pos;
+        _mm512_storeu_si512((void*)r, a);
+        _mm512_storeu_si512((void*)(r+64), b);
+        _mm512_storeu_si512((void*)(r+128), c);
+        _mm512_storeu_si512((void*)(r+192), d);
+    }
+    for (; pos+64 <= len; pos += 64)
+    {
+        __m512i a = _mm512_loadu_si512((const void*)((const uint8_t*)src[0] + pos));
+        for (int i = 1; i < n; i++)
+            a = _mm512_xor_si512(a, _mm512_loadu_si512((const void*)((const uint8_t*)src[i] + pos)));
+        _mm512_storeu_si512((void*)((uint8_t*)res + pos), a);
+    }
+    memxor_multi_tail(src, n, res, pos, len);
+}
+#endif
+
+struct memxor_impl_t
+{
+    const char *name;
+    memxor_multi_fn fn;
+    bool (*supported)();
+};
+
+static bool memxor_always() { return true; }
+
+#ifdef XOR_X86
+static bool memxor_has_avx2() { return __builtin_cpu_supports("avx2"); }
+static bool memxor_has_avx512() { return __builtin_cpu_supports("avx512f"); }
+#endif
+
+// Ordered from the best to the worst
+static const memxor_impl_t memxor_impls[] = {
+#ifdef XOR_X86
+    { "avx512", memxor_multi_avx512, memxor_has_avx512 },
+    { "avx2", memxor_multi_avx2, memxor_has_avx2 },
+#endif
+    { "generic", memxor_multi_generic, memxor_always },
+};
+
+static const memxor_impl_t *memxor_selected = NULL;
+
+static inline const memxor_impl_t *memxor_get_impl()
+{
+    if (!memxor_selected)
+    {
+        for (auto & impl: memxor_impls)
+        {
+            if (impl.supported())
+            {
+                memxor_selected = &impl;
+                break;
+            }
+        }
+    }
+    return memxor_selected;
+}
+
+bool memxor_select(const char *name)
+{
+    for (auto & impl: memxor_impls)
+    {
+        if (!strcmp(impl.name, name))
+        {
+            if (!impl.supported())
+                return false;
+            memxor_selected = &impl;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *memxor_impl_name()
+{
+    return memxor_get_impl()->name;
+}
+
+void memxor(const void *r1, const void *r2, void *res, unsigned int len)
+{
+    const void *src[2] = { r1, r2 };
+    memxor_get_impl()->fn(src, 2, res, len);
+}
+
+void memxor_multi(const void **src, int n, void *res, unsigned int len)
+{
+    if (n == 1)
+    {
+        if (src[0] != res)
+            memmove(res, src[0], len);
+        return;
+    }
+    memxor_get_impl()->fn(src, n, res, len);
+}
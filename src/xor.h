@@ -5,11 +5,17 @@
 
 #include <stdint.h>
 
-inline void memxor(const void *r1, const void *r2, void *res, unsigned int len)
-{
-    unsigned int i;
-    for (i = 0; i < len; ++i)
-    {
-        ((uint8_t*)res)[i] = ((uint8_t*)r1)[i] ^ ((uint8_t*)r2)[i];
-    }
-}
+// XOR kernels are selected at runtime based on CPU features (AVX-512 / AVX2 / 64-bit words)
+
+// res = r1 ^ r2
+void memxor(const void *r1, const void *r2, void *res, unsigned int len);
+
+// res = src[0] ^ src[1] ^ ... ^ src[n-1], all sources are processed in one pass
+void memxor_multi(const void **src, int n, void *res, unsigned int len);
+
+// Name of the selected implementation, for benchmarks and logs
+const char *memxor_impl_name();
+
+// Force a specific implementation ("generic", "avx2", "avx512"), mainly for benchmarks.
+// Returns false if it's not supported by the CPU
+bool memxor_select(const char *name);
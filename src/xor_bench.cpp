@@ -0,0 +1,91 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// XOR kernel benchmark: measures single-core GB/s of memxor_multi for every
+// supported implementation over a range of EC stripe shapes and chunk sizes.
+// Usage: xor_bench [min_seconds_per_case]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "xor.h"
+#include "malloc_or_die.h"
+
+static double now()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec/1000000000.0;
+}
+
+static bool check_impl(uint8_t **bufs, int n, uint32_t len, uint8_t *res)
+{
+    for (int off = 0; off < 3; off++)
+    {
+        uint32_t l = len-off*7;
+        memxor_multi((const void**)bufs, n, res, l);
+        for (uint32_t i = 0; i < l; i++)
+        {
+            uint8_t b = 0;
+            for (int j = 0; j < n; j++)
+                b ^= bufs[j][i];
+            if (res[i] != b)
+                return false;
+        }
+    }
+    return true;
+}
+
+int main(int narg, char *args[])
+{
+    double min_time = narg > 1 ? atof(args[1]) : 0.5;
+    const char *impls[] = { "generic", "avx2", "avx512" };
+    const int data_chunks[] = { 2, 4, 8 };
+    const uint32_t chunk_sizes[] = { 4096, 32768, 131072, 1048576 };
+    uint8_t *bufs[8];
+    for (int i = 0; i < 8; i++)
+    {
+        bufs[i] = (uint8_t*)memalign_or_die(64, 1048576);
+        for (int j = 0; j < 1048576; j++)
+            bufs[i][j] = rand();
+    }
+    uint8_t *res = (uint8_t*)memalign_or_die(64, 1048576);
+    printf("%-8s %6s %8s %10s\n", "impl", "k", "chunk", "GB/s");
+    for (auto impl: impls)
+    {
+        if (!memxor_select(impl))
+        {
+            printf("%-8s not supported by this CPU\n", impl);
+            continue;
+        }
+        if (!check_impl(bufs, 4, 65536, res))
+        {
+            printf("%-8s produces INCORRECT results\n", impl);
+            return 1;
+        }
+        for (int k: data_chunks)
+        {
+            for (uint32_t len: chunk_sizes)
+            {
+                uint64_t bytes = 0;
+                double start = now(), end;
+                do
+                {
+                    for (int i = 0; i < 64; i++)
+                    {
+                        memxor_multi((const void**)bufs, k, res, len);
+                        bytes += (uint64_t)len*k;
+                    }
+                    end = now();
+                } while (end-start < min_time);
+                // Throughput is counted as the amount of source data processed
+                printf("%-8s %6d %7uK %10.2f\n", impl, k, len/1024, bytes/(end-start)/1000000000.0);
+            }
+        }
+    }
+    for (int i = 0; i < 8; i++)
+        free(bufs[i]);
+    free(res);
+    return 0;
+}
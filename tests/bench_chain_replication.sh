@@ -0,0 +1,25 @@
+#!/bin/bash -ex
+
+# Compare large sequential write throughput of fan-out and chain replication
+# in a 3-replica pool on a loopback 3-OSD cluster
+
+if [ "$CHAIN_REPLICATION" = "" ]; then
+    cd `dirname $0`/..
+    RESULTS=""
+    for mode in false true; do
+        CHAIN_REPLICATION=$mode bash tests/bench_chain_replication.sh
+        RESULTS="$RESULTS chain_replication=$mode: $(($(jq '.jobs[0].write.bw' ./testdata/fio-chain.json)/1024)) MB/s;"
+    done
+    echo $RESULTS
+    exit 0
+fi
+
+SCHEME=replicated
+OSD_ARGS="$OSD_ARGS --chain_replication $CHAIN_REPLICATION"
+
+. `dirname $0`/run_3osds.sh
+
+fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4M -direct=1 -iodepth=4 -rw=write \
+    -etcd=$ETCD_URL -pool=1 -inode=1 -size=512M -output-format=json > ./testdata/fio-chain.json
+
+format_green "chain_replication=$CHAIN_REPLICATION: $(($(jq '.jobs[0].write.bw' ./testdata/fio-chain.json)/1024)) MB/s"
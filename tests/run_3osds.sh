@@ -25,7 +25,11 @@ if [ -n "$GLOBAL_CONF" ]; then
     $ETCDCTL put /vitastor/config/global "$GLOBAL_CONF"
 fi
 
-$ETCDCTL put /vitastor/config/pools '{"1":{"name":"testpool","scheme":"xor","pg_size":3,"pg_minsize":2,"parity_chunks":1,"pg_count":1,"failure_domain":"osd"}}'
+if [ "$SCHEME" = "replicated" ]; then
+    $ETCDCTL put /vitastor/config/pools '{"1":{"name":"testpool","scheme":"replicated","pg_size":3,"pg_minsize":2,"pg_count":1,"failure_domain":"osd"}}'
+else
+    $ETCDCTL put /vitastor/config/pools '{"1":{"name":"testpool","scheme":"xor","pg_size":3,"pg_minsize":2,"parity_chunks":1,"pg_count":1,"failure_domain":"osd"}}'
+fi
 
 sleep 2
 
@@ -0,0 +1,45 @@
+#!/bin/bash -ex
+
+# Overlapping unsynced writes sent through different connections of a multi-connection
+# vitastor-nbd device must keep their order when they're replayed after an OSD reconnect
+
+SCHEME=replicated
+
+. `dirname $0`/run_3osds.sh
+
+NBD_DEV=$(sudo build/src/vitastor-nbd map --etcd_address $ETCD_URL --pool 1 --inode 1 --size $((32*1024*1024)) --nbd_connections 2)
+trap "sudo build/src/vitastor-nbd unmap $NBD_DEV; kill -9 \$(jobs -p)" EXIT
+
+head -c 8M /dev/urandom > ./testdata/nbd_first.bin
+head -c 8M /dev/urandom > ./testdata/nbd_second.bin
+
+# The kernel maps hardware queues (connections) to CPUs, so writes from different CPUs
+# go through different connections. Neither of them is synced
+LAST_CPU=$(($(nproc)-1))
+sudo taskset -c 0 dd if=./testdata/nbd_first.bin of=$NBD_DEV bs=1M oflag=direct
+sudo taskset -c $LAST_CPU dd if=./testdata/nbd_second.bin of=$NBD_DEV bs=1M oflag=direct
+
+# Restart the primary OSD, clients reconnect and replay unsynced writes
+PRIMARY=$($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -r .primary)
+kill -9 $(eval echo \$OSD${PRIMARY}_PID)
+build/src/vitastor-osd --osd_num $PRIMARY --bind_address 127.0.0.1 $OSD_ARGS --etcd_address $ETCD_URL \
+    $(node mon/simple-offsets.js --format options --device ./testdata/test_osd$PRIMARY.bin 2>/dev/null) &>>./testdata/osd$PRIMARY.log &
+eval OSD${PRIMARY}_PID=$!
+
+for i in {1..30}; do
+    ($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -s -e '(. | length) != 0 and .[0].state == ["active"]') && \
+        break
+    if [ $i -eq 30 ]; then
+        format_error "PG couldn't become active in 30 seconds after restarting the primary OSD"
+    fi
+    sleep 1
+done
+
+sudo blockdev --flushbufs $NBD_DEV
+sudo dd if=$NBD_DEV of=./testdata/nbd_read.bin bs=1M count=8 iflag=direct
+
+if ! cmp ./testdata/nbd_read.bin ./testdata/nbd_second.bin; then
+    format_error "FAILED: the first write was replayed over the second one"
+fi
+
+format_green OK
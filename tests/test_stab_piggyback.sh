@@ -0,0 +1,36 @@
+#!/bin/bash -ex
+
+# Kill the primary OSD while stabilize lists of synced EC writes are still deferred
+# (stab_piggyback_delay) and check that no synced data is lost after it restarts
+
+SCHEME=xor
+OSD_ARGS="--stab_piggyback_delay 10000 $OSD_ARGS"
+
+. `dirname $0`/run_3osds.sh
+
+LD_PRELOAD=libasan.so.5 \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4k -direct=1 -iodepth=4 -fsync=1 -end_fsync=1 \
+        -rw=write -verify=crc32c -do_verify=0 -etcd=$ETCD_URL -pool=1 -inode=1 -size=16M
+
+# Stabilize lists of the last writes are still waiting for the next write or for the 10 second timer
+PRIMARY=$($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -r .primary)
+kill -9 $(eval echo \$OSD${PRIMARY}_PID)
+
+build/src/vitastor-osd --osd_num $PRIMARY --bind_address 127.0.0.1 $OSD_ARGS --etcd_address $ETCD_URL \
+    $(node mon/simple-offsets.js --format options --device ./testdata/test_osd$PRIMARY.bin 2>/dev/null) &>>./testdata/osd$PRIMARY.log &
+eval OSD${PRIMARY}_PID=$!
+
+for i in {1..30}; do
+    ($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -s -e '(. | length) != 0 and .[0].state == ["active"]') && \
+        break
+    if [ $i -eq 30 ]; then
+        format_error "PG couldn't become active in 30 seconds after restarting the primary OSD"
+    fi
+    sleep 1
+done
+
+LD_PRELOAD=libasan.so.5 \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4k -direct=1 -iodepth=4 \
+        -rw=write -verify=crc32c -verify_only=1 -etcd=$ETCD_URL -pool=1 -inode=1 -size=16M
+
+format_green OK
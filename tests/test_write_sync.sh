@@ -0,0 +1,49 @@
+#!/bin/bash -ex
+
+# Writes made durable at once while a SYNC is pending for their PG (write_sync_on_pending_sync)
+# must survive a restart of all OSDs. The second run hides OSD_FEATURE_WRITE_SYNC (disabled_features)
+# to check the fallback to regular writes and syncs with peers that don't support it
+
+if [ "$WRITE_SYNC_FEATURES" = "" ]; then
+    cd `dirname $0`/..
+    WRITE_SYNC_FEATURES=all bash tests/test_write_sync.sh
+    WRITE_SYNC_FEATURES=none bash tests/test_write_sync.sh
+    exit 0
+fi
+
+OSD_ARGS="--write_sync_on_pending_sync true $OSD_ARGS"
+if [ "$WRITE_SYNC_FEATURES" = "none" ]; then
+    # OSD_FEATURE_WRITE_SYNC
+    OSD_ARGS="--disabled_features 1 $OSD_ARGS"
+fi
+
+. `dirname $0`/run_3osds.sh
+
+# Many writes in flight with frequent syncs, so that new writes arrive while a sync is pending
+LD_PRELOAD=libasan.so.5 \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4k -direct=1 -iodepth=16 -fsync=4 -end_fsync=1 \
+        -rw=write -verify=crc32c -do_verify=0 -etcd=$ETCD_URL -pool=1 -inode=1 -size=32M
+
+kill -9 $OSD1_PID $OSD2_PID $OSD3_PID
+sleep 1
+
+for i in 1 2 3; do
+    build/src/vitastor-osd --osd_num $i --bind_address 127.0.0.1 $OSD_ARGS --etcd_address $ETCD_URL \
+        $(node mon/simple-offsets.js --format options --device ./testdata/test_osd$i.bin 2>/dev/null) &>>./testdata/osd$i.log &
+    eval OSD${i}_PID=$!
+done
+
+for i in {1..30}; do
+    ($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -s -e '(. | length) != 0 and .[0].state == ["active"]') && \
+        break
+    if [ $i -eq 30 ]; then
+        format_error "PG couldn't become active in 30 seconds after restarting OSDs"
+    fi
+    sleep 1
+done
+
+LD_PRELOAD=libasan.so.5 \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4k -direct=1 -iodepth=16 \
+        -rw=write -verify=crc32c -verify_only=1 -etcd=$ETCD_URL -pool=1 -inode=1 -size=32M
+
+format_green "OK (features: $WRITE_SYNC_FEATURES)"